@@ -27,6 +27,11 @@ WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
 #ifndef __CBUS_OPC_H__
 #define __CBUS_OPC_H__
 
+//! Number of data bytes following the opcode (encoded in the 3 upper bits of the opcode)
+#define CBUS_OPC_DATA_LENGTH(opc)   (((opc)>>5)&0x07)
+//! Total CAN frame length (opcode + data bytes)
+#define CBUS_OPC_LENGTH(opc)        (CBUS_OPC_DATA_LENGTH(opc)+1)
+
 #define OPC_ACK 0x00     //  General affirmative acknowledge
 #define OPC_NAK 0x01     //  General negative acknowledge
 #define OPC_HLT 0x02     //  CAN bus not available / busy
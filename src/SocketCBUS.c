@@ -25,23 +25,69 @@ WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
 */
 
 #include "SocketCBUS.h"
+#include "cbus_transport.h"
 #include <linux/can.h>
+#include <linux/can/raw.h>
+#include <linux/can/error.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <stdint.h>
 #include <net/if.h>
 #include <sys/ioctl.h>
 #include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
+#include <poll.h>
 
 static int CANSocket = -1;
+static int RXBufferSize = 0;                // 0 = system default
+static uint32_t KernelDropCount = 0;        // Last value of the SO_RXQ_OVFL counter of the socket
+static uint32_t DroppedFrames = 0;          // Frames dropped by the kernel, not yet read by getCBUSDroppedFrames
+static int SocketError = 0;                 // Last read error, not yet read by getCBUSSocketError
+static int OwnFrames = 0;                   // 1 = frames sent by the socket are received back after transmission
+static const TCBUSTransport* Transport = 0; // 0 = SocketCAN
+
+void setCBUSTransport (const TCBUSTransport* NewTransport)
+{
+    closeCBUSSocket ();
+    Transport = NewTransport;
+    if (Transport)
+        Transport->SetOwnFrames (OwnFrames);
+}  // setCBUSTransport
+// ------------------------------------------------------------
+
+void setCBUSSocketRXBuffer (int Size)
+{
+    RXBufferSize = Size;
+}  // setCBUSSocketRXBuffer
+// ------------------------------------------------------------
+
+void setCBUSSocketOwnFrames (int Enable)
+{
+    OwnFrames = Enable;
+    if (Transport)
+    {
+        Transport->SetOwnFrames (Enable);
+        return;
+    }
+    if (CANSocket != -1)
+        setsockopt (CANSocket, SOL_CAN_RAW, CAN_RAW_RECV_OWN_MSGS, &OwnFrames, sizeof(OwnFrames));
+}  // setCBUSSocketOwnFrames
+// ------------------------------------------------------------
 
 int createCBUSSocket (char* ifname)
 {
     struct sockaddr_can addr;
     struct ifreq ifr;
+    can_err_mask_t ErrorMask;
+    int Enable;
 
     // Just in case...
     closeCBUSSocket ();
 
+    if (Transport)
+        return Transport->Create (ifname);
+
     // Try to create the CAN socket
     CANSocket=socket (PF_CAN, SOCK_RAW, CAN_RAW);
     if (CANSocket == -1)
@@ -62,6 +108,21 @@ int createCBUSSocket (char* ifname)
         return CBUS_ERR_BIND_ERROR;
     }
 
+    // Error frames generated by the controller driver are received with CBUS_ERR_FLAG in the CAN ID
+    ErrorMask = CAN_ERR_TX_TIMEOUT|CAN_ERR_CRTL|CAN_ERR_ACK|CAN_ERR_BUSOFF|CAN_ERR_BUSERROR|CAN_ERR_RESTARTED;
+    setsockopt (CANSocket, SOL_CAN_RAW, CAN_RAW_ERR_FILTER, &ErrorMask, sizeof(ErrorMask));
+
+    // Kernel gives the number of frames dropped because the receive queue was full with each frame
+    Enable = 1;
+    setsockopt (CANSocket, SOL_SOCKET, SO_RXQ_OVFL, &Enable, sizeof(Enable));
+    KernelDropCount = 0;
+
+    if (RXBufferSize > 0)
+        setsockopt (CANSocket, SOL_SOCKET, SO_RCVBUF, &RXBufferSize, sizeof(RXBufferSize));
+
+    if (OwnFrames)
+        setsockopt (CANSocket, SOL_CAN_RAW, CAN_RAW_RECV_OWN_MSGS, &OwnFrames, sizeof(OwnFrames));
+
     // Make the socket non blocking
     int Flags = fcntl (CANSocket, F_GETFL, 0);
     fcntl (CANSocket, F_SETFL, Flags | O_NONBLOCK);
@@ -72,6 +133,9 @@ int createCBUSSocket (char* ifname)
 
 void closeCBUSSocket (void)
 {
+    if (Transport)
+        Transport->Close ();
+
     if (CANSocket != -1)
     {
 	close (CANSocket);
@@ -85,22 +149,124 @@ unsigned int getNextCBUSMessage (unsigned int* CANID, unsigned char* CANData)
     int nbytes;
     struct can_frame frame;
     int len;
+    struct msghdr Msg;
+    struct iovec Vector;
+    struct cmsghdr* Control;
+    char ControlBuffer[CMSG_SPACE(sizeof(uint32_t))];
+    uint32_t DropCount;
+
+    if (Transport)
+        return Transport->GetNextMessage (CANID, CANData);
+
+    Vector.iov_base = &frame;
+    Vector.iov_len = sizeof(struct can_frame);
+    memset (&Msg, 0, sizeof(Msg));
+    Msg.msg_iov = &Vector;
+    Msg.msg_iovlen = 1;
+    Msg.msg_control = ControlBuffer;
+    Msg.msg_controllen = sizeof(ControlBuffer);
+
+    nbytes = recvmsg (CANSocket, &Msg, 0);
+    if (nbytes == -1)
+    {
+        // Empty queue is the normal case, other errors are reported to the caller
+        if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+            __atomic_store_n (&SocketError, errno, __ATOMIC_RELAXED);
+        return 0xFFFFFFFF;
+    }
+    if (nbytes < (int)sizeof(struct can_frame)) return 0xFFFFFFFF;
 
-    nbytes = read (CANSocket, &frame, sizeof(struct can_frame));
-    if (nbytes == -1) return 0xFFFFFFFF;
+    for (Control = CMSG_FIRSTHDR(&Msg); Control != 0; Control = CMSG_NXTHDR(&Msg, Control))
+    {
+        if ((Control->cmsg_level == SOL_SOCKET) && (Control->cmsg_type == SO_RXQ_OVFL))
+        {
+            memcpy (&DropCount, CMSG_DATA(Control), sizeof(DropCount));
+            if (DropCount != KernelDropCount)
+            {
+                __atomic_add_fetch (&DroppedFrames, DropCount-KernelDropCount, __ATOMIC_RELAXED);
+                KernelDropCount = DropCount;
+            }
+        }
+    }
 
     len = frame.can_dlc & 0xF;
+    if (len > 8) len = 8;
     *CANID = frame.can_id;
     memcpy (CANData, &frame.data[0], len);
 
+    // Echo of a frame sent by this socket
+    if (Msg.msg_flags & MSG_CONFIRM)
+        return frame.can_dlc|CBUS_OWN_FRAME;
     return frame.can_dlc;
 }  // getNextCBUSMessage
 // ------------------------------------------------------------
 
-void sendCBUSRaw (unsigned int ID, unsigned char DLC, unsigned char* Data)
+int waitCBUSMessage (int TimeoutMs)
+{
+    struct pollfd PollFD;
+    int Result;
+    int Error;
+    socklen_t ErrorLength;
+
+    if (Transport)
+        return Transport->WaitMessage (TimeoutMs);
+    if (CANSocket == -1) return -1;
+
+    PollFD.fd = CANSocket;
+    PollFD.events = POLLIN;
+    PollFD.revents = 0;
+
+    Result = poll (&PollFD, 1, TimeoutMs);
+    if (Result <= 0) return Result;
+    if (PollFD.revents & POLLIN) return 1;
+
+    // Pending socket error (interface down) : read it, so it is reported by getCBUSSocketError and poll
+    // does not return immediately again
+    ErrorLength = sizeof(Error);
+    Error = 0;
+    getsockopt (CANSocket, SOL_SOCKET, SO_ERROR, &Error, &ErrorLength);
+    __atomic_store_n (&SocketError, (Error != 0) ? Error : ENETDOWN, __ATOMIC_RELAXED);
+    return -1;
+}  // waitCBUSMessage
+// ------------------------------------------------------------
+
+int getCBUSSocketError (void)
+{
+    if (Transport)
+        return Transport->GetError ();
+    return __atomic_exchange_n (&SocketError, 0, __ATOMIC_RELAXED);
+}  // getCBUSSocketError
+// ------------------------------------------------------------
+
+void setCBUSSocketError (int Error)
+{
+    __atomic_store_n (&SocketError, Error, __ATOMIC_RELAXED);
+}  // setCBUSSocketError
+// ------------------------------------------------------------
+
+unsigned int getCBUSDroppedFrames (void)
+{
+    if (Transport)
+        return Transport->GetDroppedFrames ();
+    return __atomic_exchange_n (&DroppedFrames, 0, __ATOMIC_RELAXED);
+}  // getCBUSDroppedFrames
+// ------------------------------------------------------------
+
+int getCBUSSocketHandle (void)
+{
+    if (Transport)
+        return Transport->GetHandle ();
+    return CANSocket;
+}  // getCBUSSocketHandle
+// ------------------------------------------------------------
+
+int sendCBUSRaw (unsigned int ID, unsigned char DLC, unsigned char* Data)
 {
 	struct can_frame frame;
 
+	if (Transport)
+		return Transport->Send (ID, DLC, Data);
+
 	frame.can_id = ID;
 	frame.can_dlc = DLC;
 
@@ -109,7 +275,16 @@ void sendCBUSRaw (unsigned int ID, unsigned char DLC, unsigned char* Data)
     	memcpy (&frame.data[0], Data, DLC);
     }
 
-	write (CANSocket, &frame, sizeof (struct can_frame));
+	if (write (CANSocket, &frame, sizeof (struct can_frame)) != sizeof (struct can_frame))
+		return -1;
+	return 0;
 }  // sendCBUSRaw
 // ------------------------------------------------------------
 
+void flushCBUSSocket (void)
+{
+    // SocketCAN frames are written by sendCBUSRaw
+    if (Transport)
+        Transport->Flush ();
+}  // flushCBUSSocket
+// ------------------------------------------------------------
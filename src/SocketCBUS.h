@@ -30,6 +30,22 @@ WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
 // CBUS Error codes
 #define CBUS_ERR_SOCKET_ERROR		-1		// Can not create the socket
 #define CBUS_ERR_BIND_ERROR			-2		// Can not bind the socket to requested interface
+#define CBUS_ERR_CONNECT_ERROR		-3		// Can not connect to the CBUS server (see cbus_transport.h)
+
+// Flags in the CAN ID returned by getNextCBUSMessage and given to sendCBUSRaw (same values as socketcan)
+#define CBUS_EFF_FLAG				0x80000000U		// Extended (29 bits) frame
+#define CBUS_RTR_FLAG				0x40000000U		// Remote transmission request (used for CAN ID enumeration)
+#define CBUS_ERR_FLAG				0x20000000U		// Error frame generated by the CAN controller driver (see linux/can/error.h)
+
+// Flag in the value returned by getNextCBUSMessage : frame has been sent by this socket (see setCBUSSocketOwnFrames)
+#define CBUS_OWN_FRAME				0x100
+
+//! Set the size of the socket receive buffer used by next call to createCBUSSocket (0 = system default)
+void setCBUSSocketRXBuffer (int Size);
+
+//! Receive frames sent by this socket once they have been transmitted on the bus (CAN_RAW_RECV_OWN_MSGS)
+// Applies to the current socket and to the next ones. Echoed frames are returned with CBUS_OWN_FRAME
+void setCBUSSocketOwnFrames (int Enable);
 
 //! \return 0 if socket has been created correctly, negative values are errors (see CBUS_ERROR_CODES)
 int createCBUSSocket (char* ifname);
@@ -41,8 +57,28 @@ void closeCBUSSocket (void);
 // Function is non blocking and returns -1 if no CAN message has been received (as DLC can be 0)
 unsigned int getNextCBUSMessage (unsigned int* CANID, unsigned char* CANData);
 
-//! Send a message on the CAN bus
-void sendCBUSRaw (unsigned int ID, unsigned char DLC, unsigned char* Data);
+//! Wait until a CBUS message is available in system reception queue
+// \return 1 if a message is waiting, 0 on timeout, negative value on error
+int waitCBUSMessage (int TimeoutMs);
+
+//! \return last socket read error (errno value) since previous call, 0 if none. An empty queue is not an error
+int getCBUSSocketError (void);
+
+//! Record a socket error for getCBUSSocketError, for reads and writes not done by this module (io_uring)
+void setCBUSSocketError (int Error);
+
+//! \return number of frames dropped by the kernel (receive queue full) since previous call
+unsigned int getCBUSDroppedFrames (void);
+
+//! \return file descriptor of the CAN socket (-1 if socket is not opened)
+int getCBUSSocketHandle (void);
+
+//! Send a message on the CAN bus (ID can include CBUS_RTR_FLAG to send a remote frame)
+// \return 0 if the frame has been queued, -1 otherwise (errno is ENOBUFS when the TX queue is full)
+int sendCBUSRaw (unsigned int ID, unsigned char DLC, unsigned char* Data);
+
+//! Write frames buffered by the transport (SocketCAN frames are written by sendCBUSRaw)
+void flushCBUSSocket (void);
 
 
 #endif
@@ -7,6 +7,17 @@
 #include <string.h>
 #include "SystemSleep.h"
 #include "cbus_io.h"
+#include "modbus_fastpath.h"
+#include "modbus_push.h"
+#include "cbus_stream.h"
+#include "cbus_shm.h"
+#include "cbus_soe.h"
+#include "cbus_counters.h"
+#include "cbus_rules.h"
+#include "cbus_state.h"
+#include "cbus_txconfirm.h"
+#include "cbus_liveness.h"
+#include "cbus_transport.h"
 #ifdef __TARGET_LINUX__
 #include <unistd.h>
 #include <arpa/inet.h>
@@ -22,26 +33,72 @@
 //! Number of output registers (DAC)
 //#define OUTPUT_REGISTERS_NUMBER     0
 
+// Input registers map
+//! Gateway metrics (TCBUSMetrics), 2 registers per counter, high word first
+#define IR_METRICS_BASE             0
+#define IR_METRICS_SIZE             128
+//! Sequence of events (see cbus_soe.h)
+#define IR_SOE_BASE                 (IR_METRICS_BASE+IR_METRICS_SIZE)
+//! Edge counters and ON time per input (see cbus_counters.h)
+#define IR_COUNTERS_BASE            512
+//! TX latency histogram (see cbus_txconfirm.h)
+#define IR_TX_LATENCY_BASE          (IR_COUNTERS_BASE+CBUS_COUNTER_REGISTERS)
+#define INPUT_REGISTERS_NUMBER      (IR_TX_LATENCY_BASE+CBUS_TX_LATENCY_REGISTERS)
+
+#if (IR_SOE_BASE+CBUS_SOE_REGISTERS > IR_COUNTERS_BASE)
+#error "Sequence of events registers overlap counters"
+#endif
+
 modbus_t* ctx = 0;
 int ModbusListenSocket = -1;
 modbus_mapping_t* mb_mapping = 0;
 CThread* ModbusThread = 0;
 unsigned char BreakRequest=0;
+int StreamPort=0;                   // TCP port for delta streaming (0 = disabled)
+char StreamSocketPath[108]="";      // Unix socket for delta streaming (empty = disabled)
+unsigned int SharedMemoryMode=0;    // 1 = I/O image is also published in shared memory (see cbus_shm.h)
+unsigned int ModbusFastPath=1;      // 1 = FC1/FC2/FC5/FC15 are handled natively (see modbus_fastpath.c)
+char CBUSInterface[64]="can0";      // CAN interface, CBUS server address or serial port (see --transport)
 
 void* ModbusThreadFunc (CThread *Control)
 {
     uint8_t ModbusQuery[1500];
     int rc=0;
+    int Address;
+    int Quantity;
 
     modbus_tcp_accept (ctx, &ModbusListenSocket);
 
+    if (ModbusFastPath)
+    {
+        while ((Control->ShouldStop==false)&&(rc!=-1))
+        {
+            // Timeout allows to check regularly if thread has to stop
+            rc = serveModbusFastPath (ctx, mb_mapping, 100);
+        }
+    }
+
     while ((Control->ShouldStop==false)&&(rc!=-1))
     {
         // modbus_receive will return -1 if socket is closed
         rc = modbus_receive (ctx, &ModbusQuery[0]);
 		if (rc>0)
 		{
-			modbus_reply (ctx, &ModbusQuery[0], rc, mb_mapping);
+            Address = 0;
+            Quantity = 0;
+            if ((rc >= 12) && (ModbusQuery[7] == 0x02))
+            {   // Request fields are only read when the frame is long enough to contain them
+                Address = (ModbusQuery[8]<<8)+ModbusQuery[9];
+                Quantity = (ModbusQuery[10]<<8)+ModbusQuery[11];
+            }
+            if ((Quantity >= 1) && (Quantity <= MODBUS_MAX_READ_BITS) && (Address+Quantity <= mb_mapping->nb_input_bits))
+            {   // Read discrete inputs : latch bits are taken from the latch counters, so they can be cleared on read
+                prepareCBUSLatchRead (mb_mapping->tab_input_bits, Address, Quantity);
+                modbus_reply (ctx, &ModbusQuery[0], rc, mb_mapping);
+                acknowledgeCBUSLatchRead ();
+            }
+            else
+                modbus_reply (ctx, &ModbusQuery[0], rc, mb_mapping);
         }
     }
 
@@ -53,6 +110,9 @@ void* ModbusThreadFunc (CThread *Control)
 
 void Terminate (void)
 {
+    stopCBUSStream();
+    stopModbusPush();
+    closeCBUSShm();
     closeCBUSDriver();
 
     if (ModbusThread)
@@ -83,6 +143,8 @@ void Terminate (void)
         ModbusListenSocket = -1;
     }
 
+    closeModbusFastPath();
+
     if (mb_mapping!=0)
     {
         modbus_mapping_free(mb_mapping);
@@ -116,21 +178,71 @@ void sig_handler (int signo)
 //! Exchange Modbus data with the CBUS handler
 void UpdateModbusData (void)
 {
-    //int RegisterNumber;
+    int RegisterNumber;
     int InputNumber;
     int CoilNumber;
+    int RuleNumber;
+    const uint32_t* Metrics;
 
     acquireCBUSPLCInputs();
     for (InputNumber=0; InputNumber<NUM_CBUS_BOOL_INPUTS; InputNumber++)
     {
         mb_mapping->tab_input_bits[InputNumber] = CBUS_PLC_BoolInput[InputNumber];
     }
+    notifyModbusPushInputs (CBUS_PLC_BoolInput, NUM_CBUS_BOOL_INPUTS);
+    exportCBUSLatches (&mb_mapping->tab_input_bits[DI_RISING_LATCH_BASE], &mb_mapping->tab_input_bits[DI_FALLING_LATCH_BASE]);
+
+    // Latch clear coils are reset once the latches have been cleared
+    for (InputNumber=0; InputNumber<NUM_CBUS_BOOL_INPUTS; InputNumber++)
+    {
+        if (mb_mapping->tab_bits[COIL_LATCH_CLEAR_BASE+InputNumber])
+        {
+            clearCBUSLatches (InputNumber);
+            mb_mapping->tab_bits[COIL_LATCH_CLEAR_BASE+InputNumber] = 0;
+            mb_mapping->tab_input_bits[DI_RISING_LATCH_BASE+InputNumber] = 0;
+            mb_mapping->tab_input_bits[DI_FALLING_LATCH_BASE+InputNumber] = 0;
+        }
+    }
 
     for (CoilNumber=0; CoilNumber<NUM_CBUS_BOOL_OUTPUTS; CoilNumber++)
     {
         CBUS_PLC_BoolOutput[CoilNumber] = mb_mapping->tab_bits[CoilNumber];
     }
+
+    if (SharedMemoryMode)
+    {
+        // A local PLC runtime writing outputs in shared memory has priority over Modbus coils
+        // Coils are updated so Modbus clients see the outputs really applied
+        if (readCBUSShmOutputs (CBUS_PLC_BoolOutput))
+        {
+            for (CoilNumber=0; CoilNumber<NUM_CBUS_BOOL_OUTPUTS; CoilNumber++)
+            {
+                mb_mapping->tab_bits[CoilNumber] = CBUS_PLC_BoolOutput[CoilNumber];
+            }
+        }
+        publishCBUSShm (CBUS_PLC_BoolInput, CBUS_PLC_BoolOutput);
+    }
+    for (RuleNumber=0; RuleNumber<MAX_CBUS_RULES; RuleNumber++)
+    {
+        setCBUSRuleOverride (RuleNumber, mb_mapping->tab_bits[COIL_RULE_OVERRIDE_BASE+RuleNumber]);
+    }
     updateCBUSPLCOutputs();
+    exportCBUSRuleResults (&mb_mapping->tab_input_bits[DI_RULE_BASE]);
+    exportCBUSTXFailed (&mb_mapping->tab_input_bits[DI_TX_FAILED_BASE]);
+    exportCBUSStaleInputs (&mb_mapping->tab_input_bits[DI_STALE_BASE], getCBUSTimestamp()/1000, NodeTimeout);
+
+    Metrics = (const uint32_t*)&CBUSMetrics;
+    for (RegisterNumber=0; (RegisterNumber<(int)NUM_CBUS_METRICS)&&(RegisterNumber*2<IR_METRICS_SIZE); RegisterNumber++)
+    {
+        mb_mapping->tab_input_registers[IR_METRICS_BASE+(RegisterNumber*2)] = Metrics[RegisterNumber]>>16;
+        mb_mapping->tab_input_registers[IR_METRICS_BASE+(RegisterNumber*2)+1] = Metrics[RegisterNumber]&0xFFFF;
+    }
+    exportCBUSSOE (&mb_mapping->tab_input_registers[IR_SOE_BASE]);
+    exportCBUSCounters (&mb_mapping->tab_input_registers[IR_COUNTERS_BASE]);
+    exportCBUSTXLatency (&mb_mapping->tab_input_registers[IR_TX_LATENCY_BASE]);
+
+    if (ModbusFastPath)
+        updateModbusFastPathImages (mb_mapping);
 }  // UpdateModbusData
 // --------------------------------
 
@@ -139,26 +251,169 @@ void ParseCLIParameters (int argc, char* argv[])
 {
     int ParmCount;
     int TestInt;
+    char* Value;
 
     if (argc<2) return;
 
     for (ParmCount = 1; ParmCount<argc; ParmCount++)
     {
-        if (strcmp(argv[ParmCount], "--verbose") == 0)
+        // Make sure we have one argument following (all parameters have a value)
+        if (ParmCount >= (argc - 1))
         {
-            // Make sure we have one argument following (verbosity level)
-            if (ParmCount >= (argc - 1))
-            {
-                fprintf (stderr, "Missing or invalid value for parameter --verbose\n");
-                return;
-            }
+            fprintf (stderr, "Missing or invalid value for parameter %s\n", argv[ParmCount]);
+            return;
+        }
+        Value = argv[ParmCount + 1];
 
-            TestInt = atoi (argv[ParmCount + 1]);
+        if (strcmp(argv[ParmCount], "--verbose") == 0)
+        {
+            TestInt = atoi (Value);
             if (TestInt<0) TestInt = 0;
             VerbosityLevel = TestInt;
-
-            ParmCount += 1;     // Jump over the argument value
         }
+        else if (strcmp(argv[ParmCount], "--pipeline") == 0)
+        {
+            PipelineMode = (atoi (Value) != 0) ? 1 : 0;
+        }
+        else if (strcmp(argv[ParmCount], "--io-uring") == 0)
+        {
+            UringMode = (atoi (Value) != 0) ? 1 : 0;
+        }
+        else if (strcmp(argv[ParmCount], "--modbus-fastpath") == 0)
+        {
+            ModbusFastPath = (atoi (Value) != 0) ? 1 : 0;
+        }
+        else if (strcmp(argv[ParmCount], "--push-host") == 0)
+        {
+            strncpy (ModbusPushConfig.Host, Value, sizeof(ModbusPushConfig.Host)-1);
+        }
+        else if (strcmp(argv[ParmCount], "--push-port") == 0)
+        {
+            ModbusPushConfig.Port = atoi (Value);
+        }
+        else if (strcmp(argv[ParmCount], "--push-target") == 0)
+        {
+            if (strcmp (Value, "registers") == 0)
+                ModbusPushConfig.Target = PUSH_TARGET_REGISTERS;
+            else
+                ModbusPushConfig.Target = PUSH_TARGET_COILS;
+        }
+        else if (strcmp(argv[ParmCount], "--push-address") == 0)
+        {
+            TestInt = atoi (Value);
+            if (TestInt<0) TestInt = 0;
+            ModbusPushConfig.BaseAddress = TestInt;
+        }
+        else if (strcmp(argv[ParmCount], "--push-window") == 0)
+        {
+            TestInt = atoi (Value);
+            if (TestInt<0) TestInt = 0;
+            ModbusPushConfig.WindowMs = TestInt;
+        }
+        else if (strcmp(argv[ParmCount], "--push-sync") == 0)
+        {
+            TestInt = atoi (Value);
+            if (TestInt<0) TestInt = 0;
+            ModbusPushConfig.SyncPeriodMs = TestInt*1000;
+        }
+        else if (strcmp(argv[ParmCount], "--output-refresh") == 0)
+        {
+            TestInt = atoi (Value);
+            if (TestInt<0) TestInt = 0;
+            OutputRefreshPeriod = TestInt*1000;
+        }
+        else if (strcmp(argv[ParmCount], "--tx-rate") == 0)
+        {
+            TestInt = atoi (Value);
+            if (TestInt<0) TestInt = 0;
+            TXRateLimit = TestInt;
+        }
+        else if (strcmp(argv[ParmCount], "--can-id") == 0)
+        {
+            TestInt = atoi (Value);
+            if ((TestInt<0)||(TestInt>127)) TestInt = 0;
+            FixedCANID = TestInt;
+        }
+        else if (strcmp(argv[ParmCount], "--rx-buffer") == 0)
+        {
+            TestInt = atoi (Value);
+            if (TestInt<0) TestInt = 0;
+            SocketRXBuffer = TestInt;
+        }
+        else if (strcmp(argv[ParmCount], "--tx-confirm") == 0)
+        {
+            TestInt = atoi (Value);
+            if (TestInt<0) TestInt = 0;
+            TXConfirmTimeout = TestInt;
+        }
+        else if (strcmp(argv[ParmCount], "--bitrate") == 0)
+        {
+            TestInt = atoi (Value);
+            if (TestInt>0) CANBitrate = TestInt;
+        }
+        else if (strcmp(argv[ParmCount], "--load-threshold") == 0)
+        {
+            TestInt = atoi (Value);
+            if ((TestInt<0)||(TestInt>100)) TestInt = 0;
+            BusLoadThreshold = TestInt;
+        }
+        else if (strcmp(argv[ParmCount], "--node-timeout") == 0)
+        {
+            TestInt = atoi (Value);
+            if (TestInt<0) TestInt = 0;
+            NodeTimeout = TestInt*1000;
+        }
+        else if (strcmp(argv[ParmCount], "--transport") == 0)
+        {
+            if (strcmp (Value, "gridconnect") == 0)
+                CBUSTransportType = CBUS_TRANSPORT_GRIDCONNECT;
+            else if (strcmp (Value, "slcan") == 0)
+                CBUSTransportType = CBUS_TRANSPORT_SLCAN;
+            else if (strcmp (Value, "socketcan") == 0)
+                CBUSTransportType = CBUS_TRANSPORT_SOCKETCAN;
+            else
+                fprintf (stderr, "Unknown transport %s\n", Value);
+        }
+        else if (strcmp(argv[ParmCount], "--interface") == 0)
+        {
+            strncpy (CBUSInterface, Value, sizeof(CBUSInterface)-1);
+        }
+        else if (strcmp(argv[ParmCount], "--node-number") == 0)
+        {
+            TestInt = atoi (Value);
+            if ((TestInt<0)||(TestInt>65535)) TestInt = 0;
+            CBUSNodeNumber = TestInt;
+        }
+        else if (strcmp(argv[ParmCount], "--areq-proxy") == 0)
+        {
+            TestInt = atoi (Value);
+            if (TestInt<0) TestInt = 0;
+            AREQProxyMaxAge = TestInt;
+        }
+        else if (strcmp(argv[ParmCount], "--shm") == 0)
+        {
+            SharedMemoryMode = (atoi (Value) != 0) ? 1 : 0;
+        }
+        else if (strcmp(argv[ParmCount], "--stream-port") == 0)
+        {
+            TestInt = atoi (Value);
+            if ((TestInt<0)||(TestInt>65535)) TestInt = 0;
+            StreamPort = TestInt;
+        }
+        else if (strcmp(argv[ParmCount], "--stream-socket") == 0)
+        {
+            strncpy (StreamSocketPath, Value, sizeof(StreamSocketPath)-1);
+        }
+        else if (strcmp(argv[ParmCount], "--state-file") == 0)
+        {
+            strncpy (CBUSStateFile, Value, sizeof(CBUSStateFile)-1);
+        }
+        else
+        {
+            fprintf (stderr, "Unknown parameter %s\n", argv[ParmCount]);
+        }
+
+        ParmCount += 1;     // Jump over the argument value
     }
 }  // ParseCLIParameters
 // --------------------------------
@@ -167,6 +422,7 @@ int main(int argc, char* argv[])
 {
     int MaxPrio;
     int CBUSResult;
+    int CoilNumber;
 
 	fprintf (stdout, "cbus2modbus : MERG CBUS to Modbus gateway - V0.1\n");
 	fprintf (stdout, "(c) Benoit BOUCHEZ - 2024\n");
@@ -175,7 +431,7 @@ int main(int argc, char* argv[])
 
     signal (SIGINT, sig_handler);       // Make sure we terminate application gracefully
 
-    CBUSResult = startCBUSDriver("can0");
+    CBUSResult = startCBUSDriver(CBUSInterface);
     if (CBUSResult != 0)
     {
         if (CBUSResult == -1)
@@ -183,7 +439,7 @@ int main(int argc, char* argv[])
         else if (CBUSResult == -2)
             fprintf (stdout, "Missing or corrupted PLC outputs configuration file\n");
         else
-            fprintf (stdout, "Can not create can0 communication socket");
+            fprintf (stdout, "Can not create %s communication socket\n", CBUSInterface);
         fprintf (stdout, "Exiting cbus2modbus\n");
     }
 
@@ -206,7 +462,7 @@ int main(int argc, char* argv[])
         return -1;
 	}
 
-	mb_mapping = modbus_mapping_new (NUM_CBUS_BOOL_OUTPUTS, NUM_CBUS_BOOL_INPUTS, 0, 0);
+	mb_mapping = modbus_mapping_new (COIL_RULES_END, DI_LIVENESS_END, 0, INPUT_REGISTERS_NUMBER);
     if (mb_mapping==0)
     {
         fprintf (stderr, "Error : Unable to allocate Modbus mapping\n");
@@ -214,6 +470,40 @@ int main(int argc, char* argv[])
         return -1;
     }
 
+    // Coils start with the outputs restored from the state file (all 0 without state file)
+    for (CoilNumber=0; CoilNumber<NUM_CBUS_BOOL_OUTPUTS; CoilNumber++)
+    {
+        mb_mapping->tab_bits[CoilNumber] = CBUS_PLC_BoolOutput[CoilNumber];
+    }
+
+    if (ModbusFastPath)
+    {
+        if (initModbusFastPath (mb_mapping) != 0)
+        {
+            fprintf (stderr, "Warning : Unable to allocate Modbus fast path images, using libmodbus only\n");
+            ModbusFastPath = 0;
+        }
+    }
+
+    if (startModbusPush() != 0)
+    {
+        fprintf (stderr, "Error : can not start Modbus push mode\n");
+    }
+
+    if (SharedMemoryMode)
+    {
+        if (createCBUSShm() != 0)
+        {
+            fprintf (stderr, "Error : can not create shared memory segment %s\n", CBUS_SHM_NAME);
+            SharedMemoryMode = 0;
+        }
+    }
+
+    if (startCBUSStream (StreamPort, StreamSocketPath) != 0)
+    {
+        fprintf (stderr, "Error : can not open streaming server socket\n");
+    }
+
     // Start Modbus thread
     MaxPrio = sched_get_priority_max(SCHED_FIFO);
     ModbusThread = new CThread ((ThreadFuncType*)ModbusThreadFunc, MaxPrio, 0);
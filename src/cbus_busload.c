@@ -0,0 +1,94 @@
+/*
+cbus_busload.c
+cbus2modbus
+CAN bus load estimation
+Development : Benoit BOUCHEZ - M8718
+
+The load is computed from the frames received and sent by the gateway over a sliding window of
+1 second, made of 10 slots of 100 ms. The length of each frame is computed from its DLC, with
+the worst case number of stuff bits : the bus load is slightly overestimated, which is the safe
+side for throttling. Error frames and retransmissions done by the CAN controller are not seen.
+Functions are called by the thread calling ProcessCBUS_IO.
+*/
+
+#include <string.h>
+#include "cbus_busload.h"
+#include "SocketCBUS.h"
+
+#define BUSLOAD_SLOTS           10
+#define BUSLOAD_SLOT_TIME       100000      // Slot duration in microseconds
+
+typedef struct {
+    uint64_t Period;            // Timestamp/BUSLOAD_SLOT_TIME of the bits counted in the slot
+    uint32_t Bits;
+} TCBUSLoadSlot;
+
+static TCBUSLoadSlot LoadSlots[BUSLOAD_SLOTS];
+
+void clearCBUSBusLoad (void)
+{
+    memset (LoadSlots, 0, sizeof(LoadSlots));
+}  // clearCBUSBusLoad
+// ------------------------------------------------------------
+
+uint32_t getCBUSFrameBits (unsigned int ID, unsigned int DLC)
+{
+    uint32_t DataBits;
+    uint32_t StuffedBits;       // SOF to end of CRC : bit stuffing applies
+    uint32_t FixedBits;         // CRC delimiter, ACK, EOF and interframe space : no bit stuffing
+
+    DLC &= 0x0F;
+    if (DLC > 8) DLC = 8;
+    DataBits = (ID & CBUS_RTR_FLAG) ? 0 : DLC*8;
+
+    if (ID & CBUS_EFF_FLAG)
+        StuffedBits = 54+DataBits;      // SOF, 11+18 bits ID, SRR, IDE, RTR, r1, r0, DLC, CRC
+    else
+        StuffedBits = 34+DataBits;      // SOF, 11 bits ID, RTR, IDE, r0, DLC, CRC
+    FixedBits = 13;
+
+    // Worst case : one stuff bit after each group of 4 bits following the first one
+    return StuffedBits+((StuffedBits-1)/4)+FixedBits;
+}  // getCBUSFrameBits
+// ------------------------------------------------------------
+
+void addCBUSBusFrame (unsigned int ID, unsigned int DLC, uint64_t Timestamp)
+{
+    uint64_t Period;
+    TCBUSLoadSlot* Slot;
+
+    Period = Timestamp/BUSLOAD_SLOT_TIME;
+    Slot = &LoadSlots[Period%BUSLOAD_SLOTS];
+    if (Slot->Period != Period)
+    {  // Slot contains bits from a previous window
+        Slot->Period = Period;
+        Slot->Bits = 0;
+    }
+    Slot->Bits += getCBUSFrameBits (ID, DLC);
+}  // addCBUSBusFrame
+// ------------------------------------------------------------
+
+uint32_t getCBUSBusLoad (uint32_t Bitrate, uint64_t Timestamp)
+{
+    uint64_t Period;
+    uint64_t TotalBits = 0;
+    uint64_t WindowTime;
+    uint64_t Load;
+    int SlotCounter;
+
+    if (Bitrate == 0) return 0;
+
+    Period = Timestamp/BUSLOAD_SLOT_TIME;
+    for (SlotCounter=0; SlotCounter<BUSLOAD_SLOTS; SlotCounter++)
+    {
+        if ((LoadSlots[SlotCounter].Period <= Period) && (Period-LoadSlots[SlotCounter].Period < BUSLOAD_SLOTS))
+            TotalBits += LoadSlots[SlotCounter].Bits;
+    }
+
+    // Window is made of the previous slots and of the elapsed part of the current slot
+    WindowTime = ((BUSLOAD_SLOTS-1)*BUSLOAD_SLOT_TIME)+(Timestamp%BUSLOAD_SLOT_TIME);
+    Load = (TotalBits*1000000ULL*10000ULL)/((uint64_t)Bitrate*WindowTime);
+    if (Load > 10000) Load = 10000;
+    return (uint32_t)Load;
+}  // getCBUSBusLoad
+// ------------------------------------------------------------
@@ -0,0 +1,36 @@
+/*
+cbus_busload.h
+cbus2modbus
+CAN bus load estimation
+Development : Benoit BOUCHEZ - M8718
+*/
+
+#ifndef __CBUS_BUSLOAD_H__
+#define __CBUS_BUSLOAD_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CBUS_DEFAULT_BITRATE    125000      // CBUS standard bitrate
+
+//! Reset the measurement window
+void clearCBUSBusLoad (void);
+
+//! \return number of bits used on the bus by a frame, including worst case bit stuffing and interframe space
+// ID can include CBUS_EFF_FLAG and CBUS_RTR_FLAG (remote frames have no data field)
+uint32_t getCBUSFrameBits (unsigned int ID, unsigned int DLC);
+
+//! Add a frame seen on the bus (received or sent by the gateway). Timestamp from getCBUSTimestamp
+void addCBUSBusFrame (unsigned int ID, unsigned int DLC, uint64_t Timestamp);
+
+//! \return bus load over the last second in 1/100 % (10000 = bus fully used)
+uint32_t getCBUSBusLoad (uint32_t Bitrate, uint64_t Timestamp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
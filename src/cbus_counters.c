@@ -0,0 +1,88 @@
+/*
+cbus_counters.c
+cbus2modbus
+Edge counters and ON time totalizers for PLC inputs
+Development : Benoit BOUCHEZ - M8718
+
+Counting pulses (axle counters, cycle counters) or accumulating ON time in the PLC requires
+a fast polling to avoid missing edges. The gateway counts them when the CBUS frame is received,
+so the PLC can read the totals at any rate and still get exact values.
+Counters are updated and exported by the thread calling ProcessCBUS_IO and UpdateModbusData.
+*/
+
+#include <string.h>
+#include "cbus_counters.h"
+
+typedef struct {
+    uint32_t RisingEdges;
+    uint8_t State;
+    uint64_t OnTime;            // Accumulated ON time (microseconds) of terminated ON periods
+    uint64_t OnSince;           // Start of current ON period
+} TCBUSInputCounter;
+
+static TCBUSInputCounter InputCounters[NUM_CBUS_BOOL_INPUTS];
+
+void clearCBUSCounters (void)
+{
+    memset (InputCounters, 0, sizeof(InputCounters));
+}  // clearCBUSCounters
+// ------------------------------------------------------------
+
+//! Start or end the ON period of an input. Edge is counted if CountEdge is 1
+static void changeCBUSCounterState (int Input, uint8_t State, uint64_t Timestamp, int CountEdge)
+{
+    TCBUSInputCounter* Counter;
+
+    if ((Input < 0) || (Input >= NUM_CBUS_BOOL_INPUTS)) return;
+    Counter = &InputCounters[Input];
+    if (Counter->State == State) return;
+
+    if (State)
+    {
+        if (CountEdge) Counter->RisingEdges++;
+        Counter->OnSince = Timestamp;
+    }
+    else
+    {
+        Counter->OnTime += Timestamp - Counter->OnSince;
+    }
+    Counter->State = State;
+}  // changeCBUSCounterState
+// ------------------------------------------------------------
+
+void updateCBUSCounters (int Input, uint8_t State, uint64_t Timestamp)
+{
+    changeCBUSCounterState (Input, State, Timestamp, 1);
+}  // updateCBUSCounters
+// ------------------------------------------------------------
+
+void setCBUSCounterState (int Input, uint8_t State, uint64_t Timestamp)
+{
+    changeCBUSCounterState (Input, State, Timestamp, 0);
+}  // setCBUSCounterState
+// ------------------------------------------------------------
+
+void exportCBUSCounters (uint16_t* Registers)
+{
+    int Input;
+    uint64_t Now;
+    uint32_t OnTimeMs;
+    TCBUSInputCounter* Counter;
+
+    Now = getCBUSTimestamp ();
+    for (Input=0; Input<NUM_CBUS_BOOL_INPUTS; Input++)
+    {
+        Counter = &InputCounters[Input];
+        if (Counter->State)
+            OnTimeMs = (Counter->OnTime + (Now - Counter->OnSince)) / 1000;
+        else
+            OnTimeMs = Counter->OnTime / 1000;
+
+        Registers[0] = Counter->RisingEdges>>16;
+        Registers[1] = Counter->RisingEdges&0xFFFF;
+        Registers[2] = OnTimeMs>>16;
+        Registers[3] = OnTimeMs&0xFFFF;
+        Registers += CBUS_COUNTER_REGISTERS_PER_INPUT;
+    }
+}  // exportCBUSCounters
+// ------------------------------------------------------------
@@ -0,0 +1,42 @@
+/*
+cbus_counters.h
+cbus2modbus
+Edge counters and ON time totalizers for PLC inputs
+Development : Benoit BOUCHEZ - M8718
+*/
+
+#ifndef __CBUS_COUNTERS_H__
+#define __CBUS_COUNTERS_H__
+
+#include <stdint.h>
+#include "cbus_io.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Counters as input registers : 4 registers per input, high word first
+// - number of rising edges (ACON received while input was 0)
+// - time spent ON in milliseconds (includes current ON period)
+// Both values wrap around at 2^32
+#define CBUS_COUNTER_REGISTERS_PER_INPUT    4
+#define CBUS_COUNTER_REGISTERS              (NUM_CBUS_BOOL_INPUTS*CBUS_COUNTER_REGISTERS_PER_INPUT)
+
+//! Reset all counters (called when the driver starts)
+void clearCBUSCounters (void);
+
+//! Update counters of an input when its state changes (Timestamp from getCBUSTimestamp)
+void updateCBUSCounters (int Input, uint8_t State, uint64_t Timestamp);
+
+//! Set the state of an input without counting an edge : state restored from the state file, or first
+// answer after startup or socket recovery (the change may have happened long before, or not at all)
+void setCBUSCounterState (int Input, uint8_t State, uint64_t Timestamp);
+
+//! Copy counters to input registers (CBUS_COUNTER_REGISTERS registers)
+void exportCBUSCounters (uint16_t* Registers);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
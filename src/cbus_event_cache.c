@@ -0,0 +1,106 @@
+/*
+cbus_event_cache.c
+cbus2modbus
+Cache of the last state of all long events seen on CBUS
+Development : Benoit BOUCHEZ - M8718
+
+Open addressing hash table with linear probing, indexed by node number and event number.
+The table has a fixed size : when no free entry is found within CACHE_MAX_PROBE slots,
+the oldest entry of the probe window is replaced. Entries are never removed, so probe
+chains are never broken and a lookup can stop at the first free entry.
+*/
+
+#include <string.h>
+#include "cbus_event_cache.h"
+
+#define CACHE_MAX_PROBE     16
+#define CACHE_FLAG_USED     0x80
+#define CACHE_FLAG_STATE    0x01
+
+typedef struct {
+    uint32_t Key;               // (NN<<16)+EN
+    uint32_t Flags;
+    uint64_t Timestamp;         // Time of last event (microseconds)
+} TCBUSEventCacheEntry;
+
+TCBUSEventCacheStats CBUSEventCacheStats;
+
+static TCBUSEventCacheEntry EventCache[CBUS_EVENT_CACHE_SIZE];
+
+static inline uint32_t hashEventKey (uint32_t Key)
+{
+    // Fibonacci hashing : spreads consecutive event numbers over the whole table
+    return (Key * 2654435761u) >> (32-CBUS_EVENT_CACHE_BITS);
+}
+
+void clearCBUSEventCache (void)
+{
+    memset (EventCache, 0, sizeof(EventCache));
+    memset (&CBUSEventCacheStats, 0, sizeof(CBUSEventCacheStats));
+}  // clearCBUSEventCache
+// ------------------------------------------------------------
+
+void updateCBUSEventCache (uint16_t NN, uint16_t EN, uint8_t State, uint64_t Timestamp)
+{
+    uint32_t Key;
+    uint32_t Index;
+    uint32_t Probe;
+    TCBUSEventCacheEntry* Entry;
+    TCBUSEventCacheEntry* Oldest = 0;
+
+    Key = ((uint32_t)NN<<16)+EN;
+    Index = hashEventKey (Key);
+
+    for (Probe=0; Probe<CACHE_MAX_PROBE; Probe++)
+    {
+        Entry = &EventCache[(Index+Probe) & (CBUS_EVENT_CACHE_SIZE-1)];
+
+        if ((Entry->Flags & CACHE_FLAG_USED) == 0)
+        {   // Event is not in the cache : use the free entry
+            Entry->Key = Key;
+            CBUSEventCacheStats.Entries++;
+            break;
+        }
+
+        if (Entry->Key == Key) break;
+
+        if ((Oldest == 0) || (Entry->Timestamp < Oldest->Timestamp)) Oldest = Entry;
+    }
+
+    if (Probe == CACHE_MAX_PROBE)
+    {   // Probe window is full : replace the oldest event
+        Entry = Oldest;
+        Entry->Key = Key;
+        CBUSEventCacheStats.Evictions++;
+    }
+
+    Entry->Flags = CACHE_FLAG_USED | (State ? CACHE_FLAG_STATE : 0);
+    Entry->Timestamp = Timestamp;
+}  // updateCBUSEventCache
+// ------------------------------------------------------------
+
+int lookupCBUSEventCache (uint16_t NN, uint16_t EN, uint8_t* State, uint64_t* Timestamp)
+{
+    uint32_t Key;
+    uint32_t Index;
+    uint32_t Probe;
+    TCBUSEventCacheEntry* Entry;
+
+    Key = ((uint32_t)NN<<16)+EN;
+    Index = hashEventKey (Key);
+
+    for (Probe=0; Probe<CACHE_MAX_PROBE; Probe++)
+    {
+        Entry = &EventCache[(Index+Probe) & (CBUS_EVENT_CACHE_SIZE-1)];
+        if ((Entry->Flags & CACHE_FLAG_USED) == 0) return 0;
+
+        if (Entry->Key == Key)
+        {
+            *State = (Entry->Flags & CACHE_FLAG_STATE) ? 1 : 0;
+            *Timestamp = Entry->Timestamp;
+            return 1;
+        }
+    }
+    return 0;
+}  // lookupCBUSEventCache
+// ------------------------------------------------------------
@@ -0,0 +1,43 @@
+/*
+cbus_event_cache.h
+cbus2modbus
+Cache of the last state of all long events seen on CBUS
+Development : Benoit BOUCHEZ - M8718
+*/
+
+#ifndef __CBUS_EVENT_CACHE_H__
+#define __CBUS_EVENT_CACHE_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//! Number of entries in the cache is 2^CBUS_EVENT_CACHE_BITS
+#define CBUS_EVENT_CACHE_BITS       12
+#define CBUS_EVENT_CACHE_SIZE       (1<<CBUS_EVENT_CACHE_BITS)
+
+typedef struct {
+    uint32_t Entries;           // Number of events in the cache
+    uint32_t Evictions;         // Events replaced because the cache is full
+    uint32_t ProxyResponses;    // AREQ answered from the cache
+} TCBUSEventCacheStats;
+
+extern TCBUSEventCacheStats CBUSEventCacheStats;
+
+//! Clear all entries
+void clearCBUSEventCache (void);
+
+//! Store state of an event seen on the bus (ACON/ACOF/ARON/AROF)
+void updateCBUSEventCache (uint16_t NN, uint16_t EN, uint8_t State, uint64_t Timestamp);
+
+//! Get last known state of an event
+// \return 1 if event is in the cache, 0 if it has never been seen (or has been evicted)
+int lookupCBUSEventCache (uint16_t NN, uint16_t EN, uint8_t* State, uint64_t* Timestamp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
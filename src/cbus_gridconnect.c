@@ -0,0 +1,566 @@
+/*
+cbus_gridconnect.c
+cbus2modbus
+CBUS over TCP using the GridConnect ASCII protocol (CANETHER, CBUS servers)
+Development : Benoit BOUCHEZ - M8718
+
+Each CAN frame is sent as text : ":S" + 4 hex digits + 'N' + data bytes in hex + ';' for
+standard frames, ":X" + 8 hex digits for extended frames, 'R' instead of 'N' for remote frames.
+Header digits are the ID registers of the MCP2515 (11 bit ID shifted left by 5 bits).
+
+Reception : the socket is read in large chunks and all complete frames of a chunk are decoded in
+one pass into a batch of TCBUSFrame (same frames as the pipeline rings), then given one by one by
+getNextCBUSMessage. Frame delimiters are found 16 characters at a time with SSE2 or NEON compare
+instructions (memchr on other targets), and hex digits are decoded with a lookup table.
+Transmission : frames given to sendCBUSRaw are encoded in a buffer and written with a single
+send() call by flushCBUSSocket, called at the end of each ProcessCBUS_IO cycle (or by the TX
+thread of the pipeline when its rings are empty).
+
+The server does not report when a frame has been sent on the CAN bus : with TX confirmation,
+frames are echoed when they have been written to the TCP socket. Loss of the connection is
+reported as ENETDOWN by getCBUSSocketError, so the driver connects again (bus-off recovery).
+With the pipeline, RX functions are called by the RX thread and TX functions by the TX thread.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include "cbus_gridconnect.h"
+#include "SocketCBUS.h"
+
+#define GRIDCONNECT_CONNECT_TIMEOUT     1000        // ms
+#define GRIDCONNECT_SEND_TIMEOUT        10          // ms waited for room in the socket buffer by flush
+#define GRIDCONNECT_TX_FRAMES           (GRIDCONNECT_TEXT_SIZE/8)
+
+const uint8_t CBUSHexDigits[256] = {
+    ['0']=1, ['1']=2, ['2']=3, ['3']=4, ['4']=5, ['5']=6, ['6']=7, ['7']=8, ['8']=9, ['9']=10,
+    ['A']=11, ['B']=12, ['C']=13, ['D']=14, ['E']=15, ['F']=16,
+    ['a']=11, ['b']=12, ['c']=13, ['d']=14, ['e']=15, ['f']=16
+};
+const char CBUSHexChars[] = "0123456789ABCDEF";
+
+static int ServerSocket = -1;
+static int OwnFrames = 0;
+static int SocketError = 0;                 // Last error, not yet read by getCBUSSocketError
+static uint32_t DroppedFrames = 0;          // Frames not decoded, not yet read by getCBUSDroppedFrames
+
+// Reception (RX thread)
+static TGridConnectParser Parser;
+static uint32_t ParserErrors = 0;           // Parser.Errors already added to DroppedFrames
+static TCBUSFrame RXFrames[GRIDCONNECT_MAX_BATCH];
+static int RXFrameCount = 0;
+static int RXFrameIndex = 0;
+
+// Transmission (TX thread)
+static char TXText[GRIDCONNECT_TEXT_SIZE];
+static int TXLength = 0;
+static TCBUSFrame TXFrames[GRIDCONNECT_TX_FRAMES];  // Frames in TXText, echoed once written (TX confirmation)
+static int TXFrameEnd[GRIDCONNECT_TX_FRAMES];       // Offset of the end of each frame in TXText
+static int TXFrameCount = 0;
+
+static TCBUSRing EchoRing;                  // Written by TX functions, read by RX functions
+
+int findCBUSTextDelimiters (const char* Text, int Length, char Delimiter, uint16_t* Positions, int MaxPositions)
+{
+    int Offset = 0;
+    int Count = 0;
+    const char* Next;
+#if defined(__SSE2__)
+    __m128i Delimiters = _mm_set1_epi8 (Delimiter);
+    uint32_t Mask;
+
+    for (; Offset+16 <= Length; Offset += 16)
+    {
+        Mask = _mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i*)&Text[Offset]), Delimiters));
+        while (Mask != 0)
+        {
+            Positions[Count++] = Offset+__builtin_ctz (Mask);
+            if (Count == MaxPositions) return Count;
+            Mask &= Mask-1;
+        }
+    }
+#elif defined(__ARM_NEON)
+    uint8x16_t Delimiters = vdupq_n_u8 ((uint8_t)Delimiter);
+    uint64_t Mask;
+    int Bit;
+
+    for (; Offset+16 <= Length; Offset += 16)
+    {
+        // Narrowing shift gives 4 bits per character (NEON has no movemask)
+        Mask = vget_lane_u64 (vreinterpret_u64_u8 (vshrn_n_u16 (vreinterpretq_u16_u8 (vceqq_u8 (vld1q_u8 ((const uint8_t*)&Text[Offset]), Delimiters)), 4)), 0);
+        while (Mask != 0)
+        {
+            Bit = __builtin_ctzll (Mask);
+            Positions[Count++] = Offset+(Bit>>2);
+            if (Count == MaxPositions) return Count;
+            Mask &= ~(0xFULL<<(Bit&~3));
+        }
+    }
+#endif
+
+    // Remaining characters (all characters on other targets)
+    while (Offset < Length)
+    {
+        Next = (const char*)memchr (&Text[Offset], Delimiter, Length-Offset);
+        if (Next == 0) break;
+        Positions[Count++] = Next-Text;
+        if (Count == MaxPositions) break;
+        Offset = (Next-Text)+1;
+    }
+    return Count;
+}  // findCBUSTextDelimiters
+// ------------------------------------------------------------
+
+//! Decode one frame from ':' to the character before ';'
+// \return 1 if frame is valid
+static int decodeGridConnectText (const char* Text, int Length, TCBUSFrame* Frame)
+{
+    uint32_t Header;
+    int HeaderDigits;
+    int Index;
+    int Digit;
+    int High;
+    int Low;
+    int DataDigits;
+    char Type;
+
+    if (Length < 7) return 0;
+    if (Text[1] == 'S') HeaderDigits = 4;
+    else if (Text[1] == 'X') HeaderDigits = 8;
+    else return 0;
+    if (Length < 3+HeaderDigits) return 0;
+
+    Header = 0;
+    for (Index=0; Index<HeaderDigits; Index++)
+    {
+        Digit = CBUSHexDigits[(uint8_t)Text[2+Index]];
+        if (Digit == 0) return 0;
+        Header = (Header<<4)|(Digit-1);
+    }
+
+    if (HeaderDigits == 4)
+        Frame->ID = Header>>5;
+    else
+        Frame->ID = CBUS_EFF_FLAG|((Header>>21)<<18)|(((Header>>16)&0x03)<<16)|(Header&0xFFFF);
+
+    Index = 2+HeaderDigits;
+    Type = Text[Index++];
+    DataDigits = Length-Index;
+
+    if (Type == 'R')
+    {   // Optional data length
+        Frame->ID |= CBUS_RTR_FLAG;
+        Frame->DLC = 0;
+        if (DataDigits == 0) return 1;
+        Digit = CBUSHexDigits[(uint8_t)Text[Index]];
+        if ((DataDigits != 1) || (Digit == 0) || (Digit > 9)) return 0;
+        Frame->DLC = Digit-1;
+        return 1;
+    }
+    if ((Type != 'N') || (DataDigits & 1) || (DataDigits > 16)) return 0;
+
+    Frame->DLC = DataDigits/2;
+    for (Digit=0; Digit<(int)Frame->DLC; Digit++)
+    {
+        High = CBUSHexDigits[(uint8_t)Text[Index++]];
+        Low = CBUSHexDigits[(uint8_t)Text[Index++]];
+        if ((High == 0) || (Low == 0)) return 0;
+        Frame->Data[Digit] = ((High-1)<<4)|(Low-1);
+    }
+    return 1;
+}  // decodeGridConnectText
+// ------------------------------------------------------------
+
+int decodeGridConnectFrames (TGridConnectParser* Parser, TCBUSFrame* Frames, int MaxFrames)
+{
+    uint16_t Positions[GRIDCONNECT_MAX_BATCH];
+    int NumDelimiters;
+    int Index;
+    int Count = 0;
+    int Start = 0;
+    const char* FrameStart;
+    const char* Next;
+    const char* End;
+
+    if (MaxFrames > GRIDCONNECT_MAX_BATCH) MaxFrames = GRIDCONNECT_MAX_BATCH;
+    if (MaxFrames <= 0) return 0;
+
+    NumDelimiters = findCBUSTextDelimiters (Parser->Text, Parser->Length, ';', Positions, MaxFrames);
+    for (Index=0; Index<NumDelimiters; Index++)
+    {
+        // Frame starts at the last ':' before the delimiter : characters between frames (CR, LF) are ignored
+        End = &Parser->Text[Positions[Index]];
+        FrameStart = 0;
+        Next = (const char*)memchr (&Parser->Text[Start], ':', End-&Parser->Text[Start]);
+        while (Next != 0)
+        {
+            FrameStart = Next;
+            Next = (const char*)memchr (Next+1, ':', End-(Next+1));
+        }
+
+        if ((FrameStart != 0) && (decodeGridConnectText (FrameStart, End-FrameStart, &Frames[Count])))
+            Count++;
+        else
+            Parser->Errors++;
+        Start = Positions[Index]+1;
+    }
+
+    // Keep the beginning of next frame
+    if (Start > 0)
+    {
+        memmove (Parser->Text, &Parser->Text[Start], Parser->Length-Start);
+        Parser->Length -= Start;
+    }
+    else if (Parser->Length == GRIDCONNECT_TEXT_SIZE)
+    {   // Buffer full without delimiter : this is not GridConnect
+        Parser->Errors++;
+        Parser->Length = 0;
+    }
+    return Count;
+}  // decodeGridConnectFrames
+// ------------------------------------------------------------
+
+int encodeGridConnectFrame (unsigned int ID, unsigned int DLC, const unsigned char* Data, char* Text)
+{
+    uint32_t Header;
+    int Digits;
+    int Index;
+    int Length;
+
+    Text[0] = ':';
+    if (ID & CBUS_EFF_FLAG)
+    {   // SIDH, SIDL (with extended identifier bit), EID8, EID0
+        Header = (((ID>>18)&0x7FF)<<21)|0x00080000|(((ID>>16)&0x03)<<16)|(ID&0xFFFF);
+        Text[1] = 'X';
+        Digits = 8;
+    }
+    else
+    {
+        Header = (ID&0x7FF)<<5;
+        Text[1] = 'S';
+        Digits = 4;
+    }
+    for (Index=Digits-1; Index>=0; Index--)
+    {
+        Text[2+Index] = CBUSHexChars[Header&0x0F];
+        Header >>= 4;
+    }
+    Length = 2+Digits;
+
+    if (ID & CBUS_RTR_FLAG)
+        Text[Length++] = 'R';
+    else
+    {
+        Text[Length++] = 'N';
+        DLC &= 0x0F;
+        if (DLC > 8) DLC = 8;
+        for (Index=0; Index<(int)DLC; Index++)
+        {
+            Text[Length++] = CBUSHexChars[Data[Index]>>4];
+            Text[Length++] = CBUSHexChars[Data[Index]&0x0F];
+        }
+    }
+    Text[Length++] = ';';
+    return Length;
+}  // encodeGridConnectFrame
+// ------------------------------------------------------------
+
+//! Record a socket error. Errors meaning that the connection is lost are reported as ENETDOWN
+static void setGridConnectError (int Error)
+{
+    if ((Error == EPIPE) || (Error == ECONNRESET) || (Error == ENOTCONN) || (Error == ETIMEDOUT) || (Error == 0))
+        Error = ENETDOWN;
+    __atomic_store_n (&SocketError, Error, __ATOMIC_RELAXED);
+}  // setGridConnectError
+// ------------------------------------------------------------
+
+static void closeGridConnect (void)
+{
+    if (ServerSocket != -1)
+    {
+        close (ServerSocket);
+        ServerSocket = -1;
+    }
+    Parser.Length = 0;
+    RXFrameCount = 0;
+    RXFrameIndex = 0;
+    TXLength = 0;
+    TXFrameCount = 0;
+    memset (&EchoRing, 0, sizeof(EchoRing));
+}  // closeGridConnect
+// ------------------------------------------------------------
+
+//! Connect to "host" or "host:port"
+static int createGridConnect (char* Name)
+{
+    char Host[64];
+    char Port[8];
+    char* Colon;
+    struct addrinfo Hints;
+    struct addrinfo* Result;
+    struct addrinfo* Address;
+    struct pollfd PollFD;
+    int Error;
+    socklen_t ErrorLength;
+    int Flag;
+
+    closeGridConnect ();
+
+    strncpy (Host, Name, sizeof(Host)-1);
+    Host[sizeof(Host)-1] = 0;
+    snprintf (Port, sizeof(Port), "%d", GRIDCONNECT_DEFAULT_PORT);
+    Colon = strrchr (Host, ':');
+    if (Colon != 0)
+    {
+        *Colon = 0;
+        strncpy (Port, Colon+1, sizeof(Port)-1);
+        Port[sizeof(Port)-1] = 0;
+    }
+
+    memset (&Hints, 0, sizeof(Hints));
+    Hints.ai_family = AF_UNSPEC;
+    Hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo (Host, Port, &Hints, &Result) != 0) return CBUS_ERR_CONNECT_ERROR;
+
+    // Connection is not blocking, so the driver cycle is not stopped for long if the server does not answer
+    for (Address = Result; Address != 0; Address = Address->ai_next)
+    {
+        ServerSocket = socket (Address->ai_family, Address->ai_socktype, Address->ai_protocol);
+        if (ServerSocket == -1) continue;
+        fcntl (ServerSocket, F_SETFL, fcntl (ServerSocket, F_GETFL, 0) | O_NONBLOCK);
+
+        Error = 0;
+        if (connect (ServerSocket, Address->ai_addr, Address->ai_addrlen) != 0)
+        {
+            Error = errno;
+            if (Error == EINPROGRESS)
+            {
+                PollFD.fd = ServerSocket;
+                PollFD.events = POLLOUT;
+                PollFD.revents = 0;
+                if (poll (&PollFD, 1, GRIDCONNECT_CONNECT_TIMEOUT) == 1)
+                {
+                    ErrorLength = sizeof(Error);
+                    getsockopt (ServerSocket, SOL_SOCKET, SO_ERROR, &Error, &ErrorLength);
+                }
+                else
+                    Error = ETIMEDOUT;
+            }
+        }
+        if (Error == 0) break;
+
+        close (ServerSocket);
+        ServerSocket = -1;
+    }
+    freeaddrinfo (Result);
+    if (ServerSocket == -1) return CBUS_ERR_CONNECT_ERROR;
+
+    // Frames are already grouped by flush : send them without delay
+    Flag = 1;
+    setsockopt (ServerSocket, IPPROTO_TCP, TCP_NODELAY, &Flag, sizeof(Flag));
+    return 0;
+}  // createGridConnect
+// ------------------------------------------------------------
+
+static void flushGridConnect (void)
+{
+    int Sent;
+    int Offset;
+    int Index;
+    struct pollfd PollFD;
+
+    if ((ServerSocket == -1) || (TXLength == 0)) return;
+
+    Offset = 0;
+    while (Offset < TXLength)
+    {
+        Sent = send (ServerSocket, &TXText[Offset], TXLength-Offset, MSG_NOSIGNAL);
+        if (Sent > 0)
+        {
+            Offset += Sent;
+            continue;
+        }
+        if ((Sent < 0) && (errno == EINTR)) continue;
+        if ((Sent < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+        {   // Server is slow : wait a little, then keep the remaining text for next flush
+            PollFD.fd = ServerSocket;
+            PollFD.events = POLLOUT;
+            PollFD.revents = 0;
+            if (poll (&PollFD, 1, GRIDCONNECT_SEND_TIMEOUT) == 1) continue;
+            break;
+        }
+        setGridConnectError ((Sent < 0) ? errno : 0);
+        TXLength = 0;
+        TXFrameCount = 0;
+        return;
+    }
+
+    // Echo frames which have been completely written (echo is lost if the RX side does not read them)
+    for (Index=0; (Index < TXFrameCount) && (TXFrameEnd[Index] <= Offset); Index++)
+    {
+        if (!cbusRingPush (&EchoRing, TXFrames[Index].ID, TXFrames[Index].DLC, TXFrames[Index].Data))
+            __atomic_add_fetch (&DroppedFrames, 1, __ATOMIC_RELAXED);
+    }
+
+    memmove (TXText, &TXText[Offset], TXLength-Offset);
+    TXLength -= Offset;
+    memmove (TXFrames, &TXFrames[Index], (TXFrameCount-Index)*sizeof(TCBUSFrame));
+    memmove (TXFrameEnd, &TXFrameEnd[Index], (TXFrameCount-Index)*sizeof(int));
+    TXFrameCount -= Index;
+    for (Index=0; Index<TXFrameCount; Index++)
+        TXFrameEnd[Index] -= Offset;
+}  // flushGridConnect
+// ------------------------------------------------------------
+
+static int sendGridConnect (unsigned int ID, unsigned char DLC, unsigned char* Data)
+{
+    if (ServerSocket == -1)
+    {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    if ((TXLength+GRIDCONNECT_MAX_FRAME > GRIDCONNECT_TEXT_SIZE) || (TXFrameCount >= GRIDCONNECT_TX_FRAMES))
+    {
+        flushGridConnect ();
+        if ((TXLength+GRIDCONNECT_MAX_FRAME > GRIDCONNECT_TEXT_SIZE) || (TXFrameCount >= GRIDCONNECT_TX_FRAMES))
+        {
+            errno = ENOBUFS;
+            return -1;
+        }
+    }
+
+    TXLength += encodeGridConnectFrame (ID, DLC, Data, &TXText[TXLength]);
+    if (OwnFrames)
+    {
+        TXFrames[TXFrameCount].ID = ID;
+        TXFrames[TXFrameCount].DLC = DLC;
+        memcpy (TXFrames[TXFrameCount].Data, Data, ((DLC&0x0F) > 8) ? 8 : (DLC&0x0F));
+        TXFrameEnd[TXFrameCount] = TXLength;
+        TXFrameCount++;
+    }
+    return 0;
+}  // sendGridConnect
+// ------------------------------------------------------------
+
+//! Read and decode the text received from the server
+static void receiveGridConnect (void)
+{
+    int Received;
+
+    RXFrameIndex = 0;
+    RXFrameCount = decodeGridConnectFrames (&Parser, RXFrames, GRIDCONNECT_MAX_BATCH);
+    if (RXFrameCount == 0)
+    {
+        Received = recv (ServerSocket, &Parser.Text[Parser.Length], GRIDCONNECT_TEXT_SIZE-Parser.Length, 0);
+        if (Received <= 0)
+        {
+            if ((Received == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)))
+                setGridConnectError ((Received < 0) ? errno : 0);
+            return;
+        }
+        Parser.Length += Received;
+        RXFrameCount = decodeGridConnectFrames (&Parser, RXFrames, GRIDCONNECT_MAX_BATCH);
+    }
+
+    if (Parser.Errors != ParserErrors)
+    {
+        __atomic_add_fetch (&DroppedFrames, Parser.Errors-ParserErrors, __ATOMIC_RELAXED);
+        ParserErrors = Parser.Errors;
+    }
+}  // receiveGridConnect
+// ------------------------------------------------------------
+
+static unsigned int getNextGridConnectMessage (unsigned int* CANID, unsigned char* CANData)
+{
+    TCBUSFrame Frame;
+    TCBUSFrame* Next;
+
+    if (cbusRingPop (&EchoRing, &Frame))
+    {
+        *CANID = Frame.ID;
+        memcpy (CANData, Frame.Data, ((Frame.DLC&0x0F) > 8) ? 8 : (Frame.DLC&0x0F));
+        return Frame.DLC|CBUS_OWN_FRAME;
+    }
+
+    if (ServerSocket == -1) return 0xFFFFFFFF;
+    if (RXFrameIndex >= RXFrameCount)
+    {
+        receiveGridConnect ();
+        if (RXFrameCount == 0) return 0xFFFFFFFF;
+    }
+
+    Next = &RXFrames[RXFrameIndex++];
+    *CANID = Next->ID;
+    memcpy (CANData, Next->Data, Next->DLC);
+    return Next->DLC;
+}  // getNextGridConnectMessage
+// ------------------------------------------------------------
+
+static int waitGridConnectMessage (int TimeoutMs)
+{
+    struct pollfd PollFD;
+    int Result;
+
+    if ((RXFrameIndex < RXFrameCount) || (EchoRing.Head != EchoRing.Tail)) return 1;
+    if (ServerSocket == -1) return -1;
+
+    PollFD.fd = ServerSocket;
+    PollFD.events = POLLIN;
+    PollFD.revents = 0;
+    Result = poll (&PollFD, 1, TimeoutMs);
+    if (Result <= 0) return Result;
+    if (PollFD.revents & POLLIN) return 1;
+    return -1;
+}  // waitGridConnectMessage
+// ------------------------------------------------------------
+
+static int getGridConnectError (void)
+{
+    return __atomic_exchange_n (&SocketError, 0, __ATOMIC_RELAXED);
+}  // getGridConnectError
+// ------------------------------------------------------------
+
+static unsigned int getGridConnectDroppedFrames (void)
+{
+    return __atomic_exchange_n (&DroppedFrames, 0, __ATOMIC_RELAXED);
+}  // getGridConnectDroppedFrames
+// ------------------------------------------------------------
+
+static int getGridConnectHandle (void)
+{
+    return ServerSocket;
+}  // getGridConnectHandle
+// ------------------------------------------------------------
+
+static void setGridConnectOwnFrames (int Enable)
+{
+    OwnFrames = Enable;
+}  // setGridConnectOwnFrames
+// ------------------------------------------------------------
+
+const TCBUSTransport GridConnectTransport = {
+    createGridConnect,
+    closeGridConnect,
+    getNextGridConnectMessage,
+    waitGridConnectMessage,
+    sendGridConnect,
+    flushGridConnect,
+    getGridConnectError,
+    getGridConnectDroppedFrames,
+    getGridConnectHandle,
+    setGridConnectOwnFrames
+};
@@ -0,0 +1,55 @@
+/*
+cbus_gridconnect.h
+cbus2modbus
+CBUS over TCP using the GridConnect ASCII protocol (CANETHER, CBUS servers)
+Development : Benoit BOUCHEZ - M8718
+*/
+
+#ifndef __CBUS_GRIDCONNECT_H__
+#define __CBUS_GRIDCONNECT_H__
+
+#include <stdint.h>
+#include "cbus_transport.h"
+#include "cbus_pipeline.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define GRIDCONNECT_DEFAULT_PORT    5550        // Port used by CBUS servers when none is given
+#define GRIDCONNECT_MAX_FRAME       28          // ":X" + 8 header digits + 'N' + 16 data digits + ';'
+#define GRIDCONNECT_TEXT_SIZE       4096
+#define GRIDCONNECT_MAX_BATCH       512         // Shortest frame (":S0000N;") is 8 characters
+
+//! Text received from a GridConnect stream, not yet decoded
+typedef struct {
+    char Text[GRIDCONNECT_TEXT_SIZE];
+    int Length;
+    uint32_t Errors;                    // Frames which could not be decoded
+} TGridConnectParser;
+
+//! Transport given to setCBUSTransport. Name given to createCBUSSocket is "host" or "host:port"
+extern const TCBUSTransport GridConnectTransport;
+
+//! Decode the complete frames waiting in Parser->Text (received text is appended by the caller)
+// The text of incomplete frames, or frames not decoded because MaxFrames is reached, is kept for next call
+// \return number of frames written in Frames (ID has the same flags as getNextCBUSMessage)
+int decodeGridConnectFrames (TGridConnectParser* Parser, TCBUSFrame* Frames, int MaxFrames);
+
+//! Encode a frame (ID can include CBUS_EFF_FLAG and CBUS_RTR_FLAG)
+// \return number of characters written in Text (GRIDCONNECT_MAX_FRAME maximum, not terminated by 0)
+int encodeGridConnectFrame (unsigned int ID, unsigned int DLC, const unsigned char* Data, char* Text);
+
+// Also used by the SLCAN transport (cbus_slcan.c)
+extern const uint8_t CBUSHexDigits[256];     // Value of each hex digit + 1 (0 = not a hex digit)
+extern const char CBUSHexChars[];           // Upper case hex digits
+
+//! Find the positions of Delimiter in Text, 16 characters at a time with SSE2 or NEON
+// \return number of positions written (MaxPositions maximum)
+int findCBUSTextDelimiters (const char* Text, int Length, char Delimiter, uint16_t* Positions, int MaxPositions);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
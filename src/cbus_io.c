@@ -34,9 +34,27 @@ The CBUS driver thread sends the queued message each time its thread is reactiva
 #include <pthread.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <linux/can.h>
+#include <linux/can/error.h>
 #include "CBUS_OPC.h"
 #include "cbus_io.h"
 #include "SocketCBUS.h"
+#include "cbus_pipeline.h"
+#include "cbus_transport.h"
+#include "cbus_gridconnect.h"
+#include "cbus_slcan.h"
+#include "cbus_uring.h"
+#include "cbus_stream.h"
+#include "cbus_event_cache.h"
+#include "cbus_soe.h"
+#include "cbus_counters.h"
+#include "cbus_rules.h"
+#include "cbus_state.h"
+#include "cbus_txconfirm.h"
+#include "cbus_busload.h"
+#include "cbus_liveness.h"
 
 //! CBUS CAN message for the queue from PLC to driver
 typedef struct {
@@ -51,22 +69,60 @@ typedef struct {
 	uint32_t LastRefresh;
 	uint32_t CBUSDeviceNumber;		// 0 = entry not used
 	uint32_t CBUSEventNumber;
+	uint8_t TXClass;			// Priority class for output changes (refresh is always background)
+	uint16_t CANPriority;		// CBUS priority bits of the CAN ID (major/minor priority)
+	// Rate limiting policy (from cbus_outputs.dat, 0 = no limit)
+	uint32_t MinInterval;		// Minimum time between two events (ms)
+	uint32_t CoalesceWindow;	// Time to wait after a change before sending, only the final state is sent (ms)
+	uint32_t MaxFPS;			// Maximum number of events per second
+	// Rate limiting state
+	uint8_t ChangePending;		// State is different from LastOutput and has not been sent yet
+	uint8_t PendingOutput;		// State sampled during previous scan while change is pending
+	uint32_t ChangeTime;		// Time when pending change has been detected (ms)
+	uint32_t LastSendTime;
+	uint32_t FPSWindowStart;
+	uint32_t FPSCount;			// Events sent since FPSWindowStart
+	uint32_t SnoopCredit;		// Refresh time saved by events seen on the bus (ms)
 } TCBUS_OUTPUT_CTRL;
 
 typedef struct {
 	uint8_t CurrentInput;
+	uint8_t Unconfirmed;		// 1 until an event has been received for the input (state may be restored from state file)
 	uint32_t LastRefresh;
 	uint32_t CBUSDeviceNumber;		// 0 = entry not used
 	uint32_t CBUSEventNumber;
+	uint8_t TXClass;			// Priority class for status requests
+	uint16_t CANPriority;		// CBUS priority bits of the CAN ID (major/minor priority)
+	uint8_t RefreshBackoff;		// Refresh period is multiplied by 2^RefreshBackoff while the producer is silent
 } TCBUS_INPUT_CTRL;
 
-#define REFRESH_OUTPUT_TIMEOUT	30000		// 30 seconds
+#define REFRESH_OUTPUT_TIMEOUT	300000		// 5 minutes (consumers can get the state at any time with AREQ)
 #define REFRESH_INPUT_TIMEOUT	30000		// 30 seconds
+#define STARTUP_AREQ_PERIOD		10			// 10 ms between each status request for unconfirmed inputs
+#define STATE_SAVE_PERIOD		100			// State file is written at most every 100 ms
+#define ENUM_RESPONSE_TIME		100			// Time given to other nodes to answer the enumeration request (ms)
+#define MIN_ENUM_CANID			1			// CAN IDs 100 to 127 are reserved for fixed devices (command stations, interfaces)
+#define MAX_ENUM_CANID			99
+#define SOCKET_RECOVERY_DELAY	1000		// Time before the CAN socket is created again after bus-off or interface failure (ms)
+#define TX_CONFIRM_RETRIES		3			// Maximum number of retransmissions of an output frame not confirmed in time
+#define THROTTLED_FRAME_PERIOD	100			// Time between refresh frames while the bus load is over the threshold (ms)
+#define NODE_TIMEOUT			75000		// A producer not heard for 75 s (2.5 input refresh periods) is considered dead
+#define MAX_REFRESH_BACKOFF		5			// Status requests to a dead node are sent every 16 minutes at most
+#define AREQ_PROXY_DELAY		20			// Time given to the producer to answer a status request before the proxy answers (ms)
+#define AREQ_PROXY_PENDING		16			// Status requests waiting for the answer of the producer
 
-//! Precomputed CBUS ID. Value is from 0 to 2047
-static unsigned int CBUS_ID = 0x2FF;
-static int CBUS_MAJOR_PRIORITY = 0;   // value is 0 (max) to 2 (3 is not allowed)
-static int CBUS_MINOR_PRIORITY = 0;   // value is 0 (max) to 3
+//! CAN ID of the gateway (7 bits). CBUS priority bits are added for each frame
+static unsigned int CBUS_CANID = 0x7F;
+
+//! CBUS priority bits : major priority in bits 9-10 (0 = max to 2, 3 is not allowed), minor priority in bits 7-8 (0 = max to 3)
+#define CBUS_PRIORITY(Major, Minor)     (((Major)<<9)|((Minor)<<7))
+//! Default priority bits for each TX class (normal is the priority always used by previous versions)
+static const uint16_t DefaultCANPriority[NUM_CBUS_TX_CLASSES] = {CBUS_PRIORITY(0, 0), CBUS_PRIORITY(1, 1), CBUS_PRIORITY(2, 3)};
+
+//! Frames waiting to be sent at the end of the cycle, for each class (direct socket and io_uring modes)
+#define TX_CLASS_QUEUE_SIZE     256
+static TCBUSMsg TXClassQueue[NUM_CBUS_TX_CLASSES][TX_CLASS_QUEUE_SIZE];
+static int TXClassCount[NUM_CBUS_TX_CLASSES];
 
 uint8_t CANSocketReady = 0;     // False until cansocket is opened successfully
 
@@ -85,18 +141,102 @@ uint8_t CBUS_PLC_BoolOutput[NUM_CBUS_BOOL_OUTPUTS];
 const char* TokenDelimiter = " ,\r\n";
 
 unsigned int VerbosityLevel = 0;
+TCBUSMetrics CBUSMetrics;
+unsigned int PipelineMode = 0;      // 1 = RX and TX are handled by dedicated threads (see cbus_pipeline.c)
+unsigned int OutputRefreshPeriod = REFRESH_OUTPUT_TIMEOUT;    // Period for re-sending produced events (ms). 0 = never
+unsigned int AREQProxyMaxAge = 0;  // AREQ are answered from event cache if event is younger than this (ms). 0 = disabled
+unsigned int UringMode = 0;         // 1 = CAN socket I/O is done through io_uring (see cbus_uring.c)
+unsigned int TXRateLimit = 0;       // Maximum frames per second for outputs and status requests. 0 = no limit
+unsigned int FixedCANID = 0;        // CAN ID given on command line. 0 = CAN ID is found by self-enumeration
+unsigned int CBUSNodeNumber = 0;    // Node number for OPC_ENUM and OPC_CANID commands. 0 = commands are ignored
+unsigned int SocketRXBuffer = 0;    // CAN socket receive buffer size (bytes). 0 = system default
+unsigned int TXConfirmTimeout = 0;  // Time for a sent frame to come back from the bus (ms). 0 = TX confirmation disabled
+unsigned int CANBitrate = CBUS_DEFAULT_BITRATE;     // Used for bus load computation
+unsigned int BusLoadThreshold = 0;  // Bus load (%) over which refresh traffic is reduced. 0 = never reduced
+unsigned int NodeTimeout = NODE_TIMEOUT;    // Time after which inputs of a silent producer are stale (ms). 0 = disabled
+unsigned int CBUSTransportType = CBUS_TRANSPORT_SOCKETCAN;  // Link to the CBUS (see cbus_transport.h)
+
+// Global TX token bucket. One frame costs 1000000 units, refilled by TXRateLimit units per microsecond
+#define TX_TOKEN_COST       1000000ULL
+static uint64_t TXTokens = 0;
+static uint64_t TXTokensTime = 0;
+
+static int StartupSweepIndex = NUM_CBUS_BOOL_INPUTS;    // Next input to check for startup status request
+static uint32_t StartupSweepTimer = 0;
+static uint8_t StateDirty = 0;          // I/O state has changed since state file was written
+static uint32_t StateSaveTimer = 0;
+static uint8_t RestoreNotifyPending = 0;
+
+// CAN ID self-enumeration
+static uint8_t EnumInProgress = 0;
+static uint8_t EnumAckPending = 0;      // OPC_NNACK must be sent when enumeration requested by OPC_ENUM is finished
+static uint32_t EnumTimer = 0;
+static uint8_t CANIDInUse[128];         // CAN IDs seen during enumeration
+
+// CAN socket recovery
+static char CBUSInterfaceName[64];
+static uint8_t RecoveryPending = 0;
+static uint32_t RecoveryTimer = 0;
+
+static uint8_t TXConfirmActive = 0;     // Sent frames are received back from the socket
+
+static uint8_t BusOverloaded = 0;       // Bus load is over BusLoadThreshold
+
+// AREQ proxy : status requests not answered yet by the producer
+typedef struct {
+    uint16_t NN;
+    uint16_t EN;
+    uint32_t Time;              // ms
+} TCBUSProxyRequest;
+static TCBUSProxyRequest ProxyRequests[AREQ_PROXY_PENDING];
+static int ProxyRequestCount = 0;
+static uint32_t LastThrottledFrame = 0;
+
+//! Parse TX priority options of a mapping line : class=urgent|normal|background, major=<0-2>, minor=<0-3>
+// \return 1 if Token is a priority option
+static int parseCBUSPriorityOption (const char* Token, uint8_t* Class, int* Major, int* Minor)
+{
+    if (strcmp (Token, "class=urgent") == 0)
+        *Class = CBUS_TX_URGENT;
+    else if (strcmp (Token, "class=normal") == 0)
+        *Class = CBUS_TX_NORMAL;
+    else if (strcmp (Token, "class=background") == 0)
+        *Class = CBUS_TX_BACKGROUND;
+    else if (strncmp (Token, "major=", 6) == 0)
+        *Major = atoi (&Token[6]);
+    else if (strncmp (Token, "minor=", 6) == 0)
+        *Minor = atoi (&Token[6]);
+    else
+        return 0;
+    return 1;
+}  // parseCBUSPriorityOption
+// ------------------------------------------------------------
+
+//! Build CBUS priority bits from options. Priority not given in the line is the default priority of the class
+static uint16_t getCBUSPriorityBits (uint8_t Class, int Major, int Minor)
+{
+    if ((Major < 0) || (Major > 2)) Major = (DefaultCANPriority[Class]>>9)&0x03;
+    if ((Minor < 0) || (Minor > 3)) Minor = (DefaultCANPriority[Class]>>7)&0x03;
+    return CBUS_PRIORITY(Major, Minor);
+}  // getCBUSPriorityBits
+// ------------------------------------------------------------
 
 //! Read I/O configuration file to associate PLC I/Os to CBUS events
-// Each line in the file corresponds to a PLC boolean input. The two values are
+// Each line in the file corresponds to a PLC boolean input. The values are
 // - input number
 // - node number
 // - event number
+// - optional latch mode : "latch" (latch bits cleared on read) or "latch-coil" (cleared by coil)
+// - optional priority of status requests : class=..., major=..., minor=... (default is background class)
 int ReadCBUSInputsConfig (void)
 {
     FILE* ConfigFile;
     char Buffer [256];
     char* Token;
     int InputNumber, NN, EN;  // Node Number, Event Number
+    int Latch;
+    uint8_t Class;
+    int Major, Minor;
 
     if (VerbosityLevel > 0)
         fprintf (stdout, "Reading CBUS input configuration file...\n");
@@ -131,15 +271,33 @@ int ReadCBUSInputsConfig (void)
                 if (Token)
                     EN = atoi (Token);
 
+                // Optional parameters
+                Latch = CBUS_LATCH_NONE;
+                Class = CBUS_TX_BACKGROUND;
+                Major = -1;
+                Minor = -1;
+                while ((Token = strtok (NULL, TokenDelimiter)) != 0)
+                {
+                    if (strcmp (Token, "latch") == 0)
+                        Latch = CBUS_LATCH_CLEAR_ON_READ;
+                    else if (strcmp (Token, "latch-coil") == 0)
+                        Latch = CBUS_LATCH_CLEAR_BY_COIL;
+                    else
+                        parseCBUSPriorityOption (Token, &Class, &Major, &Minor);
+                }
+
                 if ((InputNumber<NUM_CBUS_BOOL_INPUTS)&&(InputNumber>=0))
                 {
                     if ((NN>0)&&(NN<65535)&&(EN>=0)&&(EN<65535))
                     {
                         if (VerbosityLevel > 0)
-                            fprintf (stdout, "Input:%d NN:%d EN:%d\n", InputNumber, NN, EN);
+                            fprintf (stdout, "Input:%d NN:%d EN:%d%s\n", InputNumber, NN, EN, Latch!=CBUS_LATCH_NONE ? " (latched)" : "");
 
                         CBUS_InCtrl[InputNumber].CBUSDeviceNumber = NN;
                         CBUS_InCtrl[InputNumber].CBUSEventNumber = EN;
+                        CBUS_InCtrl[InputNumber].TXClass = Class;
+                        CBUS_InCtrl[InputNumber].CANPriority = getCBUSPriorityBits (Class, Major, Minor);
+                        setCBUSLatchMode (InputNumber, Latch);
                     }
                 }
             }
@@ -157,6 +315,9 @@ int ReadCBUSOutputsConfig (void)
     char Buffer [256];
     char* Token;
     int OutputNumber, NN, EN;  // Node Number, Event Number
+    int MinInterval, CoalesceWindow, MaxFPS;
+    uint8_t Class;
+    int Major, Minor;
 
     ConfigFile = fopen ("cbus_outputs.dat", "rt");
     if (ConfigFile!=0)
@@ -189,6 +350,29 @@ int ReadCBUSOutputsConfig (void)
                 if (Token)
                     EN = atoi (Token);
 
+                // Optional rate limiting policy : min=<ms> coalesce=<ms> fps=<events per second>
+                // Optional priority : class=urgent|normal|background major=<0-2> minor=<0-3>
+                MinInterval = 0;
+                CoalesceWindow = 0;
+                MaxFPS = 0;
+                Class = CBUS_TX_NORMAL;
+                Major = -1;
+                Minor = -1;
+                while ((Token = strtok (NULL, TokenDelimiter)) != 0)
+                {
+                    if (strncmp (Token, "min=", 4) == 0)
+                        MinInterval = atoi (&Token[4]);
+                    else if (strncmp (Token, "coalesce=", 9) == 0)
+                        CoalesceWindow = atoi (&Token[9]);
+                    else if (strncmp (Token, "fps=", 4) == 0)
+                        MaxFPS = atoi (&Token[4]);
+                    else
+                        parseCBUSPriorityOption (Token, &Class, &Major, &Minor);
+                }
+                if (MinInterval < 0) MinInterval = 0;
+                if (CoalesceWindow < 0) CoalesceWindow = 0;
+                if (MaxFPS < 0) MaxFPS = 0;
+
                 //printf ("%d %d %d\n", OutputNumber, NN, EN);
 
                 if ((OutputNumber<NUM_CBUS_BOOL_INPUTS)&&(OutputNumber>=0))
@@ -196,10 +380,15 @@ int ReadCBUSOutputsConfig (void)
                     if ((NN>0)&&(NN<65535)&&(EN>=0)&&(EN<65535))
                     {
                         if (VerbosityLevel > 0)
-                            fprintf (stdout, "Output:%d NN:%d EN:%d\n", OutputNumber, NN, EN);
+                            fprintf (stdout, "Output:%d NN:%d EN:%d min:%d coalesce:%d fps:%d\n", OutputNumber, NN, EN, MinInterval, CoalesceWindow, MaxFPS);
 
                         CBUS_OutCtrl[OutputNumber].CBUSDeviceNumber = NN;
                         CBUS_OutCtrl[OutputNumber].CBUSEventNumber = EN;
+                        CBUS_OutCtrl[OutputNumber].MinInterval = MinInterval;
+                        CBUS_OutCtrl[OutputNumber].CoalesceWindow = CoalesceWindow;
+                        CBUS_OutCtrl[OutputNumber].MaxFPS = MaxFPS;
+                        CBUS_OutCtrl[OutputNumber].TXClass = Class;
+                        CBUS_OutCtrl[OutputNumber].CANPriority = getCBUSPriorityBits (Class, Major, Minor);
                     }
                 }
             }
@@ -211,29 +400,907 @@ int ReadCBUSOutputsConfig (void)
 }  // ReadCBUSOutputsConfig
 // ------------------------------------------------------------
 
+uint64_t getCBUSTimestamp (void)
+{
+    struct timespec Now;
+
+    clock_gettime (CLOCK_MONOTONIC, &Now);
+    return ((uint64_t)Now.tv_sec*1000000)+(Now.tv_nsec/1000);
+}  // getCBUSTimestamp
+// ------------------------------------------------------------
+
 void setCBUS_ID (unsigned int id)
 {
-    CBUS_ID=id+(CBUS_MAJOR_PRIORITY<<9)+(CBUS_MINOR_PRIORITY<<7);
+    CBUS_CANID=id&0x7F;
+    CBUSMetrics.CANID = CBUS_CANID;
 }  // setCBUS_ID
 // ------------------------------------------------------------
 
-//! Called by CBUS driver thread to process incoming CBUS messages and generate CBUS message from PLC outputs
-void ProcessCBUS_IO (void)
+//! Get next received CAN message, either directly from the socket or from the RX stage
+static unsigned int receiveCBUSFrame (unsigned int* CANID, unsigned char* CANData)
+{
+    if (PipelineMode)
+        return getPipelineCBUSMessage (CANID, CANData);
+    if (UringMode)
+        return getUringCBUSMessage (CANID, CANData);
+    return getNextCBUSMessage (CANID, CANData);
+}  // receiveCBUSFrame
+// ------------------------------------------------------------
+
+//! Write a CAN message to the socket (directly or through io_uring)
+static void writeCBUSFrame (unsigned int ID, unsigned char DLC, unsigned char* Data)
+{
+    if (UringMode)
+        sendUringCBUSRaw (ID, DLC, Data);
+    else
+        sendCBUSRaw (ID, DLC, Data);
+}  // writeCBUSFrame
+// ------------------------------------------------------------
+
+//! Write frames waiting in class queues, from the highest priority class
+static void drainCBUSTXQueues (void)
+{
+    int Class;
+    int FrameCounter;
+    TCBUSMsg* Msg;
+
+    for (Class=0; Class<NUM_CBUS_TX_CLASSES; Class++)
+    {
+        for (FrameCounter=0; FrameCounter<TXClassCount[Class]; FrameCounter++)
+        {
+            Msg = &TXClassQueue[Class][FrameCounter];
+            writeCBUSFrame (Msg->ID, Msg->DLC, &Msg->Data[0]);
+        }
+        TXClassCount[Class] = 0;
+    }
+}  // drainCBUSTXQueues
+// ------------------------------------------------------------
+
+//! Send a CAN message, either directly to the socket or through the TX stage
+// Priority bits must already be set in ID. Urgent frames are written immediately, normal and background frames
+// generated during the cycle are written by flushCBUSFrames, normal frames first
+// With TX confirmation, the frame is kept until it is received back. Output is the PLC output driven by the frame (-1 if none)
+// \return 0 if the frame has been dropped because the TX stage is stalled (pipeline mode only)
+static int transmitTrackedCBUSFrame (int Output, uint8_t Retries, int Class, unsigned int ID, unsigned char DLC, unsigned char* Data)
+{
+    TCBUSMsg* Msg;
+    TCBUSTXFrame Frame;
+
+    // The logic stage never waits for the TX thread : a frame which does not fit in the TX ring is not sent
+    if ((PipelineMode) && (sendPipelineCBUSRaw (Class, ID, DLC, Data) == 0))
+    {
+        CBUSMetrics.TXDroppedFrames++;
+        return 0;
+    }
+
+    CBUSMetrics.FramesSent++;
+    addCBUSBusFrame (ID, DLC, getCBUSTimestamp());
+    if (TXConfirmActive)
+    {
+        Frame.ID = ID;
+        Frame.DLC = DLC;
+        memcpy (&Frame.Data[0], Data, (DLC > 8) ? 8 : DLC);
+        Frame.Class = Class;
+        Frame.Output = Output;
+        Frame.Retries = Retries;
+        Frame.SendTime = getCBUSTimestamp();
+        trackCBUSTXFrame (&Frame);
+    }
+
+    if (PipelineMode) return 1;
+
+    if ((Class <= CBUS_TX_URGENT) || (Class >= NUM_CBUS_TX_CLASSES))
+    {
+        writeCBUSFrame (ID, DLC, Data);
+        return 1;
+    }
+
+    if (TXClassCount[Class] >= TX_CLASS_QUEUE_SIZE)
+        drainCBUSTXQueues ();
+
+    Msg = &TXClassQueue[Class][TXClassCount[Class]];
+    Msg->ID = ID;
+    Msg->DLC = DLC;
+    if (DLC > 8) DLC = 8;
+    memcpy (&Msg->Data[0], Data, DLC);
+    TXClassCount[Class]++;
+    return 1;
+}  // transmitTrackedCBUSFrame
+// ------------------------------------------------------------
+
+//! Send a CAN message not related to a PLC output (see transmitTrackedCBUSFrame)
+static void transmitCBUSFrame (int Class, unsigned int ID, unsigned char DLC, unsigned char* Data)
+{
+    transmitTrackedCBUSFrame (-1, 0, Class, ID, DLC, Data);
+}  // transmitCBUSFrame
+// ------------------------------------------------------------
+
+//! Push frames queued by transmitCBUSFrame to the kernel
+static void flushCBUSFrames (void)
+{
+    drainCBUSTXQueues ();
+    if (UringMode)
+        flushCBUSUring ();
+    else if (PipelineMode == 0)
+        flushCBUSSocket ();
+}  // flushCBUSFrames
+// ------------------------------------------------------------
+
+//! Set input state from a received event and report the change
+static void updateCBUSInput (int InputCounter, uint8_t State)
+{
+    uint64_t Timestamp;
+    uint8_t Unconfirmed;
+
+    CBUS_InCtrl[InputCounter].LastRefresh = 0;	// Reset timeout
+    Unconfirmed = CBUS_InCtrl[InputCounter].Unconfirmed;
+    CBUS_InCtrl[InputCounter].Unconfirmed = 0;
+    if (CBUS_InCtrl[InputCounter].CurrentInput == State) return;
+
+    CBUS_InCtrl[InputCounter].CurrentInput = State;
+    StateDirty = 1;
+    Timestamp = getCBUSTimestamp ();
+    recordCBUSInputChange (InputCounter, State, Timestamp);
+    // First state received after startup or recovery is not an edge seen on the bus
+    if (Unconfirmed)
+        setCBUSCounterState (InputCounter, State, Timestamp);
+    else
+        updateCBUSCounters (InputCounter, State, Timestamp);
+    setCBUSRuleInput (InputCounter, State, Timestamp);
+    notifyCBUSStream (CBUS_STREAM_INPUT, InputCounter, State);
+}  // updateCBUSInput
+// ------------------------------------------------------------
+
+//! A frame seen on the bus has the same effect as a refresh sent by the gateway : restart the refresh timer
+// The time the refresh is postponed is accumulated, each full period counts as one frame saved
+static void snoopCBUSRefresh (uint32_t* LastRefresh, uint32_t* SnoopCredit, uint32_t Period)
+{
+    if (Period == 0)
+    {  // No periodic refresh : nothing is saved
+        *LastRefresh = 0;
+        return;
+    }
+
+    *SnoopCredit += *LastRefresh;
+    *LastRefresh = 0;
+    while (*SnoopCredit >= Period)
+    {
+        *SnoopCredit -= Period;
+        CBUSMetrics.SnoopedRefreshes++;
+    }
+}  // snoopCBUSRefresh
+// ------------------------------------------------------------
+
+//! Answer status request (AREQ) for an event produced by the gateway
+// Only long events are produced, so short event requests (ASRQ) are never answered
+// \return 1 if the event is produced by the gateway
+static int answerCBUSOutputRequest (uint16_t NN, uint16_t EN)
+{
+    int OutputCounter;
+    int Found = 0;
+    uint8_t SendCANMsg[8];
+
+    for (OutputCounter=0; OutputCounter<NUM_CBUS_BOOL_OUTPUTS; OutputCounter++)
+    {
+        if (CBUS_OutCtrl[OutputCounter].CBUSDeviceNumber==0) continue;
+        if ((CBUS_OutCtrl[OutputCounter].CBUSDeviceNumber!=NN) || (CBUS_OutCtrl[OutputCounter].CBUSEventNumber!=EN)) continue;
+
+        if (VerbosityLevel > 1)
+            fprintf (stdout, "Answering status request for output %d\n", OutputCounter);
+
+        // Answer with the state known by consumers (last state sent)
+        SendCANMsg[0] = CBUS_OutCtrl[OutputCounter].LastOutput ? OPC_ARON : OPC_AROF;
+        SendCANMsg[1] = CBUS_OutCtrl[OutputCounter].CBUSDeviceNumber>>8;
+        SendCANMsg[2] = CBUS_OutCtrl[OutputCounter].CBUSDeviceNumber&0xFF;
+        SendCANMsg[3] = EN>>8;
+        SendCANMsg[4] = EN&0xFF;
+        transmitCBUSFrame (CBUS_OutCtrl[OutputCounter].TXClass, CBUS_CANID|CBUS_OutCtrl[OutputCounter].CANPriority, 5, &SendCANMsg[0]);
+
+        // The response has the same effect as a periodic refresh
+        snoopCBUSRefresh (&CBUS_OutCtrl[OutputCounter].LastRefresh, &CBUS_OutCtrl[OutputCounter].SnoopCredit, OutputRefreshPeriod);
+        Found = 1;
+    }
+    return Found;
+}  // answerCBUSOutputRequest
+// ------------------------------------------------------------
+
+//! Answer AREQ on behalf of the producer if its last event is recent enough
+// AnyAge : producer is known to be silent, its last known state is given whatever its age
+static void answerCBUSStatusRequest (uint16_t NN, uint16_t EN, int AnyAge)
+{
+    uint8_t State;
+    uint64_t Timestamp;
+    uint8_t SendCANMsg[8];
+
+    if (lookupCBUSEventCache (NN, EN, &State, &Timestamp) == 0) return;
+    if ((AnyAge == 0) && (getCBUSTimestamp() - Timestamp > (uint64_t)AREQProxyMaxAge*1000)) return;
+
+    if (VerbosityLevel > 1)
+        fprintf (stdout, "Answering AREQ from cache NN:%d - EN:%d\n", NN, EN);
+
+    SendCANMsg[0] = State ? OPC_ARON : OPC_AROF;
+    SendCANMsg[1] = NN>>8;
+    SendCANMsg[2] = NN&0xFF;
+    SendCANMsg[3] = EN>>8;
+    SendCANMsg[4] = EN&0xFF;
+    transmitCBUSFrame (CBUS_TX_NORMAL, CBUS_CANID|DefaultCANPriority[CBUS_TX_NORMAL], 5, &SendCANMsg[0]);
+    CBUSEventCacheStats.ProxyResponses++;
+}  // answerCBUSStatusRequest
+// ------------------------------------------------------------
+
+//! Give the producer AREQ_PROXY_DELAY to answer the status request before answering from the cache
+static void queueCBUSProxyRequest (uint16_t NN, uint16_t EN, uint32_t NowMs)
+{
+    int Counter;
+
+    for (Counter=0; Counter<ProxyRequestCount; Counter++)
+    {
+        if ((ProxyRequests[Counter].NN == NN) && (ProxyRequests[Counter].EN == EN)) return;
+    }
+    if (ProxyRequestCount >= AREQ_PROXY_PENDING) return;    // Request is left to the producer
+
+    ProxyRequests[ProxyRequestCount].NN = NN;
+    ProxyRequests[ProxyRequestCount].EN = EN;
+    ProxyRequests[ProxyRequestCount].Time = NowMs;
+    ProxyRequestCount++;
+}  // queueCBUSProxyRequest
+// ------------------------------------------------------------
+
+//! Event received for a pending status request : the producer (or another node) has answered
+static void cancelCBUSProxyRequest (uint16_t NN, uint16_t EN)
+{
+    int Counter;
+
+    for (Counter=0; Counter<ProxyRequestCount; Counter++)
+    {
+        if ((ProxyRequests[Counter].NN == NN) && (ProxyRequests[Counter].EN == EN))
+        {
+            ProxyRequests[Counter] = ProxyRequests[--ProxyRequestCount];
+            return;
+        }
+    }
+}  // cancelCBUSProxyRequest
+// ------------------------------------------------------------
+
+//! Answer from the cache the status requests the producer did not answer in time
+static void processCBUSProxyRequests (uint32_t NowMs)
+{
+    int Counter = 0;
+
+    while (Counter < ProxyRequestCount)
+    {
+        if (NowMs - ProxyRequests[Counter].Time >= AREQ_PROXY_DELAY)
+        {
+            answerCBUSStatusRequest (ProxyRequests[Counter].NN, ProxyRequests[Counter].EN, 0);
+            ProxyRequests[Counter] = ProxyRequests[--ProxyRequestCount];
+        }
+        else
+            Counter++;
+    }
+}  // processCBUSProxyRequests
+// ------------------------------------------------------------
+
+//! Event of a PLC output sent by another node (proxy answer, other producer) with the state already sent by the gateway
+static void snoopCBUSOutputEvent (uint16_t NN, uint16_t EN, uint8_t State)
+{
+    int OutputCounter;
+
+    for (OutputCounter=0; OutputCounter<NUM_CBUS_BOOL_OUTPUTS; OutputCounter++)
+    {
+        if ((CBUS_OutCtrl[OutputCounter].CBUSDeviceNumber != NN) || (CBUS_OutCtrl[OutputCounter].CBUSEventNumber != EN)) continue;
+        if ((CBUS_OutCtrl[OutputCounter].LastOutput != State) || (CBUS_OutCtrl[OutputCounter].ChangePending)) continue;
+
+        snoopCBUSRefresh (&CBUS_OutCtrl[OutputCounter].LastRefresh, &CBUS_OutCtrl[OutputCounter].SnoopCredit, OutputRefreshPeriod);
+    }
+}  // snoopCBUSOutputEvent
+// ------------------------------------------------------------
+
+//! Accessory ON event (long) : normal event or response to a status request
+static void handleAccessoryOn (uint8_t* CANMsg)
 {
     uint16_t NN;  // CBUS node number
     uint16_t EN;  // CBUS event number
-    uint8_t ReceivedCANMsg[8];
+    int InputCounter;
+
+    NN=(CANMsg[1]<<8)+CANMsg[2];
+    EN=(CANMsg[3]<<8)+CANMsg[4];
+    updateCBUSEventCache (NN, EN, 1, getCBUSTimestamp());
+    if (ProxyRequestCount != 0) cancelCBUSProxyRequest (NN, EN);
+    if (VerbosityLevel > 1)
+        fprintf (stdout, "Received ACON / ARON NN:%d - EN:%d\n", NN, EN);
+    snoopCBUSOutputEvent (NN, EN, 1);
+
+    // Search in the input table if this event is associated with a PLC input
+    // If event is found, set the PLC input
+    for (InputCounter=0; InputCounter<NUM_CBUS_BOOL_INPUTS; InputCounter++)
+    {
+        if (CBUS_InCtrl[InputCounter].CBUSDeviceNumber!=0)  // Input is defined
+        {
+            if ((CBUS_InCtrl[InputCounter].CBUSDeviceNumber==NN)&&(CBUS_InCtrl[InputCounter].CBUSEventNumber==EN))
+            {
+                updateCBUSInput (InputCounter, 1);
+            }
+        }
+    }
+}  // handleAccessoryOn
+// ------------------------------------------------------------
+
+//! Accessory OFF event (long) : normal event or response to a status request
+static void handleAccessoryOff (uint8_t* CANMsg)
+{
+    uint16_t NN;
+    uint16_t EN;
+    int InputCounter;
+
+    NN=(CANMsg[1]<<8)+CANMsg[2];
+    EN=(CANMsg[3]<<8)+CANMsg[4];
+    updateCBUSEventCache (NN, EN, 0, getCBUSTimestamp());
+    if (ProxyRequestCount != 0) cancelCBUSProxyRequest (NN, EN);
+    if (VerbosityLevel > 1)
+        fprintf (stdout, "Received ACOF / AROF NN:%d - EN:%d\n", NN, EN);
+    snoopCBUSOutputEvent (NN, EN, 0);
+
+    // Search in the input table if this event is associated with a PLC input
+    // If event is found, clear the PLC input
+    for (InputCounter=0; InputCounter<NUM_CBUS_BOOL_INPUTS; InputCounter++)
+    {
+        if (CBUS_InCtrl[InputCounter].CBUSDeviceNumber!=0)  // Input is defined
+        {
+            if ((CBUS_InCtrl[InputCounter].CBUSDeviceNumber==NN)&&(CBUS_InCtrl[InputCounter].CBUSEventNumber==EN))
+            {
+                updateCBUSInput (InputCounter, 0);
+            }
+        }
+    }
+}  // handleAccessoryOff
+// ------------------------------------------------------------
+
+//! Status request for a long event
+static void handleAccessoryRequest (uint8_t* CANMsg)
+{
+    uint16_t NN;
+    uint16_t EN;
+
+    NN=(CANMsg[1]<<8)+CANMsg[2];
+    EN=(CANMsg[3]<<8)+CANMsg[4];
+    if (answerCBUSOutputRequest (NN, EN)) return;		// We are the producer of this event
+    if (AREQProxyMaxAge == 0) return;
+
+    // A producer known to be silent can not answer : the cache answers at once with the last known state.
+    // It is older than NodeTimeout, so the age limit of the proxy is not used
+    if (isCBUSNodeStale (NN, getCBUSTimestamp()/1000, NodeTimeout))
+        answerCBUSStatusRequest (NN, EN, 1);
+    else
+        queueCBUSProxyRequest (NN, EN, getCBUSTimestamp()/1000);
+}  // handleAccessoryRequest
+// ------------------------------------------------------------
+
+//! Start CAN ID self-enumeration : all other nodes answer the remote frame with an empty frame carrying their CAN ID
+static void startCBUSEnumeration (void)
+{
+    uint8_t Empty[8];
+
+    if (EnumInProgress) return;
+
+    memset (CANIDInUse, 0, sizeof(CANIDInUse));
+    EnumInProgress = 1;
+    EnumTimer = 0;
+    transmitCBUSFrame (CBUS_TX_URGENT, CBUS_RTR_FLAG|CBUS_CANID|DefaultCANPriority[CBUS_TX_URGENT], 0, &Empty[0]);
+}  // startCBUSEnumeration
+// ------------------------------------------------------------
+
+//! End of self-enumeration : keep the current CAN ID if nobody else uses it, otherwise take the lowest free one
+static void finishCBUSEnumeration (void)
+{
+    unsigned int ID;
+    unsigned int NewID = 0;
     uint8_t SendCANMsg[8];
+
+    EnumInProgress = 0;
+
+    if ((CBUS_CANID >= MIN_ENUM_CANID) && (CBUS_CANID <= MAX_ENUM_CANID) && (CANIDInUse[CBUS_CANID] == 0))
+        NewID = CBUS_CANID;
+    for (ID=MIN_ENUM_CANID; (NewID == 0) && (ID <= MAX_ENUM_CANID); ID++)
+    {
+        if (CANIDInUse[ID] == 0) NewID = ID;
+    }
+
+    if (NewID == 0)
+    {
+        if (VerbosityLevel > 0)
+            fprintf (stdout, "CAN ID enumeration : no free CAN ID, keeping %d\n", CBUS_CANID);
+    }
+    else
+    {
+        if ((VerbosityLevel > 0) && (NewID != CBUS_CANID))
+            fprintf (stdout, "CAN ID enumeration : using CAN ID %d\n", NewID);
+        setCBUS_ID (NewID);
+        CBUSMetrics.Enumerations++;
+    }
+
+    if (EnumAckPending)
+    {
+        EnumAckPending = 0;
+        SendCANMsg[0] = OPC_NNACK;
+        SendCANMsg[1] = CBUSNodeNumber>>8;
+        SendCANMsg[2] = CBUSNodeNumber&0xFF;
+        transmitCBUSFrame (CBUS_TX_NORMAL, CBUS_CANID|DefaultCANPriority[CBUS_TX_NORMAL], 3, &SendCANMsg[0]);
+    }
+}  // finishCBUSEnumeration
+// ------------------------------------------------------------
+
+//! Check the CAN ID of a received frame : answer enumeration requests, collect used CAN IDs and detect collisions
+static void checkCBUSCANID (unsigned int CANID)
+{
+    unsigned int SenderID;
+    uint8_t Empty[8];
+
+    if (CANID & CBUS_EFF_FLAG) return;      // Extended frames are only used by bootloaders
+
+    SenderID = CANID&0x7F;
+    if (EnumInProgress)
+        CANIDInUse[SenderID] = 1;
+
+    if (CANID & CBUS_RTR_FLAG)
+    {  // Another node is enumerating
+        transmitCBUSFrame (CBUS_TX_URGENT, CBUS_CANID|DefaultCANPriority[CBUS_TX_URGENT], 0, &Empty[0]);
+        return;
+    }
+
+    if ((SenderID == CBUS_CANID) && (EnumInProgress == 0))
+    {  // Both nodes may transmit at the same time with the same identifier : arbitration can not separate them
+        CBUSMetrics.CANIDCollisions++;
+        if (VerbosityLevel > 0)
+            fprintf (stdout, "CAN ID %d is also used by another node\n", CBUS_CANID);
+        if (FixedCANID == 0)
+        {
+            startCBUSEnumeration ();
+            CANIDInUse[SenderID] = 1;
+        }
+    }
+}  // checkCBUSCANID
+// ------------------------------------------------------------
+
+//! Force self-enumeration (OPC_ENUM) when addressed to the gateway node number
+static void handleForceEnumeration (uint8_t* CANMsg)
+{
+    if ((CBUSNodeNumber == 0) || (((CANMsg[1]<<8)|CANMsg[2]) != CBUSNodeNumber)) return;
+
+    EnumAckPending = 1;
+    startCBUSEnumeration ();
+}  // handleForceEnumeration
+// ------------------------------------------------------------
+
+//! Set CAN ID (OPC_CANID) when addressed to the gateway node number
+static void handleSetCANID (uint8_t* CANMsg)
+{
+    if ((CBUSNodeNumber == 0) || (((CANMsg[1]<<8)|CANMsg[2]) != CBUSNodeNumber)) return;
+    if ((CANMsg[3] == 0) || (CANMsg[3] > 0x7F)) return;
+
+    EnumInProgress = 0;     // The configuration tool has the last word
+    EnumAckPending = 0;
+    setCBUS_ID (CANMsg[3]);
+    if (VerbosityLevel > 0)
+        fprintf (stdout, "CAN ID set to %d by OPC_CANID\n", CBUS_CANID);
+}  // handleSetCANID
+// ------------------------------------------------------------
+
+typedef void (*TCBUSOpcodeHandler) (uint8_t* CANMsg);
+
+//! Dispatch table indexed by opcode. Opcodes without handler are ignored
+// Frame length is checked before calling the handler, so handlers can read all data bytes of their opcode
+static const TCBUSOpcodeHandler CBUSOpcodeHandlers[256] = {
+    [OPC_ACON] = handleAccessoryOn,
+    [OPC_ARON] = handleAccessoryOn,
+    [OPC_ACOF] = handleAccessoryOff,
+    [OPC_AROF] = handleAccessoryOff,
+    [OPC_AREQ] = handleAccessoryRequest,
+    [OPC_ENUM] = handleForceEnumeration,
+    [OPC_CANID] = handleSetCANID,
+};
+
+//! Check frame length and call the handler associated with the opcode
+static void dispatchCBUSFrame (uint8_t* CANMsg, unsigned int DLC)
+{
+    uint8_t Opcode;
+
+    DLC &= 0x0F;
+    if (DLC == 0) return;       // No opcode (CAN_ID enumeration frames)
+
+    Opcode = CANMsg[0];
+    if (DLC < CBUS_OPC_LENGTH(Opcode))
+    {   // Frame is too short for its opcode : do not use bytes left from the previous frame
+        CBUSMetrics.MalformedFrames++;
+        if (VerbosityLevel > 1)
+            fprintf (stdout, "Malformed frame : opcode %02X with DLC %d\n", Opcode, DLC);
+        return;
+    }
+
+    if (CBUSOpcodeHandlers[Opcode] == 0)
+    {
+        CBUSMetrics.UnhandledFrames++;
+        return;
+    }
+
+    CBUSOpcodeHandlers[Opcode] (CANMsg);
+}  // dispatchCBUSFrame
+// ------------------------------------------------------------
+
+//! Send ACON/ACOF for an output and reset its refresh timer
+// Periodic refresh is sent as background traffic, changes with the priority of the output
+static void produceCBUSOutput (int OutputCounter, uint8_t State, int Refresh)
+{
+    uint8_t SendCANMsg[8];
+    uint64_t Now;
+    int Queued;
+
+    if (VerbosityLevel > 1)
+        fprintf (stdout, "Updating output %d\n", OutputCounter);
+
+    if (State == 0)
+    {
+        SendCANMsg[0]=OPC_ACOF;
+    }
+    else
+    {
+        SendCANMsg[0]=OPC_ACON;
+    }
+    SendCANMsg[1] = CBUS_OutCtrl[OutputCounter].CBUSDeviceNumber>>8;
+    SendCANMsg[2] = CBUS_OutCtrl[OutputCounter].CBUSDeviceNumber&0xFF;
+    SendCANMsg[3] = CBUS_OutCtrl[OutputCounter].CBUSEventNumber>>8;
+    SendCANMsg[4] = CBUS_OutCtrl[OutputCounter].CBUSEventNumber&0xFF;
+    if (Refresh)
+        Queued = transmitTrackedCBUSFrame (OutputCounter, 0, CBUS_TX_BACKGROUND, CBUS_CANID|DefaultCANPriority[CBUS_TX_BACKGROUND], 5, &SendCANMsg[0]);
+    else
+        Queued = transmitTrackedCBUSFrame (OutputCounter, 0, CBUS_OutCtrl[OutputCounter].TXClass, CBUS_CANID|CBUS_OutCtrl[OutputCounter].CANPriority, 5, &SendCANMsg[0]);
+    // Output state on the bus is unchanged : the output scan sends its latest state again at next cycle
+    if (Queued == 0) return;
+    Now = getCBUSTimestamp();
+    updateCBUSEventCache (CBUS_OutCtrl[OutputCounter].CBUSDeviceNumber, CBUS_OutCtrl[OutputCounter].CBUSEventNumber, State, Now);
+
+    CBUS_OutCtrl[OutputCounter].ChangePending = 0;
+    CBUS_OutCtrl[OutputCounter].LastSendTime = Now/1000;
+    if (CBUS_OutCtrl[OutputCounter].LastSendTime - CBUS_OutCtrl[OutputCounter].FPSWindowStart >= 1000)
+    {
+        CBUS_OutCtrl[OutputCounter].FPSWindowStart = CBUS_OutCtrl[OutputCounter].LastSendTime;
+        CBUS_OutCtrl[OutputCounter].FPSCount = 0;
+    }
+    CBUS_OutCtrl[OutputCounter].FPSCount++;
+
+    if (CBUS_OutCtrl[OutputCounter].LastOutput != State)
+    {
+        CBUS_OutCtrl[OutputCounter].LastOutput = State;
+        StateDirty = 1;
+        notifyCBUSStream (CBUS_STREAM_OUTPUT, OutputCounter, State);
+        setCBUSRuleOutput (OutputCounter, State, Now);
+    }
+    CBUS_OutCtrl[OutputCounter].LastRefresh = 0;
+}  // produceCBUSOutput
+// ------------------------------------------------------------
+
+//! Check the rate limiting policy of an output before sending a change
+// \return 1 if output event can be sent now
+static int isCBUSOutputAllowed (int OutputCounter, uint32_t NowMs)
+{
+    TCBUS_OUTPUT_CTRL* Ctrl = &CBUS_OutCtrl[OutputCounter];
+
+    if (NowMs - Ctrl->ChangeTime < Ctrl->CoalesceWindow) return 0;
+    if ((Ctrl->MinInterval != 0) && (NowMs - Ctrl->LastSendTime < Ctrl->MinInterval)) return 0;
+    if ((Ctrl->MaxFPS != 0) && (NowMs - Ctrl->FPSWindowStart < 1000) && (Ctrl->FPSCount >= Ctrl->MaxFPS)) return 0;
+    return 1;
+}  // isCBUSOutputAllowed
+// ------------------------------------------------------------
+
+//! Take a frame from the global TX token bucket (outputs and status requests only, answers are never delayed)
+// \return 1 if frame can be sent now
+static int takeCBUSTXToken (void)
+{
+    uint64_t Now;
+    uint64_t Burst;
+
+    if (TXRateLimit == 0) return 1;
+
+    // Up to 100 ms of traffic can be sent in a burst
+    Burst = TXRateLimit/10;
+    if (Burst == 0) Burst = 1;
+    Burst *= TX_TOKEN_COST;
+
+    Now = getCBUSTimestamp ();
+    TXTokens += (Now - TXTokensTime) * TXRateLimit;
+    TXTokensTime = Now;
+    if (TXTokens > Burst) TXTokens = Burst;
+
+    if (TXTokens < TX_TOKEN_COST) return 0;
+    TXTokens -= TX_TOKEN_COST;
+    return 1;
+}  // takeCBUSTXToken
+// ------------------------------------------------------------
+
+//! Apply outputs changed by the rule engine immediately, without waiting for the PLC
+static void applyCBUSRuleOutputs (void)
+{
+    int OutputCounter;
+    uint8_t State;
+    int Count = 0;
+
+    // Rules which never settle (Q1 = NOT Q1) are rejected by loadCBUSRules : count limit is only a safety
+    while ((Count < NUM_CBUS_BOOL_OUTPUTS) && (getCBUSRuleOutputChange (&OutputCounter, &State)))
+    {
+        Count++;
+        CBUS_OutCtrl[OutputCounter].CurrentOutput = State;
+        if ((CBUS_OutCtrl[OutputCounter].CBUSDeviceNumber != 0) && (CBUS_OutCtrl[OutputCounter].LastOutput != State))
+            produceCBUSOutput (OutputCounter, State, 0);
+    }
+}  // applyCBUSRuleOutputs
+// ------------------------------------------------------------
+
+//! Send status request for an input
+static void requestCBUSInput (int InputCounter)
+{
+    uint8_t SendCANMsg[8];
+
+    SendCANMsg[0]=OPC_AREQ;
+    SendCANMsg[1] = CBUS_InCtrl[InputCounter].CBUSDeviceNumber>>8;
+    SendCANMsg[2] = CBUS_InCtrl[InputCounter].CBUSDeviceNumber&0xFF;
+    SendCANMsg[3] = CBUS_InCtrl[InputCounter].CBUSEventNumber>>8;
+    SendCANMsg[4] = CBUS_InCtrl[InputCounter].CBUSEventNumber&0xFF;
+    transmitCBUSFrame (CBUS_InCtrl[InputCounter].TXClass, CBUS_CANID|CBUS_InCtrl[InputCounter].CANPriority, 5, &SendCANMsg[0]);
+}  // requestCBUSInput
+// ------------------------------------------------------------
+
+//! Write current I/O state in the state file
+static void saveCBUSIOState (void)
+{
+    TCBUSStateImage Image;
+    int Counter;
+
+    memset (&Image, 0, sizeof(Image));
+    for (Counter=0; Counter<NUM_CBUS_BOOL_INPUTS; Counter++)
+    {
+        // An input restored from file and not confirmed yet is saved again with its restored state
+        Image.Inputs[Counter].NN = CBUS_InCtrl[Counter].CBUSDeviceNumber;
+        Image.Inputs[Counter].EN = CBUS_InCtrl[Counter].CBUSEventNumber;
+        Image.Inputs[Counter].State = CBUS_InCtrl[Counter].CurrentInput;
+        Image.Inputs[Counter].Valid = (CBUS_InCtrl[Counter].CBUSDeviceNumber != 0);
+    }
+    for (Counter=0; Counter<NUM_CBUS_BOOL_OUTPUTS; Counter++)
+    {
+        Image.Outputs[Counter].NN = CBUS_OutCtrl[Counter].CBUSDeviceNumber;
+        Image.Outputs[Counter].EN = CBUS_OutCtrl[Counter].CBUSEventNumber;
+        Image.Outputs[Counter].State = CBUS_OutCtrl[Counter].LastOutput;
+        Image.Outputs[Counter].Valid = (CBUS_OutCtrl[Counter].CBUSDeviceNumber != 0);
+    }
+    saveCBUSState (&Image);
+}  // saveCBUSIOState
+// ------------------------------------------------------------
+
+//! Restore I/O state from state file. Restored inputs stay unconfirmed until their event is received
+static void restoreCBUSIOState (void)
+{
+    TCBUSStateImage Image;
+    int Counter;
+    int Restored = 0;
+
+    if (openCBUSStateFile () != 0)
+    {
+        if (VerbosityLevel > 0)
+            fprintf (stdout, "Can not open state file %s\n", CBUSStateFile);
+        return;
+    }
+    if (loadCBUSState (&Image) == 0) return;
+
+    for (Counter=0; Counter<NUM_CBUS_BOOL_INPUTS; Counter++)
+    {
+        if ((CBUS_InCtrl[Counter].CBUSDeviceNumber != 0) && (Image.Inputs[Counter].Valid) &&
+            (Image.Inputs[Counter].NN == CBUS_InCtrl[Counter].CBUSDeviceNumber) && (Image.Inputs[Counter].EN == CBUS_InCtrl[Counter].CBUSEventNumber))
+        {
+            CBUS_InCtrl[Counter].CurrentInput = Image.Inputs[Counter].State;
+            setCBUSCounterState (Counter, Image.Inputs[Counter].State, getCBUSTimestamp());
+            setCBUSRuleInput (Counter, Image.Inputs[Counter].State, getCBUSTimestamp());
+            Restored++;
+        }
+    }
+
+    // PLC coils are initialized with the restored outputs, so no event is sent at startup
+    for (Counter=0; Counter<NUM_CBUS_BOOL_OUTPUTS; Counter++)
+    {
+        if ((CBUS_OutCtrl[Counter].CBUSDeviceNumber != 0) && (Image.Outputs[Counter].Valid) &&
+            (Image.Outputs[Counter].NN == CBUS_OutCtrl[Counter].CBUSDeviceNumber) && (Image.Outputs[Counter].EN == CBUS_OutCtrl[Counter].CBUSEventNumber))
+        {
+            CBUS_OutCtrl[Counter].LastOutput = Image.Outputs[Counter].State;
+            CBUS_OutCtrl[Counter].CurrentOutput = Image.Outputs[Counter].State;
+            CBUS_PLC_BoolOutput[Counter] = Image.Outputs[Counter].State;
+            updateCBUSEventCache (CBUS_OutCtrl[Counter].CBUSDeviceNumber, CBUS_OutCtrl[Counter].CBUSEventNumber, Image.Outputs[Counter].State, getCBUSTimestamp());
+            setCBUSRuleOutput (Counter, Image.Outputs[Counter].State, getCBUSTimestamp());
+            Restored++;
+        }
+    }
+
+    RestoreNotifyPending = 1;
+    if (VerbosityLevel > 0)
+        fprintf (stdout, "%d I/O states restored from %s\n", Restored, CBUSStateFile);
+}  // restoreCBUSIOState
+// ------------------------------------------------------------
+
+//! Stop CBUS processing until the CAN socket is created again
+// Output changes are kept pending (they are sent after recovery) instead of being lost while the controller is bus-off
+static void startCBUSRecovery (void)
+{
+    CANSocketReady = 0;
+    if (RecoveryPending) return;
+
+    RecoveryPending = 1;
+    RecoveryTimer = 0;
+}  // startCBUSRecovery
+// ------------------------------------------------------------
+
+//! Create CAN socket again, then request the state of all inputs as events may have been missed
+static void recoverCBUSSocket (void)
+{
+    int InputCounter;
+
+    stopCBUSPipeline ();
+    if (UringMode)
+        stopCBUSUring ();
+    closeCBUSSocket ();
+
+    setCBUSSocketRXBuffer (SocketRXBuffer);
+    if (createCBUSSocket (CBUSInterfaceName) != 0)
+    {  // Interface is still not available
+        RecoveryTimer = 0;
+        return;
+    }
+    getCBUSSocketError ();      // Error reported by the previous socket is not relevant any more
+
+    if ((PipelineMode) && (startCBUSPipeline() != 0))
+        PipelineMode = 0;
+    if ((UringMode) && (startCBUSUring() != 0))
+        UringMode = 0;
+
+    RecoveryPending = 0;
+    CANSocketReady = 1;
+    CBUSMetrics.SocketRecoveries++;
+    if (VerbosityLevel > 0)
+        fprintf (stdout, "CAN socket created again on %s\n", CBUSInterfaceName);
+
+    for (InputCounter=0; InputCounter<NUM_CBUS_BOOL_INPUTS; InputCounter++)
+    {
+        if (CBUS_InCtrl[InputCounter].CBUSDeviceNumber != 0)
+            CBUS_InCtrl[InputCounter].Unconfirmed = 1;
+    }
+    StartupSweepIndex = 0;
+    StartupSweepTimer = STARTUP_AREQ_PERIOD;
+
+    // Other nodes may have been enumerated while the gateway was off the bus
+    if (FixedCANID == 0)
+        startCBUSEnumeration ();
+}  // recoverCBUSSocket
+// ------------------------------------------------------------
+
+//! Decode an error frame generated by the CAN controller driver (see linux/can/error.h)
+static void handleCBUSErrorFrame (unsigned int CANID, uint8_t* Data)
+{
+    CBUSMetrics.ErrorFrames++;
+
+    if (CANID & CAN_ERR_CRTL)
+    {
+        if (Data[1] & (CAN_ERR_CRTL_RX_PASSIVE|CAN_ERR_CRTL_TX_PASSIVE))
+            CBUSMetrics.ErrorPassiveEvents++;
+        if (Data[1] & (CAN_ERR_CRTL_RX_OVERFLOW|CAN_ERR_CRTL_TX_OVERFLOW))
+            CBUSMetrics.DroppedFrames++;
+    }
+
+    if (CANID & CAN_ERR_ACK)
+        CBUSMetrics.AckErrors++;
+
+    if (CANID & CAN_ERR_BUSOFF)
+    {
+        CBUSMetrics.BusOffEvents++;
+        if (VerbosityLevel > 0)
+            fprintf (stdout, "CAN controller is bus-off\n");
+        startCBUSRecovery ();
+    }
+
+    if ((CANID & CAN_ERR_RESTARTED) && (RecoveryPending))
+    {  // Controller is back on the bus : no need to wait any longer
+        RecoveryTimer = SOCKET_RECOVERY_DELAY;
+    }
+}  // handleCBUSErrorFrame
+// ------------------------------------------------------------
+
+//! A frame has not been received back from the bus before the deadline
+// Output frames are sent again if they still carry the last output state, then the output is flagged
+static void handleUnconfirmedCBUSFrame (TCBUSTXFrame* Frame)
+{
+    uint8_t State;
+
+    if ((Frame->Output < 0) || (Frame->Output >= NUM_CBUS_BOOL_OUTPUTS))
+    {
+        CBUSMetrics.TXUnconfirmed++;
+        return;
+    }
+
+    State = (Frame->Data[0] == OPC_ACON) ? 1 : 0;
+    if (State != CBUS_OutCtrl[Frame->Output].LastOutput)
+    {  // Output has changed since : the new state has its own frame
+        CBUSMetrics.TXUnconfirmed++;
+        return;
+    }
+
+    if (Frame->Retries < TX_CONFIRM_RETRIES)
+    {
+        CBUSMetrics.TXRetransmissions++;
+        // CAN ID may have changed since the first transmission
+        transmitTrackedCBUSFrame (Frame->Output, Frame->Retries+1, Frame->Class, (Frame->ID & ~0x7F)|CBUS_CANID, Frame->DLC, &Frame->Data[0]);
+        return;
+    }
+
+    CBUSMetrics.TXUnconfirmed++;
+    setCBUSTXFailed (Frame->Output);
+    if (VerbosityLevel > 0)
+        fprintf (stdout, "Event for output %d has not been sent on the bus\n", Frame->Output);
+}  // handleUnconfirmedCBUSFrame
+// ------------------------------------------------------------
+
+//! Refresh frames and status requests are limited to one every THROTTLED_FRAME_PERIOD while the bus is overloaded
+// \return 1 if a refresh frame can be sent now
+static int allowCBUSRefreshFrame (uint32_t NowMs)
+{
+    if (BusOverloaded == 0) return 1;
+    if (NowMs - LastThrottledFrame < THROTTLED_FRAME_PERIOD) return 0;
+
+    LastThrottledFrame = NowMs;
+    return 1;
+}  // allowCBUSRefreshFrame
+// ------------------------------------------------------------
+
+//! Called by CBUS driver thread to process incoming CBUS messages and generate CBUS message from PLC outputs
+void ProcessCBUS_IO (void)
+{
+    uint8_t ReceivedCANMsg[8];
     unsigned int ReceivedCANSize;
     unsigned int ReceivedCANID;
     int OutputCounter;
     int InputCounter;
     uint8_t OutSnapshot;
+    uint32_t NowMs;
+    int SocketError;
+    TCBUSTXFrame ExpiredFrame;
+    int Stale;
+
+	// Wait for the CAN interface to be available again after bus-off or socket failure
+	if (RecoveryPending)
+	{
+	    // Other frames are ignored, but error frames are read to see the controller restart (CAN_ERR_RESTARTED)
+	    if (getCBUSSocketHandle () != -1)
+	    {
+	        while ((ReceivedCANSize = receiveCBUSFrame (&ReceivedCANID, &ReceivedCANMsg[0])) != 0xFFFFFFFF)
+	        {
+	            if (((ReceivedCANSize & CBUS_OWN_FRAME) == 0) && (ReceivedCANID & CBUS_ERR_FLAG))
+	                handleCBUSErrorFrame (ReceivedCANID, &ReceivedCANMsg[0]);
+	        }
+	    }
+	    RecoveryTimer++;
+	    if (RecoveryTimer >= SOCKET_RECOVERY_DELAY)
+	        recoverCBUSSocket ();
+	}
 
 	if (CANSocketReady == 0) return;		// cansocket connection is not opened : nothing can be done
 
+	// Restored states are reported once the stream server is running
+	if (RestoreNotifyPending)
+	{
+	    RestoreNotifyPending = 0;
+	    for (InputCounter=0; InputCounter<NUM_CBUS_BOOL_INPUTS; InputCounter++)
+	        if (CBUS_InCtrl[InputCounter].CBUSDeviceNumber != 0)
+	            notifyCBUSStream (CBUS_STREAM_INPUT, InputCounter, CBUS_InCtrl[InputCounter].CurrentInput);
+	    for (OutputCounter=0; OutputCounter<NUM_CBUS_BOOL_OUTPUTS; OutputCounter++)
+	        if (CBUS_OutCtrl[OutputCounter].CBUSDeviceNumber != 0)
+	            notifyCBUSStream (CBUS_STREAM_OUTPUT, OutputCounter, CBUS_OutCtrl[OutputCounter].LastOutput);
+	}
+
 	// Check if we have received anything in socketcan
-	ReceivedCANSize = getNextCBUSMessage (&ReceivedCANID, &ReceivedCANMsg[0]);
+	ReceivedCANSize = receiveCBUSFrame (&ReceivedCANID, &ReceivedCANMsg[0]);
 	if (ReceivedCANSize != 0xFFFFFFFF)
 	{  // if we have received a first message, start looping until we have received all messages from the socket
 	    // Protect intermediate buffer in case PLC tries to update its inputs while we copy received CBUS events images
@@ -241,92 +1308,125 @@ void ProcessCBUS_IO (void)
 
 	    do
 	    {
-		switch (ReceivedCANMsg[0])
+		if (ReceivedCANSize & CBUS_OWN_FRAME)
+		{  // Frame sent by the gateway is now on the bus
+		    if (confirmCBUSTXFrame (ReceivedCANID, ReceivedCANSize, &ReceivedCANMsg[0], getCBUSTimestamp()))
+		        CBUSMetrics.TXConfirmed++;
+		}
+		else if (ReceivedCANID & CBUS_ERR_FLAG)
 		{
-			case OPC_ACON : case OPC_ARON :  // CBUS event accessory ON either from response after request or "normal" event
-				NN=(ReceivedCANMsg[1]<<8)+ReceivedCANMsg[2];
-				EN=(ReceivedCANMsg[3]<<8)+ReceivedCANMsg[4];
-				if (VerbosityLevel > 1)
-                    fprintf (stdout, "Received ACON / ARON NN:%d - EN:%d\n", NN, EN);
-
-				// Search in the input table if this event is associated with a PLC input
-				// If event is found, set the PLC input
-				for (InputCounter=0; InputCounter<NUM_CBUS_BOOL_INPUTS; InputCounter++)
-				{
-					if (CBUS_InCtrl[InputCounter].CBUSDeviceNumber!=0)  // Input is defined
-					{
-						if ((CBUS_InCtrl[InputCounter].CBUSDeviceNumber==NN)&&(CBUS_InCtrl[InputCounter].CBUSEventNumber==EN))
-						{
-							CBUS_InCtrl[InputCounter].CurrentInput = 1;
-							CBUS_InCtrl[InputCounter].LastRefresh = 0;	// Reset timeout
-						}
-					}
-				}
-				break;
-			case OPC_ACOF : case OPC_AROF :  // CBUS event accessory OFF either from response after request or "normal" event
-				NN=(ReceivedCANMsg[1]<<8)+ReceivedCANMsg[2];
-				EN=(ReceivedCANMsg[3]<<8)+ReceivedCANMsg[4];
-
-				if (VerbosityLevel > 1)
-                    fprintf (stdout, "Received ACOF / AROF NN:%d - EN:%d\n", NN, EN);
-
-				// Search in the input table if this event is associated with a PLC input
-				// If event is found, clear the PLC input
-				//printf ("ACOF NN: %d - EN: %d\n", NN, EN);
-				for (InputCounter=0; InputCounter<NUM_CBUS_BOOL_INPUTS; InputCounter++)
-				{
-					if (CBUS_InCtrl[InputCounter].CBUSDeviceNumber!=0)  // Input is defined
-					{
-						if ((CBUS_InCtrl[InputCounter].CBUSDeviceNumber==NN)&&(CBUS_InCtrl[InputCounter].CBUSEventNumber==EN))
-						{
-							CBUS_InCtrl[InputCounter].CurrentInput = 0;
-							CBUS_InCtrl[InputCounter].LastRefresh = 0;	// Reset timeout
-						}
-					}
-				}
-				break;
+		    handleCBUSErrorFrame (ReceivedCANID, &ReceivedCANMsg[0]);
 		}
+		else
+		{
+		    CBUSMetrics.FramesReceived++;
+		    addCBUSBusFrame (ReceivedCANID, ReceivedCANSize, getCBUSTimestamp());
+		    checkCBUSCANID (ReceivedCANID);
+		    if ((ReceivedCANID & CBUS_RTR_FLAG) == 0)
+		    {
+		        updateCBUSNodes (&ReceivedCANMsg[0], ReceivedCANSize, getCBUSTimestamp()/1000);
+		        dispatchCBUSFrame (&ReceivedCANMsg[0], ReceivedCANSize);
+		    }
+		}
+		if (getCBUSRuleCount() != 0)
+		    applyCBUSRuleOutputs ();     // React to the event before processing next frame
 
 		// Get next CAN message from socket
-		ReceivedCANSize = getNextCBUSMessage (&ReceivedCANID, &ReceivedCANMsg[0]);
+		ReceivedCANSize = receiveCBUSFrame (&ReceivedCANID, &ReceivedCANMsg[0]);
 	    } while (ReceivedCANSize != 0xFFFFFFFF);
 
 	    // Free access to intermediate buffer (PLC can now read updated inputs)
 	    //pthread_mutex_unlock (&IntermediateInputBufferLock);
 	}
 
+	CBUSMetrics.DroppedFrames += getCBUSDroppedFrames ();
+	if (PipelineMode)
+	    CBUSMetrics.TXDroppedFrames += getPipelineTXDroppedFrames ();
+	else if (UringMode)
+	    CBUSMetrics.TXDroppedFrames += getUringTXDroppedFrames ();
+	SocketError = getCBUSSocketError ();
+	if (SocketError != 0)
+	{
+	    CBUSMetrics.SocketErrors++;
+	    if (VerbosityLevel > 0)
+	        fprintf (stdout, "CAN socket error : %s\n", strerror (SocketError));
+	    if ((SocketError == ENETDOWN) || (SocketError == ENODEV) || (SocketError == EBADF) || (SocketError == ETIMEDOUT))
+	        startCBUSRecovery ();
+	}
+
+	// Bus-off detected : frames generated now would be lost
+	if (CANSocketReady == 0) return;
+
+	// Refresh traffic is reduced while the bus is busy
+	CBUSMetrics.BusLoad = getCBUSBusLoad (CANBitrate, getCBUSTimestamp());
+	if (CBUSMetrics.BusLoad > CBUSMetrics.BusLoadPeak)
+	    CBUSMetrics.BusLoadPeak = CBUSMetrics.BusLoad;
+	BusOverloaded = ((BusLoadThreshold != 0) && (CBUSMetrics.BusLoad > BusLoadThreshold*100));
+
+	if (TXConfirmActive)
+	{
+	    while (getExpiredCBUSTXFrame (getCBUSTimestamp(), (uint64_t)TXConfirmTimeout*1000, &ExpiredFrame))
+	        handleUnconfirmedCBUSFrame (&ExpiredFrame);
+	}
+
+	// Self-enumeration ends when other nodes had time to answer
+	if (EnumInProgress)
+	{
+	    EnumTimer++;
+	    if (EnumTimer >= ENUM_RESPONSE_TIME)
+	        finishCBUSEnumeration ();
+	}
+
+	// Outputs driven by local rules are sent before the outputs driven by the PLC
+	if (getCBUSRuleCount() != 0)
+	{
+	    processCBUSRuleTimers (getCBUSTimestamp());
+	    applyCBUSRuleOutputs ();
+	}
+
 	// Scan all PLC outputs
 	// if an output is associated with an event, check if output state has changed since last call to this function
 	// or if output has not been refreshed since maximum refresh time
 	// if output has changed or if timeout occurs, generate a OPC_ACOF or OPC_ACON depending on the output state
 	// and clear refresh timer
+	// A change is kept pending while the output rate limiting policy or the global TX rate forbid to send it.
+	// The output is sampled again at each scan, so the last state is always sent in the end
+	NowMs = getCBUSTimestamp()/1000;
+	if (ProxyRequestCount != 0)
+	    processCBUSProxyRequests (NowMs);
 	for (OutputCounter=0; OutputCounter<NUM_CBUS_BOOL_OUTPUTS; OutputCounter++)
 	{
 		if (CBUS_OutCtrl[OutputCounter].CBUSDeviceNumber!=0)  // PLC output is associated with an event
 		{
-			CBUS_OutCtrl[OutputCounter].LastRefresh++;
+			if (CBUS_OutCtrl[OutputCounter].LastRefresh < 0xFFFFFFFF)
+                CBUS_OutCtrl[OutputCounter].LastRefresh++;
 			OutSnapshot = CBUS_OutCtrl[OutputCounter].CurrentOutput;  // Make sure output will not be changed by PLC while we process it
-			if ((CBUS_OutCtrl[OutputCounter].LastRefresh >= REFRESH_OUTPUT_TIMEOUT)||(CBUS_OutCtrl[OutputCounter].LastOutput!=OutSnapshot))
-			{  // Output state has changed or timeout occured
-                if (VerbosityLevel > 1)
-                    fprintf (stdout, "Updating output %d\n", OutputCounter);
-
-				if (OutSnapshot == 0)
-				{
-					SendCANMsg[0]=OPC_ACOF;
-				}
-				else
-				{
-					SendCANMsg[0]=OPC_ACON;
-				}
-				SendCANMsg[1] = CBUS_OutCtrl[OutputCounter].CBUSDeviceNumber>>8;
-				SendCANMsg[2] = CBUS_OutCtrl[OutputCounter].CBUSDeviceNumber&0xFF;
-				SendCANMsg[3] = CBUS_OutCtrl[OutputCounter].CBUSEventNumber>>8;
-				SendCANMsg[4] = CBUS_OutCtrl[OutputCounter].CBUSEventNumber&0xFF;
-				sendCBUSRaw (CBUS_ID, 5, &SendCANMsg[0]);
-
-				CBUS_OutCtrl[OutputCounter].LastOutput = OutSnapshot;
-				CBUS_OutCtrl[OutputCounter].LastRefresh = 0;
+
+			if ((CBUS_OutCtrl[OutputCounter].ChangePending)&&(CBUS_OutCtrl[OutputCounter].PendingOutput != OutSnapshot))
+			{  // Intermediate state will never be sent
+			    CBUS_OutCtrl[OutputCounter].PendingOutput = OutSnapshot;
+			    CBUSMetrics.CoalescedOutputChanges++;
+			}
+
+			if (CBUS_OutCtrl[OutputCounter].LastOutput!=OutSnapshot)
+			{  // Output state has changed
+			    if (CBUS_OutCtrl[OutputCounter].ChangePending == 0)
+			    {
+			        CBUS_OutCtrl[OutputCounter].ChangePending = 1;
+			        CBUS_OutCtrl[OutputCounter].PendingOutput = OutSnapshot;
+			        CBUS_OutCtrl[OutputCounter].ChangeTime = NowMs;
+			    }
+			    if ((isCBUSOutputAllowed (OutputCounter, NowMs))&&(takeCBUSTXToken()))
+                    produceCBUSOutput (OutputCounter, OutSnapshot, 0);
+			}
+			else
+			{
+			    CBUS_OutCtrl[OutputCounter].ChangePending = 0;     // Output is back to the state on the bus
+			    if ((OutputRefreshPeriod != 0)&&(CBUS_OutCtrl[OutputCounter].LastRefresh >= OutputRefreshPeriod)&&
+                (allowCBUSRefreshFrame (NowMs))&&(takeCBUSTXToken()))
+			    {  // Timeout occured
+                    produceCBUSOutput (OutputCounter, OutSnapshot, 1);
+			    }
 			}
 		}
 	}
@@ -334,26 +1434,60 @@ void ProcessCBUS_IO (void)
 	// Check timeout on inputs. If we have not received an event for an input for a "long" timeout
 	// send a CBUS status request for the event. This allows the CBUS PLC to get a correct image of
 	// all inputs even if it connects to CBUS after events have been already exchanged
+	// Requests to a producer not heard for NodeTimeout are sent less and less often, until the producer is heard again
 	for (InputCounter=0; InputCounter<NUM_CBUS_BOOL_INPUTS; InputCounter++)
 	{
 		if (CBUS_InCtrl[InputCounter].CBUSDeviceNumber!=0)  // PLC input is associated with an event
 		{
 			CBUS_InCtrl[InputCounter].LastRefresh++;
-			if (CBUS_InCtrl[InputCounter].LastRefresh >= REFRESH_OUTPUT_TIMEOUT)
+			Stale = isCBUSInputStale (InputCounter, NowMs, NodeTimeout);
+			if (Stale == 0)
+			    CBUS_InCtrl[InputCounter].RefreshBackoff = 0;
+			if (CBUS_InCtrl[InputCounter].LastRefresh >= ((uint32_t)REFRESH_INPUT_TIMEOUT << CBUS_InCtrl[InputCounter].RefreshBackoff))
 			{
 				//printf ("Ask refresh of input %d\n", InputCounter);
-
-				SendCANMsg[0]=OPC_AREQ;
-				SendCANMsg[1] = CBUS_InCtrl[InputCounter].CBUSDeviceNumber>>8;
-				SendCANMsg[2] = CBUS_InCtrl[InputCounter].CBUSDeviceNumber&0xFF;
-				SendCANMsg[3] = CBUS_InCtrl[InputCounter].CBUSEventNumber>>8;
-				SendCANMsg[4] = CBUS_InCtrl[InputCounter].CBUSEventNumber&0xFF;
-				sendCBUSRaw (CBUS_ID, 5, &SendCANMsg[0]);
-
-				CBUS_InCtrl[InputCounter].LastRefresh = 0;
+				if ((allowCBUSRefreshFrame (NowMs))&&(takeCBUSTXToken()))
+				{  // Otherwise request is sent at next call
+				    requestCBUSInput (InputCounter);
+				    CBUS_InCtrl[InputCounter].LastRefresh = 0;
+				    if ((Stale) && (CBUS_InCtrl[InputCounter].RefreshBackoff < MAX_REFRESH_BACKOFF))
+				        CBUS_InCtrl[InputCounter].RefreshBackoff++;
+				}
 			}
 		}
 	}
+	CBUSMetrics.StaleNodes = getCBUSStaleNodeCount (NowMs, NodeTimeout);
+
+	// After startup, request state of inputs not confirmed yet (one request every STARTUP_AREQ_PERIOD)
+	// Inputs confirmed by an event received in the meantime are skipped. Sweep waits for the end of enumeration
+	if ((StartupSweepIndex < NUM_CBUS_BOOL_INPUTS) && (EnumInProgress == 0))
+	{
+	    StartupSweepTimer++;
+	    if (StartupSweepTimer >= STARTUP_AREQ_PERIOD)
+	    {
+	        StartupSweepTimer = 0;
+	        while ((StartupSweepIndex < NUM_CBUS_BOOL_INPUTS) &&
+                   ((CBUS_InCtrl[StartupSweepIndex].CBUSDeviceNumber == 0) || (CBUS_InCtrl[StartupSweepIndex].Unconfirmed == 0)))
+                StartupSweepIndex++;
+            if ((StartupSweepIndex < NUM_CBUS_BOOL_INPUTS) && (allowCBUSRefreshFrame (NowMs)) && (takeCBUSTXToken()))
+            {
+                requestCBUSInput (StartupSweepIndex);
+                StartupSweepIndex++;
+            }
+	    }
+	}
+
+	if (StateSaveTimer < STATE_SAVE_PERIOD)
+	    StateSaveTimer++;
+	if ((StateDirty) && (StateSaveTimer >= STATE_SAVE_PERIOD))
+	{
+	    saveCBUSIOState ();
+	    StateDirty = 0;
+	    StateSaveTimer = 0;
+	}
+
+	// Submit all frames generated during this cycle
+	flushCBUSFrames ();
 }  // ProcessCBUS_IO
 /* ------------------------------------------------- */
 
@@ -362,7 +1496,6 @@ int startCBUSDriver (char* InterfaceName)
     int SockErr;
     int InputCounter;
     int OutputCounter;
-    uint8_t SendCANMsg[8];
     int RetVal;
 
     // Read I/O configuration file to associate events with PLC I/Os
@@ -373,37 +1506,109 @@ int startCBUSDriver (char* InterfaceName)
 	if (RetVal != 0)
         return RetVal;       // No output configuration file or corrupted file
 
+	clearCBUSEventCache();
+	clearCBUSCounters();
+	clearCBUSTXConfirm();
+	clearCBUSBusLoad();
+	clearCBUSNodes (getCBUSTimestamp()/1000);
+	for (InputCounter=0; InputCounter<NUM_CBUS_BOOL_INPUTS; InputCounter++)
+	    setCBUSInputNode (InputCounter, CBUS_InCtrl[InputCounter].CBUSDeviceNumber);
+	loadCBUSRules();
+	if (CBUSStateFile[0] != 0)
+	    restoreCBUSIOState();
+
+	// Frames are exchanged with the CAN interface, with a CBUS server or with a serial CAN adapter
+	if (CBUSTransportType == CBUS_TRANSPORT_GRIDCONNECT)
+	    setCBUSTransport (&GridConnectTransport);
+	else if (CBUSTransportType == CBUS_TRANSPORT_SLCAN)
+	{
+	    if (setSLCANBitrate (CANBitrate) != 0)
+	        fprintf (stdout, "CAN bitrate %u not supported by SLCAN adapters, using 125000\n", CANBitrate);
+	    setCBUSTransport (&SLCANTransport);
+	}
+	else
+	    setCBUSTransport (0);
+
+	strncpy (CBUSInterfaceName, InterfaceName, sizeof(CBUSInterfaceName)-1);
+	setCBUSSocketRXBuffer (SocketRXBuffer);
 	SockErr=createCBUSSocket(InterfaceName);
 	if (SockErr!=0)
 	{
         return 0x10000000+SockErr;
 	}
 
+	if (PipelineMode)
+	{
+        if (startCBUSPipeline() != 0)
+        {
+            if (VerbosityLevel > 0)
+                fprintf (stdout, "Can not start CBUS pipeline threads, using single thread mode\n");
+            PipelineMode = 0;
+        }
+	}
+
+	if ((UringMode) && (CBUSTransportType != CBUS_TRANSPORT_SOCKETCAN))
+	{
+        if (VerbosityLevel > 0)
+            fprintf (stdout, "io_uring is only available with SocketCAN, using direct calls\n");
+        UringMode = 0;
+	}
+
+	if (UringMode)
+	{
+        if (PipelineMode)
+        {
+            // Pipeline threads already use blocking calls on the socket
+            UringMode = 0;
+        }
+        else if (startCBUSUring() != 0)
+        {
+            if (VerbosityLevel > 0)
+                fprintf (stdout, "io_uring is not supported by the kernel, using direct socket calls\n");
+            UringMode = 0;
+        }
+	}
+
+	// Echo of sent frames can not be recognized with io_uring reads
+	TXConfirmActive = 0;
+	if ((TXConfirmTimeout != 0) && (UringMode == 0))
+	{
+	    setCBUSSocketOwnFrames (1);
+	    TXConfirmActive = 1;
+	}
+	else if ((TXConfirmTimeout != 0) && (VerbosityLevel > 0))
+	    fprintf (stdout, "TX confirmation is not available with io_uring\n");
+
 	CANSocketReady=1;
 
+	// Get a CAN ID not used by other nodes
+	if (FixedCANID != 0)
+	    setCBUS_ID (FixedCANID);
+	else
+	{
+	    CBUSMetrics.CANID = CBUS_CANID;
+	    startCBUSEnumeration ();
+	}
+
 	// Preload refresh timer for all outputs
 	for (OutputCounter=0; OutputCounter<NUM_CBUS_BOOL_OUTPUTS; OutputCounter++)
 	{
 		CBUS_OutCtrl[OutputCounter].LastRefresh = OutputCounter*500;
 	}
 
-	// Send AREQ for all inputs to get the latest images
+	// Inputs get their state from AREQ sent in background by ProcessCBUS_IO, so the gateway can be used
+	// immediately (with states restored from state file if available)
 	// DO NOT SEND updates for outputs when PLC starts, as we want outputs to keep their state
 	for (InputCounter=0; InputCounter<NUM_CBUS_BOOL_INPUTS; InputCounter++)
 	{
 		if (CBUS_InCtrl[InputCounter].CBUSDeviceNumber!=0)
 		{
 			CBUS_InCtrl[InputCounter].LastRefresh = InputCounter*500;	// Preload the timer to spread inputs refresh requests
-
-			SendCANMsg[0]=OPC_AREQ;
-			SendCANMsg[1] = CBUS_InCtrl[InputCounter].CBUSDeviceNumber>>8;
-			SendCANMsg[2] = CBUS_InCtrl[InputCounter].CBUSDeviceNumber&0xFF;
-			SendCANMsg[3] = CBUS_InCtrl[InputCounter].CBUSEventNumber>>8;
-			SendCANMsg[4] = CBUS_InCtrl[InputCounter].CBUSEventNumber&0xFF;
-			sendCBUSRaw (CBUS_ID, 5, &SendCANMsg[0]);
+			CBUS_InCtrl[InputCounter].Unconfirmed = 1;
 		}
-		usleep (10000);   // 10 ms between each request
 	}
+	StartupSweepIndex = 0;
+	StartupSweepTimer = STARTUP_AREQ_PERIOD;      // First request is sent immediately
 
 	return 0;
 }  // startCBUSDriver
@@ -411,7 +1616,19 @@ int startCBUSDriver (char* InterfaceName)
 
 void closeCBUSDriver (void)
 {
+    if (StateDirty)
+        saveCBUSIOState();
+    closeCBUSStateFile();
     CANSocketReady=0;
+    RecoveryPending=0;
+    stopCBUSPipeline();
+    if (UringMode)
+    {
+        if (VerbosityLevel > 0)
+            fprintf (stdout, "io_uring : %u system calls for %u received and %u sent frames, %u errors\n",
+                     CBUSUringStats.EnterCalls, CBUSUringStats.FramesReceived, CBUSUringStats.FramesSent, CBUSUringStats.Errors);
+        stopCBUSUring();
+    }
     closeCBUSSocket();
 }  // closeCBUSDriver
 /* ------------------------------------------------- */
@@ -435,6 +1652,7 @@ void updateCBUSPLCOutputs (void)
   // Copy CBUS boolean data to PLC input
   for (OutputCounter=0; OutputCounter<NUM_CBUS_BOOL_OUTPUTS; OutputCounter++)
   {
+    if (isCBUSRuleOutput (OutputCounter)) continue;     // Output is driven by the rule engine
     CBUS_OutCtrl[OutputCounter].CurrentOutput = CBUS_PLC_BoolOutput[OutputCounter];
   }
 }  // updateCBUSPLCOutputs
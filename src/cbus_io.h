@@ -13,6 +13,42 @@ Development : Benoit BOUCHEZ - M8718
 #define NUM_CBUS_BOOL_INPUTS	128
 #define NUM_CBUS_BOOL_OUTPUTS	128
 
+// TX priority classes. Urgent frames are sent first, background frames when nothing else is waiting
+#define CBUS_TX_URGENT          0
+#define CBUS_TX_NORMAL          1
+#define CBUS_TX_BACKGROUND      2
+#define NUM_CBUS_TX_CLASSES     3
+
+//! Gateway metrics, exposed as Modbus input registers (see README)
+// New counters must be added at the end of the structure so register addresses do not change
+typedef struct {
+    uint32_t FramesReceived;
+    uint32_t FramesSent;
+    uint32_t MalformedFrames;       // Frames shorter than the length encoded in their opcode
+    uint32_t UnhandledFrames;       // Frames with an opcode not used by the gateway
+    uint32_t CoalescedOutputChanges;    // Output states replaced by a newer state before being sent (rate limiting)
+    uint32_t CANIDCollisions;       // Frames received from another node using the CAN ID of the gateway
+    uint32_t Enumerations;          // CAN ID self-enumerations completed
+    uint32_t CANID;                 // CAN ID currently used by the gateway
+    uint32_t ErrorFrames;           // Error frames reported by the CAN controller driver
+    uint32_t BusOffEvents;
+    uint32_t ErrorPassiveEvents;    // Controller entered error passive state (RX or TX)
+    uint32_t AckErrors;             // Frames sent without acknowledge (no other node on the bus)
+    uint32_t DroppedFrames;         // Frames lost in the kernel receive queue or in the controller
+    uint32_t SocketErrors;          // CAN socket read errors
+    uint32_t SocketRecoveries;      // CAN socket created again after bus-off or interface failure
+    uint32_t TXConfirmed;           // Sent frames received back from the bus (TX confirmation)
+    uint32_t TXRetransmissions;     // Output frames sent again because they were not confirmed in time
+    uint32_t TXUnconfirmed;         // Frames never confirmed (after all retransmissions for outputs)
+    uint32_t BusLoad;               // Bus load over the last second, in 1/100 %
+    uint32_t BusLoadPeak;           // Highest bus load since start, in 1/100 %
+    uint32_t StaleNodes;            // Producer nodes not heard for more than the node timeout
+    uint32_t SnoopedRefreshes;      // Refresh frames not sent because the same information has been seen on the bus
+    uint32_t TXDroppedFrames;       // Frames not sent because the bus does not take frames any more (pipeline and io_uring modes)
+} TCBUSMetrics;
+
+#define NUM_CBUS_METRICS    (sizeof(TCBUSMetrics)/sizeof(uint32_t))
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -21,6 +57,20 @@ extern uint8_t CBUS_PLC_BoolInput[NUM_CBUS_BOOL_INPUTS];
 extern uint8_t CBUS_PLC_BoolOutput[NUM_CBUS_BOOL_OUTPUTS];
 
 extern unsigned int VerbosityLevel;
+extern TCBUSMetrics CBUSMetrics;
+extern unsigned int PipelineMode;
+extern unsigned int UringMode;
+extern unsigned int AREQProxyMaxAge;
+extern unsigned int OutputRefreshPeriod;
+extern unsigned int TXRateLimit;
+extern unsigned int FixedCANID;
+extern unsigned int CBUSNodeNumber;
+extern unsigned int SocketRXBuffer;
+extern unsigned int TXConfirmTimeout;
+extern unsigned int CANBitrate;
+extern unsigned int BusLoadThreshold;
+extern unsigned int NodeTimeout;
+extern unsigned int CBUSTransportType;
 
 //! Starts CBUS communication driver
 int startCBUSDriver (char* InterfaceName);
@@ -35,6 +85,10 @@ void updateCBUSPLCOutputs (void);
 
 void ProcessCBUS_IO (void);
 
+//! Monotonic time base used for all gateway timestamps
+// \return time in microseconds
+uint64_t getCBUSTimestamp (void);
+
 #ifdef __cplusplus
 }
 #endif
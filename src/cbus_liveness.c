@@ -0,0 +1,146 @@
+/*
+cbus_liveness.c
+cbus2modbus
+Liveness of the nodes producing PLC inputs
+Development : Benoit BOUCHEZ - M8718
+
+When a producer is powered off, the PLC still sees the last state of its inputs. The gateway
+keeps the time each producer node has been heard for the last time, from any frame the node
+sends with its own node number (events, answers to status requests, configuration answers).
+Inputs produced by a node silent for too long are flagged as stale, and the periodic status
+requests sent to this node are slowed down by cbus_io.c until the node is heard again.
+Functions are called by the thread calling ProcessCBUS_IO and UpdateModbusData.
+*/
+
+#include <string.h>
+#include "cbus_liveness.h"
+#include "CBUS_OPC.h"
+
+typedef struct {
+    uint16_t NN;
+    uint32_t LastHeard;         // ms
+} TCBUSNode;
+
+static TCBUSNode Nodes[NUM_CBUS_BOOL_INPUTS];      // One node per input at most
+static int NodeCount = 0;
+static int InputNode[NUM_CBUS_BOOL_INPUTS];         // Index in Nodes, -1 if input is not used
+
+//! Opcodes sent by a node with its own node number in bytes 1 and 2
+static const uint8_t NodeOpcodes[256] = {
+    [OPC_RQNN] = 1, [OPC_NNREL] = 1, [OPC_NNACK] = 1, [OPC_WRACK] = 1, [OPC_CMDERR] = 1,
+    [OPC_EVNLF] = 1, [OPC_NUMEV] = 1, [OPC_NVANS] = 1, [OPC_PARAN] = 1, [OPC_NEVAL] = 1,
+    [OPC_PNN] = 1, [OPC_ENRSP] = 1, [OPC_ACDAT] = 1, [OPC_ARDAT] = 1,
+    [OPC_ACON] = 1, [OPC_ACOF] = 1, [OPC_ARON] = 1, [OPC_AROF] = 1,
+    [OPC_ASON] = 1, [OPC_ASOF] = 1, [OPC_ARSON] = 1, [OPC_ARSOF] = 1,
+    [OPC_ACON1] = 1, [OPC_ACOF1] = 1, [OPC_ARON1] = 1, [OPC_AROF1] = 1,
+    [OPC_ASON1] = 1, [OPC_ASOF1] = 1, [OPC_ARSON1] = 1, [OPC_ARSOF1] = 1,
+    [OPC_ACON2] = 1, [OPC_ACOF2] = 1, [OPC_ARON2] = 1, [OPC_AROF2] = 1,
+    [OPC_ASON2] = 1, [OPC_ASOF2] = 1, [OPC_ARSON2] = 1, [OPC_ARSOF2] = 1,
+    [OPC_ACON3] = 1, [OPC_ACOF3] = 1, [OPC_ARON3] = 1, [OPC_AROF3] = 1,
+    [OPC_ASON3] = 1, [OPC_ASOF3] = 1, [OPC_ARSON3] = 1, [OPC_ARSOF3] = 1,
+};
+
+void clearCBUSNodes (uint32_t NowMs)
+{
+    int InputCounter;
+
+    memset (Nodes, 0, sizeof(Nodes));
+    NodeCount = 0;
+    for (InputCounter=0; InputCounter<NUM_CBUS_BOOL_INPUTS; InputCounter++)
+    {
+        InputNode[InputCounter] = -1;
+        Nodes[InputCounter].LastHeard = NowMs;      // Nodes have the full timeout to be heard after startup
+    }
+}  // clearCBUSNodes
+// ------------------------------------------------------------
+
+//! \return index of the node in the table, -1 if node is unknown
+static int findCBUSNode (uint16_t NN)
+{
+    int NodeCounter;
+
+    for (NodeCounter=0; NodeCounter<NodeCount; NodeCounter++)
+    {
+        if (Nodes[NodeCounter].NN == NN) return NodeCounter;
+    }
+    return -1;
+}  // findCBUSNode
+// ------------------------------------------------------------
+
+void setCBUSInputNode (int Input, uint16_t NN)
+{
+    int Node;
+
+    if ((Input < 0) || (Input >= NUM_CBUS_BOOL_INPUTS)) return;
+    if (NN == 0)
+    {
+        InputNode[Input] = -1;
+        return;
+    }
+
+    Node = findCBUSNode (NN);
+    if ((Node == -1) && (NodeCount < NUM_CBUS_BOOL_INPUTS))
+    {
+        Node = NodeCount++;
+        Nodes[Node].NN = NN;
+    }
+    InputNode[Input] = Node;
+}  // setCBUSInputNode
+// ------------------------------------------------------------
+
+void updateCBUSNodes (const uint8_t* CANMsg, unsigned int DLC, uint32_t NowMs)
+{
+    int Node;
+
+    if (((DLC & 0x0F) < 3) || (NodeOpcodes[CANMsg[0]] == 0)) return;
+
+    Node = findCBUSNode ((CANMsg[1]<<8)|CANMsg[2]);
+    if (Node != -1)
+        Nodes[Node].LastHeard = NowMs;
+}  // updateCBUSNodes
+// ------------------------------------------------------------
+
+int isCBUSInputStale (int Input, uint32_t NowMs, uint32_t Timeout)
+{
+    int Node;
+
+    if ((Timeout == 0) || (Input < 0) || (Input >= NUM_CBUS_BOOL_INPUTS)) return 0;
+    Node = InputNode[Input];
+    if (Node == -1) return 0;
+    return (NowMs - Nodes[Node].LastHeard > Timeout);
+}  // isCBUSInputStale
+// ------------------------------------------------------------
+
+int isCBUSNodeStale (uint16_t NN, uint32_t NowMs, uint32_t Timeout)
+{
+    int Node;
+
+    if (Timeout == 0) return 0;
+    Node = findCBUSNode (NN);
+    if (Node == -1) return 0;
+    return (NowMs - Nodes[Node].LastHeard > Timeout);
+}  // isCBUSNodeStale
+// ------------------------------------------------------------
+
+int getCBUSStaleNodeCount (uint32_t NowMs, uint32_t Timeout)
+{
+    int NodeCounter;
+    int Count = 0;
+
+    if (Timeout == 0) return 0;
+    for (NodeCounter=0; NodeCounter<NodeCount; NodeCounter++)
+    {
+        if (NowMs - Nodes[NodeCounter].LastHeard > Timeout) Count++;
+    }
+    return Count;
+}  // getCBUSStaleNodeCount
+// ------------------------------------------------------------
+
+void exportCBUSStaleInputs (uint8_t* Bits, uint32_t NowMs, uint32_t Timeout)
+{
+    int InputCounter;
+
+    for (InputCounter=0; InputCounter<NUM_CBUS_BOOL_INPUTS; InputCounter++)
+        Bits[InputCounter] = isCBUSInputStale (InputCounter, NowMs, Timeout);
+}  // exportCBUSStaleInputs
+// ------------------------------------------------------------
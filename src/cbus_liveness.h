@@ -0,0 +1,48 @@
+/*
+cbus_liveness.h
+cbus2modbus
+Liveness of the nodes producing PLC inputs
+Development : Benoit BOUCHEZ - M8718
+*/
+
+#ifndef __CBUS_LIVENESS_H__
+#define __CBUS_LIVENESS_H__
+
+#include <stdint.h>
+#include "cbus_io.h"
+#include "cbus_txconfirm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Discrete inputs 640 to 767 are set when the node producing input 0 to 127 has not been heard for too long
+#define DI_STALE_BASE           DI_TXCONFIRM_END
+#define DI_LIVENESS_END         (DI_STALE_BASE+NUM_CBUS_BOOL_INPUTS)
+
+//! Remove all nodes. Nodes are considered alive at startup (NowMs)
+void clearCBUSNodes (uint32_t NowMs);
+
+//! Associate an input with the node number of its producer (0 = input not used)
+void setCBUSInputNode (int Input, uint16_t NN);
+
+//! Update the node table with a received frame (only opcodes sent by a node with its own node number are used)
+void updateCBUSNodes (const uint8_t* CANMsg, unsigned int DLC, uint32_t NowMs);
+
+//! \return 1 if the node producing the input has not been heard for more than Timeout ms (0 = never stale)
+int isCBUSInputStale (int Input, uint32_t NowMs, uint32_t Timeout);
+
+//! \return 1 if the node produces a PLC input and has not been heard for more than Timeout ms (0 = never stale)
+int isCBUSNodeStale (uint16_t NN, uint32_t NowMs, uint32_t Timeout);
+
+//! \return number of nodes not heard for more than Timeout ms
+int getCBUSStaleNodeCount (uint32_t NowMs, uint32_t Timeout);
+
+//! Copy stale flags of all inputs to discrete inputs (NUM_CBUS_BOOL_INPUTS values)
+void exportCBUSStaleInputs (uint8_t* Bits, uint32_t NowMs, uint32_t Timeout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
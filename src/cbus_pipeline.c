@@ -0,0 +1,248 @@
+/*
+cbus_pipeline.c
+cbus2modbus
+Optional RX -> logic -> TX pipeline between dedicated threads
+Development : Benoit BOUCHEZ - M8718
+
+In the default mode, the main loop thread reads the CAN socket, decodes the messages,
+scans the outputs and writes the CAN socket in sequence. A slow write() then delays
+decoding of the next incoming events.
+
+In pipelined mode, three stages are running in parallel :
+- RX thread : blocks on the CAN socket and pushes received frames in the RX ring
+- logic stage : the main loop (ProcessCBUS_IO) pops frames from the RX ring and pushes
+  frames to send in the TX ring. It never touches the socket
+- TX thread : sleeps on a semaphore and writes queued frames to the CAN socket. There is one
+  TX ring per priority class : urgent frames are always written before normal and background frames
+
+Rings are single producer / single consumer, so no lock is needed between stages
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <unistd.h>
+#include "cbus_pipeline.h"
+#include "SocketCBUS.h"
+#include "cbus_io.h"
+
+static TCBUSRing RXRing;
+static TCBUSRing TXRings[NUM_CBUS_TX_CLASSES];
+
+static pthread_t RXThread;
+static pthread_t TXThread;
+static sem_t TXSemaphore;
+static volatile int PipelineStopRequest = 0;
+static int PipelineRunning = 0;
+
+#define PIPELINE_TX_TIMEOUT     1000        // Time a frame waits for room in the socket TX queue before the bus is declared stalled (ms)
+static int TXStalled = 0;                   // TX thread only : frames are dropped until the pipeline is started again
+static uint32_t TXDroppedFrames = 0;        // Frames lost by the TX stage, not yet read by getPipelineTXDroppedFrames
+
+int cbusRingPush (TCBUSRing* Ring, unsigned int ID, unsigned int DLC, unsigned char* Data)
+{
+    uint32_t Head;
+    uint32_t Tail;
+    TCBUSFrame* Frame;
+
+    Head = Ring->Head;      // Only producer writes Head
+    Tail = __atomic_load_n (&Ring->Tail, __ATOMIC_ACQUIRE);
+    if ((Head - Tail) >= CBUS_RING_SIZE) return 0;     // Ring is full
+
+    Frame = &Ring->Frames[Head & (CBUS_RING_SIZE-1)];
+    Frame->ID = ID;
+    Frame->DLC = DLC;
+    if (DLC > 8) DLC = 8;
+    memcpy (&Frame->Data[0], Data, DLC);
+
+    // Release : frame content must be visible before the consumer sees the new head
+    __atomic_store_n (&Ring->Head, Head+1, __ATOMIC_RELEASE);
+    return 1;
+}  // cbusRingPush
+/* ------------------------------------------------- */
+
+int cbusRingPop (TCBUSRing* Ring, TCBUSFrame* Frame)
+{
+    uint32_t Head;
+    uint32_t Tail;
+
+    Tail = Ring->Tail;      // Only consumer writes Tail
+    Head = __atomic_load_n (&Ring->Head, __ATOMIC_ACQUIRE);
+    if (Head == Tail) return 0;     // Ring is empty
+
+    *Frame = Ring->Frames[Tail & (CBUS_RING_SIZE-1)];
+    __atomic_store_n (&Ring->Tail, Tail+1, __ATOMIC_RELEASE);
+    return 1;
+}  // cbusRingPop
+/* ------------------------------------------------- */
+
+//! RX stage : wait for CAN frames and move them to the RX ring
+static void* CBUSRXThreadFunc (void* Param)
+{
+    unsigned int ReceivedCANSize;
+    unsigned int ReceivedCANID;
+    unsigned char ReceivedCANMsg[8];
+    int WaitResult;
+
+    while (PipelineStopRequest == 0)
+    {
+        // Timeout is only used to check regularly if thread has to stop
+        WaitResult = waitCBUSMessage (100);
+        if (WaitResult < 0)
+        {   // Socket error is reported by getCBUSSocketError : logic stage stops the pipeline and creates the socket again
+            usleep (1000);
+            continue;
+        }
+        if (WaitResult == 0) continue;
+
+        ReceivedCANSize = getNextCBUSMessage (&ReceivedCANID, &ReceivedCANMsg[0]);
+        while (ReceivedCANSize != 0xFFFFFFFF)
+        {
+            // If logic stage is late, do not drop the frame : leave next frames in the kernel queue until there is room
+            while ((cbusRingPush (&RXRing, ReceivedCANID, ReceivedCANSize, &ReceivedCANMsg[0]) == 0) && (PipelineStopRequest == 0))
+            {
+                usleep (1000);
+            }
+            ReceivedCANSize = getNextCBUSMessage (&ReceivedCANID, &ReceivedCANMsg[0]);
+        }
+    }
+
+    return 0;
+}  // CBUSRXThreadFunc
+/* ------------------------------------------------- */
+
+//! Get next frame to send, from the highest priority class
+static int popTXFrame (TCBUSFrame* Frame)
+{
+    int Class;
+
+    for (Class=0; Class<NUM_CBUS_TX_CLASSES; Class++)
+    {
+        if (cbusRingPop (&TXRings[Class], Frame)) return 1;
+    }
+    return 0;
+}  // popTXFrame
+/* ------------------------------------------------- */
+
+//! Write a frame to the socket, waiting up to PIPELINE_TX_TIMEOUT for room in the socket TX queue
+// \return 0 if frame has been written
+static int writeTXFrame (TCBUSFrame* Frame)
+{
+    int WaitTime = 0;
+
+    while (sendCBUSRaw (Frame->ID, Frame->DLC, &Frame->Data[0]) != 0)
+    {
+        if ((errno != ENOBUFS) && (errno != EAGAIN)) return -1;     // Socket failure : socket is recovered by logic stage
+        if (PipelineStopRequest) return -1;
+        if (WaitTime >= PIPELINE_TX_TIMEOUT)
+        {   // Bus does not take frames any more without going bus-off (no acknowledge, cable pulled)
+            TXStalled = 1;
+            setCBUSSocketError (ETIMEDOUT);
+            return -1;
+        }
+        flushCBUSSocket ();
+        usleep (1000);
+        WaitTime++;
+    }
+    return 0;
+}  // writeTXFrame
+/* ------------------------------------------------- */
+
+//! TX stage : write frames from the TX rings to the CAN socket
+static void* CBUSTXThreadFunc (void* Param)
+{
+    TCBUSFrame Frame;
+
+    while (PipelineStopRequest == 0)
+    {
+        sem_wait (&TXSemaphore);
+
+        // Rings are checked again after each frame, so an urgent frame queued meanwhile is sent next
+        // Once the bus is stalled, frames are dropped so the rings never stay full until the socket is recovered
+        while (popTXFrame (&Frame))
+        {
+            if ((TXStalled) || (writeTXFrame (&Frame) != 0))
+                __atomic_add_fetch (&TXDroppedFrames, 1, __ATOMIC_RELAXED);
+        }
+        // Transports buffering frames write them once the rings are empty
+        flushCBUSSocket ();
+    }
+
+    return 0;
+}  // CBUSTXThreadFunc
+/* ------------------------------------------------- */
+
+int startCBUSPipeline (void)
+{
+    if (PipelineRunning) return 0;
+
+    memset (&RXRing, 0, sizeof(RXRing));
+    memset (&TXRings, 0, sizeof(TXRings));
+    PipelineStopRequest = 0;
+    TXStalled = 0;
+
+    if (sem_init (&TXSemaphore, 0, 0) != 0) return -1;
+
+    if (pthread_create (&RXThread, NULL, CBUSRXThreadFunc, NULL) != 0)
+    {
+        sem_destroy (&TXSemaphore);
+        return -1;
+    }
+
+    if (pthread_create (&TXThread, NULL, CBUSTXThreadFunc, NULL) != 0)
+    {
+        PipelineStopRequest = 1;
+        pthread_join (RXThread, NULL);
+        sem_destroy (&TXSemaphore);
+        return -1;
+    }
+
+    PipelineRunning = 1;
+    return 0;
+}  // startCBUSPipeline
+/* ------------------------------------------------- */
+
+void stopCBUSPipeline (void)
+{
+    if (PipelineRunning == 0) return;
+
+    PipelineStopRequest = 1;
+    sem_post (&TXSemaphore);        // Wake up TX thread so it sees the stop request
+    pthread_join (RXThread, NULL);
+    pthread_join (TXThread, NULL);
+    sem_destroy (&TXSemaphore);
+    PipelineRunning = 0;
+}  // stopCBUSPipeline
+/* ------------------------------------------------- */
+
+unsigned int getPipelineCBUSMessage (unsigned int* CANID, unsigned char* CANData)
+{
+    TCBUSFrame Frame;
+
+    if (cbusRingPop (&RXRing, &Frame) == 0) return 0xFFFFFFFF;
+
+    *CANID = Frame.ID;
+    memcpy (CANData, &Frame.Data[0], Frame.DLC & 0xF);
+    return Frame.DLC;
+}  // getPipelineCBUSMessage
+/* ------------------------------------------------- */
+
+int sendPipelineCBUSRaw (int Class, unsigned int ID, unsigned char DLC, unsigned char* Data)
+{
+    if ((Class < 0) || (Class >= NUM_CBUS_TX_CLASSES)) Class = CBUS_TX_NORMAL;
+
+    // TX thread drains the ring much faster than the logic stage fills it. If it is full, the bus is
+    // stalled : logic stage must not wait for it, the caller decides if the frame is sent again later
+    if (cbusRingPush (&TXRings[Class], ID, DLC, Data) == 0) return 0;
+    sem_post (&TXSemaphore);
+    return 1;
+}  // sendPipelineCBUSRaw
+/* ------------------------------------------------- */
+
+unsigned int getPipelineTXDroppedFrames (void)
+{
+    return __atomic_exchange_n (&TXDroppedFrames, 0, __ATOMIC_RELAXED);
+}  // getPipelineTXDroppedFrames
+/* ------------------------------------------------- */
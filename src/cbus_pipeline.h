@@ -0,0 +1,68 @@
+/*
+cbus_pipeline.h
+cbus2modbus
+Optional RX -> logic -> TX pipeline between dedicated threads
+Development : Benoit BOUCHEZ - M8718
+*/
+
+#ifndef __CBUS_PIPELINE_H__
+#define __CBUS_PIPELINE_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//! Number of frames in each ring (must be a power of 2)
+#define CBUS_RING_SIZE      1024
+
+#define CBUS_CACHE_LINE     64
+
+//! CAN frame as exchanged between pipeline stages
+typedef struct {
+    unsigned int ID;
+    unsigned int DLC;
+    unsigned char Data[8];
+} TCBUSFrame;
+
+//! Single producer / single consumer lock-free ring
+// Head (written by producer) and tail (written by consumer) live on separate cache lines
+// so the two threads never invalidate each other's line when they only touch their own index
+typedef struct {
+    volatile uint32_t Head __attribute__((aligned(CBUS_CACHE_LINE)));
+    volatile uint32_t Tail __attribute__((aligned(CBUS_CACHE_LINE)));
+    TCBUSFrame Frames[CBUS_RING_SIZE] __attribute__((aligned(CBUS_CACHE_LINE)));
+} TCBUSRing;
+
+//! \return 1 if frame has been stored, 0 if ring is full
+int cbusRingPush (TCBUSRing* Ring, unsigned int ID, unsigned int DLC, unsigned char* Data);
+
+//! \return 1 if a frame has been read, 0 if ring is empty
+int cbusRingPop (TCBUSRing* Ring, TCBUSFrame* Frame);
+
+//! Starts RX and TX threads. CAN socket must be opened before
+// \return 0 if threads are running
+int startCBUSPipeline (void);
+
+//! Stops RX and TX threads (call before closing the CAN socket)
+void stopCBUSPipeline (void);
+
+//! Called by logic stage to get next received frame
+// Same convention as getNextCBUSMessage : returns 0xFFFFFFFF if no frame is waiting
+unsigned int getPipelineCBUSMessage (unsigned int* CANID, unsigned char* CANData);
+
+//! Called by logic stage to queue a frame for the TX thread
+// Class is the TX priority class (CBUS_TX_URGENT / NORMAL / BACKGROUND)
+// \return 1 if frame is queued, 0 if the TX ring is full (frame is not sent). Never waits
+int sendPipelineCBUSRaw (int Class, unsigned int ID, unsigned char DLC, unsigned char* Data);
+
+//! Frames the TX thread could not write since last call (socket failure, or bus stalled for PIPELINE_TX_TIMEOUT)
+// A stalled bus is reported as ETIMEDOUT by getCBUSSocketError
+unsigned int getPipelineTXDroppedFrames (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,666 @@
+/*
+cbus_rules.c
+cbus2modbus
+Local rule engine : CBUS input events drive CBUS outputs without PLC round trip
+Development : Benoit BOUCHEZ - M8718
+
+Going through the PLC (Modbus poll, PLC scan, coil write) takes tens of milliseconds. Simple
+interlocks (occupancy -> signal to danger) can be declared in cbus_rules.dat and are executed
+by the gateway when the CBUS event is received.
+
+Each line of cbus_rules.dat defines one output :
+    Q<output> = <expression>
+Expressions use :
+    I<n>            PLC input n
+    Q<n>            last state sent on CBUS for output n
+    NOT x, !x
+    x AND y, x & y
+    x OR y, x | y
+    TON(x, ms)      true when x has been true for ms milliseconds
+    TOF(x, ms)      true when x is true, and for ms milliseconds after x becomes false
+    ( )
+NOT has the highest priority, then AND, then OR.
+
+Rules are compiled into a single flat array of postfix instructions. The evaluation stack
+is a 32 bits word (one bit per stack level), so each instruction is a shift and a logical
+operation without branch. Each input and output has a bit mask of the rules using it :
+when an input changes, only these rules are evaluated. Rules with timers are also evaluated
+periodically while a timer is running.
+
+A rule using outputs can create a loop (Q1 = NOT Q1, or Q1 = NOT Q2 with Q2 = Q1). A loop
+with an odd number of NOT and no timer never settles : each output change triggers the
+next one immediately. Such rules are rejected when the file is loaded. Loops with an even
+number of NOT (self-holding output : Q1 = I1 OR (Q1 AND NOT I2)) or going through a timer
+are accepted.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "cbus_rules.h"
+
+#define MAX_RULE_CODE           4096
+#define MAX_RULE_TIMERS         256
+#define MAX_RULE_STACK          32          // Evaluation stack is a 32 bits word
+#define RULE_MASK_WORDS         (MAX_CBUS_RULES/32)
+#define OUTPUT_MASK_WORDS       (NUM_CBUS_BOOL_OUTPUTS/32)
+
+enum {
+    RULE_OP_INPUT,
+    RULE_OP_OUTPUT,
+    RULE_OP_NOT,
+    RULE_OP_AND,
+    RULE_OP_OR,
+    RULE_OP_TON,
+    RULE_OP_TOF
+};
+
+typedef struct {
+    uint8_t Op;
+    uint16_t Arg;       // Input, output or timer number
+} TCBUSRuleInstr;
+
+typedef struct {
+    uint16_t CodeStart;
+    uint16_t CodeLength;
+    uint16_t Output;
+    uint8_t HasTimer;
+    uint8_t Result;
+    uint8_t Override;
+} TCBUSRule;
+
+typedef struct {
+    uint64_t Preset;        // Microseconds
+    uint64_t Start;
+    uint8_t Running;
+    uint8_t Active;         // TOF : output is held
+} TCBUSRuleTimer;
+
+typedef struct {
+    const char* Pos;
+    int Error;
+    int Depth;
+    int MaxDepth;
+    int Rule;
+    int HasTimer;
+    int Negated;                                        // Odd number of NOT around current token
+    uint32_t Feedback[2][OUTPUT_MASK_WORDS];            // Outputs used without timer delay (index 1 : inverted)
+} TRuleParser;
+
+static TCBUSRuleInstr RuleCode[MAX_RULE_CODE];
+static int RuleCodeSize = 0;
+static TCBUSRule Rules[MAX_CBUS_RULES];
+static int RuleCount = 0;
+static TCBUSRuleTimer RuleTimers[MAX_RULE_TIMERS];
+static int RuleTimerCount = 0;
+
+static uint8_t RuleInputState[NUM_CBUS_BOOL_INPUTS];
+static uint8_t RuleOutputState[NUM_CBUS_BOOL_OUTPUTS];
+static uint32_t InputRules[NUM_CBUS_BOOL_INPUTS][RULE_MASK_WORDS];      // Rules using each input
+static uint32_t OutputRules[NUM_CBUS_BOOL_OUTPUTS][RULE_MASK_WORDS];    // Rules using each output
+static int OutputRule[NUM_CBUS_BOOL_OUTPUTS];                           // Rule driving each output (-1 = none)
+static uint32_t RuleFeedback[MAX_CBUS_RULES][2][OUTPUT_MASK_WORDS];     // TRuleParser.Feedback of each rule
+
+// Outputs waiting to be updated (each output is queued only once)
+static uint16_t ChangeQueue[NUM_CBUS_BOOL_OUTPUTS];
+static uint8_t ChangeQueued[NUM_CBUS_BOOL_OUTPUTS];
+static int ChangeHead = 0;
+static int ChangeCount = 0;
+
+static void queueOutputChange (int Output)
+{
+    if (ChangeQueued[Output]) return;
+    ChangeQueued[Output] = 1;
+    ChangeQueue[(ChangeHead+ChangeCount)%NUM_CBUS_BOOL_OUTPUTS] = Output;
+    ChangeCount++;
+}  // queueOutputChange
+// ------------------------------------------------------------
+
+//! Run the code of a rule
+static uint8_t executeRule (TCBUSRule* Rule, uint64_t Now)
+{
+    const TCBUSRuleInstr* Instr;
+    const TCBUSRuleInstr* End;
+    TCBUSRuleTimer* Timer;
+    uint32_t Stack = 0;
+    uint32_t Value;
+
+    Instr = &RuleCode[Rule->CodeStart];
+    End = Instr + Rule->CodeLength;
+    for (; Instr<End; Instr++)
+    {
+        switch (Instr->Op)
+        {
+            case RULE_OP_INPUT : Stack = (Stack<<1) | RuleInputState[Instr->Arg]; break;
+            case RULE_OP_OUTPUT : Stack = (Stack<<1) | RuleOutputState[Instr->Arg]; break;
+            case RULE_OP_NOT : Stack ^= 1; break;
+            case RULE_OP_AND : Stack = (Stack>>1) & (Stack | ~1u); break;
+            case RULE_OP_OR : Stack = (Stack>>1) | (Stack & 1); break;
+
+            case RULE_OP_TON :
+                Timer = &RuleTimers[Instr->Arg];
+                Value = Stack & 1;
+                if (Value == 0)
+                {
+                    Timer->Running = 0;
+                }
+                else
+                {
+                    if (Timer->Running == 0)
+                    {
+                        Timer->Running = 1;
+                        Timer->Start = Now;
+                    }
+                    Value = (Now - Timer->Start >= Timer->Preset);
+                }
+                Stack = (Stack & ~1u) | Value;
+                break;
+
+            case RULE_OP_TOF :
+                Timer = &RuleTimers[Instr->Arg];
+                Value = Stack & 1;
+                if (Value)
+                {
+                    Timer->Running = 0;
+                    Timer->Active = 1;
+                }
+                else if (Timer->Active)
+                {
+                    if (Timer->Running == 0)
+                    {
+                        Timer->Running = 1;
+                        Timer->Start = Now;
+                    }
+                    if (Now - Timer->Start >= Timer->Preset)
+                    {
+                        Timer->Running = 0;
+                        Timer->Active = 0;
+                    }
+                    Value = Timer->Active;
+                }
+                Stack = (Stack & ~1u) | Value;
+                break;
+        }
+    }
+    return Stack & 1;
+}  // executeRule
+// ------------------------------------------------------------
+
+//! Evaluate rules selected in Mask and queue outputs of rules whose result has changed
+static void evaluateRules (const uint32_t* Mask, uint64_t Now)
+{
+    int Word;
+    int RuleNumber;
+    uint32_t Bits;
+    uint8_t Result;
+
+    for (Word=0; Word<RULE_MASK_WORDS; Word++)
+    {
+        Bits = Mask[Word];
+        while (Bits)
+        {
+            RuleNumber = (Word*32) + __builtin_ctz (Bits);
+            Bits &= Bits-1;
+
+            Result = executeRule (&Rules[RuleNumber], Now);
+            if (Result != Rules[RuleNumber].Result)
+            {
+                Rules[RuleNumber].Result = Result;
+                if (Rules[RuleNumber].Override == 0)
+                    queueOutputChange (Rules[RuleNumber].Output);
+            }
+        }
+    }
+}  // evaluateRules
+// ------------------------------------------------------------
+
+static void skipSpaces (TRuleParser* Parser)
+{
+    while ((*Parser->Pos == ' ') || (*Parser->Pos == '\t')) Parser->Pos++;
+}  // skipSpaces
+// ------------------------------------------------------------
+
+//! Check if next token is the symbol or the keyword, and skip it
+static int matchToken (TRuleParser* Parser, char Symbol, const char* Keyword)
+{
+    int Length;
+
+    skipSpaces (Parser);
+    if ((Symbol != 0) && (*Parser->Pos == Symbol))
+    {
+        Parser->Pos++;
+        return 1;
+    }
+    if (Keyword == 0) return 0;
+
+    Length = strlen (Keyword);
+    if (strncasecmp (Parser->Pos, Keyword, Length) != 0) return 0;
+    if (isalnum ((unsigned char)Parser->Pos[Length])) return 0;
+    Parser->Pos += Length;
+    return 1;
+}  // matchToken
+// ------------------------------------------------------------
+
+static int parseNumber (TRuleParser* Parser, int Max)
+{
+    int Value = 0;
+
+    skipSpaces (Parser);
+    if (!isdigit ((unsigned char)*Parser->Pos))
+    {
+        Parser->Error = 1;
+        return 0;
+    }
+    while (isdigit ((unsigned char)*Parser->Pos))
+    {
+        Value = (Value*10) + (*Parser->Pos - '0');
+        if (Value > Max) Parser->Error = 1;
+        Parser->Pos++;
+    }
+    return Parser->Error ? 0 : Value;
+}  // parseNumber
+// ------------------------------------------------------------
+
+static void emitInstr (TRuleParser* Parser, uint8_t Op, uint16_t Arg)
+{
+    if (Parser->Error) return;
+    if (RuleCodeSize >= MAX_RULE_CODE)
+    {
+        Parser->Error = 1;
+        return;
+    }
+
+    RuleCode[RuleCodeSize].Op = Op;
+    RuleCode[RuleCodeSize].Arg = Arg;
+    RuleCodeSize++;
+
+    if ((Op == RULE_OP_INPUT) || (Op == RULE_OP_OUTPUT))
+    {
+        Parser->Depth++;
+        if (Parser->Depth > Parser->MaxDepth) Parser->MaxDepth = Parser->Depth;
+    }
+    else if ((Op == RULE_OP_AND) || (Op == RULE_OP_OR))
+        Parser->Depth--;
+}  // emitInstr
+// ------------------------------------------------------------
+
+static void parseOr (TRuleParser* Parser);
+
+static void parseTimer (TRuleParser* Parser, uint8_t Op)
+{
+    int Preset;
+    uint32_t SavedFeedback[2][OUTPUT_MASK_WORDS];
+
+    if (!matchToken (Parser, '(', 0))
+    {
+        Parser->Error = 1;
+        return;
+    }
+    memcpy (SavedFeedback, Parser->Feedback, sizeof(SavedFeedback));
+    parseOr (Parser);
+    if (!matchToken (Parser, ',', 0))
+    {
+        Parser->Error = 1;
+        return;
+    }
+    Preset = parseNumber (Parser, 86400000);
+    if (!matchToken (Parser, ')', 0)) Parser->Error = 1;
+    if ((Parser->Error) || (RuleTimerCount >= MAX_RULE_TIMERS))
+    {
+        Parser->Error = 1;
+        return;
+    }
+
+    // Outputs used by a running timer can not change the result before the preset
+    if (Preset > 0)
+        memcpy (Parser->Feedback, SavedFeedback, sizeof(SavedFeedback));
+
+    memset (&RuleTimers[RuleTimerCount], 0, sizeof(TCBUSRuleTimer));
+    RuleTimers[RuleTimerCount].Preset = (uint64_t)Preset*1000;
+    emitInstr (Parser, Op, RuleTimerCount);
+    RuleTimerCount++;
+    Parser->HasTimer = 1;
+}  // parseTimer
+// ------------------------------------------------------------
+
+static void parsePrimary (TRuleParser* Parser)
+{
+    int Number;
+
+    if (Parser->Error) return;
+
+    if (matchToken (Parser, '(', 0))
+    {
+        parseOr (Parser);
+        if (!matchToken (Parser, ')', 0)) Parser->Error = 1;
+    }
+    else if (matchToken (Parser, 0, "TON"))
+        parseTimer (Parser, RULE_OP_TON);
+    else if (matchToken (Parser, 0, "TOF"))
+        parseTimer (Parser, RULE_OP_TOF);
+    else if ((*Parser->Pos == 'I') || (*Parser->Pos == 'i'))
+    {
+        Parser->Pos++;
+        Number = parseNumber (Parser, NUM_CBUS_BOOL_INPUTS-1);
+        if (Parser->Error) return;
+        InputRules[Number][Parser->Rule/32] |= (1u<<(Parser->Rule%32));
+        emitInstr (Parser, RULE_OP_INPUT, Number);
+    }
+    else if ((*Parser->Pos == 'Q') || (*Parser->Pos == 'q'))
+    {
+        Parser->Pos++;
+        Number = parseNumber (Parser, NUM_CBUS_BOOL_OUTPUTS-1);
+        if (Parser->Error) return;
+        OutputRules[Number][Parser->Rule/32] |= (1u<<(Parser->Rule%32));
+        Parser->Feedback[Parser->Negated][Number/32] |= (1u<<(Number%32));
+        emitInstr (Parser, RULE_OP_OUTPUT, Number);
+    }
+    else
+        Parser->Error = 1;
+}  // parsePrimary
+// ------------------------------------------------------------
+
+static void parseUnary (TRuleParser* Parser)
+{
+    if (matchToken (Parser, '!', "NOT"))
+    {
+        Parser->Negated ^= 1;
+        parseUnary (Parser);
+        Parser->Negated ^= 1;
+        emitInstr (Parser, RULE_OP_NOT, 0);
+    }
+    else
+        parsePrimary (Parser);
+}  // parseUnary
+// ------------------------------------------------------------
+
+static void parseAnd (TRuleParser* Parser)
+{
+    parseUnary (Parser);
+    while ((Parser->Error == 0) && (matchToken (Parser, '&', "AND")))
+    {
+        parseUnary (Parser);
+        emitInstr (Parser, RULE_OP_AND, 0);
+    }
+}  // parseAnd
+// ------------------------------------------------------------
+
+static void parseOr (TRuleParser* Parser)
+{
+    parseAnd (Parser);
+    while ((Parser->Error == 0) && (matchToken (Parser, '|', "OR")))
+    {
+        parseAnd (Parser);
+        emitInstr (Parser, RULE_OP_OR, 0);
+    }
+}  // parseOr
+// ------------------------------------------------------------
+
+//! Search a loop with an odd number of NOT going through the output of the new rule
+// Nodes are (output, parity of NOT from the new rule output), each one is visited once
+// \return 1 if the new rule can make its output oscillate
+static int isOscillatingRule (int NewRule)
+{
+    uint8_t Reached[2][NUM_CBUS_BOOL_OUTPUTS];
+    uint16_t Stack[2*NUM_CBUS_BOOL_OUTPUTS];
+    int StackSize = 0;
+    int Node;
+    int Output;
+    int Parity;
+    int RuleNumber;
+    int Polarity;
+    int Next;
+
+    memset (Reached, 0, sizeof(Reached));
+    Reached[0][Rules[NewRule].Output] = 1;
+    Stack[StackSize++] = Rules[NewRule].Output;
+
+    while (StackSize > 0)
+    {
+        Node = Stack[--StackSize];
+        Parity = Node / NUM_CBUS_BOOL_OUTPUTS;
+        Output = Node % NUM_CBUS_BOOL_OUTPUTS;
+
+        // Every rule using this output changes when it changes
+        for (RuleNumber=0; RuleNumber<=NewRule; RuleNumber++)
+        {
+            for (Polarity=0; Polarity<2; Polarity++)
+            {
+                if ((RuleFeedback[RuleNumber][Polarity][Output/32] & (1u<<(Output%32))) == 0) continue;
+                Next = Parity ^ Polarity;
+                if (Reached[Next][Rules[RuleNumber].Output]) continue;
+                Reached[Next][Rules[RuleNumber].Output] = 1;
+                Stack[StackSize++] = (Next*NUM_CBUS_BOOL_OUTPUTS) + Rules[RuleNumber].Output;
+            }
+        }
+    }
+    return Reached[1][Rules[NewRule].Output];
+}  // isOscillatingRule
+// ------------------------------------------------------------
+
+//! Compile one line of the rule file
+// \return 0 if rule has been added
+static int compileRule (const char* Line)
+{
+    TRuleParser Parser;
+    int Output;
+    int SavedCodeSize;
+    int SavedTimerCount;
+    int Counter;
+
+    memset (&Parser, 0, sizeof(Parser));
+    Parser.Pos = Line;
+    Parser.Rule = RuleCount;
+    SavedCodeSize = RuleCodeSize;
+    SavedTimerCount = RuleTimerCount;
+
+    skipSpaces (&Parser);
+    if ((*Parser.Pos != 'Q') && (*Parser.Pos != 'q')) return -1;
+    Parser.Pos++;
+    Output = parseNumber (&Parser, NUM_CBUS_BOOL_OUTPUTS-1);
+    if ((Parser.Error == 0) && (OutputRule[Output] != -1)) Parser.Error = 1;     // Only one rule per output
+    if (!matchToken (&Parser, '=', 0)) Parser.Error = 1;
+
+    parseOr (&Parser);
+    skipSpaces (&Parser);
+    if ((*Parser.Pos != 0) && (*Parser.Pos != '\r') && (*Parser.Pos != '\n') && (*Parser.Pos != '#')) Parser.Error = 1;
+    if ((Parser.Depth != 1) || (Parser.MaxDepth > MAX_RULE_STACK)) Parser.Error = 1;
+
+    if (Parser.Error == 0)
+    {
+        Rules[RuleCount].Output = Output;
+        memcpy (RuleFeedback[RuleCount], Parser.Feedback, sizeof(Parser.Feedback));
+        if (isOscillatingRule (RuleCount))
+        {
+            fprintf (stdout, "Rule for Q%d creates a loop without timer and with an odd number of NOT\n", Output);
+            Parser.Error = 1;
+        }
+    }
+
+    if (Parser.Error)
+    {   // Remove everything created by this line
+        RuleCodeSize = SavedCodeSize;
+        RuleTimerCount = SavedTimerCount;
+        for (Counter=0; Counter<NUM_CBUS_BOOL_INPUTS; Counter++)
+            InputRules[Counter][RuleCount/32] &= ~(1u<<(RuleCount%32));
+        for (Counter=0; Counter<NUM_CBUS_BOOL_OUTPUTS; Counter++)
+            OutputRules[Counter][RuleCount/32] &= ~(1u<<(RuleCount%32));
+        memset (RuleFeedback[RuleCount], 0, sizeof(RuleFeedback[RuleCount]));
+        return -1;
+    }
+
+    Rules[RuleCount].CodeStart = SavedCodeSize;
+    Rules[RuleCount].CodeLength = RuleCodeSize - SavedCodeSize;
+    Rules[RuleCount].Output = Output;
+    Rules[RuleCount].HasTimer = Parser.HasTimer;
+    Rules[RuleCount].Result = 0;
+    Rules[RuleCount].Override = 0;
+    OutputRule[Output] = RuleCount;
+    RuleCount++;
+    return 0;
+}  // compileRule
+// ------------------------------------------------------------
+
+int loadCBUSRules (void)
+{
+    FILE* RuleFile;
+    char Buffer[256];
+    int LineNumber = 0;
+    int Counter;
+    uint32_t AllRules[RULE_MASK_WORDS];
+
+    RuleCodeSize = 0;
+    RuleCount = 0;
+    RuleTimerCount = 0;
+    ChangeHead = 0;
+    ChangeCount = 0;
+    memset (ChangeQueued, 0, sizeof(ChangeQueued));
+    memset (RuleInputState, 0, sizeof(RuleInputState));
+    memset (RuleOutputState, 0, sizeof(RuleOutputState));
+    memset (InputRules, 0, sizeof(InputRules));
+    memset (OutputRules, 0, sizeof(OutputRules));
+    memset (RuleFeedback, 0, sizeof(RuleFeedback));
+    for (Counter=0; Counter<NUM_CBUS_BOOL_OUTPUTS; Counter++)
+        OutputRule[Counter] = -1;
+
+    RuleFile = fopen ("cbus_rules.dat", "rt");
+    if (RuleFile == 0) return 0;        // Rules are optional
+
+    if (VerbosityLevel > 0)
+        fprintf (stdout, "Reading CBUS rules file...\n");
+
+    while (fgets (Buffer, 256, RuleFile))
+    {
+        LineNumber++;
+        Counter = strspn (Buffer, " \t\r\n");
+        if ((Buffer[Counter] == 0) || (Buffer[Counter] == '#')) continue;
+
+        if (RuleCount >= MAX_CBUS_RULES)
+        {
+            fprintf (stdout, "Too many rules in cbus_rules.dat, line %d ignored\n", LineNumber);
+            continue;
+        }
+
+        if (compileRule (Buffer) != 0)
+            fprintf (stdout, "Error in cbus_rules.dat line %d, rule ignored\n", LineNumber);
+        else if (VerbosityLevel > 0)
+            fprintf (stdout, "Rule %d: %s", RuleCount-1, &Buffer[Counter]);
+    }
+    fclose (RuleFile);
+
+    // Initial evaluation : all outputs driven by rules are set. Timers started now run for their full preset
+    memset (AllRules, 0, sizeof(AllRules));
+    for (Counter=0; Counter<RuleCount; Counter++)
+        AllRules[Counter/32] |= (1u<<(Counter%32));
+    evaluateRules (AllRules, getCBUSTimestamp());
+    for (Counter=0; Counter<RuleCount; Counter++)
+        queueOutputChange (Rules[Counter].Output);
+
+    return RuleCount;
+}  // loadCBUSRules
+// ------------------------------------------------------------
+
+int getCBUSRuleCount (void)
+{
+    return RuleCount;
+}  // getCBUSRuleCount
+// ------------------------------------------------------------
+
+void setCBUSRuleInput (int Input, uint8_t State, uint64_t Timestamp)
+{
+    if ((RuleCount == 0) || (Input < 0) || (Input >= NUM_CBUS_BOOL_INPUTS)) return;
+    if (RuleInputState[Input] == State) return;
+
+    RuleInputState[Input] = State;
+    evaluateRules (InputRules[Input], Timestamp);
+}  // setCBUSRuleInput
+// ------------------------------------------------------------
+
+void setCBUSRuleOutput (int Output, uint8_t State, uint64_t Timestamp)
+{
+    if ((RuleCount == 0) || (Output < 0) || (Output >= NUM_CBUS_BOOL_OUTPUTS)) return;
+    if (RuleOutputState[Output] == State) return;
+
+    RuleOutputState[Output] = State;
+    evaluateRules (OutputRules[Output], Timestamp);
+}  // setCBUSRuleOutput
+// ------------------------------------------------------------
+
+void processCBUSRuleTimers (uint64_t Timestamp)
+{
+    uint32_t TimerRules[RULE_MASK_WORDS];
+    int RuleNumber;
+    int HasTimer = 0;
+
+    if (RuleCount == 0) return;
+
+    memset (TimerRules, 0, sizeof(TimerRules));
+    for (RuleNumber=0; RuleNumber<RuleCount; RuleNumber++)
+    {
+        if (Rules[RuleNumber].HasTimer)
+        {
+            TimerRules[RuleNumber/32] |= (1u<<(RuleNumber%32));
+            HasTimer = 1;
+        }
+    }
+    if (HasTimer)
+        evaluateRules (TimerRules, Timestamp);
+}  // processCBUSRuleTimers
+// ------------------------------------------------------------
+
+int getCBUSRuleOutputChange (int* Output, uint8_t* State)
+{
+    int RuleNumber;
+
+    while (ChangeCount > 0)
+    {
+        *Output = ChangeQueue[ChangeHead];
+        ChangeHead = (ChangeHead+1)%NUM_CBUS_BOOL_OUTPUTS;
+        ChangeCount--;
+        ChangeQueued[*Output] = 0;
+
+        RuleNumber = OutputRule[*Output];
+        if ((RuleNumber == -1) || (Rules[RuleNumber].Override)) continue;   // Output is now controlled by PLC
+        *State = Rules[RuleNumber].Result;
+        return 1;
+    }
+    return 0;
+}  // getCBUSRuleOutputChange
+// ------------------------------------------------------------
+
+int isCBUSRuleOutput (int Output)
+{
+    int RuleNumber;
+
+    if ((Output < 0) || (Output >= NUM_CBUS_BOOL_OUTPUTS)) return 0;
+    RuleNumber = OutputRule[Output];
+    if (RuleNumber == -1) return 0;
+    return Rules[RuleNumber].Override == 0;
+}  // isCBUSRuleOutput
+// ------------------------------------------------------------
+
+void setCBUSRuleOverride (int Rule, uint8_t Override)
+{
+    if ((Rule < 0) || (Rule >= RuleCount)) return;
+    Override = Override ? 1 : 0;
+    if (Rules[Rule].Override == Override) return;
+
+    Rules[Rule].Override = Override;
+    // Rule result is applied again when PLC releases the output
+    if (Override == 0)
+        queueOutputChange (Rules[Rule].Output);
+}  // setCBUSRuleOverride
+// ------------------------------------------------------------
+
+void exportCBUSRuleResults (uint8_t* Results)
+{
+    int RuleNumber;
+
+    for (RuleNumber=0; RuleNumber<MAX_CBUS_RULES; RuleNumber++)
+    {
+        Results[RuleNumber] = (RuleNumber < RuleCount) ? Rules[RuleNumber].Result : 0;
+    }
+}  // exportCBUSRuleResults
+// ------------------------------------------------------------
@@ -0,0 +1,62 @@
+/*
+cbus_rules.h
+cbus2modbus
+Local rule engine : CBUS input events drive CBUS outputs without PLC round trip
+Development : Benoit BOUCHEZ - M8718
+*/
+
+#ifndef __CBUS_RULES_H__
+#define __CBUS_RULES_H__
+
+#include <stdint.h>
+#include "cbus_io.h"
+#include "cbus_soe.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MAX_CBUS_RULES              128
+
+// Discrete inputs map : result of each rule (in the order of cbus_rules.dat)
+#define DI_RULE_BASE                DI_SOE_END
+#define DI_RULES_END                (DI_RULE_BASE+MAX_CBUS_RULES)
+
+// Coils map : when set, output of the rule follows the PLC coil instead of the rule result
+#define COIL_RULE_OVERRIDE_BASE     COIL_SOE_END
+#define COIL_RULES_END              (COIL_RULE_OVERRIDE_BASE+MAX_CBUS_RULES)
+
+//! Read and compile cbus_rules.dat
+// \return number of rules loaded (0 if there is no rule file)
+int loadCBUSRules (void);
+
+//! \return number of rules loaded
+int getCBUSRuleCount (void);
+
+//! Give new state of a PLC input to the rule engine. Rules using the input are evaluated immediately
+void setCBUSRuleInput (int Input, uint8_t State, uint64_t Timestamp);
+
+//! Give the state sent on CBUS for an output (used by rules referencing outputs)
+void setCBUSRuleOutput (int Output, uint8_t State, uint64_t Timestamp);
+
+//! Evaluate rules with running timers. Called periodically by ProcessCBUS_IO
+void processCBUSRuleTimers (uint64_t Timestamp);
+
+//! Get next output to be updated by a rule
+// \return 0 if no output has to be updated
+int getCBUSRuleOutputChange (int* Output, uint8_t* State);
+
+//! \return 1 if output is driven by a rule (and not overriden by the PLC)
+int isCBUSRuleOutput (int Output);
+
+//! PLC override of a rule output (Override = 1 : output follows the PLC coil)
+void setCBUSRuleOverride (int Rule, uint8_t Override);
+
+//! Copy rule results to PLC image (MAX_CBUS_RULES values)
+void exportCBUSRuleResults (uint8_t* Results);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
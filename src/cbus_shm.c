@@ -0,0 +1,121 @@
+/*
+cbus_shm.c
+cbus2modbus
+Shared memory I/O image for PLC runtimes running on the same machine
+Development : Benoit BOUCHEZ - M8718
+
+The PLC runtime can access the I/O image directly in a POSIX shared memory segment
+instead of using Modbus/TCP on the loopback interface. See cbus_shm.h for the layout.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cbus_shm.h"
+#include "cbus_io.h"
+
+#if (CBUS_SHM_NUM_INPUTS != NUM_CBUS_BOOL_INPUTS) || (CBUS_SHM_NUM_OUTPUTS != NUM_CBUS_BOOL_OUTPUTS)
+#error "Shared memory image size does not match CBUS I/O image size"
+#endif
+
+#define SHM_READ_ATTEMPTS       4           // Reads of the PLC outputs tried in one cycle
+
+static TCBUSSharedImage* SharedImage = 0;
+static uint8_t LastPLCOutputs[CBUS_SHM_NUM_OUTPUTS];    // Last consistent copy of the PLC outputs
+static int LastPLCOwned = 0;
+
+int createCBUSShm (void)
+{
+    int FD;
+    void* Map;
+
+    closeCBUSShm ();
+
+    FD = shm_open (CBUS_SHM_NAME, O_RDWR|O_CREAT, 0666);
+    if (FD == -1) return -1;
+
+    if (ftruncate (FD, sizeof(TCBUSSharedImage)) != 0)
+    {
+        close (FD);
+        return -1;
+    }
+
+    Map = mmap (0, sizeof(TCBUSSharedImage), PROT_READ|PROT_WRITE, MAP_SHARED, FD, 0);
+    close (FD);
+    if (Map == MAP_FAILED) return -1;
+
+    SharedImage = (TCBUSSharedImage*)Map;
+    memset (SharedImage, 0, sizeof(TCBUSSharedImage));
+    SharedImage->Version = CBUS_SHM_VERSION;
+    SharedImage->NumInputs = CBUS_SHM_NUM_INPUTS;
+    SharedImage->NumOutputs = CBUS_SHM_NUM_OUTPUTS;
+
+    // Magic is written last : clients attaching before this point will reject the segment
+    __atomic_store_n (&SharedImage->Magic, CBUS_SHM_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}  // createCBUSShm
+// ------------------------------------------------------------
+
+void closeCBUSShm (void)
+{
+    if (SharedImage == 0) return;
+
+    SharedImage->Magic = 0;
+    munmap (SharedImage, sizeof(TCBUSSharedImage));
+    SharedImage = 0;
+    LastPLCOwned = 0;
+    shm_unlink (CBUS_SHM_NAME);
+}  // closeCBUSShm
+// ------------------------------------------------------------
+
+void publishCBUSShm (const uint8_t* Inputs, const uint8_t* Outputs)
+{
+    if (SharedImage == 0) return;
+
+    // Do not disturb readers if nothing has changed
+    if ((memcmp (SharedImage->Inputs, Inputs, CBUS_SHM_NUM_INPUTS) == 0) &&
+        (memcmp (SharedImage->Outputs, Outputs, CBUS_SHM_NUM_OUTPUTS) == 0))
+        return;
+
+    cbusShmWriteBegin (&SharedImage->GatewaySequence);
+    memcpy (SharedImage->Inputs, Inputs, CBUS_SHM_NUM_INPUTS);
+    memcpy (SharedImage->Outputs, Outputs, CBUS_SHM_NUM_OUTPUTS);
+    SharedImage->GatewayTimestamp = getCBUSTimestamp ();
+    cbusShmWriteEnd (&SharedImage->GatewaySequence);
+}  // publishCBUSShm
+// ------------------------------------------------------------
+
+int readCBUSShmOutputs (uint8_t* Outputs)
+{
+    uint8_t Copy[CBUS_SHM_NUM_OUTPUTS];
+    uint32_t Sequence;
+    uint32_t Owned;
+    int Attempt;
+
+    if (SharedImage == 0) return 0;
+
+    // A PLC runtime stopped during cbusShmWriteOutputs leaves the sequence odd : the gateway never waits
+    // for it. When no consistent copy can be read, outputs read during the previous cycle are kept
+    for (Attempt=0; Attempt<SHM_READ_ATTEMPTS; Attempt++)
+    {
+        Sequence = __atomic_load_n (&SharedImage->PLCSequence, __ATOMIC_ACQUIRE);
+        if (Sequence & 1) continue;         // Write in progress
+        Owned = SharedImage->PLCOwnsOutputs;
+        memcpy (Copy, SharedImage->PLCOutputs, CBUS_SHM_NUM_OUTPUTS);
+        if (cbusShmReadRetry (&SharedImage->PLCSequence, Sequence)) continue;
+
+        LastPLCOwned = (Owned != 0);
+        if (LastPLCOwned)
+            memcpy (LastPLCOutputs, Copy, CBUS_SHM_NUM_OUTPUTS);
+        break;
+    }
+
+    if (LastPLCOwned == 0) return 0;
+
+    memcpy (Outputs, LastPLCOutputs, CBUS_SHM_NUM_OUTPUTS);
+    return 1;
+}  // readCBUSShmOutputs
+// ------------------------------------------------------------
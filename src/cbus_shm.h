@@ -0,0 +1,167 @@
+/*
+cbus_shm.h
+cbus2modbus
+Shared memory I/O image for PLC runtimes running on the same machine
+Development : Benoit BOUCHEZ - M8718
+
+This header is used by cbus2modbus and by the PLC runtime. It has no dependency on other
+cbus2modbus files, so it can be copied in the PLC runtime source tree.
+
+Client usage :
+    TCBUSSharedImage* Image = cbusShmAttach ();
+    cbusShmReadInputs (Image, Inputs, Outputs);     // Inputs and outputs as seen by the gateway
+    cbusShmWriteOutputs (Image, NewOutputs);        // Gateway uses these outputs instead of Modbus coils
+    cbusShmReleaseOutputs (Image);                  // Gateway uses Modbus coils again
+    cbusShmDetach (Image);
+
+Each section is protected by a sequence lock : the writer makes the sequence odd during
+the update and even when the update is finished. A reader copies the data and retries if
+the sequence was odd or has changed during the copy. No system call and no lock is needed.
+*/
+
+#ifndef __CBUS_SHM_H__
+#define __CBUS_SHM_H__
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define CBUS_SHM_NAME           "/cbus2modbus"
+#define CBUS_SHM_MAGIC          0x43425553      // 'CBUS'
+#define CBUS_SHM_VERSION        1
+#define CBUS_SHM_NUM_INPUTS     128
+#define CBUS_SHM_NUM_OUTPUTS    128
+
+typedef struct {
+    uint32_t Magic;
+    uint32_t Version;
+    uint32_t NumInputs;
+    uint32_t NumOutputs;
+
+    // Written by cbus2modbus
+    uint32_t GatewaySequence __attribute__((aligned(64)));
+    uint64_t GatewayTimestamp;                  // Time of last update (microseconds, monotonic clock)
+    uint8_t Inputs[CBUS_SHM_NUM_INPUTS];        // PLC inputs (CBUS consumed events)
+    uint8_t Outputs[CBUS_SHM_NUM_OUTPUTS];      // PLC outputs currently applied by the gateway
+
+    // Written by the PLC runtime
+    uint32_t PLCSequence __attribute__((aligned(64)));
+    uint32_t PLCOwnsOutputs;                    // 1 = gateway uses PLCOutputs instead of Modbus coils
+    uint8_t PLCOutputs[CBUS_SHM_NUM_OUTPUTS];
+} TCBUSSharedImage;
+
+//! Start of a write to a section protected by Sequence
+static inline void cbusShmWriteBegin (uint32_t* Sequence)
+{
+    __atomic_store_n (Sequence, *Sequence+1, __ATOMIC_RELAXED);
+    __atomic_thread_fence (__ATOMIC_RELEASE);
+}
+
+//! End of a write to a section protected by Sequence
+static inline void cbusShmWriteEnd (uint32_t* Sequence)
+{
+    __atomic_store_n (Sequence, *Sequence+1, __ATOMIC_RELEASE);
+}
+
+//! Start of a read. Returns the sequence to give to cbusShmReadRetry
+static inline uint32_t cbusShmReadBegin (const uint32_t* Sequence)
+{
+    uint32_t Value;
+
+    do
+    {
+        Value = __atomic_load_n (Sequence, __ATOMIC_ACQUIRE);
+    } while (Value & 1);        // Write in progress
+    return Value;
+}
+
+//! \return non zero if data read since cbusShmReadBegin may be inconsistent and must be read again
+static inline int cbusShmReadRetry (const uint32_t* Sequence, uint32_t Start)
+{
+    __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    return __atomic_load_n (Sequence, __ATOMIC_RELAXED) != Start;
+}
+
+//! Map the shared image created by cbus2modbus
+// \return 0 if cbus2modbus is not running with shared memory enabled
+static inline TCBUSSharedImage* cbusShmAttach (void)
+{
+    int FD;
+    void* Map;
+
+    FD = shm_open (CBUS_SHM_NAME, O_RDWR, 0);
+    if (FD == -1) return 0;
+    Map = mmap (0, sizeof(TCBUSSharedImage), PROT_READ|PROT_WRITE, MAP_SHARED, FD, 0);
+    close (FD);
+    if (Map == MAP_FAILED) return 0;
+
+    if ((((TCBUSSharedImage*)Map)->Magic != CBUS_SHM_MAGIC) || (((TCBUSSharedImage*)Map)->Version != CBUS_SHM_VERSION))
+    {
+        munmap (Map, sizeof(TCBUSSharedImage));
+        return 0;
+    }
+    return (TCBUSSharedImage*)Map;
+}
+
+static inline void cbusShmDetach (TCBUSSharedImage* Image)
+{
+    if (Image) munmap (Image, sizeof(TCBUSSharedImage));
+}
+
+//! Get consistent copy of inputs and outputs (Inputs or Outputs can be NULL)
+static inline void cbusShmReadInputs (const TCBUSSharedImage* Image, uint8_t* Inputs, uint8_t* Outputs)
+{
+    uint32_t Sequence;
+
+    do
+    {
+        Sequence = cbusShmReadBegin (&Image->GatewaySequence);
+        if (Inputs) memcpy (Inputs, Image->Inputs, CBUS_SHM_NUM_INPUTS);
+        if (Outputs) memcpy (Outputs, Image->Outputs, CBUS_SHM_NUM_OUTPUTS);
+    } while (cbusShmReadRetry (&Image->GatewaySequence, Sequence));
+}
+
+//! Write PLC outputs. Gateway uses them instead of Modbus coils until cbusShmReleaseOutputs is called
+static inline void cbusShmWriteOutputs (TCBUSSharedImage* Image, const uint8_t* Outputs)
+{
+    cbusShmWriteBegin (&Image->PLCSequence);
+    memcpy (Image->PLCOutputs, Outputs, CBUS_SHM_NUM_OUTPUTS);
+    Image->PLCOwnsOutputs = 1;
+    cbusShmWriteEnd (&Image->PLCSequence);
+}
+
+static inline void cbusShmReleaseOutputs (TCBUSSharedImage* Image)
+{
+    cbusShmWriteBegin (&Image->PLCSequence);
+    Image->PLCOwnsOutputs = 0;
+    cbusShmWriteEnd (&Image->PLCSequence);
+}
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Functions used by cbus2modbus only
+
+//! Create shared memory segment
+// \return 0 if segment is available
+int createCBUSShm (void);
+
+//! Remove shared memory segment
+void closeCBUSShm (void);
+
+//! Publish inputs and outputs applied by the gateway (only written when they change)
+void publishCBUSShm (const uint8_t* Inputs, const uint8_t* Outputs);
+
+//! Get outputs written by the PLC runtime, without waiting if the PLC runtime is writing them
+// (outputs read during the previous call are given again)
+// \return 1 if PLC runtime owns the outputs (Outputs has been updated), 0 otherwise
+int readCBUSShmOutputs (uint8_t* Outputs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,595 @@
+/*
+cbus_slcan.c
+cbus2modbus
+CBUS through a serial CAN adapter using the SLCAN (Lawicel) ASCII protocol
+Development : Benoit BOUCHEZ - M8718
+
+USB CAN adapters which are not SocketCAN interfaces (CANUSB, CANable with slcan firmware...) are
+seen as a serial port. Each CAN frame is a text line : 't' + 3 ID digits + DLC digit + data bytes
+in hex + CR for standard frames, 'T' + 8 ID digits for extended frames, 'r' / 'R' for remote
+frames. The adapter answers each command with CR (or "z" / "Z" + CR for a frame), or BELL when
+the command is refused.
+
+The serial port is configured in raw mode, without flow control, at high speed (the speed is
+ignored by USB CDC adapters). Low latency mode is requested for USB serial converters.
+Reception : the port is read in large chunks and all complete lines of a chunk are decoded in one
+pass, with the same delimiter search as the GridConnect transport (SSE2 / NEON).
+Transmission : frames given to sendCBUSRaw are encoded in a buffer and written with a single
+write() call by flushCBUSSocket.
+
+With TX confirmation, frames are echoed when they have been written to the serial port. Frames
+refused by the adapter and lines which can not be decoded are counted as dropped frames. When the
+adapter is unplugged, the error is reported as ENETDOWN so the driver opens the port again.
+With the pipeline, RX functions are called by the RX thread and TX functions by the TX thread.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+#include "cbus_slcan.h"
+#include "cbus_gridconnect.h"
+#include "SocketCBUS.h"
+
+#define SLCAN_COMMAND_TIMEOUT       500         // ms waited for the answer to a configuration command
+#define SLCAN_SEND_TIMEOUT          10          // ms waited for room in the serial port buffer by flush
+#define SLCAN_TX_FRAMES             (SLCAN_TEXT_SIZE/6)
+
+//! CAN bitrates of the 'S' command (S0 to S8)
+static const unsigned int SLCANBitrates[9] = {10000, 20000, 50000, 100000, 125000, 250000, 500000, 800000, 1000000};
+
+static int PortHandle = -1;
+static struct termios SavedSettings;        // Serial port settings restored when the port is closed
+static char BitrateCommand[3] = "S4";
+static int OwnFrames = 0;
+static int PortError = 0;                   // Last error, not yet read by getCBUSSocketError
+static uint32_t DroppedFrames = 0;          // Frames not decoded or refused, not yet read by getCBUSDroppedFrames
+
+// Reception (RX thread)
+static TSLCANParser Parser;
+static uint32_t ParserErrors = 0;           // Parser.Errors + Parser.Rejected already added to DroppedFrames
+static TCBUSFrame RXFrames[SLCAN_MAX_BATCH];
+static int RXFrameCount = 0;
+static int RXFrameIndex = 0;
+
+// Transmission (TX thread)
+static char TXText[SLCAN_TEXT_SIZE];
+static int TXLength = 0;
+static TCBUSFrame TXFrames[SLCAN_TX_FRAMES];    // Frames in TXText, echoed once written (TX confirmation)
+static int TXFrameEnd[SLCAN_TX_FRAMES];         // Offset of the end of each frame in TXText
+static int TXFrameCount = 0;
+
+static TCBUSRing EchoRing;                  // Written by TX functions, read by RX functions
+
+int setSLCANBitrate (unsigned int Bitrate)
+{
+    int Index;
+
+    for (Index=0; Index<9; Index++)
+    {
+        if (SLCANBitrates[Index] == Bitrate)
+        {
+            BitrateCommand[1] = '0'+Index;
+            return 0;
+        }
+    }
+    return -1;
+}  // setSLCANBitrate
+// ------------------------------------------------------------
+
+int decodeSLCANLine (const char* Text, int Length, TCBUSFrame* Frame)
+{
+    uint32_t ID;
+    int IDDigits;
+    int DataDigits;
+    int Index;
+    int Digit;
+    int High;
+    int Low;
+
+    if ((Text[0] == 't') || (Text[0] == 'r')) IDDigits = 3;
+    else if ((Text[0] == 'T') || (Text[0] == 'R')) IDDigits = 8;
+    else return 0;
+    if (Length < 2+IDDigits) return 0;
+
+    ID = 0;
+    for (Index=1; Index<=IDDigits; Index++)
+    {
+        Digit = CBUSHexDigits[(uint8_t)Text[Index]];
+        if (Digit == 0) return 0;
+        ID = (ID<<4)|(Digit-1);
+    }
+    if (ID > ((IDDigits == 3) ? 0x7FFU : 0x1FFFFFFFU)) return 0;
+
+    Digit = CBUSHexDigits[(uint8_t)Text[Index++]];
+    if ((Digit == 0) || (Digit > 9)) return 0;
+    Frame->DLC = Digit-1;
+    Frame->ID = ID;
+    if (IDDigits == 8) Frame->ID |= CBUS_EFF_FLAG;
+
+    // Data is followed by a timestamp when the adapter has been configured with Z1
+    DataDigits = 0;
+    if ((Text[0] == 'r') || (Text[0] == 'R'))
+        Frame->ID |= CBUS_RTR_FLAG;
+    else
+        DataDigits = Frame->DLC*2;
+    if ((Length-Index != DataDigits) && (Length-Index != DataDigits+4)) return 0;
+
+    for (Digit=0; Digit<DataDigits/2; Digit++)
+    {
+        High = CBUSHexDigits[(uint8_t)Text[Index++]];
+        Low = CBUSHexDigits[(uint8_t)Text[Index++]];
+        if ((High == 0) || (Low == 0)) return 0;
+        Frame->Data[Digit] = ((High-1)<<4)|(Low-1);
+    }
+    return 1;
+}  // decodeSLCANLine
+// ------------------------------------------------------------
+
+int decodeSLCANFrames (TSLCANParser* Parser, TCBUSFrame* Frames, int MaxFrames)
+{
+    uint16_t Positions[SLCAN_MAX_BATCH];
+    int NumDelimiters;
+    int Requested;
+    int Index;
+    int Count = 0;
+    int Start = 0;
+    int Base;
+    int Length;
+    const char* Line;
+
+    if (MaxFrames > SLCAN_MAX_BATCH) MaxFrames = SLCAN_MAX_BATCH;
+    if (MaxFrames <= 0) return 0;
+
+    // Answers of the adapter give no frame : search again until the batch is full or all lines are decoded
+    do
+    {
+        Base = Start;
+        Requested = MaxFrames-Count;
+        NumDelimiters = findCBUSTextDelimiters (&Parser->Text[Base], Parser->Length-Base, '\r', Positions, Requested);
+        for (Index=0; Index<NumDelimiters; Index++)
+        {
+            Line = &Parser->Text[Start];
+            Length = Base+Positions[Index]-Start;
+            Start = Base+Positions[Index]+1;
+
+            // BELL is not followed by CR : it is found at the beginning of the next line
+            while ((Length > 0) && ((*Line == '\a') || (*Line == '\n')))
+            {
+                if (*Line == '\a') Parser->Rejected++;
+                Line++;
+                Length--;
+            }
+            if (Length == 0) continue;      // Command accepted
+
+            if (decodeSLCANLine (Line, Length, &Frames[Count]))
+                Count++;
+            else if (memchr ("zZVvNF", *Line, 6) == 0)     // Not a frame sent, version, serial number or status answer
+                Parser->Errors++;
+        }
+    } while ((NumDelimiters == Requested) && (Count < MaxFrames));
+
+    // BELL waiting at the end of the text
+    while ((Start < Parser->Length) && (Parser->Text[Start] == '\a'))
+    {
+        Parser->Rejected++;
+        Start++;
+    }
+
+    // Keep the beginning of next line
+    if (Start > 0)
+    {
+        memmove (Parser->Text, &Parser->Text[Start], Parser->Length-Start);
+        Parser->Length -= Start;
+    }
+    else if (Parser->Length == SLCAN_TEXT_SIZE)
+    {   // Buffer full without delimiter : this is not SLCAN
+        Parser->Errors++;
+        Parser->Length = 0;
+    }
+    return Count;
+}  // decodeSLCANFrames
+// ------------------------------------------------------------
+
+int encodeSLCANFrame (unsigned int ID, unsigned int DLC, const unsigned char* Data, char* Text)
+{
+    uint32_t Header;
+    int Digits;
+    int Index;
+    int Length;
+
+    DLC &= 0x0F;
+    if (DLC > 8) DLC = 8;
+
+    if (ID & CBUS_EFF_FLAG)
+    {
+        Text[0] = (ID & CBUS_RTR_FLAG) ? 'R' : 'T';
+        Header = ID&0x1FFFFFFF;
+        Digits = 8;
+    }
+    else
+    {
+        Text[0] = (ID & CBUS_RTR_FLAG) ? 'r' : 't';
+        Header = ID&0x7FF;
+        Digits = 3;
+    }
+    for (Index=Digits; Index>=1; Index--)
+    {
+        Text[Index] = CBUSHexChars[Header&0x0F];
+        Header >>= 4;
+    }
+    Length = 1+Digits;
+    Text[Length++] = '0'+DLC;
+
+    if ((ID & CBUS_RTR_FLAG) == 0)
+    {
+        for (Index=0; Index<(int)DLC; Index++)
+        {
+            Text[Length++] = CBUSHexChars[Data[Index]>>4];
+            Text[Length++] = CBUSHexChars[Data[Index]&0x0F];
+        }
+    }
+    Text[Length++] = '\r';
+    return Length;
+}  // encodeSLCANFrame
+// ------------------------------------------------------------
+
+//! Record a serial port error. Errors meaning that the adapter is gone are reported as ENETDOWN
+static void setSLCANError (int Error)
+{
+    if ((Error == EIO) || (Error == ENXIO) || (Error == ENODEV) || (Error == EPIPE) || (Error == 0))
+        Error = ENETDOWN;
+    __atomic_store_n (&PortError, Error, __ATOMIC_RELAXED);
+}  // setSLCANError
+// ------------------------------------------------------------
+
+//! \return termios speed constant, B0 if Speed is not supported
+static speed_t getSLCANSpeed (int Speed)
+{
+    switch (Speed)
+    {
+        case 9600 : return B9600;
+        case 19200 : return B19200;
+        case 38400 : return B38400;
+        case 57600 : return B57600;
+        case 115200 : return B115200;
+        case 230400 : return B230400;
+        case 460800 : return B460800;
+        case 500000 : return B500000;
+        case 921600 : return B921600;
+        case 1000000 : return B1000000;
+        case 1500000 : return B1500000;
+        case 2000000 : return B2000000;
+        case 3000000 : return B3000000;
+        case 4000000 : return B4000000;
+        default : return B0;
+    }
+}  // getSLCANSpeed
+// ------------------------------------------------------------
+
+//! Send a configuration command and wait for the answer of the adapter
+// \return 0 if the command is accepted (CR), -1 if it is refused (BELL) or not answered
+static int sendSLCANCommand (const char* Command)
+{
+    char Text[8];
+    char Answer;
+    int Length;
+    int Count;
+    struct pollfd PollFD;
+
+    Length = snprintf (Text, sizeof(Text), "%s\r", Command);
+    if (write (PortHandle, Text, Length) != Length) return -1;
+
+    for (Count=0; Count<64; Count++)
+    {
+        PollFD.fd = PortHandle;
+        PollFD.events = POLLIN;
+        PollFD.revents = 0;
+        if (poll (&PollFD, 1, SLCAN_COMMAND_TIMEOUT) != 1) return -1;
+        if (read (PortHandle, &Answer, 1) != 1) return -1;
+        if (Answer == '\r') return 0;
+        if (Answer == '\a') return -1;
+    }
+    return -1;
+}  // sendSLCANCommand
+// ------------------------------------------------------------
+
+static void closeSLCAN (void)
+{
+    if (PortHandle != -1)
+    {
+        // Close the CAN channel, so the adapter does not keep frames until next open
+        if (write (PortHandle, "C\r", 2) == 2)
+            tcdrain (PortHandle);
+        tcsetattr (PortHandle, TCSANOW, &SavedSettings);
+        close (PortHandle);
+        PortHandle = -1;
+    }
+    Parser.Length = 0;
+    RXFrameCount = 0;
+    RXFrameIndex = 0;
+    TXLength = 0;
+    TXFrameCount = 0;
+    memset (&EchoRing, 0, sizeof(EchoRing));
+}  // closeSLCAN
+// ------------------------------------------------------------
+
+//! Open "device" or "device:speed" and open the CAN channel of the adapter
+static int createSLCAN (char* Name)
+{
+    char Device[64];
+    char Flush[64];
+    char* Colon;
+    speed_t Speed;
+    struct termios Settings;
+    struct serial_struct Serial;
+    struct pollfd PollFD;
+
+    closeSLCAN ();
+
+    strncpy (Device, Name, sizeof(Device)-1);
+    Device[sizeof(Device)-1] = 0;
+    Speed = getSLCANSpeed (SLCAN_DEFAULT_SPEED);
+    Colon = strrchr (Device, ':');
+    if (Colon != 0)
+    {
+        *Colon = 0;
+        Speed = getSLCANSpeed (atoi (Colon+1));
+        if (Speed == B0) return CBUS_ERR_SOCKET_ERROR;
+    }
+
+    PortHandle = open (Device, O_RDWR|O_NOCTTY|O_NONBLOCK);
+    if (PortHandle == -1) return CBUS_ERR_SOCKET_ERROR;
+    if (tcgetattr (PortHandle, &SavedSettings) != 0)
+    {
+        close (PortHandle);
+        PortHandle = -1;
+        return CBUS_ERR_SOCKET_ERROR;
+    }
+
+    // Raw mode : no echo, no line processing, no flow control. As the port is not blocking, read returns the
+    // characters available, EAGAIN if there is none (VMIN = 1) and 0 only when the adapter is unplugged
+    Settings = SavedSettings;
+    cfmakeraw (&Settings);
+    Settings.c_cflag |= CLOCAL|CREAD;
+    Settings.c_cflag &= ~CRTSCTS;
+    Settings.c_iflag &= ~(IXON|IXOFF|IXANY);
+    Settings.c_cc[VMIN] = 1;
+    Settings.c_cc[VTIME] = 0;
+    cfsetispeed (&Settings, Speed);
+    cfsetospeed (&Settings, Speed);
+    if (tcsetattr (PortHandle, TCSANOW, &Settings) != 0)
+    {
+        closeSLCAN ();
+        return CBUS_ERR_SOCKET_ERROR;
+    }
+
+    // USB serial converters give received characters every 16 ms, unless low latency is requested
+    if (ioctl (PortHandle, TIOCGSERIAL, &Serial) == 0)
+    {
+        Serial.flags |= ASYNC_LOW_LATENCY;
+        ioctl (PortHandle, TIOCSSERIAL, &Serial);
+    }
+
+    // Cancel a partial command and ignore the answers
+    if (write (PortHandle, "\r\r\r", 3) != 3)
+    {
+        closeSLCAN ();
+        return CBUS_ERR_CONNECT_ERROR;
+    }
+    PollFD.fd = PortHandle;
+    PollFD.events = POLLIN;
+    PollFD.revents = 0;
+    while (poll (&PollFD, 1, 50) == 1)
+    {
+        if (read (PortHandle, Flush, sizeof(Flush)) <= 0) break;
+    }
+
+    // CAN channel may still be open if the application has been stopped : close it before setting the bitrate
+    sendSLCANCommand ("C");
+    if ((sendSLCANCommand (BitrateCommand) != 0) || (sendSLCANCommand ("O") != 0))
+    {
+        closeSLCAN ();
+        return CBUS_ERR_CONNECT_ERROR;
+    }
+    return 0;
+}  // createSLCAN
+// ------------------------------------------------------------
+
+static void flushSLCAN (void)
+{
+    int Written;
+    int Offset;
+    int Index;
+    struct pollfd PollFD;
+
+    if ((PortHandle == -1) || (TXLength == 0)) return;
+
+    Offset = 0;
+    while (Offset < TXLength)
+    {
+        Written = write (PortHandle, &TXText[Offset], TXLength-Offset);
+        if (Written > 0)
+        {
+            Offset += Written;
+            continue;
+        }
+        if ((Written < 0) && (errno == EINTR)) continue;
+        if ((Written < 0) && (errno == EAGAIN))
+        {   // Serial port is slower than the bus : wait a little, then keep the remaining text for next flush
+            PollFD.fd = PortHandle;
+            PollFD.events = POLLOUT;
+            PollFD.revents = 0;
+            if (poll (&PollFD, 1, SLCAN_SEND_TIMEOUT) == 1) continue;
+            break;
+        }
+        setSLCANError ((Written < 0) ? errno : 0);
+        TXLength = 0;
+        TXFrameCount = 0;
+        return;
+    }
+
+    // Echo frames which have been completely written (echo is lost if the RX side does not read them)
+    for (Index=0; (Index < TXFrameCount) && (TXFrameEnd[Index] <= Offset); Index++)
+    {
+        if (!cbusRingPush (&EchoRing, TXFrames[Index].ID, TXFrames[Index].DLC, TXFrames[Index].Data))
+            __atomic_add_fetch (&DroppedFrames, 1, __ATOMIC_RELAXED);
+    }
+
+    memmove (TXText, &TXText[Offset], TXLength-Offset);
+    TXLength -= Offset;
+    memmove (TXFrames, &TXFrames[Index], (TXFrameCount-Index)*sizeof(TCBUSFrame));
+    memmove (TXFrameEnd, &TXFrameEnd[Index], (TXFrameCount-Index)*sizeof(int));
+    TXFrameCount -= Index;
+    for (Index=0; Index<TXFrameCount; Index++)
+        TXFrameEnd[Index] -= Offset;
+}  // flushSLCAN
+// ------------------------------------------------------------
+
+static int sendSLCAN (unsigned int ID, unsigned char DLC, unsigned char* Data)
+{
+    if (PortHandle == -1)
+    {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    if ((TXLength+SLCAN_MAX_FRAME > SLCAN_TEXT_SIZE) || (TXFrameCount >= SLCAN_TX_FRAMES))
+    {
+        flushSLCAN ();
+        if ((TXLength+SLCAN_MAX_FRAME > SLCAN_TEXT_SIZE) || (TXFrameCount >= SLCAN_TX_FRAMES))
+        {
+            errno = ENOBUFS;
+            return -1;
+        }
+    }
+
+    TXLength += encodeSLCANFrame (ID, DLC, Data, &TXText[TXLength]);
+    if (OwnFrames)
+    {
+        TXFrames[TXFrameCount].ID = ID;
+        TXFrames[TXFrameCount].DLC = DLC;
+        memcpy (TXFrames[TXFrameCount].Data, Data, ((DLC&0x0F) > 8) ? 8 : (DLC&0x0F));
+        TXFrameEnd[TXFrameCount] = TXLength;
+        TXFrameCount++;
+    }
+    return 0;
+}  // sendSLCAN
+// ------------------------------------------------------------
+
+//! Read and decode the text received from the adapter
+static void receiveSLCAN (void)
+{
+    int Received;
+
+    RXFrameIndex = 0;
+    RXFrameCount = decodeSLCANFrames (&Parser, RXFrames, SLCAN_MAX_BATCH);
+    if (RXFrameCount == 0)
+    {
+        Received = read (PortHandle, &Parser.Text[Parser.Length], SLCAN_TEXT_SIZE-Parser.Length);
+        if (Received <= 0)
+        {
+            if ((Received == 0) || ((errno != EAGAIN) && (errno != EINTR)))
+                setSLCANError ((Received < 0) ? errno : 0);
+            return;
+        }
+        Parser.Length += Received;
+        RXFrameCount = decodeSLCANFrames (&Parser, RXFrames, SLCAN_MAX_BATCH);
+    }
+
+    if (Parser.Errors+Parser.Rejected != ParserErrors)
+    {
+        __atomic_add_fetch (&DroppedFrames, Parser.Errors+Parser.Rejected-ParserErrors, __ATOMIC_RELAXED);
+        ParserErrors = Parser.Errors+Parser.Rejected;
+    }
+}  // receiveSLCAN
+// ------------------------------------------------------------
+
+static unsigned int getNextSLCANMessage (unsigned int* CANID, unsigned char* CANData)
+{
+    TCBUSFrame Frame;
+    TCBUSFrame* Next;
+
+    if (cbusRingPop (&EchoRing, &Frame))
+    {
+        *CANID = Frame.ID;
+        memcpy (CANData, Frame.Data, ((Frame.DLC&0x0F) > 8) ? 8 : (Frame.DLC&0x0F));
+        return Frame.DLC|CBUS_OWN_FRAME;
+    }
+
+    if (PortHandle == -1) return 0xFFFFFFFF;
+    if (RXFrameIndex >= RXFrameCount)
+    {
+        receiveSLCAN ();
+        if (RXFrameCount == 0) return 0xFFFFFFFF;
+    }
+
+    Next = &RXFrames[RXFrameIndex++];
+    *CANID = Next->ID;
+    if ((Next->ID & CBUS_RTR_FLAG) == 0)
+        memcpy (CANData, Next->Data, Next->DLC);
+    return Next->DLC;
+}  // getNextSLCANMessage
+// ------------------------------------------------------------
+
+static int waitSLCANMessage (int TimeoutMs)
+{
+    struct pollfd PollFD;
+    int Result;
+
+    if ((RXFrameIndex < RXFrameCount) || (EchoRing.Head != EchoRing.Tail)) return 1;
+    if (PortHandle == -1) return -1;
+
+    PollFD.fd = PortHandle;
+    PollFD.events = POLLIN;
+    PollFD.revents = 0;
+    Result = poll (&PollFD, 1, TimeoutMs);
+    if (Result <= 0) return Result;
+    if (PollFD.revents & POLLIN) return 1;
+    setSLCANError (ENETDOWN);       // Adapter unplugged
+    return -1;
+}  // waitSLCANMessage
+// ------------------------------------------------------------
+
+static int getSLCANError (void)
+{
+    return __atomic_exchange_n (&PortError, 0, __ATOMIC_RELAXED);
+}  // getSLCANError
+// ------------------------------------------------------------
+
+static unsigned int getSLCANDroppedFrames (void)
+{
+    return __atomic_exchange_n (&DroppedFrames, 0, __ATOMIC_RELAXED);
+}  // getSLCANDroppedFrames
+// ------------------------------------------------------------
+
+static int getSLCANHandle (void)
+{
+    return PortHandle;
+}  // getSLCANHandle
+// ------------------------------------------------------------
+
+static void setSLCANOwnFrames (int Enable)
+{
+    OwnFrames = Enable;
+}  // setSLCANOwnFrames
+// ------------------------------------------------------------
+
+const TCBUSTransport SLCANTransport = {
+    createSLCAN,
+    closeSLCAN,
+    getNextSLCANMessage,
+    waitSLCANMessage,
+    sendSLCAN,
+    flushSLCAN,
+    getSLCANError,
+    getSLCANDroppedFrames,
+    getSLCANHandle,
+    setSLCANOwnFrames
+};
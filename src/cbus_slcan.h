@@ -0,0 +1,57 @@
+/*
+cbus_slcan.h
+cbus2modbus
+CBUS through a serial CAN adapter using the SLCAN (Lawicel) ASCII protocol
+Development : Benoit BOUCHEZ - M8718
+*/
+
+#ifndef __CBUS_SLCAN_H__
+#define __CBUS_SLCAN_H__
+
+#include <stdint.h>
+#include "cbus_transport.h"
+#include "cbus_pipeline.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SLCAN_DEFAULT_SPEED     1000000     // Serial speed used when none is given (ignored by USB CDC adapters)
+#define SLCAN_MAX_FRAME         27          // 'T' + 8 ID digits + DLC + 16 data digits + CR
+#define SLCAN_TEXT_SIZE         4096
+#define SLCAN_MAX_BATCH         512         // Shortest frame ("t0000\r") is 6 characters
+
+//! Text received from a SLCAN adapter, not yet decoded
+typedef struct {
+    char Text[SLCAN_TEXT_SIZE];
+    int Length;
+    uint32_t Errors;                    // Lines which could not be decoded
+    uint32_t Rejected;                  // Commands refused by the adapter (BELL), including frames to send
+} TSLCANParser;
+
+//! Transport given to setCBUSTransport. Name given to createCBUSSocket is "device" or "device:speed" (/dev/ttyACM0:1000000)
+extern const TCBUSTransport SLCANTransport;
+
+//! CAN bitrate configured in the adapter by createCBUSSocket (default 125000)
+// \return 0 if the bitrate can be set with the 'S' command, -1 otherwise
+int setSLCANBitrate (unsigned int Bitrate);
+
+//! Decode the complete lines waiting in Parser->Text (received text is appended by the caller)
+// Answers of the adapter (CR, z, Z, BELL, version...) are skipped. Text of an incomplete line, or lines not
+// decoded because MaxFrames is reached, is kept for next call
+// \return number of frames written in Frames (ID has the same flags as getNextCBUSMessage)
+int decodeSLCANFrames (TSLCANParser* Parser, TCBUSFrame* Frames, int MaxFrames);
+
+//! Decode a frame line (t, T, r or R command) without its CR. A 4 digit timestamp after the data is ignored
+// \return 1 if frame is valid
+int decodeSLCANLine (const char* Text, int Length, TCBUSFrame* Frame);
+
+//! Encode a frame (ID can include CBUS_EFF_FLAG and CBUS_RTR_FLAG)
+// \return number of characters written in Text (SLCAN_MAX_FRAME maximum, not terminated by 0)
+int encodeSLCANFrame (unsigned int ID, unsigned int DLC, const unsigned char* Data, char* Text);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
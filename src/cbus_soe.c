@@ -0,0 +1,194 @@
+/*
+cbus_soe.c
+cbus2modbus
+Sequence of events recorder and latched inputs
+Development : Benoit BOUCHEZ - M8718
+
+If a sensor sends ACON then ACOF within one PLC poll period, the PLC never sees the pulse
+on the input. Two mechanisms are provided so short pulses are not missed :
+
++ Latched inputs
+Each edge on a latched input increments an edge counter. The latch bit is set while the
+edge counter is different from the acknowledged counter. When the latch is cleared, the
+acknowledged counter takes the value of the edge counter seen by the PLC : an edge occuring
+between the PLC read and the clear is therefore never lost.
+
++ Sequence of events
+All input changes are recorded with their timestamp in a ring buffer, readable as Modbus
+input registers. A client can poll slowly and rebuild the exact sequence, as long as fewer
+than CBUS_SOE_SIZE events occur between two reads.
+
+Edges and events are recorded by the CBUS thread when the frame is received. The ring has
+a single writer and is read without lock.
+*/
+
+#include <string.h>
+#include "cbus_soe.h"
+
+typedef struct {
+    uint32_t Sequence;
+    uint16_t Input;
+    uint8_t State;
+    uint64_t Timestamp;
+} TCBUSSOEEntry;
+
+static uint8_t LatchMode[NUM_CBUS_BOOL_INPUTS];
+static uint32_t RisingEdges[NUM_CBUS_BOOL_INPUTS];      // Written by CBUS thread only
+static uint32_t FallingEdges[NUM_CBUS_BOOL_INPUTS];
+static uint32_t RisingAcked[NUM_CBUS_BOOL_INPUTS];      // Written when latch is cleared
+static uint32_t FallingAcked[NUM_CBUS_BOOL_INPUTS];
+
+// Edge counters seen by the last read discrete inputs request (written by Modbus thread, used by clearCBUSLatches)
+static uint32_t RisingObserved[NUM_CBUS_BOOL_INPUTS];
+static uint32_t FallingObserved[NUM_CBUS_BOOL_INPUTS];
+static uint8_t RisingReadAsSet[NUM_CBUS_BOOL_INPUTS];
+static uint8_t FallingReadAsSet[NUM_CBUS_BOOL_INPUTS];
+
+static TCBUSSOEEntry SOERing[CBUS_SOE_SIZE];
+static uint32_t SOECount = 0;       // Number of events recorded since start
+
+void setCBUSLatchMode (int Input, int Mode)
+{
+    if ((Input < 0) || (Input >= NUM_CBUS_BOOL_INPUTS)) return;
+    LatchMode[Input] = Mode;
+}  // setCBUSLatchMode
+// ------------------------------------------------------------
+
+void recordCBUSInputChange (int Input, uint8_t State, uint64_t Timestamp)
+{
+    TCBUSSOEEntry* Entry;
+    uint32_t Count;
+
+    if ((Input < 0) || (Input >= NUM_CBUS_BOOL_INPUTS)) return;
+
+    if (LatchMode[Input] != CBUS_LATCH_NONE)
+    {
+        if (State)
+            __atomic_store_n (&RisingEdges[Input], RisingEdges[Input]+1, __ATOMIC_RELEASE);
+        else
+            __atomic_store_n (&FallingEdges[Input], FallingEdges[Input]+1, __ATOMIC_RELEASE);
+    }
+
+    // Entry is written before the counter is published
+    Count = SOECount;
+    Entry = &SOERing[Count & (CBUS_SOE_SIZE-1)];
+    Entry->Sequence = Count;
+    Entry->Input = Input;
+    Entry->State = State;
+    Entry->Timestamp = Timestamp;
+    __atomic_store_n (&SOECount, Count+1, __ATOMIC_RELEASE);
+}  // recordCBUSInputChange
+// ------------------------------------------------------------
+
+void exportCBUSLatches (uint8_t* RisingBits, uint8_t* FallingBits)
+{
+    int Input;
+
+    for (Input=0; Input<NUM_CBUS_BOOL_INPUTS; Input++)
+    {
+        if (LatchMode[Input] == CBUS_LATCH_NONE)
+        {
+            RisingBits[Input] = 0;
+            FallingBits[Input] = 0;
+            continue;
+        }
+        RisingBits[Input] = (__atomic_load_n (&RisingEdges[Input], __ATOMIC_ACQUIRE) != __atomic_load_n (&RisingAcked[Input], __ATOMIC_ACQUIRE));
+        FallingBits[Input] = (__atomic_load_n (&FallingEdges[Input], __ATOMIC_ACQUIRE) != __atomic_load_n (&FallingAcked[Input], __ATOMIC_ACQUIRE));
+    }
+}  // exportCBUSLatches
+// ------------------------------------------------------------
+
+//! Acknowledge edges up to the counter seen by the PLC. Acknowledged counter never goes backward
+// (observed counter is older than the last clear if the PLC did not read the latch since)
+static void acknowledgeCBUSEdges (uint32_t* Acked, uint32_t* Observed)
+{
+    uint32_t ObservedCount;
+
+    ObservedCount = __atomic_load_n (Observed, __ATOMIC_ACQUIRE);
+    if ((int32_t)(ObservedCount - __atomic_load_n (Acked, __ATOMIC_ACQUIRE)) > 0)
+        __atomic_store_n (Acked, ObservedCount, __ATOMIC_RELEASE);
+}  // acknowledgeCBUSEdges
+// ------------------------------------------------------------
+
+void clearCBUSLatches (int Input)
+{
+    if ((Input < 0) || (Input >= NUM_CBUS_BOOL_INPUTS)) return;
+
+    // Only edges seen by the last read are cleared, an edge occuring after the read stays latched
+    acknowledgeCBUSEdges (&RisingAcked[Input], &RisingObserved[Input]);
+    acknowledgeCBUSEdges (&FallingAcked[Input], &FallingObserved[Input]);
+}  // clearCBUSLatches
+// ------------------------------------------------------------
+
+void prepareCBUSLatchRead (uint8_t* InputBits, int Address, int Count)
+{
+    int Bit;
+    int Input;
+    uint32_t Observed;
+
+    memset (RisingReadAsSet, 0, sizeof(RisingReadAsSet));
+    memset (FallingReadAsSet, 0, sizeof(FallingReadAsSet));
+
+    for (Bit=Address; Bit<Address+Count; Bit++)
+    {
+        if ((Bit >= DI_RISING_LATCH_BASE) && (Bit < DI_FALLING_LATCH_BASE))
+        {
+            Input = Bit - DI_RISING_LATCH_BASE;
+            if (LatchMode[Input] == CBUS_LATCH_NONE) continue;
+            Observed = __atomic_load_n (&RisingEdges[Input], __ATOMIC_ACQUIRE);
+            __atomic_store_n (&RisingObserved[Input], Observed, __ATOMIC_RELEASE);
+            InputBits[Bit] = (Observed != __atomic_load_n (&RisingAcked[Input], __ATOMIC_ACQUIRE));
+            RisingReadAsSet[Input] = InputBits[Bit] && (LatchMode[Input] == CBUS_LATCH_CLEAR_ON_READ);
+        }
+        else if ((Bit >= DI_FALLING_LATCH_BASE) && (Bit < DI_SOE_END))
+        {
+            Input = Bit - DI_FALLING_LATCH_BASE;
+            if (LatchMode[Input] == CBUS_LATCH_NONE) continue;
+            Observed = __atomic_load_n (&FallingEdges[Input], __ATOMIC_ACQUIRE);
+            __atomic_store_n (&FallingObserved[Input], Observed, __ATOMIC_RELEASE);
+            InputBits[Bit] = (Observed != __atomic_load_n (&FallingAcked[Input], __ATOMIC_ACQUIRE));
+            FallingReadAsSet[Input] = InputBits[Bit] && (LatchMode[Input] == CBUS_LATCH_CLEAR_ON_READ);
+        }
+    }
+}  // prepareCBUSLatchRead
+// ------------------------------------------------------------
+
+void acknowledgeCBUSLatchRead (void)
+{
+    int Input;
+
+    for (Input=0; Input<NUM_CBUS_BOOL_INPUTS; Input++)
+    {
+        if (RisingReadAsSet[Input])
+            __atomic_store_n (&RisingAcked[Input], RisingObserved[Input], __ATOMIC_RELEASE);
+        if (FallingReadAsSet[Input])
+            __atomic_store_n (&FallingAcked[Input], FallingObserved[Input], __ATOMIC_RELEASE);
+        RisingReadAsSet[Input] = 0;
+        FallingReadAsSet[Input] = 0;
+    }
+}  // acknowledgeCBUSLatchRead
+// ------------------------------------------------------------
+
+void exportCBUSSOE (uint16_t* Registers)
+{
+    uint32_t Count;
+    int EntryCounter;
+    TCBUSSOEEntry* Entry;
+    uint16_t* Dest;
+
+    Count = __atomic_load_n (&SOECount, __ATOMIC_ACQUIRE);
+    Registers[0] = Count>>16;
+    Registers[1] = Count&0xFFFF;
+    Registers[2] = CBUS_SOE_SIZE;
+
+    for (EntryCounter=0; EntryCounter<CBUS_SOE_SIZE; EntryCounter++)
+    {
+        Entry = &SOERing[EntryCounter];
+        Dest = &Registers[CBUS_SOE_HEADER_REGISTERS+(EntryCounter*CBUS_SOE_ENTRY_REGISTERS)];
+        Dest[0] = Entry->Sequence & 0xFFFF;
+        Dest[1] = (Entry->Input & 0x7FFF) | (Entry->State ? 0x8000 : 0);
+        Dest[2] = (Entry->Timestamp>>16) & 0xFFFF;
+        Dest[3] = Entry->Timestamp & 0xFFFF;
+    }
+}  // exportCBUSSOE
+// ------------------------------------------------------------
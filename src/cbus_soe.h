@@ -0,0 +1,73 @@
+/*
+cbus_soe.h
+cbus2modbus
+Sequence of events recorder and latched inputs
+Development : Benoit BOUCHEZ - M8718
+*/
+
+#ifndef __CBUS_SOE_H__
+#define __CBUS_SOE_H__
+
+#include <stdint.h>
+#include "cbus_io.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Latch modes for inputs (fourth parameter in cbus_inputs.dat)
+#define CBUS_LATCH_NONE             0
+#define CBUS_LATCH_CLEAR_ON_READ    1       // "latch" : latch bits are cleared when the PLC reads them
+#define CBUS_LATCH_CLEAR_BY_COIL    2       // "latch-coil" : latch bits are only cleared by the PLC writing the clear coil
+
+// Discrete inputs map
+#define DI_RISING_LATCH_BASE        NUM_CBUS_BOOL_INPUTS            // Set when input goes from 0 to 1
+#define DI_FALLING_LATCH_BASE       (2*NUM_CBUS_BOOL_INPUTS)        // Set when input goes from 1 to 0
+#define DI_SOE_END                  (3*NUM_CBUS_BOOL_INPUTS)
+
+// Coils map
+#define COIL_LATCH_CLEAR_BASE       NUM_CBUS_BOOL_OUTPUTS           // Writing 1 clears both latches of the input
+#define COIL_SOE_END                (NUM_CBUS_BOOL_OUTPUTS+NUM_CBUS_BOOL_INPUTS)
+
+//! Number of events kept in the sequence of events ring (must be a power of 2)
+#define CBUS_SOE_SIZE               64
+
+// Sequence of events as input registers
+// Register 0-1 : number of events recorded since start (32 bits, high word first)
+// Register 2 : number of entries in the ring
+// Then CBUS_SOE_SIZE entries of 4 registers. Event number N is in entry N % CBUS_SOE_SIZE
+//   - low 16 bits of event number (to check that the entry has not been overwritten)
+//   - input number in bits 0-14, new state in bit 15
+//   - timestamp in microseconds, low 32 bits (high word first)
+#define CBUS_SOE_HEADER_REGISTERS   3
+#define CBUS_SOE_ENTRY_REGISTERS    4
+#define CBUS_SOE_REGISTERS          (CBUS_SOE_HEADER_REGISTERS+(CBUS_SOE_SIZE*CBUS_SOE_ENTRY_REGISTERS))
+
+//! Select latch mode for an input
+void setCBUSLatchMode (int Input, int Mode);
+
+//! Record input change in the sequence of events and update latches (called when the CBUS frame is received)
+void recordCBUSInputChange (int Input, uint8_t State, uint64_t Timestamp);
+
+//! Get current latch bits for the PLC image
+void exportCBUSLatches (uint8_t* RisingBits, uint8_t* FallingBits);
+
+//! Clear both latches of an input (clear coil written by the PLC) : edges counted after the last prepareCBUSLatchRead stay latched
+void clearCBUSLatches (int Input);
+
+//! Called by Modbus thread before answering a read discrete inputs request
+// Latch bits in the requested range are updated in InputBits, and their state is remembered for acknowledgeCBUSLatchRead
+void prepareCBUSLatchRead (uint8_t* InputBits, int Address, int Count);
+
+//! Called by Modbus thread after the answer has been built : latches read as 1 are cleared (clear on read mode)
+// A new edge occuring after prepareCBUSLatchRead stays latched
+void acknowledgeCBUSLatchRead (void);
+
+//! Copy sequence of events to input registers (CBUS_SOE_REGISTERS registers)
+void exportCBUSSOE (uint16_t* Registers);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
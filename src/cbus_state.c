@@ -0,0 +1,181 @@
+/*
+cbus_state.c
+cbus2modbus
+Persistent I/O state for warm restart
+Development : Benoit BOUCHEZ - M8718
+
+The last known input and output states are kept in a memory mapped file, so they can be
+restored immediately when cbus2modbus restarts instead of being all 0 until the AREQ answers
+are received.
+
+The file contains two slots. Each save is written in the slot not holding the latest image,
+with a sequence number and a CRC. If cbus2modbus (or the machine) stops in the middle of
+a write, the CRC of this slot is wrong and the other slot is used at next start.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "cbus_state.h"
+
+#define CBUS_STATE_MAGIC        0x43425354      // 'CBST'
+#define CBUS_STATE_VERSION      1
+#define CBUS_STATE_SLOTS        2
+
+typedef struct {
+    uint32_t Sequence;          // Latest image is in the valid slot with the highest sequence
+    uint32_t CRC;               // CRC32 of Image
+    TCBUSStateImage Image;
+} TCBUSStateSlot;
+
+typedef struct {
+    uint32_t Magic;
+    uint32_t Version;
+    uint32_t NumInputs;
+    uint32_t NumOutputs;
+    TCBUSStateSlot Slots[CBUS_STATE_SLOTS];
+} TCBUSStateFile;
+
+char CBUSStateFile[256] = "";
+
+static TCBUSStateFile* StateFile = 0;
+static uint32_t CRCTable[256];
+static uint32_t LastSequence = 0;
+static int LastSlot = -1;
+
+static void initCRCTable (void)
+{
+    uint32_t Value;
+    int Counter;
+    int Bit;
+
+    for (Counter=0; Counter<256; Counter++)
+    {
+        Value = Counter;
+        for (Bit=0; Bit<8; Bit++)
+            Value = (Value & 1) ? (0xEDB88320 ^ (Value>>1)) : (Value>>1);
+        CRCTable[Counter] = Value;
+    }
+}  // initCRCTable
+// ------------------------------------------------------------
+
+static uint32_t computeCRC (const uint8_t* Data, int Length)
+{
+    uint32_t CRC = 0xFFFFFFFF;
+
+    while (Length--)
+        CRC = CRCTable[(CRC ^ *Data++) & 0xFF] ^ (CRC>>8);
+    return CRC ^ 0xFFFFFFFF;
+}  // computeCRC
+// ------------------------------------------------------------
+
+int openCBUSStateFile (void)
+{
+    int FD;
+    void* Map;
+    int NewFile = 0;
+
+    closeCBUSStateFile ();
+    if (CBUSStateFile[0] == 0) return -1;
+
+    initCRCTable ();
+
+    FD = open (CBUSStateFile, O_RDWR|O_CREAT, 0644);
+    if (FD == -1) return -1;
+
+    if (lseek (FD, 0, SEEK_END) != sizeof(TCBUSStateFile))
+    {   // New file, or file created by another version
+        NewFile = 1;
+        if ((ftruncate (FD, 0) != 0) || (ftruncate (FD, sizeof(TCBUSStateFile)) != 0))
+        {
+            close (FD);
+            return -1;
+        }
+    }
+
+    Map = mmap (0, sizeof(TCBUSStateFile), PROT_READ|PROT_WRITE, MAP_SHARED, FD, 0);
+    close (FD);
+    if (Map == MAP_FAILED) return -1;
+    StateFile = (TCBUSStateFile*)Map;
+
+    if ((NewFile) || (StateFile->Magic != CBUS_STATE_MAGIC) || (StateFile->Version != CBUS_STATE_VERSION) ||
+        (StateFile->NumInputs != NUM_CBUS_BOOL_INPUTS) || (StateFile->NumOutputs != NUM_CBUS_BOOL_OUTPUTS))
+    {
+        memset (StateFile, 0, sizeof(TCBUSStateFile));
+        StateFile->Magic = CBUS_STATE_MAGIC;
+        StateFile->Version = CBUS_STATE_VERSION;
+        StateFile->NumInputs = NUM_CBUS_BOOL_INPUTS;
+        StateFile->NumOutputs = NUM_CBUS_BOOL_OUTPUTS;
+        msync (StateFile, sizeof(TCBUSStateFile), MS_SYNC);
+    }
+
+    LastSequence = 0;
+    LastSlot = -1;
+    return 0;
+}  // openCBUSStateFile
+// ------------------------------------------------------------
+
+void closeCBUSStateFile (void)
+{
+    if (StateFile == 0) return;
+
+    msync (StateFile, sizeof(TCBUSStateFile), MS_SYNC);
+    munmap (StateFile, sizeof(TCBUSStateFile));
+    StateFile = 0;
+}  // closeCBUSStateFile
+// ------------------------------------------------------------
+
+int loadCBUSState (TCBUSStateImage* Image)
+{
+    int Slot;
+    TCBUSStateSlot* Current;
+
+    if (StateFile == 0) return 0;
+
+    LastSlot = -1;
+    LastSequence = 0;
+    for (Slot=0; Slot<CBUS_STATE_SLOTS; Slot++)
+    {
+        Current = &StateFile->Slots[Slot];
+        if (Current->Sequence == 0) continue;       // Slot never written
+        if (computeCRC ((const uint8_t*)&Current->Image, sizeof(TCBUSStateImage)) != Current->CRC) continue;
+        if ((LastSlot == -1) || ((int32_t)(Current->Sequence - LastSequence) > 0))
+        {
+            LastSlot = Slot;
+            LastSequence = Current->Sequence;
+        }
+    }
+
+    if (LastSlot == -1) return 0;
+    memcpy (Image, &StateFile->Slots[LastSlot].Image, sizeof(TCBUSStateImage));
+    return 1;
+}  // loadCBUSState
+// ------------------------------------------------------------
+
+void saveCBUSState (const TCBUSStateImage* Image)
+{
+    int Slot;
+    TCBUSStateSlot* Target;
+
+    if (StateFile == 0) return;
+
+    Slot = (LastSlot+1) % CBUS_STATE_SLOTS;
+    Target = &StateFile->Slots[Slot];
+
+    // Slot is invalidated before it is modified, then sequence is written after the data
+    Target->Sequence = 0;
+    __atomic_thread_fence (__ATOMIC_RELEASE);
+    memcpy (&Target->Image, Image, sizeof(TCBUSStateImage));
+    Target->CRC = computeCRC ((const uint8_t*)Image, sizeof(TCBUSStateImage));
+    __atomic_thread_fence (__ATOMIC_RELEASE);
+    LastSequence++;
+    if (LastSequence == 0) LastSequence = 1;
+    Target->Sequence = LastSequence;
+    LastSlot = Slot;
+
+    // Data is in the page cache : it survives a crash of cbus2modbus. Ask the kernel to write it to disk
+    msync (StateFile, sizeof(TCBUSStateFile), MS_ASYNC);
+}  // saveCBUSState
+// ------------------------------------------------------------
@@ -0,0 +1,51 @@
+/*
+cbus_state.h
+cbus2modbus
+Persistent I/O state for warm restart
+Development : Benoit BOUCHEZ - M8718
+*/
+
+#ifndef __CBUS_STATE_H__
+#define __CBUS_STATE_H__
+
+#include <stdint.h>
+#include "cbus_io.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//! State of one input or output. Event is stored so a state is not restored if configuration has changed
+typedef struct {
+    uint16_t NN;
+    uint16_t EN;
+    uint8_t State;
+    uint8_t Valid;
+} TCBUSStateEntry;
+
+typedef struct {
+    TCBUSStateEntry Inputs[NUM_CBUS_BOOL_INPUTS];
+    TCBUSStateEntry Outputs[NUM_CBUS_BOOL_OUTPUTS];
+} TCBUSStateImage;
+
+//! Path of the state file (empty = state is not saved)
+extern char CBUSStateFile[256];
+
+//! Open (or create) and map the state file
+// \return 0 if file is available
+int openCBUSStateFile (void);
+
+void closeCBUSStateFile (void);
+
+//! Get the last image saved
+// \return 1 if a valid image has been found in the file
+int loadCBUSState (TCBUSStateImage* Image);
+
+//! Save image in the file
+void saveCBUSState (const TCBUSStateImage* Image);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
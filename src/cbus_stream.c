@@ -0,0 +1,474 @@
+/*
+cbus_stream.c
+cbus2modbus
+Delta streaming server for HMIs and dashboards
+Development : Benoit BOUCHEZ - M8718
+
+Dashboards connect to a TCP port or a Unix socket and send one subscription byte ('S').
+The server then sends the complete image of all inputs and outputs (between SNAPSHOT_BEGIN
+and SNAPSHOT_END records), followed by one record each time an input or output changes.
+
+Each client has its own "dirty" flag per input and output. A change only sets the flag,
+records are built from the current state when the client socket can accept more data.
+A slow client therefore never blocks the gateway : if an input changes several times before
+the client reads, the client only receives the last state (changes are coalesced).
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include "cbus_stream.h"
+#include "cbus_io.h"
+
+#define STREAM_MAX_CLIENTS      8
+#define STREAM_BUFFER_SIZE      (CBUS_STREAM_RECORD_SIZE*128)
+
+#define SNAPSHOT_NONE           0
+#define SNAPSHOT_REQUESTED      1       // Client has subscribed, begin marker not sent yet
+#define SNAPSHOT_IN_PROGRESS    2       // Begin marker sent, end marker not sent yet
+
+typedef struct {
+    int Socket;                     // -1 = slot is free
+    int Subscribed;
+    int SnapshotPending;            // SNAPSHOT_xxx
+    uint8_t DirtyInputs[NUM_CBUS_BOOL_INPUTS];
+    uint8_t DirtyOutputs[NUM_CBUS_BOOL_OUTPUTS];
+    uint8_t OutBuffer[STREAM_BUFFER_SIZE];
+    int OutLength;
+    int OutOffset;
+} TStreamClient;
+
+static TStreamClient StreamClients[STREAM_MAX_CLIENTS];
+static int TCPListenSocket = -1;
+static int UnixListenSocket = -1;
+static char UnixSocketPath[108] = "";
+static int WakePipe[2] = {-1, -1};
+static int WakePending = 0;
+
+static pthread_t StreamThread;
+static pthread_mutex_t StreamLock = PTHREAD_MUTEX_INITIALIZER;
+static volatile int StreamStopRequest = 0;
+static int StreamRunning = 0;
+
+// Last known state and change time, protected by StreamLock
+static uint8_t InputState[NUM_CBUS_BOOL_INPUTS];
+static uint64_t InputTime[NUM_CBUS_BOOL_INPUTS];
+static uint8_t OutputState[NUM_CBUS_BOOL_OUTPUTS];
+static uint64_t OutputTime[NUM_CBUS_BOOL_OUTPUTS];
+
+static void writeRecord (uint8_t* Dest, int Type, int Index, uint8_t State, uint64_t Timestamp)
+{
+    int ByteCounter;
+
+    Dest[0] = Type;
+    Dest[1] = State;
+    Dest[2] = Index>>8;
+    Dest[3] = Index&0xFF;
+    for (ByteCounter=0; ByteCounter<8; ByteCounter++)
+    {
+        Dest[4+ByteCounter] = (Timestamp >> (56-(ByteCounter*8))) & 0xFF;
+    }
+}  // writeRecord
+// ------------------------------------------------------------
+
+static void closeClient (TStreamClient* Client)
+{
+    if (Client->Socket != -1) close (Client->Socket);
+    Client->Socket = -1;
+    Client->Subscribed = 0;
+}  // closeClient
+// ------------------------------------------------------------
+
+static void acceptClient (int ListenSocket)
+{
+    int NewSocket;
+    int ClientCounter;
+    int Flags;
+    TStreamClient* Client;
+
+    NewSocket = accept (ListenSocket, NULL, NULL);
+    if (NewSocket == -1) return;
+
+    for (ClientCounter=0; ClientCounter<STREAM_MAX_CLIENTS; ClientCounter++)
+    {
+        Client = &StreamClients[ClientCounter];
+        if (Client->Socket == -1)
+        {
+            Flags = fcntl (NewSocket, F_GETFL, 0);
+            fcntl (NewSocket, F_SETFL, Flags | O_NONBLOCK);
+
+            pthread_mutex_lock (&StreamLock);
+            Client->Socket = NewSocket;
+            Client->Subscribed = 0;
+            Client->SnapshotPending = SNAPSHOT_NONE;
+            Client->OutLength = 0;
+            Client->OutOffset = 0;
+            pthread_mutex_unlock (&StreamLock);
+
+            if (VerbosityLevel > 0)
+                fprintf (stdout, "Streaming client connected\n");
+            return;
+        }
+    }
+
+    close (NewSocket);      // No room for a new client
+}  // acceptClient
+// ------------------------------------------------------------
+
+//! Fill client output buffer with pending records (called with StreamLock held)
+static void buildRecords (TStreamClient* Client)
+{
+    int Index;
+
+    Client->OutLength = 0;
+    Client->OutOffset = 0;
+
+    if (Client->SnapshotPending == SNAPSHOT_REQUESTED)
+    {
+        // Complete image is sent by marking all inputs and outputs as dirty
+        writeRecord (&Client->OutBuffer[0], CBUS_STREAM_SNAPSHOT_BEGIN, 0, 0, getCBUSTimestamp());
+        Client->OutLength = CBUS_STREAM_RECORD_SIZE;
+        memset (Client->DirtyInputs, 1, sizeof(Client->DirtyInputs));
+        memset (Client->DirtyOutputs, 1, sizeof(Client->DirtyOutputs));
+        Client->SnapshotPending = SNAPSHOT_IN_PROGRESS;
+    }
+
+    for (Index=0; Index<NUM_CBUS_BOOL_INPUTS; Index++)
+    {
+        if (Client->OutLength > STREAM_BUFFER_SIZE-CBUS_STREAM_RECORD_SIZE) return;
+        if (Client->DirtyInputs[Index])
+        {
+            writeRecord (&Client->OutBuffer[Client->OutLength], CBUS_STREAM_INPUT, Index, InputState[Index], InputTime[Index]);
+            Client->OutLength += CBUS_STREAM_RECORD_SIZE;
+            Client->DirtyInputs[Index] = 0;
+        }
+    }
+
+    for (Index=0; Index<NUM_CBUS_BOOL_OUTPUTS; Index++)
+    {
+        if (Client->OutLength > STREAM_BUFFER_SIZE-CBUS_STREAM_RECORD_SIZE) return;
+        if (Client->DirtyOutputs[Index])
+        {
+            writeRecord (&Client->OutBuffer[Client->OutLength], CBUS_STREAM_OUTPUT, Index, OutputState[Index], OutputTime[Index]);
+            Client->OutLength += CBUS_STREAM_RECORD_SIZE;
+            Client->DirtyOutputs[Index] = 0;
+        }
+    }
+
+    // All dirty flags have been processed : image is complete
+    if ((Client->SnapshotPending == SNAPSHOT_IN_PROGRESS) && (Client->OutLength <= STREAM_BUFFER_SIZE-CBUS_STREAM_RECORD_SIZE))
+    {
+        writeRecord (&Client->OutBuffer[Client->OutLength], CBUS_STREAM_SNAPSHOT_END, 0, 0, getCBUSTimestamp());
+        Client->OutLength += CBUS_STREAM_RECORD_SIZE;
+        Client->SnapshotPending = SNAPSHOT_NONE;
+    }
+}  // buildRecords
+// ------------------------------------------------------------
+
+//! Send as much data as the client socket accepts without blocking
+static void flushClient (TStreamClient* Client)
+{
+    int Sent;
+
+    while (1)
+    {
+        if (Client->OutOffset >= Client->OutLength)
+        {
+            pthread_mutex_lock (&StreamLock);
+            buildRecords (Client);
+            pthread_mutex_unlock (&StreamLock);
+            if (Client->OutLength == 0) return;     // Nothing more to send
+        }
+
+        Sent = send (Client->Socket, &Client->OutBuffer[Client->OutOffset], Client->OutLength-Client->OutOffset, MSG_NOSIGNAL);
+        if (Sent < 0)
+        {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return;   // Client is slow : changes will be coalesced
+            if (errno == EINTR) continue;
+            closeClient (Client);
+            return;
+        }
+        Client->OutOffset += Sent;
+    }
+}  // flushClient
+// ------------------------------------------------------------
+
+static void* CBUSStreamThreadFunc (void* Param)
+{
+    struct pollfd PollFD[STREAM_MAX_CLIENTS+3];
+    int ClientFD[STREAM_MAX_CLIENTS+3];     // Client index for each poll entry (-1 = not a client)
+    int NumFD;
+    int FDCounter;
+    int ClientCounter;
+    TStreamClient* Client;
+    uint8_t Command[64];
+    int Received;
+    int ByteCounter;
+    int Ready;
+
+    while (StreamStopRequest == 0)
+    {
+        NumFD = 0;
+        PollFD[NumFD].fd = WakePipe[0];
+        PollFD[NumFD].events = POLLIN;
+        ClientFD[NumFD++] = -1;
+        if (TCPListenSocket != -1)
+        {
+            PollFD[NumFD].fd = TCPListenSocket;
+            PollFD[NumFD].events = POLLIN;
+            ClientFD[NumFD++] = -1;
+        }
+        if (UnixListenSocket != -1)
+        {
+            PollFD[NumFD].fd = UnixListenSocket;
+            PollFD[NumFD].events = POLLIN;
+            ClientFD[NumFD++] = -1;
+        }
+        for (ClientCounter=0; ClientCounter<STREAM_MAX_CLIENTS; ClientCounter++)
+        {
+            Client = &StreamClients[ClientCounter];
+            if (Client->Socket == -1) continue;
+            PollFD[NumFD].fd = Client->Socket;
+            PollFD[NumFD].events = POLLIN;
+            if (Client->OutOffset < Client->OutLength) PollFD[NumFD].events |= POLLOUT;
+            ClientFD[NumFD++] = ClientCounter;
+        }
+
+        // Timeout is used to check if thread has to stop. Clients are flushed on timeout too
+        Ready = poll (PollFD, NumFD, 100);
+
+        for (FDCounter=0; (Ready > 0) && (FDCounter<NumFD); FDCounter++)
+        {
+            if (PollFD[FDCounter].revents == 0) continue;
+
+            if (PollFD[FDCounter].fd == WakePipe[0])
+            {
+                // Pipe is emptied before the flag is cleared : a notification coming after this point
+                // writes a new byte, a notification coming before is sent by the flush below
+                while (read (WakePipe[0], Command, sizeof(Command)) > 0);
+                __atomic_store_n (&WakePending, 0, __ATOMIC_SEQ_CST);
+            }
+            else if (ClientFD[FDCounter] == -1)
+            {
+                acceptClient (PollFD[FDCounter].fd);
+            }
+            else
+            {
+                Client = &StreamClients[ClientFD[FDCounter]];
+                if (PollFD[FDCounter].revents & (POLLIN|POLLHUP|POLLERR))
+                {
+                    Received = recv (Client->Socket, Command, sizeof(Command), 0);
+                    if ((Received == 0) || ((Received < 0) && (errno != EAGAIN) && (errno != EINTR)))
+                    {
+                        if (VerbosityLevel > 0)
+                            fprintf (stdout, "Streaming client disconnected\n");
+                        closeClient (Client);
+                        continue;
+                    }
+                    for (ByteCounter=0; ByteCounter<Received; ByteCounter++)
+                    {
+                        if ((Command[ByteCounter] == CBUS_STREAM_SUBSCRIBE) && (Client->Subscribed == 0))
+                        {
+                            pthread_mutex_lock (&StreamLock);
+                            Client->Subscribed = 1;
+                            Client->SnapshotPending = SNAPSHOT_REQUESTED;
+                            pthread_mutex_unlock (&StreamLock);
+                        }
+                    }
+                }
+            }
+        }
+
+        // Send pending records to all subscribed clients
+        for (ClientCounter=0; ClientCounter<STREAM_MAX_CLIENTS; ClientCounter++)
+        {
+            Client = &StreamClients[ClientCounter];
+            if ((Client->Socket != -1) && (Client->Subscribed))
+                flushClient (Client);
+        }
+    }
+
+    return 0;
+}  // CBUSStreamThreadFunc
+// ------------------------------------------------------------
+
+static int createListenSocket (int Port, const char* SocketPath)
+{
+    int Socket;
+    int Enable = 1;
+    int Flags;
+    struct sockaddr_in TCPAddress;
+    struct sockaddr_un UnixAddress;
+
+    if (SocketPath)
+    {
+        Socket = socket (AF_UNIX, SOCK_STREAM, 0);
+        if (Socket == -1) return -1;
+
+        memset (&UnixAddress, 0, sizeof(UnixAddress));
+        UnixAddress.sun_family = AF_UNIX;
+        strncpy (UnixAddress.sun_path, SocketPath, sizeof(UnixAddress.sun_path)-1);
+        unlink (UnixAddress.sun_path);      // Remove socket file left by a previous instance
+        if (bind (Socket, (struct sockaddr*)&UnixAddress, sizeof(UnixAddress)) < 0)
+        {
+            close (Socket);
+            return -1;
+        }
+    }
+    else
+    {
+        Socket = socket (AF_INET, SOCK_STREAM, 0);
+        if (Socket == -1) return -1;
+
+        setsockopt (Socket, SOL_SOCKET, SO_REUSEADDR, &Enable, sizeof(Enable));
+        memset (&TCPAddress, 0, sizeof(TCPAddress));
+        TCPAddress.sin_family = AF_INET;
+        TCPAddress.sin_addr.s_addr = htonl (INADDR_ANY);
+        TCPAddress.sin_port = htons (Port);
+        if (bind (Socket, (struct sockaddr*)&TCPAddress, sizeof(TCPAddress)) < 0)
+        {
+            close (Socket);
+            return -1;
+        }
+    }
+
+    if (listen (Socket, STREAM_MAX_CLIENTS) < 0)
+    {
+        close (Socket);
+        return -1;
+    }
+
+    Flags = fcntl (Socket, F_GETFL, 0);
+    fcntl (Socket, F_SETFL, Flags | O_NONBLOCK);
+    return Socket;
+}  // createListenSocket
+// ------------------------------------------------------------
+
+int startCBUSStream (int Port, const char* SocketPath)
+{
+    int ClientCounter;
+
+    if (StreamRunning) return 0;
+    if ((SocketPath) && (SocketPath[0] == 0)) SocketPath = 0;
+    if ((Port == 0) && (SocketPath == 0)) return 0;      // Streaming is not enabled
+
+    for (ClientCounter=0; ClientCounter<STREAM_MAX_CLIENTS; ClientCounter++)
+    {
+        StreamClients[ClientCounter].Socket = -1;
+        StreamClients[ClientCounter].Subscribed = 0;
+    }
+
+    if (Port != 0)
+    {
+        TCPListenSocket = createListenSocket (Port, 0);
+        if (TCPListenSocket == -1)
+        {
+            stopCBUSStream ();
+            return -1;
+        }
+    }
+
+    if (SocketPath)
+    {
+        UnixListenSocket = createListenSocket (0, SocketPath);
+        if (UnixListenSocket == -1)
+        {
+            stopCBUSStream ();
+            return -1;
+        }
+        strncpy (UnixSocketPath, SocketPath, sizeof(UnixSocketPath)-1);
+    }
+
+    if (pipe (WakePipe) != 0)
+    {
+        stopCBUSStream ();
+        return -1;
+    }
+    fcntl (WakePipe[0], F_SETFL, fcntl (WakePipe[0], F_GETFL, 0) | O_NONBLOCK);
+    fcntl (WakePipe[1], F_SETFL, fcntl (WakePipe[1], F_GETFL, 0) | O_NONBLOCK);
+
+    StreamStopRequest = 0;
+    if (pthread_create (&StreamThread, NULL, CBUSStreamThreadFunc, NULL) != 0)
+    {
+        stopCBUSStream ();
+        return -1;
+    }
+
+    StreamRunning = 1;
+    return 0;
+}  // startCBUSStream
+// ------------------------------------------------------------
+
+void stopCBUSStream (void)
+{
+    int ClientCounter;
+
+    if (StreamRunning)
+    {
+        StreamStopRequest = 1;
+        pthread_join (StreamThread, NULL);
+        StreamRunning = 0;
+    }
+
+    for (ClientCounter=0; ClientCounter<STREAM_MAX_CLIENTS; ClientCounter++)
+    {
+        closeClient (&StreamClients[ClientCounter]);
+    }
+
+    if (TCPListenSocket != -1) close (TCPListenSocket);
+    TCPListenSocket = -1;
+    if (UnixListenSocket != -1)
+    {
+        close (UnixListenSocket);
+        unlink (UnixSocketPath);
+    }
+    UnixListenSocket = -1;
+    if (WakePipe[0] != -1) close (WakePipe[0]);
+    if (WakePipe[1] != -1) close (WakePipe[1]);
+    WakePipe[0] = -1;
+    WakePipe[1] = -1;
+}  // stopCBUSStream
+// ------------------------------------------------------------
+
+void notifyCBUSStream (int Type, int Index, uint8_t State)
+{
+    int ClientCounter;
+    uint64_t Timestamp;
+    uint8_t WakeByte = 1;
+
+    if (StreamRunning == 0) return;
+
+    Timestamp = getCBUSTimestamp ();
+
+    pthread_mutex_lock (&StreamLock);
+    if ((Type == CBUS_STREAM_INPUT) && (Index < NUM_CBUS_BOOL_INPUTS))
+    {
+        InputState[Index] = State;
+        InputTime[Index] = Timestamp;
+        for (ClientCounter=0; ClientCounter<STREAM_MAX_CLIENTS; ClientCounter++)
+            StreamClients[ClientCounter].DirtyInputs[Index] = 1;
+    }
+    else if ((Type == CBUS_STREAM_OUTPUT) && (Index < NUM_CBUS_BOOL_OUTPUTS))
+    {
+        OutputState[Index] = State;
+        OutputTime[Index] = Timestamp;
+        for (ClientCounter=0; ClientCounter<STREAM_MAX_CLIENTS; ClientCounter++)
+            StreamClients[ClientCounter].DirtyOutputs[Index] = 1;
+    }
+    pthread_mutex_unlock (&StreamLock);
+
+    // Only one wake up byte is needed until the thread has processed it
+    if (__atomic_exchange_n (&WakePending, 1, __ATOMIC_SEQ_CST) == 0)
+    {
+        if (write (WakePipe[1], &WakeByte, 1) < 0)
+            __atomic_store_n (&WakePending, 0, __ATOMIC_SEQ_CST);
+    }
+}  // notifyCBUSStream
+// ------------------------------------------------------------
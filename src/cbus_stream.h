@@ -0,0 +1,49 @@
+/*
+cbus_stream.h
+cbus2modbus
+Delta streaming server for HMIs and dashboards
+Development : Benoit BOUCHEZ - M8718
+*/
+
+#ifndef __CBUS_STREAM_H__
+#define __CBUS_STREAM_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Record types
+#define CBUS_STREAM_INPUT           0x01        // Index is a PLC input number
+#define CBUS_STREAM_OUTPUT          0x02        // Index is a PLC output number
+#define CBUS_STREAM_SNAPSHOT_BEGIN  0x10        // Following records are the complete image
+#define CBUS_STREAM_SNAPSHOT_END    0x11        // End of complete image, next records are deltas
+
+//! Size of a record on the stream. All fields are big endian
+// Byte 0 : record type
+// Byte 1 : state (0 or 1)
+// Bytes 2-3 : index
+// Bytes 4-11 : timestamp of the change in microseconds (monotonic clock of the gateway)
+#define CBUS_STREAM_RECORD_SIZE     12
+
+//! Byte sent by a client to subscribe
+#define CBUS_STREAM_SUBSCRIBE       'S'
+
+//! Starts streaming server
+// \param Port TCP port (0 = no TCP server)
+// \param SocketPath Unix socket path (NULL or empty = no Unix socket server)
+// \return 0 if server is running or disabled
+int startCBUSStream (int Port, const char* SocketPath);
+
+//! Stops streaming server and disconnects all clients
+void stopCBUSStream (void);
+
+//! Report a change of input or output state to subscribed clients
+void notifyCBUSStream (int Type, int Index, uint8_t State);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
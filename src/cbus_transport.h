@@ -0,0 +1,46 @@
+/*
+cbus_transport.h
+cbus2modbus
+Access to the CBUS through other links than a SocketCAN interface
+Development : Benoit BOUCHEZ - M8718
+
+SocketCBUS.c functions access the CAN bus through a SocketCAN interface. Other transports (CBUS
+server over TCP, serial CAN adapters) provide the same functions in a TCBUSTransport table. Once
+a transport has been selected with setCBUSTransport, all SocketCBUS.c functions call it, so the
+driver, the pipeline threads and the tools do not depend on the transport.
+The io_uring backend reads CAN frames on the socket handle : it is only available with SocketCAN.
+*/
+
+#ifndef __CBUS_TRANSPORT_H__
+#define __CBUS_TRANSPORT_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CBUS_TRANSPORT_SOCKETCAN        0       // Interface name is the CAN interface (can0)
+#define CBUS_TRANSPORT_GRIDCONNECT      1       // Interface name is the CBUS server address (host:port)
+#define CBUS_TRANSPORT_SLCAN            2       // Interface name is the serial port of the adapter (/dev/ttyACM0:speed)
+
+//! Functions of a transport, same behaviour as the SocketCBUS.c functions of the same name
+typedef struct {
+    int (*Create) (char* Name);
+    void (*Close) (void);
+    unsigned int (*GetNextMessage) (unsigned int* CANID, unsigned char* CANData);
+    int (*WaitMessage) (int TimeoutMs);
+    int (*Send) (unsigned int ID, unsigned char DLC, unsigned char* Data);
+    void (*Flush) (void);
+    int (*GetError) (void);
+    unsigned int (*GetDroppedFrames) (void);
+    int (*GetHandle) (void);
+    void (*SetOwnFrames) (int Enable);
+} TCBUSTransport;
+
+//! Select the transport used by SocketCBUS.c functions (0 = SocketCAN). Call before createCBUSSocket
+void setCBUSTransport (const TCBUSTransport* Transport);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,154 @@
+/*
+cbus_txconfirm.c
+cbus2modbus
+Transmit confirmation and TX latency measurement
+Development : Benoit BOUCHEZ - M8718
+
+A successful write() on the CAN socket only means that the frame has been queued by the kernel.
+The frame may then wait in the driver queue, lose arbitration for a long time, or be dropped
+(queue full, bus-off). When TX confirmation is enabled, the socket receives its own frames once
+they have been sent on the bus (CAN_RAW_RECV_OWN_MSGS). Each sent frame is kept in a pending table
+until its echo is received : the delay gives the queue-to-wire latency, and frames without echo
+after the deadline are reported to the caller, which sends them again or flags the output.
+
+Frames are kept in sending order, so the echo is normally found at the head of the table.
+Latency is measured when the echo is processed by the gateway cycle (1 ms resolution).
+All functions are called by the thread calling ProcessCBUS_IO and UpdateModbusData.
+*/
+
+#include <string.h>
+#include "cbus_txconfirm.h"
+
+#define TX_PENDING_SIZE     512         // Must be a power of 2
+
+typedef struct {
+    TCBUSTXFrame Frame;
+    uint8_t Confirmed;
+} TCBUSTXPending;
+
+static TCBUSTXPending PendingFrames[TX_PENDING_SIZE];
+static uint32_t PendingHead = 0;        // Oldest frame
+static uint32_t PendingTail = 0;        // Next free entry
+
+static uint32_t LatencyHistogram[NUM_CBUS_TX_CLASSES][CBUS_TX_LATENCY_BUCKETS];
+static uint32_t MaxLatency[NUM_CBUS_TX_CLASSES];
+static uint8_t TXFailed[NUM_CBUS_BOOL_OUTPUTS];
+
+//! Upper limit of each histogram bucket (microseconds), last bucket has no limit
+static const uint32_t LatencyLimits[CBUS_TX_LATENCY_BUCKETS-1] = {500, 1000, 2000, 5000, 10000, 20000, 50000, 100000, 500000};
+
+void clearCBUSTXConfirm (void)
+{
+    PendingHead = 0;
+    PendingTail = 0;
+    memset (LatencyHistogram, 0, sizeof(LatencyHistogram));
+    memset (MaxLatency, 0, sizeof(MaxLatency));
+    memset (TXFailed, 0, sizeof(TXFailed));
+}  // clearCBUSTXConfirm
+// ------------------------------------------------------------
+
+int trackCBUSTXFrame (const TCBUSTXFrame* Frame)
+{
+    TCBUSTXPending* Entry;
+
+    if (PendingTail - PendingHead >= TX_PENDING_SIZE) return 0;
+
+    Entry = &PendingFrames[PendingTail & (TX_PENDING_SIZE-1)];
+    Entry->Frame = *Frame;
+    if (Entry->Frame.DLC > 8) Entry->Frame.DLC = 8;
+    if (Entry->Frame.Class >= NUM_CBUS_TX_CLASSES) Entry->Frame.Class = CBUS_TX_NORMAL;
+    Entry->Confirmed = 0;
+    PendingTail++;
+    return 1;
+}  // trackCBUSTXFrame
+// ------------------------------------------------------------
+
+//! Remove confirmed frames at the head of the table
+static void releaseConfirmedFrames (void)
+{
+    while ((PendingHead != PendingTail) && (PendingFrames[PendingHead & (TX_PENDING_SIZE-1)].Confirmed))
+        PendingHead++;
+}  // releaseConfirmedFrames
+// ------------------------------------------------------------
+
+int confirmCBUSTXFrame (unsigned int ID, unsigned char DLC, const uint8_t* Data, uint64_t Now)
+{
+    uint32_t Index;
+    uint32_t Latency;
+    int Bucket;
+    TCBUSTXPending* Entry;
+
+    DLC &= 0x0F;
+    if (DLC > 8) DLC = 8;
+
+    for (Index=PendingHead; Index!=PendingTail; Index++)
+    {
+        Entry = &PendingFrames[Index & (TX_PENDING_SIZE-1)];
+        if ((Entry->Confirmed) || (Entry->Frame.ID != ID) || (Entry->Frame.DLC != DLC)) continue;
+        if (memcmp (Entry->Frame.Data, Data, DLC) != 0) continue;
+
+        Entry->Confirmed = 1;
+        Latency = (Now > Entry->Frame.SendTime) ? (uint32_t)(Now - Entry->Frame.SendTime) : 0;
+        for (Bucket=0; (Bucket < CBUS_TX_LATENCY_BUCKETS-1) && (Latency > LatencyLimits[Bucket]); Bucket++);
+        LatencyHistogram[Entry->Frame.Class][Bucket]++;
+        if (Latency > MaxLatency[Entry->Frame.Class])
+            MaxLatency[Entry->Frame.Class] = Latency;
+        if ((Entry->Frame.Output >= 0) && (Entry->Frame.Output < NUM_CBUS_BOOL_OUTPUTS))
+            TXFailed[Entry->Frame.Output] = 0;
+
+        releaseConfirmedFrames ();
+        return 1;
+    }
+    return 0;
+}  // confirmCBUSTXFrame
+// ------------------------------------------------------------
+
+int getExpiredCBUSTXFrame (uint64_t Now, uint64_t Timeout, TCBUSTXFrame* Frame)
+{
+    TCBUSTXPending* Entry;
+
+    releaseConfirmedFrames ();
+    if (PendingHead == PendingTail) return 0;
+
+    // Oldest frame is at the head : if it has not expired, no other frame has
+    Entry = &PendingFrames[PendingHead & (TX_PENDING_SIZE-1)];
+    if (Now - Entry->Frame.SendTime < Timeout) return 0;
+
+    *Frame = Entry->Frame;
+    PendingHead++;
+    return 1;
+}  // getExpiredCBUSTXFrame
+// ------------------------------------------------------------
+
+void setCBUSTXFailed (int Output)
+{
+    if ((Output < 0) || (Output >= NUM_CBUS_BOOL_OUTPUTS)) return;
+    TXFailed[Output] = 1;
+}  // setCBUSTXFailed
+// ------------------------------------------------------------
+
+void exportCBUSTXFailed (uint8_t* Bits)
+{
+    memcpy (Bits, TXFailed, NUM_CBUS_BOOL_OUTPUTS);
+}  // exportCBUSTXFailed
+// ------------------------------------------------------------
+
+void exportCBUSTXLatency (uint16_t* Registers)
+{
+    int Class;
+    int Bucket;
+    uint16_t* ClassRegisters;
+
+    for (Class=0; Class<NUM_CBUS_TX_CLASSES; Class++)
+    {
+        ClassRegisters = &Registers[Class*CBUS_TX_LATENCY_CLASS_REGISTERS];
+        for (Bucket=0; Bucket<CBUS_TX_LATENCY_BUCKETS; Bucket++)
+        {
+            ClassRegisters[Bucket*2] = LatencyHistogram[Class][Bucket]>>16;
+            ClassRegisters[(Bucket*2)+1] = LatencyHistogram[Class][Bucket]&0xFFFF;
+        }
+        ClassRegisters[CBUS_TX_LATENCY_BUCKETS*2] = MaxLatency[Class]>>16;
+        ClassRegisters[(CBUS_TX_LATENCY_BUCKETS*2)+1] = MaxLatency[Class]&0xFFFF;
+    }
+}  // exportCBUSTXLatency
+// ------------------------------------------------------------
@@ -0,0 +1,70 @@
+/*
+cbus_txconfirm.h
+cbus2modbus
+Transmit confirmation and TX latency measurement
+Development : Benoit BOUCHEZ - M8718
+*/
+
+#ifndef __CBUS_TXCONFIRM_H__
+#define __CBUS_TXCONFIRM_H__
+
+#include <stdint.h>
+#include "cbus_io.h"
+#include "cbus_rules.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Discrete inputs 512 to 639 are set when the last frame sent for output 0 to 127 has never been confirmed
+#define DI_TX_FAILED_BASE           DI_RULES_END
+#define DI_TXCONFIRM_END            (DI_TX_FAILED_BASE+NUM_CBUS_BOOL_OUTPUTS)
+
+// TX latency histogram as input registers, for each TX class (urgent, normal, background) :
+// - CBUS_TX_LATENCY_BUCKETS counters (32 bits, high word first) of frames confirmed within
+//   500 us, 1 ms, 2 ms, 5 ms, 10 ms, 20 ms, 50 ms, 100 ms, 500 ms, more than 500 ms
+// - maximum latency in microseconds (32 bits)
+#define CBUS_TX_LATENCY_BUCKETS         10
+#define CBUS_TX_LATENCY_CLASS_REGISTERS ((CBUS_TX_LATENCY_BUCKETS+1)*2)
+#define CBUS_TX_LATENCY_REGISTERS       (NUM_CBUS_TX_CLASSES*CBUS_TX_LATENCY_CLASS_REGISTERS)
+
+//! Frame handed to the CAN socket, waiting for its echo
+typedef struct {
+    unsigned int ID;
+    unsigned char DLC;
+    uint8_t Data[8];
+    uint8_t Class;
+    int16_t Output;             // PLC output driven by the frame, -1 if none
+    uint8_t Retries;            // Number of times the frame has already been sent again
+    uint64_t SendTime;          // Time the frame was queued (getCBUSTimestamp)
+} TCBUSTXFrame;
+
+//! Clear pending frames, latency histogram and output flags
+void clearCBUSTXConfirm (void);
+
+//! Record a frame queued for transmission
+// \return 0 if the pending table is full (frame will not be confirmed)
+int trackCBUSTXFrame (const TCBUSTXFrame* Frame);
+
+//! Match an echoed frame with the oldest identical pending frame
+// \return 1 if the frame was pending, 0 otherwise
+int confirmCBUSTXFrame (unsigned int ID, unsigned char DLC, const uint8_t* Data, uint64_t Now);
+
+//! Get the oldest pending frame not confirmed within Timeout (microseconds). The frame is removed from the table
+// \return 1 if Frame has been filled
+int getExpiredCBUSTXFrame (uint64_t Now, uint64_t Timeout, TCBUSTXFrame* Frame);
+
+//! Mark an output whose frame has never been confirmed (flag is cleared by the next confirmed frame of the output)
+void setCBUSTXFailed (int Output);
+
+//! Copy output flags to discrete inputs (NUM_CBUS_BOOL_OUTPUTS values)
+void exportCBUSTXFailed (uint8_t* Bits);
+
+//! Copy latency histogram to input registers (CBUS_TX_LATENCY_REGISTERS registers)
+void exportCBUSTXLatency (uint16_t* Registers);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,494 @@
+/*
+cbus_uring.c
+cbus2modbus
+Optional io_uring I/O backend for the CAN socket
+Development : Benoit BOUCHEZ - M8718
+
+With direct socket calls, each received or transmitted CAN frame costs one read() or write()
+system call. This backend uses io_uring so that all reads and writes needed by one
+ProcessCBUS_IO cycle are submitted with a single io_uring_enter call, and completions are
+read from the shared completion queue without any system call.
+
+Frame buffers are registered once in the kernel (fixed buffers) to avoid mapping them for
+each operation. If buffers can not be registered (memlock limit), plain read/write operations
+are used in the ring.
+
+CBUS events order must be kept (an ACON followed by ACOF must not be swapped), so reads and
+writes are submitted as linked chains : operations in a chain are executed one after each other.
+A new chain is only submitted when the previous one of the same direction has completed.
+When a write is refused by the socket (TX queue full), the kernel cancels the rest of the chain :
+the refused and cancelled frames are submitted again at the start of the next TX chain.
+
+The backend uses the raw system calls so it does not depend on liburing. If the kernel does
+not support io_uring, startCBUSUring fails and the driver falls back to direct socket calls.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <linux/can.h>
+#include "cbus_uring.h"
+#include "SocketCBUS.h"
+
+#define URING_ENTRIES       64
+#define URING_RX_SLOTS      16      // Reads in the RX chain
+#define URING_TX_SLOTS      32      // Writes in the TX chain
+#define URING_TX_QUEUE      256     // Frames waiting for next TX chain
+#define URING_TX_RETRIES    100     // TX chains without any frame sent before the refused frames are dropped
+
+#define URING_TAG_RX        0x10000
+#define URING_TAG_TX        0x20000
+
+TCBUSUringStats CBUSUringStats;
+
+static int RingFD = -1;
+static int CANFD = -1;
+static int FixedBuffers = 0;
+
+// Submission queue
+static void* SQRingPtr = MAP_FAILED;
+static size_t SQRingSize = 0;
+static unsigned* SQHead;
+static unsigned* SQTail;
+static unsigned* SQMask;
+static unsigned* SQArray;
+static struct io_uring_sqe* SQEntries = MAP_FAILED;
+static size_t SQEntriesSize = 0;
+static unsigned SQPending = 0;          // SQE filled but not published yet
+static unsigned SQUnsubmitted = 0;      // SQE published but not consumed by the kernel yet
+
+// Completion queue
+static void* CQRingPtr = MAP_FAILED;
+static size_t CQRingSize = 0;
+static unsigned* CQHead;
+static unsigned* CQTail;
+static unsigned* CQMask;
+static struct io_uring_cqe* CQEntries;
+
+// Registered buffers : RX slots followed by TX slots
+static struct can_frame FrameBuffers[URING_RX_SLOTS+URING_TX_SLOTS] __attribute__((aligned(64)));
+
+static unsigned RXInFlight = 0;         // Reads of current chain not yet completed
+static unsigned RXReadIndex = 0;        // Next completed slot to give to the driver
+static unsigned RXCompleted = 0;        // Completed slots with a valid frame, in chain order
+static int RXResult[URING_RX_SLOTS];
+
+static unsigned TXInFlight = 0;
+static struct can_frame TXQueue[URING_TX_QUEUE];
+static unsigned TXQueueHead = 0;
+static unsigned TXQueueTail = 0;
+static unsigned TXChainCount = 0;       // Writes in the current TX chain
+static int TXResult[URING_TX_SLOTS];
+static unsigned TXRetryCount = 0;       // Frames of the previous chain to send again, at the start of the TX slots
+static unsigned TXRetries = 0;          // Consecutive TX chains which could not send any frame
+static uint32_t TXDroppedFrames = 0;    // Frames not sent, not yet read by getUringTXDroppedFrames
+
+static int sys_io_uring_setup (unsigned Entries, struct io_uring_params* Params)
+{
+    return (int)syscall (__NR_io_uring_setup, Entries, Params);
+}
+
+static int sys_io_uring_enter (int FD, unsigned ToSubmit, unsigned MinComplete, unsigned Flags)
+{
+    CBUSUringStats.EnterCalls++;
+    return (int)syscall (__NR_io_uring_enter, FD, ToSubmit, MinComplete, Flags, NULL, 0);
+}
+
+static int sys_io_uring_register (int FD, unsigned Opcode, void* Arg, unsigned NumArgs)
+{
+    return (int)syscall (__NR_io_uring_register, FD, Opcode, Arg, NumArgs);
+}
+
+//! Get a free submission entry. Caller must check there is room (rings are sized for all slots)
+static struct io_uring_sqe* getSQE (void)
+{
+    unsigned Tail;
+    unsigned Index;
+    struct io_uring_sqe* SQE;
+
+    Tail = *SQTail + SQPending;
+    Index = Tail & *SQMask;
+    SQE = &SQEntries[Index];
+    memset (SQE, 0, sizeof(struct io_uring_sqe));
+    SQArray[Index] = Index;
+    SQPending++;
+    return SQE;
+}  // getSQE
+// ------------------------------------------------------------
+
+static void prepFrameIO (struct io_uring_sqe* SQE, int Write, unsigned Slot, int Linked)
+{
+    if (FixedBuffers)
+    {
+        SQE->opcode = Write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        SQE->buf_index = 0;     // All frames are in the same registered buffer
+    }
+    else
+    {
+        SQE->opcode = Write ? IORING_OP_WRITE : IORING_OP_READ;
+    }
+    SQE->fd = CANFD;
+    SQE->addr = (unsigned long)&FrameBuffers[Slot];
+    SQE->len = sizeof(struct can_frame);
+    SQE->off = 0;
+    SQE->user_data = (Write ? URING_TAG_TX : URING_TAG_RX) | Slot;
+    if (Linked) SQE->flags |= IOSQE_IO_LINK;
+}  // prepFrameIO
+// ------------------------------------------------------------
+
+//! Queue a new chain of reads (only when previous chain is fully consumed)
+static void armRXChain (void)
+{
+    unsigned Slot;
+
+    if ((RXInFlight != 0) || (RXReadIndex < RXCompleted)) return;
+
+    for (Slot=0; Slot<URING_RX_SLOTS; Slot++)
+    {
+        prepFrameIO (getSQE(), 0, Slot, Slot < URING_RX_SLOTS-1);
+        RXResult[Slot] = 0;
+    }
+    RXInFlight = URING_RX_SLOTS;
+    RXReadIndex = 0;
+    RXCompleted = 0;
+}  // armRXChain
+// ------------------------------------------------------------
+
+//! Move queued frames into a new TX chain (only when previous chain has completed)
+static void armTXChain (void)
+{
+    unsigned Slot;
+    unsigned Count;
+
+    if (TXInFlight != 0) return;
+
+    // Frames refused in the previous chain are sent first, so frames order is kept
+    Count = TXRetryCount;
+    while ((Count < URING_TX_SLOTS) && (TXQueueHead != TXQueueTail))
+    {
+        FrameBuffers[URING_RX_SLOTS+Count] = TXQueue[TXQueueHead % URING_TX_QUEUE];
+        TXQueueHead++;
+        Count++;
+    }
+    if (Count == 0) return;
+
+    for (Slot=0; Slot<Count; Slot++)
+        prepFrameIO (getSQE(), 1, URING_RX_SLOTS+Slot, Slot < Count-1);
+    TXRetryCount = 0;
+    TXChainCount = Count;
+    TXInFlight = Count;
+}  // armTXChain
+// ------------------------------------------------------------
+
+//! Completed TX chain : keep the frame refused by the socket and the frames cancelled after it for next chain
+// Frames are dropped after a socket failure, or when the socket has refused URING_TX_RETRIES chains in a row
+static void collectTXRetries (void)
+{
+    unsigned First;
+    int Result;
+
+    for (First=0; First<TXChainCount; First++)
+    {
+        if (TXResult[First] != sizeof(struct can_frame)) break;
+    }
+    if (First == TXChainCount)
+    {
+        TXRetries = 0;
+        return;
+    }
+
+    if (First > 0)
+        TXRetries = 0;
+    else
+        TXRetries++;
+
+    Result = TXResult[First];
+    if (((Result != -ENOBUFS) && (Result != -EAGAIN)) || (TXRetries >= URING_TX_RETRIES))
+    {
+        __atomic_add_fetch (&TXDroppedFrames, TXChainCount-First, __ATOMIC_RELAXED);
+        TXRetries = 0;
+        return;
+    }
+
+    TXRetryCount = TXChainCount-First;
+    memmove (&FrameBuffers[URING_RX_SLOTS], &FrameBuffers[URING_RX_SLOTS+First], TXRetryCount*sizeof(struct can_frame));
+}  // collectTXRetries
+// ------------------------------------------------------------
+
+//! Read all available completions from the shared ring (no system call)
+static void reapCompletions (void)
+{
+    unsigned Head;
+    unsigned Tail;
+    struct io_uring_cqe* CQE;
+    unsigned Slot;
+
+    Head = *CQHead;
+    Tail = __atomic_load_n (CQTail, __ATOMIC_ACQUIRE);
+
+    while (Head != Tail)
+    {
+        CQE = &CQEntries[Head & *CQMask];
+        Slot = CQE->user_data & 0xFFFF;
+
+        if (CQE->user_data & URING_TAG_RX)
+        {
+            // Chain is executed in order, so completions come in slot order
+            RXResult[Slot] = CQE->res;
+            if (CQE->res == sizeof(struct can_frame))
+            {
+                CBUSUringStats.FramesReceived++;
+            }
+            else
+            {
+                CBUSUringStats.Errors++;
+                // Empty queue and end of chain are normal, other errors (interface down) start socket recovery
+                if ((CQE->res < 0) && (CQE->res != -EAGAIN) && (CQE->res != -EINTR) && (CQE->res != -ECANCELED))
+                    setCBUSSocketError (-CQE->res);
+            }
+            RXCompleted = Slot+1;
+            if (RXInFlight > 0) RXInFlight--;
+        }
+        else if (CQE->user_data & URING_TAG_TX)
+        {
+            TXResult[Slot-URING_RX_SLOTS] = CQE->res;
+            if (CQE->res == sizeof(struct can_frame))
+                CBUSUringStats.FramesSent++;
+            else
+            {
+                CBUSUringStats.Errors++;
+                if ((CQE->res < 0) && (CQE->res != -EAGAIN) && (CQE->res != -ENOBUFS) && (CQE->res != -EINTR) && (CQE->res != -ECANCELED))
+                    setCBUSSocketError (-CQE->res);
+            }
+            if (TXInFlight > 0)
+            {
+                TXInFlight--;
+                if (TXInFlight == 0) collectTXRetries ();
+            }
+        }
+        Head++;
+    }
+
+    __atomic_store_n (CQHead, Head, __ATOMIC_RELEASE);
+}  // reapCompletions
+// ------------------------------------------------------------
+
+int startCBUSUring (void)
+{
+    struct io_uring_params Params;
+    struct iovec BufferVector;
+    int Flags;
+
+    stopCBUSUring ();
+    memset (&CBUSUringStats, 0, sizeof(CBUSUringStats));
+
+    CANFD = getCBUSSocketHandle ();
+    if (CANFD == -1) return -1;
+
+    memset (&Params, 0, sizeof(Params));
+    RingFD = sys_io_uring_setup (URING_ENTRIES, &Params);
+    if (RingFD < 0)
+    {
+        RingFD = -1;
+        return -1;      // ENOSYS on old kernels, EPERM if disabled by sysctl or seccomp
+    }
+
+    SQRingSize = Params.sq_off.array + Params.sq_entries*sizeof(unsigned);
+    CQRingSize = Params.cq_off.cqes + Params.cq_entries*sizeof(struct io_uring_cqe);
+    if (Params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (CQRingSize > SQRingSize) SQRingSize = CQRingSize;
+        CQRingSize = SQRingSize;
+    }
+
+    SQRingPtr = mmap (0, SQRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, RingFD, IORING_OFF_SQ_RING);
+    if (SQRingPtr == MAP_FAILED)
+    {
+        stopCBUSUring ();
+        return -1;
+    }
+
+    if (Params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        CQRingPtr = SQRingPtr;
+    }
+    else
+    {
+        CQRingPtr = mmap (0, CQRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, RingFD, IORING_OFF_CQ_RING);
+        if (CQRingPtr == MAP_FAILED)
+        {
+            stopCBUSUring ();
+            return -1;
+        }
+    }
+
+    SQEntriesSize = Params.sq_entries*sizeof(struct io_uring_sqe);
+    SQEntries = mmap (0, SQEntriesSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, RingFD, IORING_OFF_SQES);
+    if (SQEntries == MAP_FAILED)
+    {
+        stopCBUSUring ();
+        return -1;
+    }
+
+    SQHead = (unsigned*)((char*)SQRingPtr + Params.sq_off.head);
+    SQTail = (unsigned*)((char*)SQRingPtr + Params.sq_off.tail);
+    SQMask = (unsigned*)((char*)SQRingPtr + Params.sq_off.ring_mask);
+    SQArray = (unsigned*)((char*)SQRingPtr + Params.sq_off.array);
+    CQHead = (unsigned*)((char*)CQRingPtr + Params.cq_off.head);
+    CQTail = (unsigned*)((char*)CQRingPtr + Params.cq_off.tail);
+    CQMask = (unsigned*)((char*)CQRingPtr + Params.cq_off.ring_mask);
+    CQEntries = (struct io_uring_cqe*)((char*)CQRingPtr + Params.cq_off.cqes);
+
+    // Register frame buffers. Failure is not fatal (RLIMIT_MEMLOCK may be too low)
+    BufferVector.iov_base = &FrameBuffers[0];
+    BufferVector.iov_len = sizeof(FrameBuffers);
+    FixedBuffers = (sys_io_uring_register (RingFD, IORING_REGISTER_BUFFERS, &BufferVector, 1) == 0);
+
+    // Reads are now completed by the kernel when frames arrive : socket must be blocking
+    // otherwise each read would complete immediately with EAGAIN
+    Flags = fcntl (CANFD, F_GETFL, 0);
+    fcntl (CANFD, F_SETFL, Flags & ~O_NONBLOCK);
+
+    SQPending = 0;
+    SQUnsubmitted = 0;
+    RXInFlight = 0;
+    RXReadIndex = 0;
+    RXCompleted = 0;
+    TXInFlight = 0;
+    TXQueueHead = 0;
+    TXQueueTail = 0;
+    TXChainCount = 0;
+    TXRetryCount = 0;
+    TXRetries = 0;
+
+    armRXChain ();
+    flushCBUSUring ();
+
+    return 0;
+}  // startCBUSUring
+// ------------------------------------------------------------
+
+void stopCBUSUring (void)
+{
+    int Flags;
+
+    // Closing the ring cancels all pending operations
+    if (SQEntries != MAP_FAILED) munmap (SQEntries, SQEntriesSize);
+    if ((CQRingPtr != MAP_FAILED) && (CQRingPtr != SQRingPtr)) munmap (CQRingPtr, CQRingSize);
+    if (SQRingPtr != MAP_FAILED) munmap (SQRingPtr, SQRingSize);
+    SQEntries = MAP_FAILED;
+    CQRingPtr = MAP_FAILED;
+    SQRingPtr = MAP_FAILED;
+
+    if (RingFD != -1)
+    {
+        close (RingFD);
+        RingFD = -1;
+
+        // Give the socket back to direct calls
+        if (CANFD != -1)
+        {
+            Flags = fcntl (CANFD, F_GETFL, 0);
+            fcntl (CANFD, F_SETFL, Flags | O_NONBLOCK);
+        }
+    }
+    CANFD = -1;
+}  // stopCBUSUring
+// ------------------------------------------------------------
+
+unsigned int getUringCBUSMessage (unsigned int* CANID, unsigned char* CANData)
+{
+    struct can_frame* Frame;
+
+    if (RingFD == -1) return 0xFFFFFFFF;
+
+    if (RXReadIndex >= RXCompleted)
+    {
+        reapCompletions ();
+    }
+
+    while (RXReadIndex < RXCompleted)
+    {
+        Frame = &FrameBuffers[RXReadIndex];
+        if (RXResult[RXReadIndex++] == sizeof(struct can_frame))
+        {
+            *CANID = Frame->can_id;
+            memcpy (CANData, &Frame->data[0], Frame->can_dlc & 0xF);
+            return Frame->can_dlc;
+        }
+    }
+
+    return 0xFFFFFFFF;
+}  // getUringCBUSMessage
+// ------------------------------------------------------------
+
+void sendUringCBUSRaw (unsigned int ID, unsigned char DLC, unsigned char* Data)
+{
+    struct can_frame* Frame;
+
+    if (RingFD == -1) return;
+
+    // Software queue is full : wait until current TX chain is completed and push the next one
+    while ((TXQueueTail - TXQueueHead) >= URING_TX_QUEUE)
+    {
+        reapCompletions ();
+        if (TXInFlight != 0)
+        {
+            sys_io_uring_enter (RingFD, 0, 1, IORING_ENTER_GETEVENTS);
+            continue;
+        }
+        flushCBUSUring ();
+    }
+
+    Frame = &TXQueue[TXQueueTail % URING_TX_QUEUE];
+    memset (Frame, 0, sizeof(struct can_frame));
+    Frame->can_id = ID;
+    Frame->can_dlc = DLC;
+    if (DLC > 8) DLC = 8;
+    if (DLC > 0) memcpy (&Frame->data[0], Data, DLC);
+    TXQueueTail++;
+}  // sendUringCBUSRaw
+// ------------------------------------------------------------
+
+unsigned int getUringTXDroppedFrames (void)
+{
+    return __atomic_exchange_n (&TXDroppedFrames, 0, __ATOMIC_RELAXED);
+}  // getUringTXDroppedFrames
+// ------------------------------------------------------------
+
+void flushCBUSUring (void)
+{
+    int Submitted;
+
+    if (RingFD == -1) return;
+
+    reapCompletions ();
+    armRXChain ();
+    armTXChain ();
+
+    // Publish all prepared entries then submit them with one system call
+    if (SQPending != 0)
+    {
+        __atomic_store_n (SQTail, *SQTail + SQPending, __ATOMIC_RELEASE);
+        SQUnsubmitted += SQPending;
+        SQPending = 0;
+    }
+
+    if (SQUnsubmitted == 0) return;
+
+    Submitted = sys_io_uring_enter (RingFD, SQUnsubmitted, 0, 0);
+    if (Submitted > 0)
+    {
+        if ((unsigned)Submitted >= SQUnsubmitted)
+            SQUnsubmitted = 0;
+        else
+            SQUnsubmitted -= Submitted;
+    }
+}  // flushCBUSUring
+// ------------------------------------------------------------
@@ -0,0 +1,51 @@
+/*
+cbus_uring.h
+cbus2modbus
+Optional io_uring I/O backend for the CAN socket
+Development : Benoit BOUCHEZ - M8718
+*/
+
+#ifndef __CBUS_URING_H__
+#define __CBUS_URING_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//! Statistics to compare io_uring backend with direct read/write calls
+typedef struct {
+    uint32_t EnterCalls;        // Number of io_uring_enter system calls
+    uint32_t FramesReceived;
+    uint32_t FramesSent;
+    uint32_t Errors;            // Failed or cancelled operations
+} TCBUSUringStats;
+
+extern TCBUSUringStats CBUSUringStats;
+
+//! Create io_uring instance for the opened CAN socket
+// \return 0 if io_uring is available, -1 if kernel does not support it (caller must use direct socket calls)
+int startCBUSUring (void);
+
+//! Release io_uring resources
+void stopCBUSUring (void);
+
+//! Get next received CAN message from the completion queue (no system call)
+// Same convention as getNextCBUSMessage : returns 0xFFFFFFFF if no frame is waiting
+unsigned int getUringCBUSMessage (unsigned int* CANID, unsigned char* CANData);
+
+//! Queue a CAN message. Message is sent by next call to flushCBUSUring
+void sendUringCBUSRaw (unsigned int ID, unsigned char DLC, unsigned char* Data);
+
+//! Frames not sent since last call : socket failure, or TX queue of the socket full for URING_TX_RETRIES chains
+unsigned int getUringTXDroppedFrames (void);
+
+//! Submit all queued operations (re-armed reads and writes) with a single system call
+void flushCBUSUring (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
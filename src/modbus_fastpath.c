@@ -0,0 +1,343 @@
+/*
+modbus_fastpath.c
+cbus2modbus
+Native Modbus/TCP processing for the function codes used by the PLC
+Development : Benoit BOUCHEZ - M8718
+
+modbus_receive + modbus_reply re-parse the MBAP header, copy each request through an
+intermediate buffer, and build bit responses one bit at a time from the byte arrays of
+the mapping.
+
+The fast path reads the socket directly and handles requests in place in the reception buffer :
+- FC1 (read coils) and FC2 (read discrete inputs) responses are built from packed bit images
+  (8 bits per byte, same layout as the Modbus frame) with one shift per byte
+- FC5 (write single coil) and FC15 (write multiple coils) update the mapping and the packed image
+- all requests received with one recv() call are processed, and their responses are sent back
+  with a single send() call (pipelined transactions)
+Any other request, or any request which is not valid, is given to modbus_reply so libmodbus
+generates the standard answer or exception.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "modbus_fastpath.h"
+#include "cbus_soe.h"
+
+#define MBAP_HEADER_LENGTH      7           // Transaction ID, protocol ID, length, unit ID
+#define FASTPATH_BUFFER_SIZE    8192
+
+TModbusFastPathStats ModbusFastPathStats;
+
+static uint8_t* PackedCoils = 0;
+static uint8_t* PackedInputs = 0;
+static int PackedCoilsSize = 0;
+static int PackedInputsSize = 0;
+
+static uint8_t RXBuffer[FASTPATH_BUFFER_SIZE];
+static int RXLength = 0;                    // Bytes waiting in RXBuffer (incomplete request)
+static uint8_t TXBuffer[FASTPATH_BUFFER_SIZE];
+static int TXLength = 0;
+
+//! Pack a byte per bit array into a bit per bit array
+static void packBits (const uint8_t* Bits, int Count, uint8_t* Packed)
+{
+    int ByteCounter;
+    int BitCounter;
+    int Index;
+    uint8_t Value;
+
+    for (ByteCounter=0; ByteCounter<(Count+7)/8; ByteCounter++)
+    {
+        Value = 0;
+        for (BitCounter=0; BitCounter<8; BitCounter++)
+        {
+            Index = (ByteCounter*8)+BitCounter;
+            if ((Index < Count) && (Bits[Index] != 0))
+                Value |= (1<<BitCounter);
+        }
+        Packed[ByteCounter] = Value;
+    }
+}  // packBits
+// ------------------------------------------------------------
+
+//! Copy Count bits starting at bit Start from packed image to Dest (Modbus response format)
+// Packed image must have one padding byte after the last bit
+static void extractBits (const uint8_t* Image, int Start, int Count, uint8_t* Dest)
+{
+    const uint8_t* Source;
+    int Shift;
+    int ByteCount;
+    int ByteCounter;
+
+    Source = Image + (Start>>3);
+    Shift = Start & 7;
+    ByteCount = (Count+7)/8;
+
+    if (Shift == 0)
+    {
+        memcpy (Dest, Source, ByteCount);
+    }
+    else
+    {
+        for (ByteCounter=0; ByteCounter<ByteCount; ByteCounter++)
+        {
+            Dest[ByteCounter] = (Source[ByteCounter] >> Shift) | (Source[ByteCounter+1] << (8-Shift));
+        }
+    }
+
+    // Unused bits in last byte must be 0
+    if (Count & 7)
+        Dest[ByteCount-1] &= (1<<(Count & 7))-1;
+}  // extractBits
+// ------------------------------------------------------------
+
+static void setCoil (modbus_mapping_t* Mapping, int Address, int Value)
+{
+    Mapping->tab_bits[Address] = Value ? 1 : 0;
+    if (Value)
+        PackedCoils[Address>>3] |= (1<<(Address & 7));
+    else
+        PackedCoils[Address>>3] &= ~(1<<(Address & 7));
+}  // setCoil
+// ------------------------------------------------------------
+
+//! Try to answer a request natively
+// \return size of response written in Response, 0 if request must be handled by libmodbus
+static int processFastRequest (const uint8_t* ADU, int ADULength, modbus_mapping_t* Mapping, uint8_t* Response)
+{
+    const uint8_t* PDU;
+    int PDULength;
+    int Address;
+    int Quantity;
+    int Value;
+    int ByteCount;
+    int BitCounter;
+
+    if ((ADU[2] != 0) || (ADU[3] != 0)) return 0;       // Not Modbus protocol
+
+    PDU = ADU + MBAP_HEADER_LENGTH;
+    PDULength = ADULength - MBAP_HEADER_LENGTH;
+    if (PDULength < 5) return 0;
+
+    Address = (PDU[1]<<8) + PDU[2];
+    Quantity = (PDU[3]<<8) + PDU[4];
+
+    // Transaction ID, protocol ID and unit ID are copied from the request
+    memcpy (Response, ADU, MBAP_HEADER_LENGTH);
+    Response[MBAP_HEADER_LENGTH] = PDU[0];
+
+    switch (PDU[0])
+    {
+        case 0x01 : case 0x02 :     // Read coils / read discrete inputs
+            if (PDULength != 5) return 0;
+            if ((Quantity < 1) || (Quantity > MODBUS_MAX_READ_BITS)) return 0;
+
+            if (PDU[0] == 0x01)
+            {
+                if (Address + Quantity > Mapping->nb_bits) return 0;
+                ByteCount = (Quantity+7)/8;
+                extractBits (PackedCoils, Address, Quantity, &Response[MBAP_HEADER_LENGTH+2]);
+            }
+            else
+            {
+                if (Address + Quantity > Mapping->nb_input_bits) return 0;
+                ByteCount = (Quantity+7)/8;
+                if (Address + Quantity > DI_RISING_LATCH_BASE)
+                {   // Latch bits are read from the latch counters, so they can be cleared on read
+                    prepareCBUSLatchRead (Mapping->tab_input_bits, Address, Quantity);
+                    packBits (Mapping->tab_input_bits, Mapping->nb_input_bits, PackedInputs);
+                    extractBits (PackedInputs, Address, Quantity, &Response[MBAP_HEADER_LENGTH+2]);
+                    acknowledgeCBUSLatchRead ();
+                }
+                else
+                    extractBits (PackedInputs, Address, Quantity, &Response[MBAP_HEADER_LENGTH+2]);
+            }
+
+            Response[MBAP_HEADER_LENGTH+1] = ByteCount;
+            Response[4] = 0;
+            Response[5] = 3+ByteCount;      // Unit ID + function code + byte count + data
+            return MBAP_HEADER_LENGTH+2+ByteCount;
+
+        case 0x05 :     // Write single coil
+            if (PDULength != 5) return 0;
+            if (Address >= Mapping->nb_bits) return 0;
+            Value = Quantity;       // Second field is the coil value
+            if ((Value != 0xFF00) && (Value != 0x0000)) return 0;
+
+            setCoil (Mapping, Address, Value == 0xFF00);
+
+            // Response is an echo of the request
+            memcpy (Response, ADU, ADULength);
+            return ADULength;
+
+        case 0x0F :     // Write multiple coils
+            if (PDULength < 6) return 0;
+            ByteCount = PDU[5];
+            if ((Quantity < 1) || (Quantity > MODBUS_MAX_WRITE_BITS)) return 0;
+            if (ByteCount != (Quantity+7)/8) return 0;
+            if (PDULength != 6+ByteCount) return 0;
+            if (Address + Quantity > Mapping->nb_bits) return 0;
+
+            for (BitCounter=0; BitCounter<Quantity; BitCounter++)
+            {
+                setCoil (Mapping, Address+BitCounter, PDU[6+(BitCounter>>3)] & (1<<(BitCounter & 7)));
+            }
+
+            memcpy (&Response[MBAP_HEADER_LENGTH+1], &PDU[1], 4);   // Address and quantity
+            Response[4] = 0;
+            Response[5] = 6;
+            return MBAP_HEADER_LENGTH+5;
+    }
+
+    return 0;
+}  // processFastRequest
+// ------------------------------------------------------------
+
+//! Send all responses waiting in TXBuffer
+static int flushResponses (int Socket)
+{
+    int Sent;
+    int Offset = 0;
+
+    while (Offset < TXLength)
+    {
+        Sent = send (Socket, &TXBuffer[Offset], TXLength-Offset, MSG_NOSIGNAL);
+        if (Sent <= 0)
+        {
+            if ((Sent < 0) && (errno == EINTR)) continue;
+            TXLength = 0;
+            return -1;
+        }
+        Offset += Sent;
+    }
+    TXLength = 0;
+    return 0;
+}  // flushResponses
+// ------------------------------------------------------------
+
+int initModbusFastPath (modbus_mapping_t* Mapping)
+{
+    closeModbusFastPath ();
+
+    // One padding byte is needed by extractBits, one more to round up
+    PackedCoilsSize = (Mapping->nb_bits/8)+2;
+    PackedInputsSize = (Mapping->nb_input_bits/8)+2;
+    PackedCoils = (uint8_t*)calloc (PackedCoilsSize, 1);
+    PackedInputs = (uint8_t*)calloc (PackedInputsSize, 1);
+    if ((PackedCoils == 0) || (PackedInputs == 0))
+    {
+        closeModbusFastPath ();
+        return -1;
+    }
+
+    RXLength = 0;
+    TXLength = 0;
+    memset (&ModbusFastPathStats, 0, sizeof(ModbusFastPathStats));
+    updateModbusFastPathImages (Mapping);
+    return 0;
+}  // initModbusFastPath
+// ------------------------------------------------------------
+
+void closeModbusFastPath (void)
+{
+    if (PackedCoils) free (PackedCoils);
+    if (PackedInputs) free (PackedInputs);
+    PackedCoils = 0;
+    PackedInputs = 0;
+}  // closeModbusFastPath
+// ------------------------------------------------------------
+
+void updateModbusFastPathImages (modbus_mapping_t* Mapping)
+{
+    if ((PackedCoils == 0) || (PackedInputs == 0)) return;
+
+    packBits (Mapping->tab_input_bits, Mapping->nb_input_bits, PackedInputs);
+    packBits (Mapping->tab_bits, Mapping->nb_bits, PackedCoils);
+}  // updateModbusFastPathImages
+// ------------------------------------------------------------
+
+int serveModbusFastPath (modbus_t* Context, modbus_mapping_t* Mapping, int TimeoutMs)
+{
+    struct pollfd PollFD;
+    int Socket;
+    int Received;
+    int Offset;
+    int ADULength;
+    int ResponseLength;
+
+    Socket = modbus_get_socket (Context);
+    if ((Socket == -1) || (PackedCoils == 0)) return -1;
+
+    PollFD.fd = Socket;
+    PollFD.events = POLLIN;
+    PollFD.revents = 0;
+    Received = poll (&PollFD, 1, TimeoutMs);
+    if (Received == 0) return 0;
+    if (Received < 0) return (errno == EINTR) ? 0 : -1;
+
+    Received = recv (Socket, &RXBuffer[RXLength], FASTPATH_BUFFER_SIZE-RXLength, 0);
+    ModbusFastPathStats.ReadCalls++;
+    if (Received <= 0)
+    {
+        if ((Received < 0) && (errno == EINTR)) return 0;
+        RXLength = 0;
+        modbus_close (Context);     // Client has closed the connection
+        return -1;
+    }
+    RXLength += Received;
+
+    Offset = 0;
+    while (RXLength - Offset >= MBAP_HEADER_LENGTH+1)
+    {
+        // Length field counts unit ID and PDU
+        ADULength = 6 + (RXBuffer[Offset+4]<<8) + RXBuffer[Offset+5];
+        if ((ADULength < MBAP_HEADER_LENGTH+1) || (ADULength > MODBUS_TCP_MAX_ADU_LENGTH))
+        {   // Stream is corrupted : there is no way to find next request boundary
+            RXLength = 0;
+            TXLength = 0;
+            modbus_close (Context);
+            return -1;
+        }
+        if (RXLength - Offset < ADULength) break;       // Wait for end of request
+
+        ResponseLength = processFastRequest (&RXBuffer[Offset], ADULength, Mapping, &TXBuffer[TXLength]);
+        if (ResponseLength > 0)
+        {
+            TXLength += ResponseLength;
+            ModbusFastPathStats.FastRequests++;
+        }
+        else
+        {
+            // Responses must be sent in the order of requests
+            if (flushResponses (Socket) != 0) return -1;
+            modbus_reply (Context, &RXBuffer[Offset], ADULength, Mapping);
+            ModbusFastPathStats.FallbackRequests++;
+
+            // libmodbus may have written coils
+            packBits (Mapping->tab_bits, Mapping->nb_bits, PackedCoils);
+        }
+        Offset += ADULength;
+
+        if (TXLength > FASTPATH_BUFFER_SIZE-MODBUS_TCP_MAX_ADU_LENGTH)
+        {
+            if (flushResponses (Socket) != 0) return -1;
+        }
+    }
+
+    if (flushResponses (Socket) != 0) return -1;
+
+    // Keep incomplete request for next call
+    if (Offset > 0)
+    {
+        RXLength -= Offset;
+        if (RXLength > 0) memmove (&RXBuffer[0], &RXBuffer[Offset], RXLength);
+    }
+
+    return 0;
+}  // serveModbusFastPath
+// ------------------------------------------------------------
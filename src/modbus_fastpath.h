@@ -0,0 +1,46 @@
+/*
+modbus_fastpath.h
+cbus2modbus
+Native Modbus/TCP processing for the function codes used by the PLC
+Development : Benoit BOUCHEZ - M8718
+*/
+
+#ifndef __MODBUS_FASTPATH_H__
+#define __MODBUS_FASTPATH_H__
+
+#include <stdint.h>
+#include "modbus.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//! Statistics about requests handled by the fast path
+typedef struct {
+    uint32_t FastRequests;          // Requests answered by the native code
+    uint32_t FallbackRequests;      // Requests given to modbus_reply
+    uint32_t ReadCalls;             // Number of recv() calls
+} TModbusFastPathStats;
+
+extern TModbusFastPathStats ModbusFastPathStats;
+
+//! Allocate packed bit images for the mapping
+// \return 0 if success, -1 if memory can not be allocated
+int initModbusFastPath (modbus_mapping_t* Mapping);
+
+//! Free packed bit images
+void closeModbusFastPath (void);
+
+//! Rebuild packed bit images from the libmodbus mapping. Called each time the mapping is updated
+void updateModbusFastPathImages (modbus_mapping_t* Mapping);
+
+//! Wait for requests on the connected client socket of the context and answer them
+// \param TimeoutMs maximum time to wait for data (so caller can check if it has to stop)
+// \return 0 if connection is still alive, -1 if connection is closed
+int serveModbusFastPath (modbus_t* Context, modbus_mapping_t* Mapping, int TimeoutMs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
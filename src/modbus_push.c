@@ -0,0 +1,261 @@
+/*
+modbus_push.c
+cbus2modbus
+Report-by-exception : the gateway writes input changes to the PLC as a Modbus/TCP client
+Development : Benoit BOUCHEZ - M8718
+
+In standard mode, the PLC has to poll the discrete inputs continuously to detect CBUS events.
+In push mode, cbus2modbus connects to the PLC Modbus/TCP server and writes the inputs itself
+when they change :
+- changes occuring within WindowMs after the first change are grouped in the same write
+- only changed ranges are written (close ranges are merged to limit the number of requests)
+- the full image is written after each (re)connection and every SyncPeriodMs, in case a write
+  has been lost or the PLC has been restarted
+
+Inputs can be written to coils (one coil per input) or holding registers (16 inputs per register)
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "modbus.h"
+#include "modbus_push.h"
+#include "cbus_io.h"
+
+#define PUSH_MERGE_GAP          8           // Unchanged inputs between two ranges before they are sent separately
+#define PUSH_RECONNECT_DELAY    1000000     // 1 second between connection attempts
+
+TModbusPushConfig ModbusPushConfig = {"", 502, PUSH_TARGET_COILS, 0, 10, 60000};
+
+static pthread_t PushThread;
+static pthread_mutex_t PushLock = PTHREAD_MUTEX_INITIALIZER;
+static volatile int PushStopRequest = 0;
+static int PushRunning = 0;
+static modbus_t* PushContext = 0;
+
+// Protected by PushLock
+static uint8_t PushImage[NUM_CBUS_BOOL_INPUTS];
+static uint8_t PushChanged[NUM_CBUS_BOOL_INPUTS];
+static int ChangePending = 0;
+static uint64_t FirstChangeTime = 0;
+static int FullSyncRequest = 1;
+
+//! Write changed inputs as coils
+static int pushCoils (const uint8_t* Values, const uint8_t* Changed)
+{
+    int Start;
+    int End;
+    int Next;
+
+    Start = 0;
+    while (Start < NUM_CBUS_BOOL_INPUTS)
+    {
+        if (Changed[Start] == 0)
+        {
+            Start++;
+            continue;
+        }
+
+        // Extend the range while next changed input is close enough
+        End = Start;
+        for (Next=Start+1; (Next<NUM_CBUS_BOOL_INPUTS)&&(Next<=End+PUSH_MERGE_GAP); Next++)
+        {
+            if (Changed[Next]) End = Next;
+        }
+
+        if (modbus_write_bits (PushContext, ModbusPushConfig.BaseAddress+Start, End-Start+1, &Values[Start]) == -1)
+            return -1;
+
+        Start = End+1;
+    }
+    return 0;
+}  // pushCoils
+// ------------------------------------------------------------
+
+//! Write changed inputs as packed holding registers
+static int pushRegisters (const uint8_t* Values, const uint8_t* Changed)
+{
+    uint16_t Words[(NUM_CBUS_BOOL_INPUTS+15)/16];
+    uint8_t WordChanged[(NUM_CBUS_BOOL_INPUTS+15)/16];
+    int NumWords = (NUM_CBUS_BOOL_INPUTS+15)/16;
+    int InputCounter;
+    int Start;
+    int End;
+
+    memset (Words, 0, sizeof(Words));
+    memset (WordChanged, 0, sizeof(WordChanged));
+    for (InputCounter=0; InputCounter<NUM_CBUS_BOOL_INPUTS; InputCounter++)
+    {
+        if (Values[InputCounter]) Words[InputCounter/16] |= (1<<(InputCounter%16));
+        if (Changed[InputCounter]) WordChanged[InputCounter/16] = 1;
+    }
+
+    Start = 0;
+    while (Start < NumWords)
+    {
+        if (WordChanged[Start] == 0)
+        {
+            Start++;
+            continue;
+        }
+
+        End = Start;
+        while ((End+1 < NumWords) && (WordChanged[End+1])) End++;
+
+        if (modbus_write_registers (PushContext, ModbusPushConfig.BaseAddress+Start, End-Start+1, &Words[Start]) == -1)
+            return -1;
+
+        Start = End+1;
+    }
+    return 0;
+}  // pushRegisters
+// ------------------------------------------------------------
+
+static void* ModbusPushThreadFunc (void* Param)
+{
+    uint8_t Values[NUM_CBUS_BOOL_INPUTS];
+    uint8_t Changed[NUM_CBUS_BOOL_INPUTS];
+    int Connected = 0;
+    int SendRequest;
+    int Result;
+    uint64_t Now;
+    uint64_t LastConnectAttempt = 0;
+    uint64_t LastSync = 0;
+
+    while (PushStopRequest == 0)
+    {
+        Now = getCBUSTimestamp ();
+
+        if (Connected == 0)
+        {
+            if ((LastConnectAttempt == 0) || (Now - LastConnectAttempt >= PUSH_RECONNECT_DELAY))
+            {
+                LastConnectAttempt = Now;
+                if (modbus_connect (PushContext) == 0)
+                {
+                    Connected = 1;
+                    if (VerbosityLevel > 0)
+                        fprintf (stdout, "Connected to PLC %s:%d for push mode\n", ModbusPushConfig.Host, ModbusPushConfig.Port);
+
+                    pthread_mutex_lock (&PushLock);
+                    FullSyncRequest = 1;
+                    pthread_mutex_unlock (&PushLock);
+                }
+            }
+
+            if (Connected == 0)
+            {
+                usleep (10000);
+                continue;
+            }
+        }
+
+        SendRequest = 0;
+        pthread_mutex_lock (&PushLock);
+        if ((ModbusPushConfig.SyncPeriodMs != 0) && (Now - LastSync >= (uint64_t)ModbusPushConfig.SyncPeriodMs*1000))
+            FullSyncRequest = 1;
+
+        if (FullSyncRequest)
+        {
+            memcpy (Values, PushImage, sizeof(Values));
+            memset (Changed, 1, sizeof(Changed));
+            memset (PushChanged, 0, sizeof(PushChanged));
+            ChangePending = 0;
+            FullSyncRequest = 0;
+            LastSync = Now;
+            SendRequest = 1;
+        }
+        else if ((ChangePending) && (Now - FirstChangeTime >= (uint64_t)ModbusPushConfig.WindowMs*1000))
+        {
+            memcpy (Values, PushImage, sizeof(Values));
+            memcpy (Changed, PushChanged, sizeof(Changed));
+            memset (PushChanged, 0, sizeof(PushChanged));
+            ChangePending = 0;
+            SendRequest = 1;
+        }
+        pthread_mutex_unlock (&PushLock);
+
+        if (SendRequest)
+        {
+            if (ModbusPushConfig.Target == PUSH_TARGET_REGISTERS)
+                Result = pushRegisters (Values, Changed);
+            else
+                Result = pushCoils (Values, Changed);
+
+            if (Result != 0)
+            {
+                if (VerbosityLevel > 0)
+                    fprintf (stdout, "Push mode : write to PLC failed, reconnecting\n");
+                modbus_close (PushContext);
+                Connected = 0;
+                LastConnectAttempt = Now;
+                // Full image will be written after reconnection, so nothing is lost
+            }
+        }
+
+        usleep (1000);
+    }
+
+    if (Connected) modbus_close (PushContext);
+    return 0;
+}  // ModbusPushThreadFunc
+// ------------------------------------------------------------
+
+int startModbusPush (void)
+{
+    if ((ModbusPushConfig.Host[0] == 0) || (PushRunning)) return 0;
+
+    PushContext = modbus_new_tcp (ModbusPushConfig.Host, ModbusPushConfig.Port);
+    if (PushContext == 0) return -1;
+
+    PushStopRequest = 0;
+    FullSyncRequest = 1;
+    if (pthread_create (&PushThread, NULL, ModbusPushThreadFunc, NULL) != 0)
+    {
+        modbus_free (PushContext);
+        PushContext = 0;
+        return -1;
+    }
+
+    PushRunning = 1;
+    return 0;
+}  // startModbusPush
+// ------------------------------------------------------------
+
+void stopModbusPush (void)
+{
+    if (PushRunning == 0) return;
+
+    PushStopRequest = 1;
+    pthread_join (PushThread, NULL);
+    modbus_free (PushContext);
+    PushContext = 0;
+    PushRunning = 0;
+}  // stopModbusPush
+// ------------------------------------------------------------
+
+void notifyModbusPushInputs (const uint8_t* Inputs, int Count)
+{
+    int InputCounter;
+
+    if (PushRunning == 0) return;
+    if (Count > NUM_CBUS_BOOL_INPUTS) Count = NUM_CBUS_BOOL_INPUTS;
+
+    pthread_mutex_lock (&PushLock);
+    for (InputCounter=0; InputCounter<Count; InputCounter++)
+    {
+        if (Inputs[InputCounter] != PushImage[InputCounter])
+        {
+            PushImage[InputCounter] = Inputs[InputCounter];
+            PushChanged[InputCounter] = 1;
+            if (ChangePending == 0)
+            {
+                ChangePending = 1;
+                FirstChangeTime = getCBUSTimestamp ();
+            }
+        }
+    }
+    pthread_mutex_unlock (&PushLock);
+}  // notifyModbusPushInputs
+// ------------------------------------------------------------
@@ -0,0 +1,46 @@
+/*
+modbus_push.h
+cbus2modbus
+Report-by-exception : the gateway writes input changes to the PLC as a Modbus/TCP client
+Development : Benoit BOUCHEZ - M8718
+*/
+
+#ifndef __MODBUS_PUSH_H__
+#define __MODBUS_PUSH_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PUSH_TARGET_COILS       0       // One coil per input (FC15)
+#define PUSH_TARGET_REGISTERS   1       // 16 inputs packed in each holding register (FC16)
+
+//! Push mode configuration (set from command line before calling startModbusPush)
+typedef struct {
+    char Host[64];              // PLC IP address. Empty = push mode disabled
+    int Port;
+    int Target;                 // PUSH_TARGET_xxx
+    int BaseAddress;            // First coil or register written on the PLC
+    unsigned int WindowMs;      // Changes occuring within this time are sent together
+    unsigned int SyncPeriodMs;  // Full image is written with this period (0 = never)
+} TModbusPushConfig;
+
+extern TModbusPushConfig ModbusPushConfig;
+
+//! Starts push thread if a PLC address has been configured
+// \return 0 if push mode is disabled or thread is running
+int startModbusPush (void);
+
+//! Stops push thread and closes PLC connection
+void stopModbusPush (void);
+
+//! Give the current input image to the push thread. Changed inputs are written to the PLC
+void notifyModbusPushInputs (const uint8_t* Inputs, int Count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,112 @@
+/*
+cbus_rules_test.c
+cbus2modbus
+Self test of the local rule engine timers
+Development : Benoit BOUCHEZ - M8718
+
+A TON or TOF started when the rules are loaded, or when the state file is restored, must
+run for its full preset. The gateway clock is replaced by a simulated clock, and the rule
+file is written in a temporary directory. Exit code is 1 if a check fails.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "cbus_rules.h"
+
+unsigned int VerbosityLevel = 0;
+
+static uint64_t TestTime = 1000000000;     // Microseconds, as a monotonic clock long after boot
+static int FailCount = 0;
+
+#define CHECK(Condition)    checkResult ((Condition), #Condition, __LINE__)
+
+static void checkResult (int Condition, const char* Text, int Line)
+{
+    if (Condition) return;
+    fprintf (stdout, "FAILED line %d : %s\n", Line, Text);
+    FailCount++;
+}  // checkResult
+// ------------------------------------------------------------
+
+//! Simulated clock used by the rule engine
+uint64_t getCBUSTimestamp (void)
+{
+    return TestTime;
+}  // getCBUSTimestamp
+// ------------------------------------------------------------
+
+//! Advance the clock by Ms, run the timers and return the result of a rule
+static uint8_t scanRules (uint32_t Ms, int Rule)
+{
+    uint8_t Results[MAX_CBUS_RULES];
+    int Output;
+    uint8_t State;
+
+    TestTime += (uint64_t)Ms*1000;
+    processCBUSRuleTimers (getCBUSTimestamp());
+    while (getCBUSRuleOutputChange (&Output, &State));
+    exportCBUSRuleResults (Results);
+    return Results[Rule];
+}  // scanRules
+// ------------------------------------------------------------
+
+//! Write the rule file in a temporary directory and load it
+static int loadTestRules (void)
+{
+    char Directory[] = "/tmp/cbus_rules_testXXXXXX";
+    FILE* RuleFile;
+    int Count;
+
+    if (mkdtemp (Directory) == 0) return -1;
+    if (chdir (Directory) != 0) return -1;
+
+    RuleFile = fopen ("cbus_rules.dat", "wt");
+    if (RuleFile == 0) return -1;
+    fprintf (RuleFile, "Q1 = TON(NOT I1, 5000)\n");       // Timer started by the initial evaluation
+    fprintf (RuleFile, "Q2 = TON(I2, 5000)\n");           // Timer started by the restored input
+    fprintf (RuleFile, "Q3 = TOF(I3, 5000)\n");           // Timer started by the restored input going back to 0
+    fclose (RuleFile);
+
+    Count = loadCBUSRules ();
+    remove ("cbus_rules.dat");
+    if (chdir ("/") == 0) rmdir (Directory);
+    return Count;
+}  // loadTestRules
+// ------------------------------------------------------------
+
+int main (void)
+{
+    CHECK (loadTestRules () == 3);
+
+    // Inputs restored from the state file, as done by restoreCBUSIOState
+    setCBUSRuleInput (2, 1, getCBUSTimestamp());
+    setCBUSRuleInput (3, 1, getCBUSTimestamp());
+    setCBUSRuleInput (3, 0, getCBUSTimestamp());
+
+    CHECK (scanRules (0, 0) == 0);
+    CHECK (scanRules (0, 1) == 0);
+    CHECK (scanRules (0, 2) == 1);
+
+    CHECK (scanRules (1, 0) == 0);          // First timer scan
+    CHECK (scanRules (0, 1) == 0);
+    CHECK (scanRules (0, 2) == 1);
+
+    CHECK (scanRules (4990, 0) == 0);       // 4991 ms after load
+    CHECK (scanRules (0, 1) == 0);
+    CHECK (scanRules (0, 2) == 1);
+
+    CHECK (scanRules (10, 0) == 1);         // Preset elapsed
+    CHECK (scanRules (0, 1) == 1);
+    CHECK (scanRules (0, 2) == 0);
+
+    if (FailCount != 0)
+    {
+        fprintf (stdout, "%d checks failed\n", FailCount);
+        return 1;
+    }
+    fprintf (stdout, "All checks passed\n");
+    return 0;
+}  // main
+// ------------------------------------------------------------
@@ -0,0 +1,773 @@
+/*
+cbus_trafficgen.c
+cbus2modbus
+Synthetic CBUS traffic generator used to size and validate the gateway
+Development : Benoit BOUCHEZ - M8718
+
+The generator simulates a CBUS layout made of many producer nodes on a CAN interface (normally
+a vcan interface shared with cbus2modbus) :
+- long events (ACON/ACOF) and short events (ASON/ASOF) toggling the state of virtual events
+- status request exchanges (AREQ followed by the ARON/AROF answer of the producer)
+- data events (ACON1/ACON2/ACON3) and noise opcodes (cab and configuration traffic) that the
+  gateway has to receive and ignore
+The traffic is paced either at a fixed frame rate or at a percentage of the bus bitrate (frame
+lengths are computed like the gateway bus load estimation, 100 % = 125 kbit/s saturation).
+On vcan, frames are never lost by the bus : the pacing gives the load a real bus would have.
+
+When a Modbus/TCP server is given, the events of the gateway input configuration file are
+injected too, and the discrete inputs of the gateway are polled to check that the image follows
+the injected state. An input change is late when it is seen after the late limit, and lost when
+it has not been seen after the lost limit. The generator also answers the status requests sent
+by the gateway for these events, like the real producers would do.
+
+The exit code is 0 when no event has been lost and the image matches the injected state.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "SocketCBUS.h"
+#include "CBUS_OPC.h"
+#include "cbus_busload.h"
+#include "modbus.h"
+
+#define MAX_TRACKED_INPUTS      128         // Discrete inputs 0 to 127 of the gateway
+#define MAX_VIRTUAL_EVENTS      1000000
+#define MAX_LATENCY_SAMPLES     1000000
+#define GEN_PRIORITY            (0x0B<<7)   // Major priority 2, minor priority 3 (normal traffic)
+
+enum {
+    TRAFFIC_LONG = 0,
+    TRAFFIC_SHORT,
+    TRAFFIC_REQUEST,
+    TRAFFIC_DATA,
+    TRAFFIC_NOISE,
+    NUM_TRAFFIC_KINDS
+};
+
+static const char* TrafficNames[NUM_TRAFFIC_KINDS] = {"long events", "short events", "AREQ/ARON", "data events", "noise"};
+
+//! Gateway input driven by the generator
+typedef struct {
+    int Input;                  // Discrete input number in the gateway
+    uint16_t NN;
+    uint16_t EN;
+    uint8_t State;              // Last state sent = expected value in the Modbus image
+    uint8_t Pending;            // Change sent and not yet seen in the Modbus image
+    uint8_t Diverged;           // Image differs from State (already counted as lost or mismatch)
+    uint64_t ChangeTime;
+} TTrackedInput;
+
+//! Opcodes sent as noise (not handled by the gateway)
+static const uint8_t NoiseOpcodes[] = {OPC_QLOC, OPC_DKEEP, OPC_RLOC, OPC_DSPD, OPC_DFUN, OPC_NVRD, OPC_RQNPN};
+
+// Configuration
+static char InterfaceName[32] = "can0";
+static int NumNodes = 200;
+static int BaseNN = 1000;
+static int EventsPerNode = 8;
+static unsigned int CANID = 110;
+static int FrameRate = 0;               // Frames per second, 0 = use LoadPercent
+static int LoadPercent = 50;            // Percentage of Bitrate, 0 = as fast as the socket accepts
+static int Bitrate = CBUS_DEFAULT_BITRATE;
+static int Duration = 10;               // Seconds
+static int TrafficMix[NUM_TRAFFIC_KINDS] = {40, 20, 10, 10, 20};
+static int TrackedShare = 10;           // Percentage of long events sent for the gateway inputs
+static char ModbusHost[64] = "";
+static int ModbusPort = 502;
+static char InputsFile[256] = "cbus_inputs.dat";
+static int LateLimit = 50;              // ms
+static int LostLimit = 1000;            // ms
+static int PollPeriod = 5;              // ms
+static uint32_t RandomSeed = 1;
+static int VerbosityLevel = 0;
+
+static volatile int BreakRequest = 0;
+static volatile int PollStop = 0;
+
+static uint8_t* VirtualState;           // State of each virtual event (NumNodes*EventsPerNode)
+static uint32_t RandomState;
+
+// Statistics of the generator
+static uint64_t FramesSent = 0;
+static uint64_t BitsSent = 0;
+static uint64_t KindCount[NUM_TRAFFIC_KINDS];
+static uint64_t QueueFull = 0;
+static uint64_t SendErrors = 0;
+static uint64_t RequestsAnswered = 0;
+
+// Protected by TrackLock
+static pthread_mutex_t TrackLock = PTHREAD_MUTEX_INITIALIZER;
+static TTrackedInput Tracked[MAX_TRACKED_INPUTS];
+static int NumTracked = 0;
+static uint64_t TrackedChanges = 0;
+static uint64_t ConfirmedChanges = 0;
+static uint64_t LateChanges = 0;
+static uint64_t LostChanges = 0;
+static uint64_t ImageMismatches = 0;
+static uint64_t ModbusErrors = 0;
+static uint32_t* LatencySamples;        // Microseconds
+static uint32_t NumLatencySamples = 0;
+
+static uint64_t getTimeUs (void)
+{
+    struct timespec Now;
+
+    clock_gettime (CLOCK_MONOTONIC, &Now);
+    return ((uint64_t)Now.tv_sec*1000000)+(Now.tv_nsec/1000);
+}  // getTimeUs
+// ------------------------------------------------------------
+
+//! Xorshift generator : reproducible traffic for a given seed
+static uint32_t getRandom (void)
+{
+    RandomState ^= RandomState<<13;
+    RandomState ^= RandomState>>17;
+    RandomState ^= RandomState<<5;
+    return RandomState;
+}  // getRandom
+// ------------------------------------------------------------
+
+void sig_handler (int signo)
+{
+    if (signo == SIGINT)
+        BreakRequest = 1;
+}  // sig_handler
+// ------------------------------------------------------------
+
+//! Send a frame, waiting while the socket TX queue is full
+static void sendFrame (unsigned char DLC, unsigned char* Data)
+{
+    unsigned int ID;
+
+    ID = GEN_PRIORITY|CANID;
+    while (sendCBUSRaw (ID, DLC, Data) != 0)
+    {
+        if ((errno != ENOBUFS) && (errno != EAGAIN))
+        {
+            SendErrors++;
+            return;
+        }
+        QueueFull++;
+        if (BreakRequest) return;
+        usleep (100);
+    }
+    FramesSent++;
+    BitsSent += getCBUSFrameBits (ID, DLC);
+}  // sendFrame
+// ------------------------------------------------------------
+
+static void sendEventFrame (uint8_t Opcode, uint16_t NN, uint16_t EN)
+{
+    unsigned char Data[8];
+
+    Data[0] = Opcode;
+    Data[1] = NN>>8;
+    Data[2] = NN&0xFF;
+    Data[3] = EN>>8;
+    Data[4] = EN&0xFF;
+    sendFrame (5, Data);
+}  // sendEventFrame
+// ------------------------------------------------------------
+
+//! Read the gateway input configuration file (same format as cbus2modbus, optional fields are ignored)
+static int readTrackedInputs (void)
+{
+    FILE* ConfigFile;
+    char Buffer [256];
+    int InputNumber, NN, EN;
+
+    ConfigFile = fopen (InputsFile, "rt");
+    if (ConfigFile == 0) return -1;
+
+    while (fgets (Buffer, 256, ConfigFile))
+    {
+        if (Buffer[0] == '#') continue;
+        if (sscanf (Buffer, "%d %d %d", &InputNumber, &NN, &EN) != 3) continue;
+        if ((InputNumber < 0) || (InputNumber >= MAX_TRACKED_INPUTS)) continue;
+        if ((NN <= 0) || (NN >= 65535) || (EN < 0) || (EN >= 65535)) continue;
+        if (NumTracked >= MAX_TRACKED_INPUTS) break;
+
+        Tracked[NumTracked].Input = InputNumber;
+        Tracked[NumTracked].NN = NN;
+        Tracked[NumTracked].EN = EN;
+        Tracked[NumTracked].State = 0;
+        Tracked[NumTracked].Pending = 0;
+        Tracked[NumTracked].Diverged = 0;
+        NumTracked++;
+    }
+    fclose (ConfigFile);
+    return 0;
+}  // readTrackedInputs
+// ------------------------------------------------------------
+
+//! Send a new state for a gateway input and start measuring the time until it is seen in the Modbus image
+static void changeTrackedInput (int Index, uint8_t State)
+{
+    pthread_mutex_lock (&TrackLock);
+    Tracked[Index].State = State;
+    Tracked[Index].Pending = 1;
+    Tracked[Index].ChangeTime = getTimeUs ();
+    TrackedChanges++;
+    pthread_mutex_unlock (&TrackLock);
+
+    sendEventFrame (State ? OPC_ACON : OPC_ACOF, Tracked[Index].NN, Tracked[Index].EN);
+}  // changeTrackedInput
+// ------------------------------------------------------------
+
+//! Toggle a gateway input which has no change in progress
+// \return 0 if all inputs are waiting for the Modbus image
+static int toggleTrackedInput (void)
+{
+    int Start;
+    int Count;
+    int Index;
+    int Found;
+    uint8_t State;
+
+    Start = getRandom() % NumTracked;
+    Found = -1;
+    State = 0;
+    pthread_mutex_lock (&TrackLock);
+    for (Count=0; Count<NumTracked; Count++)
+    {
+        Index = (Start+Count) % NumTracked;
+        if (Tracked[Index].Pending == 0)
+        {
+            Found = Index;
+            State = Tracked[Index].State ? 0 : 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock (&TrackLock);
+
+    if (Found < 0) return 0;
+    changeTrackedInput (Found, State);
+    return 1;
+}  // toggleTrackedInput
+// ------------------------------------------------------------
+
+//! Generate one traffic element of the given kind from a random virtual event
+static void generateTraffic (int Kind)
+{
+    uint32_t Event;
+    uint16_t NN;
+    uint16_t EN;
+    uint8_t Opcode;
+    unsigned char Data[8];
+    int Length;
+    int Count;
+
+    Event = getRandom() % (NumNodes*EventsPerNode);
+    NN = BaseNN+(Event/EventsPerNode);
+    EN = 1+(Event%EventsPerNode);
+
+    switch (Kind)
+    {
+        case TRAFFIC_LONG :
+            if ((NumTracked > 0) && ((int)(getRandom()%100) < TrackedShare))
+            {
+                if (toggleTrackedInput ()) break;
+            }
+            VirtualState[Event] ^= 1;
+            sendEventFrame (VirtualState[Event] ? OPC_ACON : OPC_ACOF, NN, EN);
+            break;
+        case TRAFFIC_SHORT :
+            VirtualState[Event] ^= 1;
+            sendEventFrame (VirtualState[Event] ? OPC_ASON : OPC_ASOF, NN, EN);
+            break;
+        case TRAFFIC_REQUEST :
+            // A consumer asks for the state, the producer answers
+            sendEventFrame (OPC_AREQ, NN, EN);
+            sendEventFrame (VirtualState[Event] ? OPC_ARON : OPC_AROF, NN, EN);
+            break;
+        case TRAFFIC_DATA :
+            switch (getRandom()%3)
+            {
+                case 0 : Opcode = OPC_ACON1; break;
+                case 1 : Opcode = OPC_ACON2; break;
+                default : Opcode = OPC_ACON3; break;
+            }
+            Data[0] = Opcode;
+            Data[1] = NN>>8;
+            Data[2] = NN&0xFF;
+            Data[3] = EN>>8;
+            Data[4] = EN&0xFF;
+            for (Count=5; Count<CBUS_OPC_LENGTH(Opcode); Count++)
+                Data[Count] = getRandom()&0xFF;
+            sendFrame (CBUS_OPC_LENGTH(Opcode), Data);
+            break;
+        default :
+            Opcode = NoiseOpcodes[getRandom() % sizeof(NoiseOpcodes)];
+            Length = CBUS_OPC_LENGTH(Opcode);
+            Data[0] = Opcode;
+            for (Count=1; Count<Length; Count++)
+                Data[Count] = getRandom()&0xFF;
+            sendFrame (Length, Data);
+            break;
+    }
+    KindCount[Kind]++;
+}  // generateTraffic
+// ------------------------------------------------------------
+
+//! Pick a traffic kind according to the configured mix
+static int selectTrafficKind (int MixTotal)
+{
+    int Kind;
+    int Value;
+
+    Value = getRandom() % MixTotal;
+    for (Kind=0; Kind<NUM_TRAFFIC_KINDS-1; Kind++)
+    {
+        if (Value < TrafficMix[Kind]) return Kind;
+        Value -= TrafficMix[Kind];
+    }
+    return NUM_TRAFFIC_KINDS-1;
+}  // selectTrafficKind
+// ------------------------------------------------------------
+
+//! Answer status requests sent on the bus for the events we produce
+static void processReceivedFrames (void)
+{
+    unsigned int ID;
+    unsigned char Data[8];
+    unsigned int DLC;
+    uint16_t NN;
+    uint16_t EN;
+    int Index;
+    uint8_t State;
+    int Found;
+    uint32_t Event;
+
+    while ((DLC = getNextCBUSMessage (&ID, Data)) != 0xFFFFFFFF)
+    {
+        if (ID & (CBUS_RTR_FLAG|CBUS_ERR_FLAG|CBUS_EFF_FLAG)) continue;
+        if ((DLC & 0x0F) < 5) continue;
+        if ((Data[0] != OPC_AREQ) && (Data[0] != OPC_ASRQ)) continue;
+
+        NN = (Data[1]<<8)+Data[2];
+        EN = (Data[3]<<8)+Data[4];
+        Found = 0;
+        State = 0;
+
+        if (Data[0] == OPC_AREQ)
+        {
+            pthread_mutex_lock (&TrackLock);
+            for (Index=0; Index<NumTracked; Index++)
+            {
+                if ((Tracked[Index].NN == NN) && (Tracked[Index].EN == EN))
+                {
+                    State = Tracked[Index].State;
+                    Found = 1;
+                    break;
+                }
+            }
+            pthread_mutex_unlock (&TrackLock);
+        }
+
+        if ((Found == 0) && (NN >= BaseNN) && (NN < BaseNN+NumNodes) && (EN >= 1) && (EN <= EventsPerNode))
+        {
+            Event = ((NN-BaseNN)*EventsPerNode)+(EN-1);
+            State = VirtualState[Event];
+            Found = 1;
+        }
+        if (Found == 0) continue;
+
+        if (Data[0] == OPC_AREQ)
+            sendEventFrame (State ? OPC_ARON : OPC_AROF, NN, EN);
+        else
+            sendEventFrame (State ? OPC_ARSON : OPC_ARSOF, NN, EN);
+        RequestsAnswered++;
+    }
+}  // processReceivedFrames
+// ------------------------------------------------------------
+
+//! Poll the gateway discrete inputs and compare them with the injected state
+static void* ModbusPollThread (void* Arg)
+{
+    modbus_t* Context;
+    uint8_t Bits[MAX_TRACKED_INPUTS];
+    uint64_t Now;
+    uint32_t Latency;
+    int Index;
+    TTrackedInput* Input;
+
+    Context = modbus_new_tcp (ModbusHost, ModbusPort);
+    if (Context == 0) return 0;
+
+    while (PollStop == 0)
+    {
+        if (modbus_connect (Context) != 0)
+        {
+            ModbusErrors++;
+            usleep (100000);
+            continue;
+        }
+
+        while (PollStop == 0)
+        {
+            if (modbus_read_input_bits (Context, 0, MAX_TRACKED_INPUTS, Bits) != MAX_TRACKED_INPUTS)
+            {
+                ModbusErrors++;
+                modbus_close (Context);
+                break;
+            }
+            Now = getTimeUs ();
+
+            pthread_mutex_lock (&TrackLock);
+            for (Index=0; Index<NumTracked; Index++)
+            {
+                Input = &Tracked[Index];
+                if (Input->Pending)
+                {
+                    if (Bits[Input->Input] == Input->State)
+                    {
+                        Latency = (uint32_t)(Now-Input->ChangeTime);
+                        if (NumLatencySamples < MAX_LATENCY_SAMPLES)
+                            LatencySamples[NumLatencySamples++] = Latency;
+                        if (Latency > (uint32_t)LateLimit*1000)
+                            LateChanges++;
+                        ConfirmedChanges++;
+                        Input->Pending = 0;
+                        Input->Diverged = 0;
+                    }
+                    else if (Now-Input->ChangeTime > (uint64_t)LostLimit*1000)
+                    {
+                        if (VerbosityLevel > 0)
+                            fprintf (stdout, "Lost change : input %d NN:%d EN:%d state %d\n", Input->Input, Input->NN, Input->EN, Input->State);
+                        LostChanges++;
+                        Input->Pending = 0;
+                        Input->Diverged = 1;
+                    }
+                }
+                else if (Bits[Input->Input] != Input->State)
+                {
+                    // Input changed without event from the generator
+                    if (Input->Diverged == 0) ImageMismatches++;
+                    Input->Diverged = 1;
+                }
+                else
+                    Input->Diverged = 0;
+            }
+            pthread_mutex_unlock (&TrackLock);
+
+            usleep (PollPeriod*1000);
+        }
+    }
+
+    modbus_close (Context);
+    modbus_free (Context);
+    return 0;
+}  // ModbusPollThread
+// ------------------------------------------------------------
+
+static int compareLatency (const void* A, const void* B)
+{
+    uint32_t ValueA = *(const uint32_t*)A;
+    uint32_t ValueB = *(const uint32_t*)B;
+
+    return (ValueA > ValueB) - (ValueA < ValueB);
+}  // compareLatency
+// ------------------------------------------------------------
+
+static void printReport (uint64_t ElapsedUs)
+{
+    int Kind;
+    double Seconds;
+    uint64_t Sum;
+    uint32_t Index;
+
+    Seconds = (double)ElapsedUs/1000000.0;
+    if (Seconds <= 0) Seconds = 1;
+
+    fprintf (stdout, "\nDuration : %.1f s\n", Seconds);
+    fprintf (stdout, "Frames sent : %llu (%.0f frames/s)\n", (unsigned long long)FramesSent, FramesSent/Seconds);
+    fprintf (stdout, "Equivalent bus load : %.1f %% of %d bit/s\n", (BitsSent*100.0)/(Seconds*Bitrate), Bitrate);
+    for (Kind=0; Kind<NUM_TRAFFIC_KINDS; Kind++)
+        fprintf (stdout, "  %-14s : %llu\n", TrafficNames[Kind], (unsigned long long)KindCount[Kind]);
+    fprintf (stdout, "Status requests answered : %llu\n", (unsigned long long)RequestsAnswered);
+    fprintf (stdout, "TX queue full : %llu, send errors : %llu\n", (unsigned long long)QueueFull, (unsigned long long)SendErrors);
+
+    if (ModbusHost[0] == 0) return;
+
+    fprintf (stdout, "\nInput changes : %llu sent, %llu seen, %llu late (> %d ms), %llu lost (> %d ms)\n",
+             (unsigned long long)TrackedChanges, (unsigned long long)ConfirmedChanges,
+             (unsigned long long)LateChanges, LateLimit, (unsigned long long)LostChanges, LostLimit);
+    fprintf (stdout, "Image mismatches : %llu, Modbus errors : %llu\n", (unsigned long long)ImageMismatches, (unsigned long long)ModbusErrors);
+
+    if (NumLatencySamples == 0) return;
+    qsort (LatencySamples, NumLatencySamples, sizeof(uint32_t), compareLatency);
+    Sum = 0;
+    for (Index=0; Index<NumLatencySamples; Index++)
+        Sum += LatencySamples[Index];
+    fprintf (stdout, "Latency (ms, includes %d ms poll period) : min %.1f  avg %.1f  p50 %.1f  p95 %.1f  p99 %.1f  max %.1f\n",
+             PollPeriod,
+             LatencySamples[0]/1000.0,
+             (Sum/(double)NumLatencySamples)/1000.0,
+             LatencySamples[NumLatencySamples/2]/1000.0,
+             LatencySamples[(NumLatencySamples*95)/100]/1000.0,
+             LatencySamples[(NumLatencySamples*99)/100]/1000.0,
+             LatencySamples[NumLatencySamples-1]/1000.0);
+}  // printReport
+// ------------------------------------------------------------
+
+//! Read traffic mix "long,short,areq,data,noise" (relative weights)
+static void parseTrafficMix (char* Value)
+{
+    int Kind;
+    char* Token;
+
+    Token = strtok (Value, ",");
+    for (Kind=0; Kind<NUM_TRAFFIC_KINDS; Kind++)
+    {
+        TrafficMix[Kind] = Token ? atoi (Token) : 0;
+        if (TrafficMix[Kind] < 0) TrafficMix[Kind] = 0;
+        Token = strtok (NULL, ",");
+    }
+}  // parseTrafficMix
+// ------------------------------------------------------------
+
+void ParseCLIParameters (int argc, char* argv[])
+{
+    int ParmCount;
+    int TestInt;
+    char* Value;
+
+    for (ParmCount = 1; ParmCount<argc; ParmCount++)
+    {
+        if (ParmCount >= (argc - 1))
+        {
+            fprintf (stderr, "Missing or invalid value for parameter %s\n", argv[ParmCount]);
+            return;
+        }
+        Value = argv[ParmCount + 1];
+        TestInt = atoi (Value);
+
+        if (strcmp(argv[ParmCount], "--interface") == 0)
+            strncpy (InterfaceName, Value, sizeof(InterfaceName)-1);
+        else if (strcmp(argv[ParmCount], "--nodes") == 0)
+        {
+            if (TestInt > 0) NumNodes = TestInt;
+        }
+        else if (strcmp(argv[ParmCount], "--base-nn") == 0)
+        {
+            if ((TestInt > 0) && (TestInt < 65535)) BaseNN = TestInt;
+        }
+        else if (strcmp(argv[ParmCount], "--events") == 0)
+        {
+            if (TestInt > 0) EventsPerNode = TestInt;
+        }
+        else if (strcmp(argv[ParmCount], "--can-id") == 0)
+        {
+            if ((TestInt >= 1) && (TestInt <= 127)) CANID = TestInt;
+        }
+        else if (strcmp(argv[ParmCount], "--rate") == 0)
+        {
+            if (TestInt >= 0) FrameRate = TestInt;
+        }
+        else if (strcmp(argv[ParmCount], "--load") == 0)
+        {
+            if (TestInt >= 0) LoadPercent = TestInt;
+        }
+        else if (strcmp(argv[ParmCount], "--bitrate") == 0)
+        {
+            if (TestInt > 0) Bitrate = TestInt;
+        }
+        else if (strcmp(argv[ParmCount], "--duration") == 0)
+        {
+            if (TestInt > 0) Duration = TestInt;
+        }
+        else if (strcmp(argv[ParmCount], "--mix") == 0)
+            parseTrafficMix (Value);
+        else if (strcmp(argv[ParmCount], "--tracked-share") == 0)
+        {
+            if ((TestInt >= 0) && (TestInt <= 100)) TrackedShare = TestInt;
+        }
+        else if (strcmp(argv[ParmCount], "--modbus-host") == 0)
+            strncpy (ModbusHost, Value, sizeof(ModbusHost)-1);
+        else if (strcmp(argv[ParmCount], "--modbus-port") == 0)
+        {
+            if ((TestInt > 0) && (TestInt <= 65535)) ModbusPort = TestInt;
+        }
+        else if (strcmp(argv[ParmCount], "--inputs") == 0)
+            strncpy (InputsFile, Value, sizeof(InputsFile)-1);
+        else if (strcmp(argv[ParmCount], "--late") == 0)
+        {
+            if (TestInt > 0) LateLimit = TestInt;
+        }
+        else if (strcmp(argv[ParmCount], "--lost") == 0)
+        {
+            if (TestInt > 0) LostLimit = TestInt;
+        }
+        else if (strcmp(argv[ParmCount], "--poll") == 0)
+        {
+            if (TestInt > 0) PollPeriod = TestInt;
+        }
+        else if (strcmp(argv[ParmCount], "--seed") == 0)
+        {
+            if (TestInt != 0) RandomSeed = TestInt;
+        }
+        else if (strcmp(argv[ParmCount], "--verbose") == 0)
+            VerbosityLevel = TestInt;
+        else
+            fprintf (stderr, "Unknown parameter %s\n", argv[ParmCount]);
+
+        ParmCount += 1;     // Jump over the argument value
+    }
+}  // ParseCLIParameters
+// ------------------------------------------------------------
+
+int main (int argc, char* argv[])
+{
+    pthread_t PollThread;
+    int PollRunning;
+    int MixTotal;
+    int Kind;
+    int Index;
+    uint64_t StartTime;
+    uint64_t EndTime;
+    uint64_t Now;
+    uint64_t LastBits;
+    uint64_t LastFrames;
+    double NextSend;            // Time of next traffic element (microseconds)
+    double BitTime;             // Microseconds per bit at the requested load
+    int Pending;
+
+    fprintf (stdout, "cbus_trafficgen : CBUS traffic generator for cbus2modbus\n");
+    ParseCLIParameters (argc, argv);
+
+    MixTotal = 0;
+    for (Kind=0; Kind<NUM_TRAFFIC_KINDS; Kind++)
+        MixTotal += TrafficMix[Kind];
+    if (MixTotal == 0)
+    {
+        fprintf (stderr, "Traffic mix is empty\n");
+        return 2;
+    }
+    if ((long)NumNodes*EventsPerNode > MAX_VIRTUAL_EVENTS)
+    {
+        fprintf (stderr, "Too many virtual events (maximum %d)\n", MAX_VIRTUAL_EVENTS);
+        return 2;
+    }
+    if (BaseNN+NumNodes > 65535) NumNodes = 65535-BaseNN;
+
+    VirtualState = (uint8_t*)calloc (NumNodes*EventsPerNode, 1);
+    LatencySamples = (uint32_t*)malloc (MAX_LATENCY_SAMPLES*sizeof(uint32_t));
+    if ((VirtualState == 0) || (LatencySamples == 0))
+    {
+        fprintf (stderr, "Not enough memory\n");
+        return 2;
+    }
+    RandomState = RandomSeed;
+
+    if (createCBUSSocket (InterfaceName) != 0)
+    {
+        fprintf (stderr, "Can not open CAN interface %s\n", InterfaceName);
+        return 2;
+    }
+
+    PollRunning = 0;
+    if (ModbusHost[0] != 0)
+    {
+        if (readTrackedInputs () != 0)
+            fprintf (stderr, "Can not read %s : Modbus image will not be checked\n", InputsFile);
+        for (Index=0; Index<NumTracked; Index++)
+        {
+            if ((Tracked[Index].NN >= BaseNN) && (Tracked[Index].NN < BaseNN+NumNodes))
+            {
+                fprintf (stderr, "Warning : NN %d of the gateway inputs is used by virtual nodes\n", Tracked[Index].NN);
+                break;
+            }
+        }
+        if (NumTracked > 0)
+        {
+            if (pthread_create (&PollThread, NULL, ModbusPollThread, NULL) == 0)
+                PollRunning = 1;
+        }
+    }
+
+    signal (SIGINT, sig_handler);
+
+    fprintf (stdout, "%d nodes (NN %d to %d), %d events per node, %d gateway inputs\n", NumNodes, BaseNN, BaseNN+NumNodes-1, EventsPerNode, NumTracked);
+    if (FrameRate > 0)
+        fprintf (stdout, "Rate : %d frames/s during %d s\n", FrameRate, Duration);
+    else if (LoadPercent > 0)
+        fprintf (stdout, "Load : %d %% of %d bit/s during %d s\n", LoadPercent, Bitrate, Duration);
+    else
+        fprintf (stdout, "Load : maximum during %d s\n", Duration);
+
+    // Start from a known state for all gateway inputs
+    for (Index=0; Index<NumTracked; Index++)
+        changeTrackedInput (Index, 0);
+
+    BitTime = (LoadPercent > 0) ? (100.0*1000000.0)/((double)Bitrate*LoadPercent) : 0;
+    StartTime = getTimeUs ();
+    EndTime = StartTime+((uint64_t)Duration*1000000);
+    NextSend = (double)StartTime;
+
+    while (BreakRequest == 0)
+    {
+        Now = getTimeUs ();
+        if (Now >= EndTime) break;
+
+        processReceivedFrames ();
+
+        if ((FrameRate > 0) || (LoadPercent > 0))
+        {
+            if ((double)Now < NextSend)
+            {
+                if (NextSend-(double)Now > 200)
+                    usleep (100);
+                continue;
+            }
+        }
+
+        LastBits = BitsSent;
+        LastFrames = FramesSent;
+        generateTraffic (selectTrafficKind (MixTotal));
+
+        // Next element is sent when the bus would be free again at the requested load
+        if (FrameRate > 0)
+            NextSend += (double)(FramesSent-LastFrames)*1000000.0/FrameRate;
+        else
+            NextSend += (double)(BitsSent-LastBits)*BitTime;
+        // Do not try to catch up more than 100 ms of delay
+        if (NextSend < (double)Now-100000.0)
+            NextSend = (double)Now-100000.0;
+    }
+    EndTime = getTimeUs ();
+
+    // Give the gateway time to report the last changes
+    if (PollRunning)
+    {
+        do
+        {
+            processReceivedFrames ();
+            usleep (1000);
+            pthread_mutex_lock (&TrackLock);
+            Pending = 0;
+            for (Index=0; Index<NumTracked; Index++)
+                Pending += Tracked[Index].Pending;
+            pthread_mutex_unlock (&TrackLock);
+        } while ((Pending > 0) && (getTimeUs()-EndTime < (uint64_t)(LostLimit+500)*1000));
+
+        PollStop = 1;
+        pthread_join (PollThread, NULL);
+    }
+
+    closeCBUSSocket ();
+    printReport (EndTime-StartTime);
+
+    free (VirtualState);
+    free (LatencySamples);
+
+    if ((LostChanges > 0) || (ImageMismatches > 0)) return 1;
+    return 0;
+}  // main
+// ------------------------------------------------------------
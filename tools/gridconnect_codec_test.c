@@ -0,0 +1,157 @@
+/*
+gridconnect_codec_test.c
+cbus2modbus
+Self test of the GridConnect frame encoder and decoder
+Development : Benoit BOUCHEZ - M8718
+
+Checks the decoding of standard, extended and RTR frames, the handling of invalid and
+incomplete frames, and encodes then decodes random frames with the text received in
+chunks of all sizes (a frame can be split anywhere by TCP).
+Build once with the default flags (SSE2 or NEON delimiter search), and once with
+-mno-sse2 on x86 to test the memchr path. Exit code is 1 if a check fails.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "SocketCBUS.h"
+#include "cbus_gridconnect.h"
+
+#define RANDOM_FRAMES           500
+#define RANDOM_BATCH            37          // Frames decoded per call, so batches end in the middle of the text
+
+static int FailCount = 0;
+
+#define CHECK(Condition)    checkResult ((Condition), #Condition, __LINE__)
+
+static void checkResult (int Condition, const char* Text, int Line)
+{
+    if (Condition) return;
+    fprintf (stdout, "FAILED line %d : %s\n", Line, Text);
+    FailCount++;
+}  // checkResult
+// ------------------------------------------------------------
+
+static void testKnownFrames (void)
+{
+    TGridConnectParser Parser;
+    TCBUSFrame Frames[16];
+    int Count;
+    const char* Text = ":SB020N9000010001;\r\n:X00080004N;:SB020R;junk;:S00A0N0102030405060708;:SB02";
+
+    memset (&Parser, 0, sizeof(Parser));
+    strcpy (Parser.Text, Text);
+    Parser.Length = strlen (Text);
+    Count = decodeGridConnectFrames (&Parser, Frames, 16);
+
+    CHECK (Count == 4);
+    CHECK (Parser.Errors == 1);
+    CHECK ((Frames[0].ID == 0x581) && (Frames[0].DLC == 5) && (Frames[0].Data[0] == 0x90) && (Frames[0].Data[4] == 1));
+    CHECK ((Frames[1].ID == (CBUS_EFF_FLAG|4)) && (Frames[1].DLC == 0));
+    CHECK (Frames[2].ID == (0x581|CBUS_RTR_FLAG));
+    CHECK ((Frames[3].ID == 5) && (Frames[3].DLC == 8) && (Frames[3].Data[7] == 8));
+
+    // Incomplete frame is kept, and decoded when the end is received
+    CHECK ((Parser.Length == 5) && (memcmp (Parser.Text, ":SB02", 5) == 0));
+    memcpy (&Parser.Text[Parser.Length], "0N91;", 5);
+    Parser.Length += 5;
+    Count = decodeGridConnectFrames (&Parser, Frames, 16);
+    CHECK ((Count == 1) && (Frames[0].Data[0] == 0x91) && (Parser.Length == 0));
+
+    // Text without delimiter filling the buffer is dropped
+    memset (&Parser, 0, sizeof(Parser));
+    memset (Parser.Text, 'x', GRIDCONNECT_TEXT_SIZE);
+    Parser.Length = GRIDCONNECT_TEXT_SIZE;
+    Count = decodeGridConnectFrames (&Parser, Frames, 16);
+    CHECK ((Count == 0) && (Parser.Errors == 1) && (Parser.Length == 0));
+}  // testKnownFrames
+// ------------------------------------------------------------
+
+static void testRandomFrames (void)
+{
+    static TCBUSFrame Sent[RANDOM_FRAMES];
+    static char Text[RANDOM_FRAMES*GRIDCONNECT_MAX_FRAME];
+    TGridConnectParser Parser;
+    TCBUSFrame Frames[RANDOM_BATCH];
+    int TextLength = 0;
+    int FrameCounter;
+    int ByteCounter;
+    int Chunk;
+    int Offset;
+    int Size;
+    int Received;
+    int Count;
+    TCBUSFrame* Expected;
+
+    srand (3);
+    for (FrameCounter=0; FrameCounter<RANDOM_FRAMES; FrameCounter++)
+    {
+        if (rand()%3 == 0)
+            Sent[FrameCounter].ID = CBUS_EFF_FLAG|(rand()&0x1FFFFFFF);
+        else
+            Sent[FrameCounter].ID = rand()&0x7FF;
+        if (rand()%10 == 0) Sent[FrameCounter].ID |= CBUS_RTR_FLAG;
+        Sent[FrameCounter].DLC = (Sent[FrameCounter].ID & CBUS_RTR_FLAG) ? 0 : rand()%9;
+        for (ByteCounter=0; ByteCounter<8; ByteCounter++)
+            Sent[FrameCounter].Data[ByteCounter] = rand();
+        TextLength += encodeGridConnectFrame (Sent[FrameCounter].ID, Sent[FrameCounter].DLC, Sent[FrameCounter].Data, &Text[TextLength]);
+    }
+
+    for (Chunk=1; Chunk<200; Chunk+=7)
+    {
+        memset (&Parser, 0, sizeof(Parser));
+        Received = 0;
+        Offset = 0;
+        while (Offset < TextLength)
+        {
+            Size = TextLength-Offset;
+            if (Size > Chunk) Size = Chunk;
+            if (Size > GRIDCONNECT_TEXT_SIZE-Parser.Length) Size = GRIDCONNECT_TEXT_SIZE-Parser.Length;
+            memcpy (&Parser.Text[Parser.Length], &Text[Offset], Size);
+            Parser.Length += Size;
+            Offset += Size;
+
+            do
+            {
+                Count = decodeGridConnectFrames (&Parser, Frames, RANDOM_BATCH);
+                for (FrameCounter=0; (FrameCounter<Count) && (Received+FrameCounter<RANDOM_FRAMES); FrameCounter++)
+                {
+                    Expected = &Sent[Received+FrameCounter];
+                    if ((Frames[FrameCounter].ID != Expected->ID) || (Frames[FrameCounter].DLC != Expected->DLC) ||
+                        (memcmp (Frames[FrameCounter].Data, Expected->Data, Expected->DLC) != 0))
+                    {
+                        fprintf (stdout, "FAILED : frame %d is different (chunk %d)\n", Received+FrameCounter, Chunk);
+                        FailCount++;
+                    }
+                }
+                Received += Count;
+            } while (Count == RANDOM_BATCH);
+        }
+        CHECK (Received == RANDOM_FRAMES);
+        CHECK (Parser.Errors == 0);
+    }
+}  // testRandomFrames
+// ------------------------------------------------------------
+
+int main (void)
+{
+#if defined(__SSE2__)
+    fprintf (stdout, "GridConnect codec test (SSE2 delimiter search)\n");
+#elif defined(__ARM_NEON)
+    fprintf (stdout, "GridConnect codec test (NEON delimiter search)\n");
+#else
+    fprintf (stdout, "GridConnect codec test (memchr delimiter search)\n");
+#endif
+
+    testKnownFrames ();
+    testRandomFrames ();
+
+    if (FailCount != 0)
+    {
+        fprintf (stdout, "%d checks failed\n", FailCount);
+        return 1;
+    }
+    fprintf (stdout, "All checks passed\n");
+    return 0;
+}  // main
+// ------------------------------------------------------------
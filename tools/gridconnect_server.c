@@ -0,0 +1,319 @@
+/*
+gridconnect_server.c
+cbus2modbus
+Stand-in CBUS server using the GridConnect protocol over TCP
+Development : Benoit BOUCHEZ - M8718
+
+Test replacement for a CANETHER or a CBUS server, for cbus2modbus started with
+--transport gridconnect. Frames received from a client are sent to all other clients. When a
+CAN interface is given (vcan or real interface), frames are also exchanged with it, so
+cbus_trafficgen running on a vcan interface can drive a gateway connected over TCP.
+Frames sent to a client during one loop are written with a single send() call.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "SocketCBUS.h"
+#include "cbus_gridconnect.h"
+
+#define MAX_CLIENTS             16
+#define CLIENT_TX_SIZE          65536       // Text waiting to be sent to a client
+
+typedef struct {
+    int Socket;
+    TGridConnectParser Parser;
+    char TXText[CLIENT_TX_SIZE];
+    int TXLength;
+} TGridConnectClient;
+
+static int ServerPort = GRIDCONNECT_DEFAULT_PORT;
+static char CANInterface[32] = "";
+static int VerbosityLevel = 0;
+
+static volatile int BreakRequest = 0;
+static int ListenSocket = -1;
+static int CANBridge = 0;
+static TGridConnectClient Clients[MAX_CLIENTS];
+
+static uint64_t FramesFromClients = 0;
+static uint64_t FramesFromCAN = 0;
+static uint64_t OverflowFrames = 0;
+
+void sig_handler (int signo)
+{
+    if (signo == SIGINT)
+        BreakRequest = 1;
+}  // sig_handler
+// ------------------------------------------------------------
+
+static int openListenSocket (void)
+{
+    struct sockaddr_in Address;
+    int Flag;
+
+    ListenSocket = socket (AF_INET, SOCK_STREAM, 0);
+    if (ListenSocket == -1) return -1;
+
+    Flag = 1;
+    setsockopt (ListenSocket, SOL_SOCKET, SO_REUSEADDR, &Flag, sizeof(Flag));
+    memset (&Address, 0, sizeof(Address));
+    Address.sin_family = AF_INET;
+    Address.sin_addr.s_addr = htonl (INADDR_ANY);
+    Address.sin_port = htons (ServerPort);
+    if (bind (ListenSocket, (struct sockaddr*)&Address, sizeof(Address)) != 0) return -1;
+    if (listen (ListenSocket, MAX_CLIENTS) != 0) return -1;
+    return 0;
+}  // openListenSocket
+// ------------------------------------------------------------
+
+static void acceptClient (void)
+{
+    int Socket;
+    int Index;
+    int Flag;
+
+    Socket = accept (ListenSocket, 0, 0);
+    if (Socket == -1) return;
+
+    for (Index=0; Index<MAX_CLIENTS; Index++)
+    {
+        if (Clients[Index].Socket == -1) break;
+    }
+    if (Index == MAX_CLIENTS)
+    {
+        close (Socket);
+        return;
+    }
+
+    Flag = 1;
+    setsockopt (Socket, IPPROTO_TCP, TCP_NODELAY, &Flag, sizeof(Flag));
+    fcntl (Socket, F_SETFL, fcntl (Socket, F_GETFL, 0) | O_NONBLOCK);
+    Clients[Index].Socket = Socket;
+    Clients[Index].Parser.Length = 0;
+    Clients[Index].Parser.Errors = 0;
+    Clients[Index].TXLength = 0;
+    if (VerbosityLevel > 0)
+        fprintf (stdout, "Client %d connected\n", Index);
+}  // acceptClient
+// ------------------------------------------------------------
+
+static void closeClient (int Index)
+{
+    if (VerbosityLevel > 0)
+        fprintf (stdout, "Client %d disconnected (%u frames not decoded)\n", Index, Clients[Index].Parser.Errors);
+    close (Clients[Index].Socket);
+    Clients[Index].Socket = -1;
+}  // closeClient
+// ------------------------------------------------------------
+
+//! Queue a frame for all clients except Source (-1 = frame from CAN interface)
+static void forwardFrame (int Source, TCBUSFrame* Frame)
+{
+    char Text[GRIDCONNECT_MAX_FRAME];
+    int Length;
+    int Index;
+
+    Length = encodeGridConnectFrame (Frame->ID, Frame->DLC, Frame->Data, Text);
+    for (Index=0; Index<MAX_CLIENTS; Index++)
+    {
+        if ((Index == Source) || (Clients[Index].Socket == -1)) continue;
+        if (Clients[Index].TXLength+Length > CLIENT_TX_SIZE)
+        {   // Client does not read : frame is lost for this client
+            OverflowFrames++;
+            continue;
+        }
+        memcpy (&Clients[Index].TXText[Clients[Index].TXLength], Text, Length);
+        Clients[Index].TXLength += Length;
+    }
+
+    if ((Source >= 0) && (CANBridge))
+        sendCBUSRaw (Frame->ID, Frame->DLC, Frame->Data);
+}  // forwardFrame
+// ------------------------------------------------------------
+
+static void readClient (int Index)
+{
+    TCBUSFrame Frames[GRIDCONNECT_MAX_BATCH];
+    TGridConnectParser* Parser;
+    int Received;
+    int Count;
+    int Frame;
+
+    Parser = &Clients[Index].Parser;
+    Received = recv (Clients[Index].Socket, &Parser->Text[Parser->Length], GRIDCONNECT_TEXT_SIZE-Parser->Length, 0);
+    if (Received <= 0)
+    {
+        if ((Received < 0) && ((errno == EAGAIN) || (errno == EINTR))) return;
+        closeClient (Index);
+        return;
+    }
+    Parser->Length += Received;
+
+    do
+    {
+        Count = decodeGridConnectFrames (Parser, Frames, GRIDCONNECT_MAX_BATCH);
+        for (Frame=0; Frame<Count; Frame++)
+            forwardFrame (Index, &Frames[Frame]);
+        FramesFromClients += Count;
+    } while (Count == GRIDCONNECT_MAX_BATCH);
+}  // readClient
+// ------------------------------------------------------------
+
+static void readCAN (void)
+{
+    TCBUSFrame Frame;
+    unsigned int DLC;
+
+    while ((DLC = getNextCBUSMessage (&Frame.ID, Frame.Data)) != 0xFFFFFFFF)
+    {
+        Frame.DLC = DLC&0x0F;
+        forwardFrame (-1, &Frame);
+        FramesFromCAN++;
+    }
+}  // readCAN
+// ------------------------------------------------------------
+
+static void flushClients (void)
+{
+    int Index;
+    int Sent;
+    TGridConnectClient* Client;
+
+    for (Index=0; Index<MAX_CLIENTS; Index++)
+    {
+        Client = &Clients[Index];
+        if ((Client->Socket == -1) || (Client->TXLength == 0)) continue;
+
+        Sent = send (Client->Socket, Client->TXText, Client->TXLength, MSG_NOSIGNAL);
+        if (Sent < 0)
+        {
+            if ((errno != EAGAIN) && (errno != EINTR)) closeClient (Index);
+            continue;
+        }
+        memmove (Client->TXText, &Client->TXText[Sent], Client->TXLength-Sent);
+        Client->TXLength -= Sent;
+    }
+}  // flushClients
+// ------------------------------------------------------------
+
+void ParseCLIParameters (int argc, char* argv[])
+{
+    int ParmCount;
+    int TestInt;
+    char* Value;
+
+    for (ParmCount = 1; ParmCount<argc; ParmCount++)
+    {
+        if (ParmCount >= (argc - 1))
+        {
+            fprintf (stderr, "Missing or invalid value for parameter %s\n", argv[ParmCount]);
+            return;
+        }
+        Value = argv[ParmCount + 1];
+        TestInt = atoi (Value);
+
+        if (strcmp(argv[ParmCount], "--port") == 0)
+        {
+            if ((TestInt > 0) && (TestInt <= 65535)) ServerPort = TestInt;
+        }
+        else if (strcmp(argv[ParmCount], "--interface") == 0)
+            strncpy (CANInterface, Value, sizeof(CANInterface)-1);
+        else if (strcmp(argv[ParmCount], "--verbose") == 0)
+            VerbosityLevel = TestInt;
+        else
+            fprintf (stderr, "Unknown parameter %s\n", argv[ParmCount]);
+
+        ParmCount += 1;     // Jump over the argument value
+    }
+}  // ParseCLIParameters
+// ------------------------------------------------------------
+
+int main (int argc, char* argv[])
+{
+    struct pollfd PollFDs[MAX_CLIENTS+2];
+    int PollClients[MAX_CLIENTS+2];
+    int NumPoll;
+    int Index;
+
+    fprintf (stdout, "gridconnect_server : GridConnect CBUS server for cbus2modbus tests\n");
+    ParseCLIParameters (argc, argv);
+
+    for (Index=0; Index<MAX_CLIENTS; Index++)
+        Clients[Index].Socket = -1;
+
+    if (openListenSocket () != 0)
+    {
+        fprintf (stderr, "Can not open TCP port %d\n", ServerPort);
+        return 2;
+    }
+    if (CANInterface[0] != 0)
+    {
+        if (createCBUSSocket (CANInterface) != 0)
+        {
+            fprintf (stderr, "Can not open CAN interface %s\n", CANInterface);
+            return 2;
+        }
+        CANBridge = 1;
+    }
+
+    signal (SIGINT, sig_handler);
+    fprintf (stdout, "Listening on TCP port %d%s%s\n", ServerPort, CANBridge ? ", bridged to " : "", CANInterface);
+
+    while (BreakRequest == 0)
+    {
+        NumPoll = 0;
+        PollFDs[NumPoll].fd = ListenSocket;
+        PollFDs[NumPoll].events = POLLIN;
+        PollClients[NumPoll++] = -2;
+        if (CANBridge)
+        {
+            PollFDs[NumPoll].fd = getCBUSSocketHandle ();
+            PollFDs[NumPoll].events = POLLIN;
+            PollClients[NumPoll++] = -1;
+        }
+        for (Index=0; Index<MAX_CLIENTS; Index++)
+        {
+            if (Clients[Index].Socket == -1) continue;
+            PollFDs[NumPoll].fd = Clients[Index].Socket;
+            PollFDs[NumPoll].events = POLLIN;
+            if (Clients[Index].TXLength > 0) PollFDs[NumPoll].events |= POLLOUT;
+            PollClients[NumPoll++] = Index;
+        }
+
+        if (poll (PollFDs, NumPoll, 100) <= 0) continue;
+
+        for (Index=0; Index<NumPoll; Index++)
+        {
+            if ((PollFDs[Index].revents & (POLLIN|POLLHUP|POLLERR)) == 0) continue;
+            if (PollClients[Index] == -2)
+                acceptClient ();
+            else if (PollClients[Index] == -1)
+                readCAN ();
+            else if (Clients[PollClients[Index]].Socket != -1)
+                readClient (PollClients[Index]);
+        }
+        flushClients ();
+    }
+
+    fprintf (stdout, "\nFrames from clients : %llu, from CAN : %llu, lost (client too slow) : %llu\n",
+             (unsigned long long)FramesFromClients, (unsigned long long)FramesFromCAN, (unsigned long long)OverflowFrames);
+
+    for (Index=0; Index<MAX_CLIENTS; Index++)
+    {
+        if (Clients[Index].Socket != -1) close (Clients[Index].Socket);
+    }
+    close (ListenSocket);
+    if (CANBridge) closeCBUSSocket ();
+    return 0;
+}  // main
+// ------------------------------------------------------------
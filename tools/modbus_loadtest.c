@@ -0,0 +1,805 @@
+/*
+modbus_loadtest.c
+cbus2modbus
+Modbus/TCP load test client measuring gateway throughput and request latency
+Development : Benoit BOUCHEZ - M8718
+
+Each connection keeps a fixed number of requests in flight (pipelining depth) : when responses
+are received, new requests are generated and all of them are sent with a single send() call.
+Requests are chosen randomly according to the function mix :
+- FC1 read coils and FC15 write multiple coils, in the part of the coil range owned by the
+  connection (the range is shared between the connections, so each connection knows the state
+  of its coils : the gateway processes the requests of a connection in order, so a read must
+  return the values written by the previous writes)
+- FC2 read discrete inputs : when inputs are declared static (no CBUS traffic changing them),
+  each input must always be read with the same value
+
+The Modbus protocol is handled directly on the socket (libmodbus does not pipeline requests).
+FC15 changes the PLC outputs, so the gateway sends CBUS events : use a test layout.
+The exit code is 0 when all responses have been received and are correct.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define MBAP_HEADER_LENGTH      7           // Transaction ID, protocol ID, length, unit ID
+#define MAX_ADU_LENGTH          260
+#define MAX_DEPTH               64
+#define MAX_CONNECTIONS         64
+#define MAX_READ_BITS           2000
+#define MAX_WRITE_BITS          1968
+#define MAX_LATENCY_SAMPLES     1000000     // Per connection and function
+#define RESPONSE_TIMEOUT        2           // Seconds
+#define RX_BUFFER_SIZE          16384
+
+enum {
+    TEST_FC1 = 0,
+    TEST_FC2,
+    TEST_FC15,
+    NUM_TEST_FUNCTIONS
+};
+
+static const uint8_t FunctionCodes[NUM_TEST_FUNCTIONS] = {0x01, 0x02, 0x0F};
+static const char* FunctionNames[NUM_TEST_FUNCTIONS] = {"FC1 read coils", "FC2 read inputs", "FC15 write coils"};
+
+//! Request sent and waiting for its response
+typedef struct {
+    uint16_t TransactionID;
+    int Function;
+    uint16_t Address;
+    uint16_t Quantity;
+    uint64_t SendTime;
+    uint8_t Expected[(MAX_READ_BITS+7)/8];      // FC1 : coils written before the request
+} TLoadRequest;
+
+typedef struct {
+    int Index;
+    int Socket;
+    pthread_t Thread;
+    uint32_t RandomState;
+    int CoilStart;                  // Part of the coil range owned by the connection
+    int CoilCount;
+    uint8_t* Coils;                 // Values written in the owned coils (one byte per coil)
+    TLoadRequest InFlight[MAX_DEPTH];
+    int NumInFlight;
+    uint16_t NextTransactionID;
+    uint8_t TXBuffer[MAX_DEPTH*MAX_ADU_LENGTH];
+    int TXLength;
+    uint8_t RXBuffer[RX_BUFFER_SIZE];
+    int RXLength;
+    // Statistics
+    uint64_t Requests[NUM_TEST_FUNCTIONS];
+    uint64_t Responses[NUM_TEST_FUNCTIONS];
+    uint64_t Exceptions;
+    uint64_t Mismatches;
+    uint64_t Errors;
+    uint32_t* Latency[NUM_TEST_FUNCTIONS];  // Microseconds
+    uint32_t NumLatency[NUM_TEST_FUNCTIONS];
+} TLoadConnection;
+
+// Configuration
+static char ServerHost[64] = "127.0.0.1";
+static char ServerPort[8] = "1502";
+static int NumConnections = 1;
+static int Depth = 1;
+static int Duration = 10;               // Seconds
+static int FunctionMix[NUM_TEST_FUNCTIONS] = {40, 40, 20};
+static int CoilAddress = 0;
+static int CoilRange = 128;
+static int InputAddress = 0;
+static int InputRange = 128;
+static int ReadSize = 16;
+static int WriteSize = 16;
+static int StaticInputs = 0;
+static int UnitID = 0xFF;
+static uint32_t RandomSeed = 1;
+static int VerbosityLevel = 0;
+
+static volatile int BreakRequest = 0;
+static volatile int StopRequest = 0;
+static int MixTotal = 0;
+
+static TLoadConnection* Connections;
+
+// Reference value of each discrete input (static inputs), shared by all connections
+static pthread_mutex_t InputLock = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t* InputReference;
+static uint8_t* InputKnown;
+
+static uint64_t getTimeUs (void)
+{
+    struct timespec Now;
+
+    clock_gettime (CLOCK_MONOTONIC, &Now);
+    return ((uint64_t)Now.tv_sec*1000000)+(Now.tv_nsec/1000);
+}  // getTimeUs
+// ------------------------------------------------------------
+
+//! Xorshift generator : reproducible request sequence for a given seed
+static uint32_t getRandom (TLoadConnection* Connection)
+{
+    Connection->RandomState ^= Connection->RandomState<<13;
+    Connection->RandomState ^= Connection->RandomState>>17;
+    Connection->RandomState ^= Connection->RandomState<<5;
+    return Connection->RandomState;
+}  // getRandom
+// ------------------------------------------------------------
+
+void sig_handler (int signo)
+{
+    if (signo == SIGINT)
+        BreakRequest = 1;
+}  // sig_handler
+// ------------------------------------------------------------
+
+static int connectServer (void)
+{
+    struct addrinfo Hints;
+    struct addrinfo* Result;
+    struct addrinfo* Address;
+    struct timeval Timeout;
+    int Socket;
+    int Flag;
+
+    memset (&Hints, 0, sizeof(Hints));
+    Hints.ai_family = AF_UNSPEC;
+    Hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo (ServerHost, ServerPort, &Hints, &Result) != 0) return -1;
+
+    Socket = -1;
+    for (Address = Result; Address != 0; Address = Address->ai_next)
+    {
+        Socket = socket (Address->ai_family, Address->ai_socktype, Address->ai_protocol);
+        if (Socket == -1) continue;
+        if (connect (Socket, Address->ai_addr, Address->ai_addrlen) == 0) break;
+        close (Socket);
+        Socket = -1;
+    }
+    freeaddrinfo (Result);
+    if (Socket == -1) return -1;
+
+    // Requests are grouped by the client : do not delay them more
+    Flag = 1;
+    setsockopt (Socket, IPPROTO_TCP, TCP_NODELAY, &Flag, sizeof(Flag));
+    Timeout.tv_sec = RESPONSE_TIMEOUT;
+    Timeout.tv_usec = 0;
+    setsockopt (Socket, SOL_SOCKET, SO_RCVTIMEO, &Timeout, sizeof(Timeout));
+    return Socket;
+}  // connectServer
+// ------------------------------------------------------------
+
+//! Add a request to the TX buffer of the connection
+static void buildRequest (TLoadConnection* Connection, int Function, int Address, int Quantity, const uint8_t* Values)
+{
+    TLoadRequest* Request;
+    uint8_t* ADU;
+    int Length;
+    int ByteCount;
+    int Bit;
+
+    Request = &Connection->InFlight[Connection->NumInFlight++];
+    Request->TransactionID = Connection->NextTransactionID++;
+    Request->Function = Function;
+    Request->Address = Address;
+    Request->Quantity = Quantity;
+
+    ADU = &Connection->TXBuffer[Connection->TXLength];
+    ADU[0] = Request->TransactionID>>8;
+    ADU[1] = Request->TransactionID&0xFF;
+    ADU[2] = 0;
+    ADU[3] = 0;
+    ADU[6] = UnitID;
+    ADU[7] = FunctionCodes[Function];
+    ADU[8] = Address>>8;
+    ADU[9] = Address&0xFF;
+    ADU[10] = Quantity>>8;
+    ADU[11] = Quantity&0xFF;
+    Length = 12;
+
+    if (Function == TEST_FC15)
+    {
+        ByteCount = (Quantity+7)/8;
+        ADU[12] = ByteCount;
+        memset (&ADU[13], 0, ByteCount);
+        for (Bit=0; Bit<Quantity; Bit++)
+        {
+            if (Values[Bit]) ADU[13+(Bit>>3)] |= 1<<(Bit&7);
+        }
+        Length = 13+ByteCount;
+    }
+    else if (Function == TEST_FC1)
+    {   // Coils are written in order by the gateway : the read returns the values known now
+        memset (Request->Expected, 0, (Quantity+7)/8);
+        for (Bit=0; Bit<Quantity; Bit++)
+        {
+            if (Connection->Coils[Address-Connection->CoilStart+Bit]) Request->Expected[Bit>>3] |= 1<<(Bit&7);
+        }
+    }
+
+    ADU[4] = (Length-6)>>8;
+    ADU[5] = (Length-6)&0xFF;
+    Connection->TXLength += Length;
+    Request->SendTime = getTimeUs ();
+    Connection->Requests[Function]++;
+}  // buildRequest
+// ------------------------------------------------------------
+
+//! Pick a random request according to the function mix
+static void generateRequest (TLoadConnection* Connection)
+{
+    int Function;
+    int Value;
+    int Quantity;
+    int Address;
+    int Bit;
+    uint8_t Values[MAX_WRITE_BITS];
+
+    Value = getRandom (Connection) % MixTotal;
+    for (Function=0; Function<NUM_TEST_FUNCTIONS-1; Function++)
+    {
+        if (Value < FunctionMix[Function]) break;
+        Value -= FunctionMix[Function];
+    }
+
+    switch (Function)
+    {
+        case TEST_FC2 :
+            Quantity = (ReadSize < InputRange) ? ReadSize : InputRange;
+            Address = InputAddress + (getRandom (Connection) % (InputRange-Quantity+1));
+            buildRequest (Connection, TEST_FC2, Address, Quantity, 0);
+            break;
+        case TEST_FC1 :
+            Quantity = (ReadSize < Connection->CoilCount) ? ReadSize : Connection->CoilCount;
+            Address = Connection->CoilStart + (getRandom (Connection) % (Connection->CoilCount-Quantity+1));
+            buildRequest (Connection, TEST_FC1, Address, Quantity, 0);
+            break;
+        default :
+            Quantity = (WriteSize < Connection->CoilCount) ? WriteSize : Connection->CoilCount;
+            Address = Connection->CoilStart + (getRandom (Connection) % (Connection->CoilCount-Quantity+1));
+            for (Bit=0; Bit<Quantity; Bit++)
+            {
+                Values[Bit] = getRandom (Connection) & 1;
+                Connection->Coils[Address-Connection->CoilStart+Bit] = Values[Bit];
+            }
+            buildRequest (Connection, TEST_FC15, Address, Quantity, Values);
+            break;
+    }
+}  // generateRequest
+// ------------------------------------------------------------
+
+//! Send all requests waiting in the TX buffer
+static int flushRequests (TLoadConnection* Connection)
+{
+    int Sent;
+    int Offset = 0;
+
+    while (Offset < Connection->TXLength)
+    {
+        Sent = send (Connection->Socket, &Connection->TXBuffer[Offset], Connection->TXLength-Offset, MSG_NOSIGNAL);
+        if (Sent <= 0)
+        {
+            if ((Sent < 0) && (errno == EINTR)) continue;
+            return -1;
+        }
+        Offset += Sent;
+    }
+    Connection->TXLength = 0;
+    return 0;
+}  // flushRequests
+// ------------------------------------------------------------
+
+//! Compare discrete inputs read with the values read before
+static int checkStaticInputs (int Address, int Quantity, const uint8_t* Data)
+{
+    int Bit;
+    int Index;
+    uint8_t Value;
+    int Errors = 0;
+
+    pthread_mutex_lock (&InputLock);
+    for (Bit=0; Bit<Quantity; Bit++)
+    {
+        Index = Address-InputAddress+Bit;
+        Value = (Data[Bit>>3]>>(Bit&7))&1;
+        if (InputKnown[Index] == 0)
+        {
+            InputReference[Index] = Value;
+            InputKnown[Index] = 1;
+        }
+        else if (InputReference[Index] != Value)
+            Errors++;
+    }
+    pthread_mutex_unlock (&InputLock);
+    return Errors;
+}  // checkStaticInputs
+// ------------------------------------------------------------
+
+//! Check a response and release the request
+static void processResponse (TLoadConnection* Connection, const uint8_t* ADU, int ADULength, uint64_t Now)
+{
+    uint16_t TransactionID;
+    int Index;
+    TLoadRequest* Request;
+    const uint8_t* PDU;
+    int ByteCount;
+    int Correct;
+    uint32_t Latency;
+
+    TransactionID = (ADU[0]<<8)+ADU[1];
+    for (Index=0; Index<Connection->NumInFlight; Index++)
+    {
+        if (Connection->InFlight[Index].TransactionID == TransactionID) break;
+    }
+    if (Index == Connection->NumInFlight)
+    {
+        if (VerbosityLevel > 0)
+            fprintf (stdout, "Connection %d : unexpected transaction ID %d\n", Connection->Index, TransactionID);
+        Connection->Errors++;
+        return;
+    }
+    Request = &Connection->InFlight[Index];
+    PDU = ADU+MBAP_HEADER_LENGTH;
+    ByteCount = (Request->Quantity+7)/8;
+    Correct = 1;
+
+    if (PDU[0] == (FunctionCodes[Request->Function]|0x80))
+    {
+        if (VerbosityLevel > 0)
+            fprintf (stdout, "Connection %d : exception %d for %s at %d\n", Connection->Index, PDU[1], FunctionNames[Request->Function], Request->Address);
+        Connection->Exceptions++;
+        Correct = 0;
+    }
+    else if (PDU[0] != FunctionCodes[Request->Function])
+    {
+        Connection->Errors++;
+        Correct = 0;
+    }
+    else if (Request->Function == TEST_FC15)
+    {
+        if ((ADULength != MBAP_HEADER_LENGTH+5) || (((PDU[1]<<8)+PDU[2]) != Request->Address) || (((PDU[3]<<8)+PDU[4]) != Request->Quantity))
+        {
+            Connection->Errors++;
+            Correct = 0;
+        }
+    }
+    else if ((ADULength != MBAP_HEADER_LENGTH+2+ByteCount) || (PDU[1] != ByteCount))
+    {
+        Connection->Errors++;
+        Correct = 0;
+    }
+    else if (Request->Function == TEST_FC1)
+    {
+        if (memcmp (&PDU[2], Request->Expected, ByteCount) != 0)
+        {
+            if (VerbosityLevel > 0)
+                fprintf (stdout, "Connection %d : coils %d to %d do not match the written values\n", Connection->Index, Request->Address, Request->Address+Request->Quantity-1);
+            Connection->Mismatches++;
+        }
+    }
+    else if (StaticInputs)
+    {
+        if (checkStaticInputs (Request->Address, Request->Quantity, &PDU[2]) != 0)
+        {
+            if (VerbosityLevel > 0)
+                fprintf (stdout, "Connection %d : inputs %d to %d have changed\n", Connection->Index, Request->Address, Request->Address+Request->Quantity-1);
+            Connection->Mismatches++;
+        }
+    }
+
+    if (Correct)
+    {
+        Latency = (uint32_t)(Now-Request->SendTime);
+        if (Connection->NumLatency[Request->Function] < MAX_LATENCY_SAMPLES)
+            Connection->Latency[Request->Function][Connection->NumLatency[Request->Function]++] = Latency;
+        Connection->Responses[Request->Function]++;
+    }
+
+    // Keep requests in sending order
+    memmove (Request, Request+1, (Connection->NumInFlight-Index-1)*sizeof(TLoadRequest));
+    Connection->NumInFlight--;
+}  // processResponse
+// ------------------------------------------------------------
+
+//! Write initial values in all coils owned by the connection, so reads can be checked
+static int initConnectionCoils (TLoadConnection* Connection)
+{
+    int Address;
+    int Quantity;
+
+    for (Address=0; Address<Connection->CoilCount; Address+=Quantity)
+    {
+        Quantity = Connection->CoilCount-Address;
+        if (Quantity > MAX_WRITE_BITS) Quantity = MAX_WRITE_BITS;
+        buildRequest (Connection, TEST_FC15, Connection->CoilStart+Address, Quantity, &Connection->Coils[Address]);
+    }
+    return flushRequests (Connection);
+}  // initConnectionCoils
+// ------------------------------------------------------------
+
+static void* ConnectionThread (void* Arg)
+{
+    TLoadConnection* Connection = (TLoadConnection*)Arg;
+    int Received;
+    int Offset;
+    int ADULength;
+    uint64_t Now;
+
+    if (initConnectionCoils (Connection) != 0)
+    {
+        Connection->Errors++;
+        return 0;
+    }
+
+    while (1)
+    {
+        // Keep the pipeline full until the end of the test
+        if (StopRequest == 0)
+        {
+            while (Connection->NumInFlight < Depth)
+                generateRequest (Connection);
+            if (flushRequests (Connection) != 0)
+            {
+                Connection->Errors++;
+                break;
+            }
+        }
+        if (Connection->NumInFlight == 0) break;
+
+        Received = recv (Connection->Socket, &Connection->RXBuffer[Connection->RXLength], RX_BUFFER_SIZE-Connection->RXLength, 0);
+        if (Received <= 0)
+        {
+            if ((Received < 0) && (errno == EINTR)) continue;
+            // Timeout or connection closed by the server : requests in flight are lost
+            fprintf (stderr, "Connection %d : %s, %d requests without response\n", Connection->Index,
+                     Received == 0 ? "closed by server" : "no response", Connection->NumInFlight);
+            Connection->Errors += Connection->NumInFlight;
+            break;
+        }
+        Now = getTimeUs ();
+        Connection->RXLength += Received;
+
+        Offset = 0;
+        while (Connection->RXLength-Offset >= MBAP_HEADER_LENGTH+1)
+        {
+            ADULength = 6+(Connection->RXBuffer[Offset+4]<<8)+Connection->RXBuffer[Offset+5];
+            if ((ADULength < MBAP_HEADER_LENGTH+1) || (ADULength > MAX_ADU_LENGTH))
+            {
+                fprintf (stderr, "Connection %d : invalid response length\n", Connection->Index);
+                Connection->Errors++;
+                Connection->NumInFlight = 0;
+                return 0;
+            }
+            if (Connection->RXLength-Offset < ADULength) break;
+            processResponse (Connection, &Connection->RXBuffer[Offset], ADULength, Now);
+            Offset += ADULength;
+        }
+        memmove (Connection->RXBuffer, &Connection->RXBuffer[Offset], Connection->RXLength-Offset);
+        Connection->RXLength -= Offset;
+    }
+    return 0;
+}  // ConnectionThread
+// ------------------------------------------------------------
+
+static int compareLatency (const void* A, const void* B)
+{
+    uint32_t ValueA = *(const uint32_t*)A;
+    uint32_t ValueB = *(const uint32_t*)B;
+
+    return (ValueA > ValueB) - (ValueA < ValueB);
+}  // compareLatency
+// ------------------------------------------------------------
+
+//! Print percentiles of a sorted latency array
+static void printLatency (const char* Name, uint64_t Responses, const uint32_t* Samples, uint32_t Count, double Seconds)
+{
+    if (Count == 0)
+    {
+        fprintf (stdout, "%-18s : no response\n", Name);
+        return;
+    }
+    fprintf (stdout, "%-18s : %8.0f req/s  latency ms p50 %.2f  p90 %.2f  p99 %.2f  p99.9 %.2f  max %.2f\n",
+             Name, Responses/Seconds,
+             Samples[Count/2]/1000.0,
+             Samples[(uint32_t)((Count*90ULL)/100)]/1000.0,
+             Samples[(uint32_t)((Count*99ULL)/100)]/1000.0,
+             Samples[(uint32_t)((Count*999ULL)/1000)]/1000.0,
+             Samples[Count-1]/1000.0);
+}  // printLatency
+// ------------------------------------------------------------
+
+//! Merge statistics of all connections and print the report
+// \return number of errors and mismatches
+static uint64_t printReport (uint64_t ElapsedUs)
+{
+    int Function;
+    int Index;
+    double Seconds;
+    uint32_t* Samples;
+    uint32_t Count;
+    uint32_t TotalCount;
+    uint64_t Requests;
+    uint64_t Responses;
+    uint64_t TotalResponses;
+    uint64_t Exceptions = 0;
+    uint64_t Mismatches = 0;
+    uint64_t Errors = 0;
+    uint32_t* AllSamples;
+
+    Seconds = (double)ElapsedUs/1000000.0;
+    if (Seconds <= 0) Seconds = 1;
+
+    TotalCount = 0;
+    for (Function=0; Function<NUM_TEST_FUNCTIONS; Function++)
+    {
+        for (Index=0; Index<NumConnections; Index++)
+            TotalCount += Connections[Index].NumLatency[Function];
+    }
+    AllSamples = (uint32_t*)malloc (((TotalCount/4)+NUM_TEST_FUNCTIONS)*sizeof(uint32_t));
+    TotalCount = 0;
+    TotalResponses = 0;
+
+    fprintf (stdout, "\nDuration : %.1f s, %d connection(s), depth %d\n", Seconds, NumConnections, Depth);
+    for (Function=0; Function<NUM_TEST_FUNCTIONS; Function++)
+    {
+        Count = 0;
+        for (Index=0; Index<NumConnections; Index++)
+            Count += Connections[Index].NumLatency[Function];
+        Samples = (uint32_t*)malloc ((Count+1)*sizeof(uint32_t));
+        if (Samples == 0) continue;
+
+        Count = 0;
+        Requests = 0;
+        Responses = 0;
+        for (Index=0; Index<NumConnections; Index++)
+        {
+            memcpy (&Samples[Count], Connections[Index].Latency[Function], Connections[Index].NumLatency[Function]*sizeof(uint32_t));
+            Count += Connections[Index].NumLatency[Function];
+            Requests += Connections[Index].Requests[Function];
+            Responses += Connections[Index].Responses[Function];
+        }
+        qsort (Samples, Count, sizeof(uint32_t), compareLatency);
+        printLatency (FunctionNames[Function], Responses, Samples, Count, Seconds);
+
+        // Keep one sample out of four for the total, to limit memory
+        if (AllSamples)
+        {
+            for (Index=0; Index<(int)Count; Index+=4)
+                AllSamples[TotalCount++] = Samples[Index];
+        }
+        TotalResponses += Responses;
+        free (Samples);
+    }
+    if (AllSamples)
+    {
+        qsort (AllSamples, TotalCount, sizeof(uint32_t), compareLatency);
+        printLatency ("All requests", TotalResponses, AllSamples, TotalCount, Seconds);
+        free (AllSamples);
+    }
+
+    for (Index=0; Index<NumConnections; Index++)
+    {
+        Exceptions += Connections[Index].Exceptions;
+        Mismatches += Connections[Index].Mismatches;
+        Errors += Connections[Index].Errors;
+    }
+    fprintf (stdout, "Exceptions : %llu, data mismatches : %llu, protocol errors : %llu\n",
+             (unsigned long long)Exceptions, (unsigned long long)Mismatches, (unsigned long long)Errors);
+    return Exceptions+Mismatches+Errors;
+}  // printReport
+// ------------------------------------------------------------
+
+//! Read function mix "fc1,fc2,fc15" (relative weights)
+static void parseFunctionMix (char* Value)
+{
+    int Function;
+    char* Token;
+
+    Token = strtok (Value, ",");
+    for (Function=0; Function<NUM_TEST_FUNCTIONS; Function++)
+    {
+        FunctionMix[Function] = Token ? atoi (Token) : 0;
+        if (FunctionMix[Function] < 0) FunctionMix[Function] = 0;
+        Token = strtok (NULL, ",");
+    }
+}  // parseFunctionMix
+// ------------------------------------------------------------
+
+void ParseCLIParameters (int argc, char* argv[])
+{
+    int ParmCount;
+    int TestInt;
+    char* Value;
+
+    for (ParmCount = 1; ParmCount<argc; ParmCount++)
+    {
+        if (ParmCount >= (argc - 1))
+        {
+            fprintf (stderr, "Missing or invalid value for parameter %s\n", argv[ParmCount]);
+            return;
+        }
+        Value = argv[ParmCount + 1];
+        TestInt = atoi (Value);
+
+        if (strcmp(argv[ParmCount], "--host") == 0)
+            strncpy (ServerHost, Value, sizeof(ServerHost)-1);
+        else if (strcmp(argv[ParmCount], "--port") == 0)
+        {
+            if ((TestInt > 0) && (TestInt <= 65535)) snprintf (ServerPort, sizeof(ServerPort), "%d", TestInt);
+        }
+        else if (strcmp(argv[ParmCount], "--connections") == 0)
+        {
+            if ((TestInt >= 1) && (TestInt <= MAX_CONNECTIONS)) NumConnections = TestInt;
+        }
+        else if (strcmp(argv[ParmCount], "--depth") == 0)
+        {
+            if ((TestInt >= 1) && (TestInt <= MAX_DEPTH)) Depth = TestInt;
+        }
+        else if (strcmp(argv[ParmCount], "--duration") == 0)
+        {
+            if (TestInt > 0) Duration = TestInt;
+        }
+        else if (strcmp(argv[ParmCount], "--mix") == 0)
+            parseFunctionMix (Value);
+        else if (strcmp(argv[ParmCount], "--coil-address") == 0)
+        {
+            if ((TestInt >= 0) && (TestInt < 65536)) CoilAddress = TestInt;
+        }
+        else if (strcmp(argv[ParmCount], "--coils") == 0)
+        {
+            if (TestInt > 0) CoilRange = TestInt;
+        }
+        else if (strcmp(argv[ParmCount], "--input-address") == 0)
+        {
+            if ((TestInt >= 0) && (TestInt < 65536)) InputAddress = TestInt;
+        }
+        else if (strcmp(argv[ParmCount], "--inputs") == 0)
+        {
+            if (TestInt > 0) InputRange = TestInt;
+        }
+        else if (strcmp(argv[ParmCount], "--read-size") == 0)
+        {
+            if ((TestInt >= 1) && (TestInt <= MAX_READ_BITS)) ReadSize = TestInt;
+        }
+        else if (strcmp(argv[ParmCount], "--write-size") == 0)
+        {
+            if ((TestInt >= 1) && (TestInt <= MAX_WRITE_BITS)) WriteSize = TestInt;
+        }
+        else if (strcmp(argv[ParmCount], "--static-inputs") == 0)
+            StaticInputs = (TestInt != 0) ? 1 : 0;
+        else if (strcmp(argv[ParmCount], "--unit") == 0)
+        {
+            if ((TestInt >= 0) && (TestInt <= 255)) UnitID = TestInt;
+        }
+        else if (strcmp(argv[ParmCount], "--seed") == 0)
+        {
+            if (TestInt != 0) RandomSeed = TestInt;
+        }
+        else if (strcmp(argv[ParmCount], "--verbose") == 0)
+            VerbosityLevel = TestInt;
+        else
+            fprintf (stderr, "Unknown parameter %s\n", argv[ParmCount]);
+
+        ParmCount += 1;     // Jump over the argument value
+    }
+}  // ParseCLIParameters
+// ------------------------------------------------------------
+
+int main (int argc, char* argv[])
+{
+    int Index;
+    int Function;
+    int CoilsPerConnection;
+    int Started;
+    TLoadConnection* Connection;
+    uint64_t StartTime;
+    uint64_t EndTime;
+    uint64_t Failures;
+
+    fprintf (stdout, "modbus_loadtest : Modbus/TCP load test for cbus2modbus\n");
+    ParseCLIParameters (argc, argv);
+
+    for (Function=0; Function<NUM_TEST_FUNCTIONS; Function++)
+        MixTotal += FunctionMix[Function];
+    if (MixTotal == 0)
+    {
+        fprintf (stderr, "Function mix is empty\n");
+        return 2;
+    }
+    if (CoilAddress+CoilRange > 65536) CoilRange = 65536-CoilAddress;
+    if (InputAddress+InputRange > 65536) InputRange = 65536-InputAddress;
+    CoilsPerConnection = CoilRange/NumConnections;
+    if (CoilsPerConnection < 1)
+    {
+        fprintf (stderr, "Coil range is smaller than the number of connections\n");
+        return 2;
+    }
+
+    Connections = (TLoadConnection*)calloc (NumConnections, sizeof(TLoadConnection));
+    InputReference = (uint8_t*)calloc (InputRange, 1);
+    InputKnown = (uint8_t*)calloc (InputRange, 1);
+    if ((Connections == 0) || (InputReference == 0) || (InputKnown == 0))
+    {
+        fprintf (stderr, "Not enough memory\n");
+        return 2;
+    }
+
+    for (Index=0; Index<NumConnections; Index++)
+    {
+        Connection = &Connections[Index];
+        Connection->Index = Index;
+        Connection->RandomState = RandomSeed+(Index*0x9E3779B9);
+        if (Connection->RandomState == 0) Connection->RandomState = 1;
+        Connection->CoilStart = CoilAddress+(Index*CoilsPerConnection);
+        Connection->CoilCount = CoilsPerConnection;
+        Connection->Coils = (uint8_t*)calloc (CoilsPerConnection, 1);
+        for (Function=0; Function<NUM_TEST_FUNCTIONS; Function++)
+        {
+            Connection->Latency[Function] = (uint32_t*)malloc (MAX_LATENCY_SAMPLES*sizeof(uint32_t));
+            if (Connection->Latency[Function] == 0)
+            {
+                fprintf (stderr, "Not enough memory\n");
+                return 2;
+            }
+        }
+        Connection->Socket = connectServer ();
+        if (Connection->Socket == -1)
+        {
+            fprintf (stderr, "Can not connect to %s:%s\n", ServerHost, ServerPort);
+            return 2;
+        }
+    }
+
+    signal (SIGINT, sig_handler);
+
+    fprintf (stdout, "Server %s:%s, coils %d to %d, inputs %d to %d\n", ServerHost, ServerPort,
+             CoilAddress, CoilAddress+(CoilsPerConnection*NumConnections)-1, InputAddress, InputAddress+InputRange-1);
+
+    StartTime = getTimeUs ();
+    Started = 0;
+    for (Index=0; Index<NumConnections; Index++)
+    {
+        if (pthread_create (&Connections[Index].Thread, NULL, ConnectionThread, &Connections[Index]) != 0)
+            break;
+        Started++;
+    }
+
+    EndTime = StartTime+((uint64_t)Duration*1000000);
+    while ((BreakRequest == 0) && (getTimeUs() < EndTime))
+        usleep (10000);
+    StopRequest = 1;
+    EndTime = getTimeUs ();
+
+    // Connections finish the requests in flight
+    for (Index=0; Index<Started; Index++)
+        pthread_join (Connections[Index].Thread, NULL);
+    for (Index=0; Index<NumConnections; Index++)
+        close (Connections[Index].Socket);
+
+    Failures = printReport (EndTime-StartTime);
+    if (Started < NumConnections)
+        Failures++;
+
+    for (Index=0; Index<NumConnections; Index++)
+    {
+        free (Connections[Index].Coils);
+        for (Function=0; Function<NUM_TEST_FUNCTIONS; Function++)
+            free (Connections[Index].Latency[Function]);
+    }
+    free (Connections);
+    free (InputReference);
+    free (InputKnown);
+
+    return (Failures == 0) ? 0 : 1;
+}  // main
+// ------------------------------------------------------------
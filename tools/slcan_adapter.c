@@ -0,0 +1,387 @@
+/*
+slcan_adapter.c
+cbus2modbus
+Stand-in SLCAN serial CAN adapter on a pseudo terminal
+Development : Benoit BOUCHEZ - M8718
+
+Test replacement for a USB SLCAN adapter, for cbus2modbus started with --transport slcan. A pseudo
+terminal is created and its name is displayed (a symbolic link with a fixed name can be created
+with --link) : cbus2modbus opens it as the serial port of the adapter.
+The Lawicel commands used by the SLCAN drivers are emulated (S, O, L, C, V, N, F, Z, t, T, r, R).
+Frames sent through the pseudo terminal are sent on the bus side, frames received from the bus are
+sent to the pseudo terminal when the CAN channel is open. The bus side is a CAN interface (vcan or
+real interface), or a CBUS server with --transport gridconnect, so the adapter can be tested without
+any CAN interface (gridconnect_server with cbus_trafficgen or a test client).
+Answers and frames for the pseudo terminal are written with a single write() call per loop.
+*/
+
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <termios.h>
+#include "SocketCBUS.h"
+#include "cbus_transport.h"
+#include "cbus_gridconnect.h"
+#include "cbus_slcan.h"
+
+#define TERMINAL_TX_SIZE        65536       // Text waiting to be read by the application
+
+static char LinkName[128] = "";
+static char BusInterface[64] = "";
+static int BusTransport = CBUS_TRANSPORT_SOCKETCAN;
+static int VerbosityLevel = 0;
+
+static volatile int BreakRequest = 0;
+static int MasterHandle = -1;
+static int SlaveHandle = -1;
+static int BusConnected = 0;
+
+// Emulated adapter state
+static int ChannelOpen = 0;
+static int ListenOnly = 0;
+static int Timestamps = 0;
+
+static TSLCANParser Commands;               // Text received from the application
+static char TerminalText[TERMINAL_TX_SIZE];
+static int TerminalLength = 0;
+
+static uint64_t FramesToBus = 0;
+static uint64_t FramesFromBus = 0;
+static uint64_t RefusedCommands = 0;
+static uint64_t OverflowFrames = 0;
+
+void sig_handler (int signo)
+{
+    if ((signo == SIGINT) || (signo == SIGTERM))
+        BreakRequest = 1;
+}  // sig_handler
+// ------------------------------------------------------------
+
+//! Create the pseudo terminal. The slave side is kept open, so the master is not closed when the application closes the port
+static int openTerminal (void)
+{
+    struct termios Settings;
+    char* SlaveName;
+
+    MasterHandle = posix_openpt (O_RDWR|O_NOCTTY);
+    if (MasterHandle == -1) return -1;
+    if ((grantpt (MasterHandle) != 0) || (unlockpt (MasterHandle) != 0)) return -1;
+    SlaveName = ptsname (MasterHandle);
+    if (SlaveName == 0) return -1;
+
+    SlaveHandle = open (SlaveName, O_RDWR|O_NOCTTY);
+    if (SlaveHandle == -1) return -1;
+    if (tcgetattr (SlaveHandle, &Settings) == 0)
+    {
+        cfmakeraw (&Settings);
+        tcsetattr (SlaveHandle, TCSANOW, &Settings);
+    }
+    fcntl (MasterHandle, F_SETFL, fcntl (MasterHandle, F_GETFL, 0) | O_NONBLOCK);
+
+    fprintf (stdout, "SLCAN adapter on %s\n", SlaveName);
+    if (LinkName[0] != 0)
+    {
+        unlink (LinkName);
+        if (symlink (SlaveName, LinkName) != 0)
+            fprintf (stderr, "Can not create link %s\n", LinkName);
+        else
+            fprintf (stdout, "Link %s created\n", LinkName);
+    }
+    return 0;
+}  // openTerminal
+// ------------------------------------------------------------
+
+//! Queue text for the application
+static void queueTerminalText (const char* Text, int Length)
+{
+    if (TerminalLength+Length > TERMINAL_TX_SIZE)
+    {   // Application does not read : text is lost
+        OverflowFrames++;
+        return;
+    }
+    memcpy (&TerminalText[TerminalLength], Text, Length);
+    TerminalLength += Length;
+}  // queueTerminalText
+// ------------------------------------------------------------
+
+static void answerCommand (int Accepted)
+{
+    if (Accepted)
+        queueTerminalText ("\r", 1);
+    else
+    {
+        queueTerminalText ("\a", 1);
+        RefusedCommands++;
+    }
+}  // answerCommand
+// ------------------------------------------------------------
+
+//! Execute one command line received from the application (without CR)
+static void executeCommand (const char* Line, int Length)
+{
+    TCBUSFrame Frame;
+    int Accepted;
+
+    if (Length == 0)
+    {
+        answerCommand (0);
+        return;
+    }
+
+    switch (Line[0])
+    {
+        case 't' :
+        case 'T' :
+        case 'r' :
+        case 'R' :
+            if ((ChannelOpen == 0) || (ListenOnly) || (decodeSLCANLine (Line, Length, &Frame) == 0))
+            {
+                answerCommand (0);
+                return;
+            }
+            if (BusConnected)
+                sendCBUSRaw (Frame.ID, Frame.DLC, Frame.Data);
+            FramesToBus++;
+            queueTerminalText ((Frame.ID & CBUS_EFF_FLAG) ? "Z\r" : "z\r", 2);
+            if (VerbosityLevel > 1)
+                fprintf (stdout, "To bus : %.*s\n", Length, Line);
+            return;
+        case 'S' :
+            answerCommand ((ChannelOpen == 0) && (Length == 2) && (Line[1] >= '0') && (Line[1] <= '8'));
+            return;
+        case 'O' :
+        case 'L' :
+            Accepted = (ChannelOpen == 0);
+            if (Accepted)
+            {
+                ChannelOpen = 1;
+                ListenOnly = (Line[0] == 'L');
+                if (VerbosityLevel > 0)
+                    fprintf (stdout, "CAN channel open%s\n", ListenOnly ? " (listen only)" : "");
+            }
+            answerCommand (Accepted);
+            return;
+        case 'C' :
+            Accepted = ChannelOpen;
+            ChannelOpen = 0;
+            if ((Accepted) && (VerbosityLevel > 0))
+                fprintf (stdout, "CAN channel closed\n");
+            answerCommand (Accepted);
+            return;
+        case 'Z' :
+            Accepted = (ChannelOpen == 0) && (Length == 2) && ((Line[1] == '0') || (Line[1] == '1'));
+            if (Accepted) Timestamps = (Line[1] == '1');
+            answerCommand (Accepted);
+            return;
+        case 'V' :
+            queueTerminalText ("V1013\r", 6);
+            return;
+        case 'N' :
+            queueTerminalText ("NCB01\r", 6);
+            return;
+        case 'F' :
+            queueTerminalText ("F00\r", 4);
+            return;
+        default :
+            answerCommand (0);
+            return;
+    }
+}  // executeCommand
+// ------------------------------------------------------------
+
+static void readTerminal (void)
+{
+    uint16_t Positions[SLCAN_MAX_BATCH];
+    int Received;
+    int NumLines;
+    int Index;
+    int Start;
+    int Length;
+    const char* Line;
+
+    Received = read (MasterHandle, &Commands.Text[Commands.Length], SLCAN_TEXT_SIZE-Commands.Length);
+    if (Received <= 0) return;
+    Commands.Length += Received;
+
+    do
+    {
+        Start = 0;
+        NumLines = findCBUSTextDelimiters (Commands.Text, Commands.Length, '\r', Positions, SLCAN_MAX_BATCH);
+        for (Index=0; Index<NumLines; Index++)
+        {
+            Line = &Commands.Text[Start];
+            Length = Positions[Index]-Start;
+            if ((Length > 0) && (*Line == '\n'))
+            {
+                Line++;
+                Length--;
+            }
+            executeCommand (Line, Length);
+            Start = Positions[Index]+1;
+        }
+        memmove (Commands.Text, &Commands.Text[Start], Commands.Length-Start);
+        Commands.Length -= Start;
+    } while (NumLines == SLCAN_MAX_BATCH);
+
+    if (Commands.Length == SLCAN_TEXT_SIZE)
+        Commands.Length = 0;        // No CR in the whole buffer : this is not SLCAN
+
+    if (BusConnected) flushCBUSSocket ();
+}  // readTerminal
+// ------------------------------------------------------------
+
+static void readBus (void)
+{
+    TCBUSFrame Frame;
+    unsigned int DLC;
+    char Text[SLCAN_MAX_FRAME+5];
+    int Length;
+    struct timespec Now;
+    unsigned int Timestamp;
+
+    while ((DLC = getNextCBUSMessage (&Frame.ID, Frame.Data)) != 0xFFFFFFFF)
+    {
+        FramesFromBus++;
+        if (ChannelOpen == 0) continue;
+
+        Length = encodeSLCANFrame (Frame.ID, DLC&0x0F, Frame.Data, Text);
+        if (Timestamps)
+        {   // Milliseconds, from 0 to 59999, inserted before CR
+            clock_gettime (CLOCK_MONOTONIC, &Now);
+            Timestamp = ((Now.tv_sec%60)*1000)+(Now.tv_nsec/1000000);
+            snprintf (&Text[Length-1], 6, "%04X\r", Timestamp);
+            Length += 4;
+        }
+        queueTerminalText (Text, Length);
+    }
+}  // readBus
+// ------------------------------------------------------------
+
+static void flushTerminal (void)
+{
+    int Written;
+
+    if (TerminalLength == 0) return;
+    Written = write (MasterHandle, TerminalText, TerminalLength);
+    if (Written <= 0) return;
+    memmove (TerminalText, &TerminalText[Written], TerminalLength-Written);
+    TerminalLength -= Written;
+}  // flushTerminal
+// ------------------------------------------------------------
+
+void ParseCLIParameters (int argc, char* argv[])
+{
+    int ParmCount;
+    char* Value;
+
+    for (ParmCount = 1; ParmCount<argc; ParmCount++)
+    {
+        if (ParmCount >= (argc - 1))
+        {
+            fprintf (stderr, "Missing or invalid value for parameter %s\n", argv[ParmCount]);
+            return;
+        }
+        Value = argv[ParmCount + 1];
+
+        if (strcmp(argv[ParmCount], "--interface") == 0)
+            strncpy (BusInterface, Value, sizeof(BusInterface)-1);
+        else if (strcmp(argv[ParmCount], "--transport") == 0)
+        {
+            if (strcmp (Value, "gridconnect") == 0)
+                BusTransport = CBUS_TRANSPORT_GRIDCONNECT;
+            else if (strcmp (Value, "socketcan") == 0)
+                BusTransport = CBUS_TRANSPORT_SOCKETCAN;
+            else
+                fprintf (stderr, "Unknown transport %s\n", Value);
+        }
+        else if (strcmp(argv[ParmCount], "--link") == 0)
+            strncpy (LinkName, Value, sizeof(LinkName)-1);
+        else if (strcmp(argv[ParmCount], "--verbose") == 0)
+            VerbosityLevel = atoi (Value);
+        else
+            fprintf (stderr, "Unknown parameter %s\n", argv[ParmCount]);
+
+        ParmCount += 1;     // Jump over the argument value
+    }
+}  // ParseCLIParameters
+// ------------------------------------------------------------
+
+int main (int argc, char* argv[])
+{
+    struct pollfd PollFDs[2];
+    int NumPoll;
+
+    fprintf (stdout, "slcan_adapter : SLCAN adapter emulation for cbus2modbus tests\n");
+    ParseCLIParameters (argc, argv);
+
+    if (openTerminal () != 0)
+    {
+        fprintf (stderr, "Can not create pseudo terminal\n");
+        return 2;
+    }
+    if (BusInterface[0] != 0)
+    {
+        if (BusTransport == CBUS_TRANSPORT_GRIDCONNECT)
+            setCBUSTransport (&GridConnectTransport);
+        if (createCBUSSocket (BusInterface) != 0)
+        {
+            fprintf (stderr, "Can not open %s\n", BusInterface);
+            return 2;
+        }
+        BusConnected = 1;
+        fprintf (stdout, "Bus side : %s\n", BusInterface);
+    }
+
+    signal (SIGINT, sig_handler);
+    signal (SIGTERM, sig_handler);
+
+    while (BreakRequest == 0)
+    {
+        NumPoll = 0;
+        PollFDs[NumPoll].fd = MasterHandle;
+        PollFDs[NumPoll].events = POLLIN;
+        if (TerminalLength > 0) PollFDs[NumPoll].events |= POLLOUT;
+        NumPoll++;
+        if (BusConnected)
+        {
+            PollFDs[NumPoll].fd = getCBUSSocketHandle ();
+            PollFDs[NumPoll].events = POLLIN;
+            NumPoll++;
+        }
+
+        if (poll (PollFDs, NumPoll, 100) > 0)
+        {
+            if (PollFDs[0].revents & POLLIN)
+                readTerminal ();
+            if ((NumPoll > 1) && (PollFDs[1].revents & (POLLIN|POLLHUP|POLLERR)))
+                readBus ();
+        }
+        flushTerminal ();
+
+        if ((BusConnected) && (getCBUSSocketError () == ENETDOWN))
+        {
+            fprintf (stderr, "Connection to %s lost\n", BusInterface);
+            break;
+        }
+    }
+
+    fprintf (stdout, "\nFrames to bus : %llu, from bus : %llu, refused commands : %llu, lost (application too slow) : %llu\n",
+             (unsigned long long)FramesToBus, (unsigned long long)FramesFromBus, (unsigned long long)RefusedCommands,
+             (unsigned long long)OverflowFrames);
+
+    if (LinkName[0] != 0) unlink (LinkName);
+    if (BusConnected) closeCBUSSocket ();
+    close (SlaveHandle);
+    close (MasterHandle);
+    return 0;
+}  // main
+// ------------------------------------------------------------
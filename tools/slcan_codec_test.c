@@ -0,0 +1,168 @@
+/*
+slcan_codec_test.c
+cbus2modbus
+Self test of the SLCAN frame encoder and decoder
+Development : Benoit BOUCHEZ - M8718
+
+Checks the decoding of the t, T, r and R commands with the adapter answers (CR, z, BELL,
+version) mixed between frames, for all the ways the serial port can split the text. Frames
+of all lengths are encoded then decoded, and the batch limit and buffer overflow are checked.
+Build once with the default flags (SSE2 or NEON delimiter search), and once with
+-mno-sse2 on x86 to test the memchr path. Exit code is 1 if a check fails.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "SocketCBUS.h"
+#include "cbus_slcan.h"
+
+#define MAX_TEST_FRAMES         600
+
+static TSLCANParser Parser;
+static TCBUSFrame Frames[MAX_TEST_FRAMES];
+static int FailCount = 0;
+
+#define CHECK(Condition)    checkResult ((Condition), #Condition, __LINE__)
+
+static void checkResult (int Condition, const char* Text, int Line)
+{
+    if (Condition) return;
+    fprintf (stdout, "FAILED line %d : %s\n", Line, Text);
+    FailCount++;
+}  // checkResult
+// ------------------------------------------------------------
+
+//! Give Text to the decoder by blocks of Split characters, as received from the serial port
+// \return number of frames decoded in Frames
+static int feedSLCANText (const char* Text, int Split)
+{
+    int Length;
+    int Offset = 0;
+    int Size;
+    int Count;
+    int Received = 0;
+
+    Length = strlen (Text);
+    while (Offset < Length)
+    {
+        Size = Length-Offset;
+        if (Size > Split) Size = Split;
+        memcpy (&Parser.Text[Parser.Length], &Text[Offset], Size);
+        Parser.Length += Size;
+        Offset += Size;
+        while ((Count = decodeSLCANFrames (&Parser, &Frames[Received], MAX_TEST_FRAMES-Received)) > 0)
+            Received += Count;
+    }
+    return Received;
+}  // feedSLCANText
+// ------------------------------------------------------------
+
+static void testKnownFrames (void)
+{
+    const char* Text = "t1230\rz\r\at4561AB\rT1FFFFFFF2ABCD\rr7FF8\rR000000013\rt12311122\r\a\rV1013\rxx\rt12381\r\nt0012AABB1234\r";
+    int Split;
+    int Count;
+
+    for (Split=1; Split<(int)strlen(Text)+2; Split++)
+    {
+        memset (&Parser, 0, sizeof(Parser));
+        Count = feedSLCANText (Text, Split);
+
+        CHECK (Count == 6);
+        CHECK (Parser.Rejected == 2);
+        CHECK (Parser.Errors == 3);
+        CHECK ((Frames[0].ID == 0x123) && (Frames[0].DLC == 0));
+        CHECK ((Frames[1].ID == 0x456) && (Frames[1].DLC == 1) && (Frames[1].Data[0] == 0xAB));
+        CHECK ((Frames[2].ID == (0x1FFFFFFF|CBUS_EFF_FLAG)) && (Frames[2].DLC == 2) && (Frames[2].Data[1] == 0xCD));
+        CHECK ((Frames[3].ID == (0x7FF|CBUS_RTR_FLAG)) && (Frames[3].DLC == 8));
+        CHECK ((Frames[4].ID == (1|CBUS_EFF_FLAG|CBUS_RTR_FLAG)) && (Frames[4].DLC == 3));
+        CHECK ((Frames[5].ID == 1) && (Frames[5].DLC == 2) && (Frames[5].Data[0] == 0xAA) && (Frames[5].Data[1] == 0xBB));
+    }
+}  // testKnownFrames
+// ------------------------------------------------------------
+
+static void testRoundTrip (void)
+{
+    const unsigned int IDs[] = {0, 0x7FF, 0x123|CBUS_RTR_FLAG, 0x1ABCDEF|CBUS_EFF_FLAG, 0x1FFFFFFF|CBUS_EFF_FLAG|CBUS_RTR_FLAG};
+    const unsigned char Data[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    char Text[SLCAN_MAX_FRAME];
+    TCBUSFrame Frame;
+    int IDCounter;
+    unsigned int DLC;
+    int Length;
+
+    for (IDCounter=0; IDCounter<(int)(sizeof(IDs)/sizeof(IDs[0])); IDCounter++)
+    {
+        for (DLC=0; DLC<=8; DLC++)
+        {
+            Length = encodeSLCANFrame (IDs[IDCounter], DLC, Data, Text);
+            CHECK ((Length <= SLCAN_MAX_FRAME) && (Text[Length-1] == '\r'));
+            CHECK (decodeSLCANLine (Text, Length-1, &Frame) == 1);
+            CHECK ((Frame.ID == IDs[IDCounter]) && (Frame.DLC == DLC));
+            if ((IDs[IDCounter] & CBUS_RTR_FLAG) == 0)
+                CHECK (memcmp (Frame.Data, Data, DLC) == 0);
+        }
+    }
+}  // testRoundTrip
+// ------------------------------------------------------------
+
+static void testBatches (void)
+{
+    int Counter;
+
+    // Answers do not count in the batch limit
+    memset (&Parser, 0, sizeof(Parser));
+    for (Counter=0; Counter<600; Counter++)
+    {
+        memcpy (&Parser.Text[Parser.Length], "z\r", 2);
+        Parser.Length += 2;
+    }
+    memcpy (&Parser.Text[Parser.Length], "t1230\r", 6);
+    Parser.Length += 6;
+    CHECK (decodeSLCANFrames (&Parser, Frames, 4) == 1);
+    CHECK (Parser.Length == 0);
+
+    // Frames over the batch limit are kept for next call
+    memset (&Parser, 0, sizeof(Parser));
+    for (Counter=0; Counter<10; Counter++)
+    {
+        memcpy (&Parser.Text[Parser.Length], "z\rt1230\r", 8);
+        Parser.Length += 8;
+    }
+    CHECK (decodeSLCANFrames (&Parser, Frames, 4) == 4);
+    CHECK (decodeSLCANFrames (&Parser, Frames, 4) == 4);
+    CHECK (decodeSLCANFrames (&Parser, Frames, 4) == 2);
+    CHECK (Parser.Length == 0);
+
+    // Text without CR filling the buffer is dropped
+    memset (&Parser, 0, sizeof(Parser));
+    memset (Parser.Text, 't', SLCAN_TEXT_SIZE);
+    Parser.Length = SLCAN_TEXT_SIZE;
+    CHECK (decodeSLCANFrames (&Parser, Frames, 4) == 0);
+    CHECK ((Parser.Errors == 1) && (Parser.Length == 0));
+}  // testBatches
+// ------------------------------------------------------------
+
+int main (void)
+{
+#if defined(__SSE2__)
+    fprintf (stdout, "SLCAN codec test (SSE2 delimiter search)\n");
+#elif defined(__ARM_NEON)
+    fprintf (stdout, "SLCAN codec test (NEON delimiter search)\n");
+#else
+    fprintf (stdout, "SLCAN codec test (memchr delimiter search)\n");
+#endif
+
+    testKnownFrames ();
+    testRoundTrip ();
+    testBatches ();
+
+    if (FailCount != 0)
+    {
+        fprintf (stdout, "%d checks failed\n", FailCount);
+        return 1;
+    }
+    fprintf (stdout, "All checks passed\n");
+    return 0;
+}  // main
+// ------------------------------------------------------------